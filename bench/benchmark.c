@@ -0,0 +1,304 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../include/alloy/alloy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CHECK_ERROR(condition, message)                                        \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "Error: %s\n", message);                                 \
+      goto cleanup;                                                            \
+    }                                                                          \
+  } while (0)
+
+/*
+ * Sweeps matrix addition and multiplication over square, tall-skinny,
+ * short-wide and batched shapes. Each case is warmed up, then timed end to
+ * end (submission to completion) a number of times; the median and 99th
+ * percentile latencies are reported with the arithmetic and memory
+ * throughput at the median. Operands are padded shared matrices, as in
+ * main(), so the figures are the kernels' and not staging copies'.
+ *
+ *   alloy_bench [--warmup N] [--repeat N] [--format table|json|csv]
+ *               [--filter TEXT] [--latency FILE] [--tune FILE]
+ *
+ * GB/s counts each operand read or written once, the least any kernel must
+ * move. --latency writes the per-kernel phase latencies recorded over the
+ * whole run (see dumpLatencyHistograms) to FILE. --tune autotunes each
+ * case's threadgroup shape before timing it, starting from and saving to
+ * the tuning database FILE (see autotuneOperation).
+ */
+
+typedef enum { BENCH_ADD, BENCH_MULTIPLY, BENCH_BATCHED } BenchOp;
+
+typedef struct BenchCase {
+  BenchOp op;
+  const char *shape;
+  size_t m, n, k, batch; /* m x k times k x n; k unused by add */
+} BenchCase;
+
+static const BenchCase benchCases[] = {
+    {BENCH_ADD, "square", 256, 256, 0, 1},
+    {BENCH_ADD, "square", 1024, 1024, 0, 1},
+    {BENCH_ADD, "square", 2048, 2048, 0, 1},
+    {BENCH_ADD, "tall-skinny", 65536, 64, 0, 1},
+    {BENCH_ADD, "short-wide", 64, 65536, 0, 1},
+    {BENCH_MULTIPLY, "square", 256, 256, 256, 1},
+    {BENCH_MULTIPLY, "square", 512, 512, 512, 1},
+    {BENCH_MULTIPLY, "square", 1024, 1024, 1024, 1},
+    {BENCH_MULTIPLY, "square", 2048, 2048, 2048, 1},
+    {BENCH_MULTIPLY, "tall-skinny", 16384, 64, 256, 1},
+    {BENCH_MULTIPLY, "short-wide", 64, 16384, 256, 1},
+    {BENCH_MULTIPLY, "inner", 64, 64, 16384, 1},
+    {BENCH_BATCHED, "batched", 32, 32, 32, 512},
+    {BENCH_BATCHED, "batched", 64, 64, 64, 256},
+    {BENCH_BATCHED, "batched", 128, 128, 128, 64},
+};
+
+typedef struct BenchOptions {
+  int warmup;
+  int repeat;
+  const char *format;
+  const char *filter;
+  const char *latency;
+  const char *tune;
+} BenchOptions;
+
+typedef struct BenchResult {
+  char name[64];
+  double medianMs;
+  double p99Ms;
+  double gflops;
+  double gbps;
+} BenchResult;
+
+static const char *opName(BenchOp op) {
+  switch (op) {
+  case BENCH_ADD:
+    return "add";
+  case BENCH_MULTIPLY:
+    return "multiply";
+  default:
+    return "batched-multiply";
+  }
+}
+
+static void caseName(const BenchCase *c, char *name, size_t size) {
+  if (c->op == BENCH_ADD)
+    snprintf(name, size, "%s/%s/%zux%zu", opName(c->op), c->shape, c->m,
+             c->n);
+  else if (c->op == BENCH_MULTIPLY)
+    snprintf(name, size, "%s/%s/%zux%zux%zu", opName(c->op), c->shape, c->m,
+             c->n, c->k);
+  else
+    snprintf(name, size, "%s/%s/%zux%zux%zux%zu", opName(c->op), c->shape,
+             c->batch, c->m, c->n, c->k);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compareDoubles(const void *x, const void *y) {
+  const double a = *(const double *)x, b = *(const double *)y;
+  return (a > b) - (a < b);
+}
+
+// Runs one timed iteration of c; returns its status.
+static int runCase(AlloyContext *ctx, const BenchCase *c, Matrix *a,
+                   Matrix *b, Matrix *result) {
+  switch (c->op) {
+  case BENCH_ADD:
+    return performMatrixOperation(ctx, a, b, result, MATRIX_OP_ADD);
+  case BENCH_MULTIPLY:
+    return performMatrixOperation(ctx, a, b, result, MATRIX_OP_MULTIPLY);
+  default:
+    // the items are stacked, one under the other, in the padded parents
+    return performBatchedMatrixMultiply(
+        ctx, a, c->m * a->ld, b, c->k * b->ld, result, c->m * result->ld,
+        c->batch);
+  }
+}
+
+typedef struct BenchRun {
+  const BenchCase *c;
+  Matrix *a, *b, *result;
+} BenchRun;
+
+static int runTuned(AlloyContext *ctx, void *userData) {
+  BenchRun *run = userData;
+  return runCase(ctx, run->c, run->a, run->b, run->result);
+}
+
+static int benchCase(AlloyContext *ctx, const BenchCase *c,
+                     const BenchOptions *options, BenchResult *r) {
+  const size_t k = c->op == BENCH_ADD ? c->n : c->k;
+  Matrix a = createPaddedSharedMatrix(ctx, c->batch * c->m, k);
+  Matrix b = createPaddedSharedMatrix(
+      ctx, c->op == BENCH_ADD ? c->m : c->batch * c->k, c->n);
+  Matrix result = createPaddedSharedMatrix(ctx, c->batch * c->m, c->n);
+  Matrix aItem = {0}, bItem = {0}, resultItem = {0};
+  double *times = calloc(options->repeat, sizeof(double));
+  int status = -1;
+
+  CHECK_ERROR(a.data && b.data && result.data && times,
+              "Failed to create benchmark matrices");
+  fillMatrixRandom(&a);
+  fillMatrixRandom(&b);
+  aItem = sliceMatrixRows(&a, 0, c->m);
+  bItem = sliceMatrixRows(&b, 0, c->op == BENCH_ADD ? c->m : c->k);
+  resultItem = sliceMatrixRows(&result, 0, c->m);
+
+  if (options->tune) {
+    BenchRun run = {c, &aItem, &bItem, &resultItem};
+    CHECK_ERROR(autotuneOperation(ctx, runTuned, &run, 3) == 0,
+                "Failed to tune benchmark case");
+  }
+  for (int i = 0; i < options->warmup; ++i)
+    CHECK_ERROR(runCase(ctx, c, &aItem, &bItem, &resultItem) == 0,
+                "Benchmark case failed");
+  for (int i = 0; i < options->repeat; ++i) {
+    const double start = now();
+    CHECK_ERROR(runCase(ctx, c, &aItem, &bItem, &resultItem) == 0,
+                "Benchmark case failed");
+    times[i] = now() - start;
+  }
+
+  qsort(times, options->repeat, sizeof(double), compareDoubles);
+  const size_t n = options->repeat;
+  const double median =
+      n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2.0;
+  // nearest rank
+  const size_t p99 = (n * 99 + 99) / 100 - 1;
+
+  double flops, bytes;
+  if (c->op == BENCH_ADD) {
+    flops = (double)c->m * c->n;
+    bytes = 3.0 * c->m * c->n * sizeof(float);
+  } else {
+    flops = 2.0 * c->m * c->n * c->k * c->batch;
+    bytes = ((double)c->m * c->k + (double)c->k * c->n +
+             (double)c->m * c->n) *
+            sizeof(float) * c->batch;
+  }
+
+  caseName(c, r->name, sizeof(r->name));
+  r->medianMs = median * 1e3;
+  r->p99Ms = times[p99] * 1e3;
+  r->gflops = flops / median * 1e-9;
+  r->gbps = bytes / median * 1e-9;
+  status = 0;
+
+cleanup:
+  free(times);
+  freeMatrix(&a);
+  freeMatrix(&b);
+  freeMatrix(&result);
+  return status;
+}
+
+static void printHeader(const BenchOptions *options, const char *device) {
+  if (!strcmp(options->format, "json"))
+    printf("{\"device\": \"%s\", \"warmup\": %d, \"repeat\": %d, "
+           "\"results\": [",
+           device, options->warmup, options->repeat);
+  else if (!strcmp(options->format, "csv"))
+    printf("name,median_ms,p99_ms,gflops,gbps\n");
+  else
+    printf("%s, %d warmup + %d timed runs\n%-40s %11s %11s %9s %9s\n", device,
+           options->warmup, options->repeat, "case", "median ms", "p99 ms",
+           "GFLOP/s", "GB/s");
+}
+
+static void printResult(const BenchOptions *options, const BenchResult *r,
+                        bool first) {
+  if (!strcmp(options->format, "json"))
+    printf("%s\n  {\"name\": \"%s\", \"median_ms\": %.6f, \"p99_ms\": %.6f, "
+           "\"gflops\": %.3f, \"gbps\": %.3f}",
+           first ? "" : ",", r->name, r->medianMs, r->p99Ms, r->gflops,
+           r->gbps);
+  else if (!strcmp(options->format, "csv"))
+    printf("%s,%.6f,%.6f,%.3f,%.3f\n", r->name, r->medianMs, r->p99Ms,
+           r->gflops, r->gbps);
+  else
+    printf("%-40s %11.3f %11.3f %9.1f %9.1f\n", r->name, r->medianMs,
+           r->p99Ms, r->gflops, r->gbps);
+  fflush(stdout);
+}
+
+static int usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [--warmup N] [--repeat N] [--format table|json|csv] "
+          "[--filter TEXT] [--latency FILE] [--tune FILE]\n",
+          program);
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  BenchOptions options = {.warmup = 3, .repeat = 20, .format = "table"};
+  AlloyContext *ctx = NULL;
+  bool first = true;
+  int status = 1;
+
+  for (int i = 1; i < argc; ++i) {
+    if (i + 1 == argc)
+      return usage(argv[0]);
+    if (!strcmp(argv[i], "--warmup"))
+      options.warmup = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--repeat"))
+      options.repeat = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--format"))
+      options.format = argv[++i];
+    else if (!strcmp(argv[i], "--filter"))
+      options.filter = argv[++i];
+    else if (!strcmp(argv[i], "--latency"))
+      options.latency = argv[++i];
+    else if (!strcmp(argv[i], "--tune"))
+      options.tune = argv[++i];
+    else
+      return usage(argv[0]);
+  }
+  if (options.warmup < 0 || options.repeat < 1 ||
+      (strcmp(options.format, "table") && strcmp(options.format, "json") &&
+       strcmp(options.format, "csv")))
+    return usage(argv[0]);
+
+  ctx = createContext();
+  CHECK_ERROR(ctx, "Failed to create context");
+  // a database yet to be written starts empty
+  if (options.tune)
+    loadTuningDatabase(ctx, options.tune);
+
+  printHeader(&options, mtDeviceName(ctx->device));
+  for (size_t i = 0; i < sizeof(benchCases) / sizeof(benchCases[0]); ++i) {
+    BenchResult result;
+    caseName(&benchCases[i], result.name, sizeof(result.name));
+    if (options.filter && !strstr(result.name, options.filter))
+      continue;
+    if (benchCase(ctx, &benchCases[i], &options, &result) != 0)
+      goto cleanup;
+    printResult(&options, &result, first);
+    first = false;
+  }
+  if (!strcmp(options.format, "json"))
+    printf("\n]}\n");
+
+  if (options.tune)
+    CHECK_ERROR(saveTuningDatabase(ctx, options.tune) == 0,
+                "Failed to save the tuning database");
+  if (options.latency) {
+    FILE *out = fopen(options.latency, "w");
+    CHECK_ERROR(out, "Failed to open the latency file");
+    dumpLatencyHistograms(ctx, out);
+    fclose(out);
+  }
+  status = 0;
+
+cleanup:
+  freeContext(ctx);
+  return status;
+}
@@ -0,0 +1,539 @@
+#ifndef alloy_h
+#define alloy_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "../cmt/cmt.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Elements are stored as type: MtDataTypeFloat (also assumed when type is
+ * left 0), MtDataTypeHalf or MtDataTypeBFloat, whose arithmetic is carried
+ * out in float, or the quantized MtDataTypeChar (int8) and the MtDataTypeInt
+ * sums of int8 products. data16, data8 and data32 alias data for the
+ * narrower and integer types.
+ *
+ * Rows are ld elements apart, or packed when ld is 0. A view (see
+ * sliceMatrix) borrows a window of another matrix's storage: data points at
+ * its first element, buffer is the other matrix's and offset counts the
+ * elements from the start of buffer to data. Kernels address views of
+ * shared matrices in place; other matrices are staged as usual.
+ */
+typedef struct {
+  size_t rows;
+  size_t cols;
+  union {
+    float *data;
+    uint16_t *data16;
+    int8_t *data8;
+    int32_t *data32;
+  };
+  MtBuffer *buffer; /* wraps data in place when device-visible, else NULL */
+  MtDataType type;
+  size_t ld;     /* elements from one row to the next; 0 when packed */
+  size_t offset; /* elements from the start of buffer to data */
+  bool view;     /* borrows its storage; freeMatrix only forgets it */
+  size_t mapped; /* bytes of the file or huge-page mapping data lies in */
+} Matrix;
+
+/*
+ * A matrix file is this header, then the rows, ld elements apart, from
+ * dataOffset on. dataOffset is a multiple of alignment, a power of two of at
+ * least 64 bytes; saveMatrix uses 16 KB, the largest page size in common
+ * use. Fields and elements are in native (little-endian) byte order.
+ */
+#define ALLOY_MATRIX_MAGIC "ALLOYMAT"
+#define ALLOY_MATRIX_VERSION 1
+typedef struct AlloyMatrixHeader {
+  char magic[8];       /* ALLOY_MATRIX_MAGIC, not terminated */
+  uint32_t version;    /* ALLOY_MATRIX_VERSION */
+  uint32_t type;       /* MtDataType of the elements */
+  uint64_t rows;
+  uint64_t cols;
+  uint64_t ld;         /* elements from one row to the next, at least cols */
+  uint64_t alignment;  /* bytes dataOffset is a multiple of */
+  uint64_t dataOffset; /* bytes from the start of the file to the rows */
+  uint64_t reserved;   /* 0 */
+} AlloyMatrixHeader;
+
+/* MATRIX_OP_MULTIPLY may be or-ed with the transpose flags, which use a or
+ * b transposed as stored instead of materializing the transposed copy. */
+typedef enum {
+  MATRIX_OP_ADD,
+  MATRIX_OP_MULTIPLY,
+  MATRIX_OP_TRANSPOSE_A = 1 << 8,
+  MATRIX_OP_TRANSPOSE_B = 1 << 9
+} MatrixOperation;
+
+typedef enum {
+  /* binary */
+  EXPR_OP_ADD,
+  EXPR_OP_SUB,
+  EXPR_OP_MUL,
+  EXPR_OP_DIV,
+  EXPR_OP_MIN,
+  EXPR_OP_MAX,
+  /* unary */
+  EXPR_OP_NEG,
+  EXPR_OP_ABS,
+  EXPR_OP_RELU,
+  EXPR_OP_SQRT,
+  EXPR_OP_EXP
+} ExprOp;
+
+/* Which elements share a quantization scale and zero point. */
+typedef enum {
+  QUANT_PER_TENSOR,
+  QUANT_PER_ROW,
+  QUANT_PER_COLUMN
+} QuantAxis;
+
+/*
+ * Maps int8 values q to real ones as scale * (q - zeroPoint), with one scale
+ * (and zero point) for the whole matrix, for each row or for each column.
+ * zeroPoints is NULL for symmetric quantization.
+ */
+typedef struct QuantParams {
+  QuantAxis axis;
+  float *scales;
+  int32_t *zeroPoints;
+} QuantParams;
+
+typedef enum { SPARSE_CSR, SPARSE_BSR } SparseFormat;
+
+/*
+ * A float matrix storing only its nonzero entries, by rows. CSR entries are
+ * single elements; BSR entries are dense blockSize x blockSize blocks, stored
+ * row-major and zero-padded past the last row and column, and rowOffsets and
+ * colIndices count block rows and block columns. The entries of (block) row
+ * r are colIndices and values [rowOffsets[r], rowOffsets[r + 1]).
+ * partitions holds the (block) row bounds of runs with about the same number
+ * of entries; each one is processed as a unit, so rows of very different
+ * lengths still spread evenly over threads. The arrays live in shared
+ * buffers that kernels read in place.
+ */
+typedef struct SparseMatrix {
+  SparseFormat format;
+  size_t rows;
+  size_t cols;
+  size_t blockSize; /* 1 for CSR */
+  size_t nnz;       /* stored entries (blocks for BSR) */
+  Matrix rowOffsets; /* int32, one per (block) row plus one */
+  Matrix colIndices; /* int32, one per entry */
+  Matrix values;     /* float, blockSize * blockSize per entry */
+  Matrix partitions; /* int32, one per partition plus one */
+} SparseMatrix;
+
+/*
+ * Copy the rows x cols block of a streamed matrix at (row, col) into dst,
+ * or out of src, whose rows are ld floats apart. Return 0 on success;
+ * anything else stops the multiply.
+ */
+typedef int (*AlloyTileRead)(void *userData, size_t row, size_t col,
+                             size_t rows, size_t cols, float *dst, size_t ld);
+typedef int (*AlloyTileWrite)(void *userData, size_t row, size_t col,
+                              size_t rows, size_t cols, const float *src,
+                              size_t ld);
+
+/* A rows x cols float matrix that a streaming multiply reads or writes a
+ * tile at a time: through read or write when set, otherwise from or to
+ * matrix (a mapped one, say), whose shape it then takes. */
+typedef struct AlloyMatrixStream {
+  size_t rows;
+  size_t cols;
+  Matrix *matrix;
+  AlloyTileRead read;
+  AlloyTileWrite write;
+  void *userData;
+} AlloyMatrixStream;
+
+/* The tile memory of a streaming multiply given a budget of 0. */
+#define ALLOY_STREAM_DEFAULT_BUDGET ((size_t)256 << 20)
+
+#define ALLOY_CACHE_BUCKETS 64
+
+typedef struct AlloyCacheEntry AlloyCacheEntry;
+typedef struct AlloyBufferPool AlloyBufferPool;
+typedef struct AlloyLatencyRecorder AlloyLatencyRecorder;
+typedef struct AlloyLatencyKernel AlloyLatencyKernel;
+typedef struct AlloyTuningDb AlloyTuningDb;
+typedef struct AlloyOperation AlloyOperation;
+typedef struct AlloyGraph AlloyGraph;
+typedef struct AlloyExpr AlloyExpr;
+
+/* Runs on the thread that observed completion, or on the caller of
+ * setOperationCallback when the operation had already completed. */
+typedef void (*AlloyOperationCallback)(AlloyOperation *op, void *userData);
+
+typedef struct AlloyBufferPoolStats {
+  size_t requests;      /* acquireBuffer calls */
+  size_t hits;          /* requests served without a device allocation */
+  double hitRate;       /* hits / requests */
+  size_t evictions;     /* idle buffers released to stay within the limit */
+  size_t residentBytes; /* device memory owned by the pool, in use or idle */
+  size_t cachedBytes;   /* idle bytes waiting to be reused */
+} AlloyBufferPoolStats;
+
+/*
+ * Where an operation's time goes, each phase timed from the end of the one
+ * before: encoding (from the submit call to the commit), waiting in the
+ * queue (commit to kernel start), executing (kernel start to end) and
+ * waking the caller (kernel end to the return of waitOperation, readback of
+ * a staged result included). The total runs from the submit call to the
+ * completion of the work, result visible. The wake phase is only recorded
+ * for operations that are waited for.
+ */
+typedef enum {
+  ALLOY_LATENCY_ENCODE,
+  ALLOY_LATENCY_QUEUE,
+  ALLOY_LATENCY_EXECUTE,
+  ALLOY_LATENCY_WAKE,
+  ALLOY_LATENCY_TOTAL,
+  ALLOY_LATENCY_PHASES
+} AlloyLatencyPhase;
+
+/* Seconds; quantiles are exact to within 1/64 of their value. */
+typedef struct AlloyLatencyStats {
+  size_t count;
+  double min;
+  double mean;
+  double max;
+  double p50;
+  double p90;
+  double p99;
+  double p999;
+} AlloyLatencyStats;
+
+/*
+ * Owns the device and command queue plus every library and compute pipeline
+ * built through it, keyed by shader source and function name, so repeated
+ * operations only pay for encoding and dispatch.
+ */
+typedef struct AlloyContext {
+  MtDevice *device;
+  MtCommandQueue *cmdQueue;
+  pthread_mutex_t cacheLock;
+  AlloyCacheEntry *cache[ALLOY_CACHE_BUCKETS];
+  AlloyBufferPool *bufferPool;
+  AlloyLatencyRecorder *latency;
+  AlloyTuningDb *tuning;
+} AlloyContext;
+
+AlloyContext *createContext(void);
+void freeContext(AlloyContext *ctx);
+/* Returns the cached pipeline for funcName in shaderFile, building it on
+ * first use. The pipeline is owned by the context. */
+MtComputePipelineState *getComputePipeline(AlloyContext *ctx,
+                                           const char *shaderFile,
+                                           const char *funcName);
+
+/*
+ * Size-class recycler for MtBuffers. acquireBuffer returns a buffer of at
+ * least size bytes with exactly the given options; releaseBuffer caches it
+ * for the next request of that class, releasing the longest idle buffers
+ * first if the idle bytes would pass the pool's limit
+ * (ALLOY_POOL_DEFAULT_CACHE_LIMIT until setBufferPoolLimit changes it).
+ * releaseBuffersOnCompletion hands the buffers back once cmdb completes and
+ * must be called before it is committed. Work using pooled buffers must
+ * complete before the pool is freed.
+ */
+#define ALLOY_POOL_DEFAULT_CACHE_LIMIT ((size_t)256 << 20)
+AlloyBufferPool *createBufferPool(MtDevice *device);
+void freeBufferPool(AlloyBufferPool *pool);
+MtBuffer *acquireBuffer(AlloyBufferPool *pool, size_t size,
+                        MtResourceOptions options);
+void releaseBuffer(AlloyBufferPool *pool, MtBuffer *buffer);
+bool releaseBuffersOnCompletion(AlloyBufferPool *pool, MtCommandBuffer *cmdb,
+                                MtBuffer **buffers, size_t count);
+/* Releases every idle buffer back to the device. */
+void trimBufferPool(AlloyBufferPool *pool);
+/* Caps the idle bytes the pool keeps, releasing idle buffers past it now. */
+void setBufferPoolLimit(AlloyBufferPool *pool, size_t maxCachedBytes);
+AlloyBufferPoolStats getBufferPoolStats(AlloyBufferPool *pool);
+
+/*
+ * Every operation submitted through a context has its phases recorded in
+ * per-kernel latency histograms, keyed by the Metal function name.
+ * getLatencyKernels stores up to capacity names, valid for the life of the
+ * context, and returns how many kernels there are. getLatencyStats and
+ * getLatencyPercentile (percentile from 0 to 100, result in seconds) read
+ * one kernel's histogram, or all kernels' merged when kernel is NULL; they
+ * return -1 for an unknown kernel. dumpLatencyHistograms prints a summary
+ * line per kernel and phase, in microseconds.
+ */
+size_t getLatencyKernels(AlloyContext *ctx, const char **names,
+                         size_t capacity);
+int getLatencyStats(AlloyContext *ctx, const char *kernel,
+                    AlloyLatencyPhase phase, AlloyLatencyStats *stats);
+double getLatencyPercentile(AlloyContext *ctx, const char *kernel,
+                            AlloyLatencyPhase phase, double percentile);
+void resetLatencyHistograms(AlloyContext *ctx);
+void dumpLatencyHistograms(AlloyContext *ctx, FILE *out);
+
+/*
+ * Threadgroup autotuning. Every dispatch looks up the threadgroup shape
+ * tuned for its kernel and grid (rounded up to powers of two per dimension)
+ * on the context's device, and falls back to the operation's heuristic
+ * shape when there is none. createContext loads the database named by
+ * ALLOY_TUNING_DB, if set.
+ *
+ * autotuneOperation runs run, which must submit exactly one dispatch and
+ * wait for it, repeat times (0: 5) with the heuristic shape and with each
+ * candidate: widths a multiple of the pipeline's thread execution width,
+ * heights filling up to its thread limit. The fastest median wins and is
+ * used by later dispatches; saveTuningDatabase keeps it for later runs.
+ * Loading replaces what the context knew. Each returns 0 on success, -1 on
+ * failure.
+ */
+typedef int (*AlloyTuneFn)(AlloyContext *ctx, void *userData);
+int autotuneOperation(AlloyContext *ctx, AlloyTuneFn run, void *userData,
+                      int repeat);
+int autotuneMatrixOperation(AlloyContext *ctx, Matrix *a, Matrix *b,
+                            Matrix *result, MatrixOperation op, int repeat);
+int loadTuningDatabase(AlloyContext *ctx, const char *path);
+int saveTuningDatabase(AlloyContext *ctx, const char *path);
+
+/*
+ * Parallel loops on the host. fn(userData, begin, end) is called for
+ * consecutive ranges of grain items (0: 1) covering [0, count), from any
+ * thread and concurrently; idle threads steal half of what another has
+ * left. Without Metal the threads are the host backend's, shared with its
+ * kernels; under Metal they are Grand Central Dispatch's. fn may start
+ * loops of its own. parallelFor2D covers rows x cols in tiles of rowGrain
+ * x colGrain. Each returns once every call has.
+ */
+typedef void (*AlloyRangeFn)(void *userData, size_t begin, size_t end);
+typedef void (*AlloyTileFn)(void *userData, size_t rowBegin, size_t rowEnd,
+                            size_t colBegin, size_t colEnd);
+void parallelFor(size_t count, size_t grain, AlloyRangeFn fn, void *userData);
+void parallelFor2D(size_t rows, size_t cols, size_t rowGrain,
+                   size_t colGrain, AlloyTileFn fn, void *userData);
+/* memcpy, spread over the threads when large. */
+void parallelCopy(void *dst, const void *src, size_t size);
+
+/* Allocates packed rows on a cache-line boundary. */
+Matrix createMatrix(size_t rows, size_t cols);
+Matrix createMatrixOfType(size_t rows, size_t cols, MtDataType type);
+/* Allocates page-aligned storage wrapped in a no-copy shared buffer, so
+ * kernels read and write the matrix in place. The matrix must outlive any
+ * work that uses it. */
+Matrix createSharedMatrix(AlloyContext *ctx, size_t rows, size_t cols);
+Matrix createSharedMatrixOfType(AlloyContext *ctx, size_t rows, size_t cols,
+                                MtDataType type);
+/* Like the above, but every row starts on a cache line and ld is padded so
+ * that a column of a wide power-of-two matrix spreads over the cache sets
+ * instead of landing in a few. Address elements through ld. */
+Matrix createPaddedMatrix(size_t rows, size_t cols);
+Matrix createPaddedMatrixOfType(size_t rows, size_t cols, MtDataType type);
+Matrix createPaddedSharedMatrix(AlloyContext *ctx, size_t rows, size_t cols);
+Matrix createPaddedSharedMatrixOfType(AlloyContext *ctx, size_t rows,
+                                      size_t cols, MtDataType type);
+/* Bytes per element, or 0 if the matrix type is not supported. */
+size_t matrixElementSize(const Matrix *mat);
+/* A rows x cols view of mat from (row, col) on, sharing its storage; it must
+ * not outlive mat. On a bad window the view has NULL data. */
+Matrix sliceMatrix(const Matrix *mat, size_t row, size_t col, size_t rows,
+                   size_t cols);
+/* Rows row .. row + rows - 1 of mat: a view whose rows stay contiguous. */
+Matrix sliceMatrixRows(const Matrix *mat, size_t row, size_t rows);
+/* Writes mat to path in the matrix file format, its rows page-aligned and
+ * keeping mat's padding (a view is written packed). Returns 0 on success,
+ * -1 on failure. */
+int saveMatrix(const Matrix *mat, const char *path);
+/* Maps the matrix file at path into a shared matrix without reading it:
+ * pages are faulted in as kernels or the host touch them. A writable
+ * mapping writes changes through to the file; a read-only one must not be
+ * written to, result of an operation included. On failure the matrix has
+ * NULL data. */
+Matrix mapMatrix(AlloyContext *ctx, const char *path, bool writable);
+void freeMatrix(Matrix *mat);
+void fillMatrixRandom(Matrix *mat);
+void printMatrix(const Matrix *mat);
+MtBuffer *createBuffer(MtDevice *device, size_t size,
+                       MtResourceOptions options);
+MtSize threadgroupSizeFor(MtComputePipelineState *pipelineState,
+                          MtSize gridSize);
+/* Threadgroups spanning whole rows, for memory-bound elementwise kernels. */
+MtSize rowThreadgroupSizeFor(MtComputePipelineState *pipelineState,
+                             MtSize gridSize);
+const char *shaderSource(const char *filename);
+MtLibrary *createLibraryFromFile(MtDevice *device, const char *filename);
+/*
+ * a and b must share an element type. An addition result has that type too;
+ * a product may also be float, keeping the full precision of the float
+ * accumulation. int8 (MtDataTypeChar) matrices can only be multiplied, into
+ * an MtDataTypeInt result holding the exact sums. A float-family product
+ * takes the transpose flags: with MATRIX_OP_TRANSPOSE_A, a is stored K x M,
+ * and with MATRIX_OP_TRANSPOSE_B, b is stored N x K.
+ */
+int performMatrixOperation(AlloyContext *ctx, Matrix *a, Matrix *b,
+                           Matrix *result, MatrixOperation op);
+/*
+ * Computes result[i] = a[i] * b[i] for batchCount items in one dispatch. a, b
+ * and result describe the shape, leading dimension and first item of each
+ * operand; item i starts stride{A,B,C} elements after it. A stride of 0
+ * reuses the same matrix for every item. Operands with padded rows must be
+ * shared.
+ */
+int performBatchedMatrixMultiply(AlloyContext *ctx, Matrix *a, size_t strideA,
+                                 Matrix *b, size_t strideB, Matrix *result,
+                                 size_t strideC, size_t batchCount);
+/*
+ * Computes c = a * b for float matrices too large to hold at once, in
+ * tiles that together take at most memoryBudget bytes. Panels of a and b
+ * are read into one half of a double buffer while the tiles in the other
+ * half multiply, and each tile of c is written as soon as it is complete.
+ */
+int performStreamingMatrixMultiply(AlloyContext *ctx,
+                                   const AlloyMatrixStream *a,
+                                   const AlloyMatrixStream *b,
+                                   const AlloyMatrixStream *c,
+                                   size_t memoryBudget);
+/* Rounds (or widens) every element of src into dst, which has src's shape
+ * and any of the float, half or bfloat16 types. */
+int performMatrixConversion(AlloyContext *ctx, Matrix *src, Matrix *dst);
+/* Writes the transpose of src, of any element type, to dst, which has
+ * src's type and its cols x rows shape. A square src may be its own dst,
+ * which transposes it in place. */
+int performMatrixTranspose(AlloyContext *ctx, Matrix *src, Matrix *dst);
+/* Writes the sum of each row of the float matrix src to the float matrix
+ * sums, which has src's rows and one column. */
+int performMatrixRowSums(AlloyContext *ctx, Matrix *src, Matrix *sums);
+
+/*
+ * Picks the scales (and, unless symmetric, zero points) that map the range
+ * of the float matrix src along axis onto int8. Symmetric scales map the
+ * largest magnitude to 127; asymmetric ones map [min, max], widened to
+ * include 0, onto [-128, 127]. The arrays are allocated here and released
+ * with freeQuantParams. Returns 0 on success, -1 on failure.
+ */
+int computeQuantParams(const Matrix *src, QuantAxis axis, bool symmetric,
+                       QuantParams *params);
+void freeQuantParams(QuantParams *params);
+/* Quantizes the float matrix src into the int8 matrix dst of the same shape:
+ * dst = clamp(rint(src / scale) + zeroPoint, -128, 127). */
+int performMatrixQuantization(AlloyContext *ctx, Matrix *src, Matrix *dst,
+                              const QuantParams *params);
+/* Dequantizes src, int8 or int32, into the float matrix dst. */
+int performMatrixDequantization(AlloyContext *ctx, Matrix *src, Matrix *dst,
+                                const QuantParams *params);
+/*
+ * result = dequantize(a) * dequantize(b) for int8 a and b, computed as exact
+ * int32 sums and scaled into the float result in the same pass. a's
+ * parameters are per tensor or per row, b's per tensor or per column. The
+ * int32 sums limit K to 32768. Parameters are copied at submission.
+ */
+int performQuantizedMatrixMultiply(AlloyContext *ctx, Matrix *a,
+                                   const QuantParams *qa, Matrix *b,
+                                   const QuantParams *qb, Matrix *result);
+
+/*
+ * Builds sparse from the nonzero elements of the float matrix dense. BSR
+ * keeps every blockSize x blockSize block holding a nonzero (blockSize 1 to
+ * SPARSE_MAX_BLOCK_SIZE); CSR ignores blockSize. Returns 0 on success, -1 on
+ * failure.
+ */
+#define SPARSE_MAX_BLOCK_SIZE 16
+int createSparseMatrix(AlloyContext *ctx, const Matrix *dense,
+                       SparseFormat format, size_t blockSize,
+                       SparseMatrix *sparse);
+/* Builds a CSR matrix from existing arrays, which are copied and checked:
+ * rowOffsets has rows + 1 nondecreasing entries from 0 to nnz, and every
+ * column index is below cols. */
+int createSparseMatrixFromCSR(AlloyContext *ctx, size_t rows, size_t cols,
+                              size_t nnz, const int32_t *rowOffsets,
+                              const int32_t *colIndices, const float *values,
+                              SparseMatrix *sparse);
+void freeSparseMatrix(SparseMatrix *sparse);
+/*
+ * result = a op b for sparse a and dense float b and result, touching only
+ * a's stored entries: the product a * b (a matrix-vector product when b has
+ * one column), or the sum a + b. result may be b for the sum.
+ */
+int performSparseMatrixOperation(AlloyContext *ctx, SparseMatrix *a,
+                                 Matrix *b, Matrix *result,
+                                 MatrixOperation op);
+
+/*
+ * Non-blocking forms of the operations above. They return as soon as the work
+ * is committed, or NULL if it could not be encoded. Operations on one context
+ * run in submission order, so dependent operations can be queued back to
+ * back; inputs in host memory are copied at submission, so chain them
+ * through shared matrices. A non-shared result is written once the operation
+ * completes. Every handle must be released, and the operands and context
+ * must outlive the work.
+ */
+AlloyOperation *submitMatrixOperation(AlloyContext *ctx, Matrix *a, Matrix *b,
+                                      Matrix *result, MatrixOperation op);
+AlloyOperation *submitBatchedMatrixMultiply(AlloyContext *ctx, Matrix *a,
+                                            size_t strideA, Matrix *b,
+                                            size_t strideB, Matrix *result,
+                                            size_t strideC, size_t batchCount);
+AlloyOperation *submitMatrixConversion(AlloyContext *ctx, Matrix *src,
+                                       Matrix *dst);
+AlloyOperation *submitMatrixTranspose(AlloyContext *ctx, Matrix *src,
+                                      Matrix *dst);
+AlloyOperation *submitMatrixRowSums(AlloyContext *ctx, Matrix *src,
+                                    Matrix *sums);
+AlloyOperation *submitMatrixQuantization(AlloyContext *ctx, Matrix *src,
+                                         Matrix *dst,
+                                         const QuantParams *params);
+AlloyOperation *submitMatrixDequantization(AlloyContext *ctx, Matrix *src,
+                                           Matrix *dst,
+                                           const QuantParams *params);
+AlloyOperation *submitQuantizedMatrixMultiply(AlloyContext *ctx, Matrix *a,
+                                              const QuantParams *qa, Matrix *b,
+                                              const QuantParams *qb,
+                                              Matrix *result);
+AlloyOperation *submitSparseMatrixOperation(AlloyContext *ctx,
+                                            SparseMatrix *a, Matrix *b,
+                                            Matrix *result,
+                                            MatrixOperation op);
+/* Blocks until op completes; returns 0 on success, -1 on failure. */
+int waitOperation(AlloyOperation *op);
+/* Returns true once op has completed and its result is visible. */
+bool pollOperation(AlloyOperation *op);
+/* 0 on success, -1 on failure or while still running. */
+int operationStatus(AlloyOperation *op);
+void setOperationCallback(AlloyOperation *op, AlloyOperationCallback callback,
+                          void *userData);
+void releaseOperation(AlloyOperation *op);
+
+/*
+ * Lazily built elementwise expressions, e.g. relu(A + B) * s:
+ *
+ *   AlloyExpr *sum = exprBinary(g, EXPR_OP_ADD, exprMatrix(g, &A),
+ *                               exprMatrix(g, &B));
+ *   AlloyExpr *e = exprBinary(g, EXPR_OP_MUL, exprUnary(g, EXPR_OP_RELU, sum),
+ *                             exprConstant(g, s));
+ *   evaluateExpr(ctx, e, &C);
+ *
+ * Nothing runs until evaluation, which fuses the whole expression into one
+ * pass: each input matrix is read once and the result written once. Matrix
+ * inputs must be float and have the result's shape; the result may also be
+ * an input.
+ * Builders return NULL on failure and pass NULL through, so an expression
+ * only needs checking once. Nodes belong to their graph, which is freed as a
+ * whole and must not be used from two threads at once.
+ */
+AlloyGraph *createGraph(void);
+void freeGraph(AlloyGraph *graph);
+AlloyExpr *exprMatrix(AlloyGraph *graph, Matrix *mat);
+AlloyExpr *exprConstant(AlloyGraph *graph, float value);
+AlloyExpr *exprUnary(AlloyGraph *graph, ExprOp op, AlloyExpr *x);
+AlloyExpr *exprBinary(AlloyGraph *graph, ExprOp op, AlloyExpr *x,
+                      AlloyExpr *y);
+AlloyOperation *submitExpr(AlloyContext *ctx, AlloyExpr *expr,
+                           Matrix *result);
+int evaluateExpr(AlloyContext *ctx, AlloyExpr *expr, Matrix *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* alloy_h */
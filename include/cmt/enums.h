@@ -334,6 +334,11 @@ typedef enum MtDataType {
 
     MtDataTypeRenderPipeline         = 78,
     MtDataTypeIndirectCommandBuffer  = 80,
+
+    MtDataTypeBFloat  = 121,
+    MtDataTypeBFloat2 = 122,
+    MtDataTypeBFloat3 = 123,
+    MtDataTypeBFloat4 = 124,
 } MtDataType;
 
 typedef enum MtArgumentAccess {
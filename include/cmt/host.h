@@ -0,0 +1,192 @@
+#ifndef cmt_host_h
+#define cmt_host_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+#include "types.h"
+
+/*
+ * Host (CPU) backend extensions.
+ *
+ * On platforms without Metal the cmt compute API is implemented natively:
+ * command buffers run on a per-queue scheduler thread and every dispatch is
+ * split into threadgroups that are spread across a worker pool sized to the
+ * machine. Kernels cannot be compiled from Metal source, so each kernel is a
+ * C function registered under the name that mtNewFunctionWithName looks up.
+ *
+ * A kernel either runs a whole threadgroup per call (fn), looping over its
+ * threads itself, or is written per thread in the Metal style (phases).
+ * Every threadgroup runs start to finish on one worker, with its
+ * threadgroup memory in scratch that the worker reuses from one threadgroup
+ * to the next, so it stays in cache.
+ */
+
+#define MT_HOST_MAX_BUFFER_BINDINGS 31
+#define MT_HOST_MAX_THREADGROUP_MEMORY_BINDINGS 31
+
+/* Arguments shared by every threadgroup of one dispatch. */
+typedef struct MtHostKernelArgs {
+  void *buffers[MT_HOST_MAX_BUFFER_BINDINGS];       /* contents + offset */
+  NsUInteger lengths[MT_HOST_MAX_BUFFER_BINDINGS];  /* bytes past offset */
+  MtSize threadsPerGrid;
+  MtSize threadgroupsPerGrid;
+} MtHostKernelArgs;
+
+/* Position of the threadgroup being executed. threadsPerThreadgroup is
+ * clipped to the grid for edge threadgroups of non-uniform dispatches.
+ * threadgroupMemory holds the lengths set with
+ * mtComputeCommandEncoderSetThreadgroupMemoryLengthAtIndex (NULL where none
+ * was), staticThreadgroupMemory the kernel's own; both are 16-byte aligned,
+ * private to the threadgroup and not initialized. */
+typedef struct MtHostThreadgroup {
+  MtSize threadgroupPositionInGrid;
+  MtSize threadsPerThreadgroup;
+  MtOrigin threadOrigin; /* thread_position_in_grid of the first thread */
+  void *threadgroupMemory[MT_HOST_MAX_THREADGROUP_MEMORY_BINDINGS];
+  void *staticThreadgroupMemory;
+} MtHostThreadgroup;
+
+/* One SIMD-group of a per-thread kernel: activeLanes consecutive threads
+ * of a threadgroup row, the first of which the positions and index are
+ * for. Lanes past activeLanes (the threadExecutionWidth of the kernel at
+ * most) lie outside the grid and must not be stored. state is the group's
+ * own threadExecutionWidth * threadStateLength bytes, laid out as the
+ * kernel chooses and carried from one phase to the next: the variables a
+ * Metal kernel keeps live across a barrier. */
+typedef struct MtHostThread {
+  MtOrigin threadPositionInGrid;
+  MtOrigin threadPositionInThreadgroup;
+  NsUInteger threadIndexInThreadgroup;
+  NsUInteger activeLanes;
+  void *state;
+} MtHostThread;
+
+typedef void (*MtHostKernelFn)(const MtHostKernelArgs *args,
+                               const MtHostThreadgroup *tg);
+
+/* Runs one phase of a per-thread kernel for one SIMD-group and returns the
+ * phase to run next, or MT_HOST_PHASE_END. */
+typedef NsUInteger (*MtHostThreadFn)(const MtHostKernelArgs *args,
+                                     const MtHostThreadgroup *tg,
+                                     const MtHostThread *thread);
+#define MT_HOST_PHASE_END ((NsUInteger)-1)
+
+/*
+ * A per-thread kernel is cut at its threadgroup_barrier calls into phases,
+ * starting with phases[0]. Every thread of the threadgroup runs a phase
+ * before any runs the next, which is what a barrier guarantees, so a
+ * barrier costs nothing more than returning. As in Metal, barriers must be
+ * reached in uniform control flow: all threads return the same next phase,
+ * which is how loops with barriers in them are written.
+ *
+ * Threads run threadExecutionWidth at a time, as the lanes of one call, in
+ * the SPMD style of ISPC: a kernel with a width of 1 sees a thread per
+ * call, a wider one computes its lanes as vectors and masks off those past
+ * activeLanes, so the bounds checks of the Metal source become a partial
+ * load and store at the edge of the grid.
+ */
+typedef struct MtHostKernelDesc {
+  const char *name;
+  MtHostKernelFn fn;                        /* or NULL with phases */
+  NsUInteger maxTotalThreadsPerThreadgroup; /* 0: device maximum */
+  NsUInteger threadExecutionWidth;          /* 0: 1 */
+  const MtHostThreadFn *phases;             /* must outlive the kernel */
+  NsUInteger phaseCount;
+  NsUInteger threadStateLength;     /* bytes of per-thread state */
+  NsUInteger threadgroupMemoryLength; /* bytes of static threadgroup memory */
+} MtHostKernelDesc;
+
+/* Registers (or replaces) the kernel implementation for desc->name. */
+MT_EXPORT
+bool mtHostRegisterKernel(const MtHostKernelDesc *desc);
+
+/* Fails the dispatch args belong to, from one of its threadgroups: a kernel
+ * that cannot do its share of the work (out of scratch memory, say) calls
+ * this rather than leave that part of the output unwritten. Threadgroups
+ * not yet started are skipped, later dispatches do not run, the command
+ * buffer ends with MtCommandBufferStatusError and mtCommandBufferError
+ * describes the first failure. code is an MtCommandBufferError; reason must
+ * be a string constant. */
+MT_EXPORT
+void mtHostKernelFail(const MtHostKernelArgs *args, NsInteger code,
+                      const char *reason);
+
+/* Number of threads executing threadgroups, including the submitting one. */
+MT_EXPORT
+NsUInteger mtHostDeviceThreadCount(MtDevice *device);
+
+/*
+ * NUMA. On a machine with several nodes the pool's workers are pinned to
+ * them in turn, and buffers of 2 MB or more have their pages interleaved
+ * across them, so no one node holds a whole operand. Such buffers are
+ * fresh mappings (see huge pages below), zero and untouched until first
+ * used; one that fell back to the allocator is cleared by the pool instead,
+ * so no one thread first touches all of it. mtHostInterleaveMemory
+ * interleaves memory allocated elsewhere, before it is first written.
+ * Setting MT_HOST_NUMA=0 treats the machine as one node.
+ */
+MT_EXPORT
+NsUInteger mtHostNodeCount(void);
+MT_EXPORT
+void mtHostInterleaveMemory(void *ptr, NsUInteger length);
+
+/*
+ * Huge pages. Buffers of 2 MB or more are mapped 2 MB-aligned and marked
+ * for transparent huge pages, cutting TLB misses on large operands. These
+ * resource options, or-ed into those of mtDeviceNewBufferWithLength, opt
+ * in for any size (trying reserved hugetlb pages, 1 GB then 2 MB, before
+ * transparent ones) or out altogether. mtHostAllocateMemory allocates
+ * memory the same way for use elsewhere, falling back to the allocator
+ * with alignment (a power of two up to a page; 0 for 64 bytes); it is
+ * zeroed when *mapped comes back nonzero, and mtHostFreeMemory takes that
+ * *mapped back. mtHostHugePageStats reports the bytes of such mappings
+ * still live and how many of them the kernel has backed with huge pages
+ * (false where that cannot be read).
+ */
+#define MT_HOST_RESOURCE_HUGE_PAGES (1u << 20)
+#define MT_HOST_RESOURCE_NO_HUGE_PAGES (1u << 21)
+MT_EXPORT
+void *mtHostAllocateMemory(NsUInteger length, NsUInteger options,
+                           NsUInteger alignment, NsUInteger *mapped);
+MT_EXPORT
+void mtHostFreeMemory(void *ptr, NsUInteger mapped);
+MT_EXPORT
+bool mtHostHugePageStats(NsUInteger *requested, NsUInteger *backed);
+
+/*
+ * Runs fn(ctx, begin, end) over [0, count) on the device's worker pool, the
+ * one command buffers run on, so host work and kernels share the same
+ * threads. The range is cut into chunks of grain items (0: 1) and a call
+ * covers one chunk; idle threads steal half of the chunks another has left.
+ * The caller takes part and returns when every call has. fn may call
+ * mtHostParallelFor itself.
+ */
+typedef void (*MtHostRangeFn)(void *ctx, NsUInteger begin, NsUInteger end);
+MT_EXPORT
+void mtHostParallelFor(MtDevice *device, NsUInteger count, NsUInteger grain,
+                       MtHostRangeFn fn, void *ctx);
+
+/*
+ * Tracing. While a trace runs, command buffer commits, queueing and
+ * execution, every dispatch, the threadgroups each pool thread runs, and
+ * debug groups and signposts (both as encoded and as executed) are
+ * recorded into per-thread rings of eventsPerThread events (0: 65536),
+ * which keep the most recent ones. mtHostTraceWrite saves the current
+ * trace as Chrome trace event JSON, for chrome://tracing or Perfetto.
+ * Setting MT_HOST_TRACE to a path traces the whole process into it.
+ */
+MT_EXPORT
+bool mtHostTraceStart(NsUInteger eventsPerThread);
+MT_EXPORT
+void mtHostTraceStop(void);
+MT_EXPORT
+bool mtHostTraceWrite(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* cmt_host_h */
@@ -53,8 +53,13 @@ typedef void MtEvent;
 typedef void MtSharedEvent;
 typedef void MtSharedEventHandle;
 typedef void MtFence;
+#if defined(__BLOCKS__)
 typedef void (^MtSharedEventNotificationBlock)(MtSharedEvent *ev,
                                                uint64_t value);
+#else
+typedef void (*MtSharedEventNotificationBlock)(MtSharedEvent *ev,
+                                               uint64_t value);
+#endif
 typedef void (*MtCommandBufferHandlerFun)(MtCommandBuffer *buf);
 typedef void MtSharedEventListener;
 
@@ -1,121 +1,888 @@
-#include "../include/cmt/cmt.h"
-#include "../include/cmt/command_buf.h"
-#include "../include/cmt/command_enc_compute.h"
-#include "../include/cmt/command_queue.h"
-#include "../include/cmt/compute/compute-pipeline.h"
-#include "../include/cmt/device.h"
+#include "internal.h"
 #include "../include/cmt/error_handling.h"
-#include "../include/cmt/kernels/library.h"
-#include "../include/cmt/memory/buffer.h"
-#include "../include/cmt/rendering/pipeline.h"
+#ifndef __APPLE__
+#include "../include/cmt/host.h"
+#endif
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-#define CHECK_ERROR(condition, message)                                        \
-  do {                                                                         \
-    if (!(condition)) {                                                        \
-      fprintf(stderr, "Error: %s\n", message);                                 \
-      goto cleanup;                                                            \
-    }                                                                          \
-  } while (0)
-
-typedef struct {
-  size_t rows;
-  size_t cols;
-  float *data;
-} Matrix;
-
-typedef enum { MATRIX_OP_ADD, MATRIX_OP_MULTIPLY } MatrixOperation;
-
-Matrix createMatrix(size_t rows, size_t cols);
-void freeMatrix(Matrix *mat);
-void fillMatrixRandom(Matrix *mat);
-void printMatrix(const Matrix *mat);
-MtBuffer *createBuffer(MtDevice *device, size_t size,
-                       MtResourceOptions options);
-MtLibrary *createLibraryFromFile(MtDevice *device, const char *filename);
-int performMatrixOperation(MtDevice *device, MtCommandQueue *cmdQueue,
-                           Matrix *a, Matrix *b, Matrix *result,
-                           MatrixOperation op);
+/*
+ * 16-bit helpers shared by the shaders below. bfloat16 travels as ushort and
+ * is rounded to nearest even; storeAs and loadAs switch on the MtDataType
+ * value of a buffer (Float 3, Half 16, BFloat 121).
+ */
+#define PRECISION_HELPERS                                                      \
+  "inline float fromBFloat(ushort x) { return as_type<float>(uint(x) << 16); "  \
+  "}\n"                                                                        \
+  "inline ushort toBFloat(float x) {\n"                                        \
+  "   uint u = as_type<uint>(x);\n"                                            \
+  "   if (isnan(x)) return ushort((u >> 16) | 0x40);\n"                        \
+  "   return ushort((u + 0x7fff + ((u >> 16) & 1)) >> 16);\n"                  \
+  "}\n"                                                                        \
+  "inline float loadAs(const device uchar* p, uint i, uint type) {\n"          \
+  "   if (type == 16) return float(((const device half*)p)[i]);\n"             \
+  "   if (type == 121) return fromBFloat(((const device ushort*)p)[i]);\n"     \
+  "   return ((const device float*)p)[i];\n"                                   \
+  "}\n"                                                                        \
+  "inline void storeAs(device uchar* p, uint i, float v, uint type) {\n"       \
+  "   if (type == 16) ((device half*)p)[i] = half(v);\n"                       \
+  "   else if (type == 121) ((device ushort*)p)[i] = toBFloat(v);\n"           \
+  "   else ((device float*)p)[i] = v;\n"                                       \
+  "}\n"
 
 const char *matrixAdditionShader =
     "#include <metal_stdlib>\n"
-    "using namespace metal;\n"
+    "using namespace metal;\n" PRECISION_HELPERS
     "kernel void matrix_addition(const device float* A [[buffer(0)]],\n"
     "                            const device float* B [[buffer(1)]],\n"
     "                            device float* C [[buffer(2)]],\n"
+    "                            constant uint* ld [[buffer(3)]],\n"
     "                            uint2 id [[thread_position_in_grid]],\n"
     "                            uint2 gridSize [[threads_per_grid]]) {\n"
     "   if (id.x < gridSize.x && id.y < gridSize.y) {\n"
-    "       unsigned int index = id.y * gridSize.x + id.x;\n"
-    "       C[index] = A[index] + B[index];\n"
+    "       C[id.y * ld[2] + id.x] =\n"
+    "           A[id.y * ld[0] + id.x] + B[id.y * ld[1] + id.x];\n"
+    "   }\n"
+    "}\n"
+    "kernel void matrix_addition_half(const device half* A [[buffer(0)]],\n"
+    "                                 const device half* B [[buffer(1)]],\n"
+    "                                 device half* C [[buffer(2)]],\n"
+    "                                 constant uint* ld [[buffer(3)]],\n"
+    "                                 uint2 id [[thread_position_in_grid]],\n"
+    "                                 uint2 gridSize [[threads_per_grid]]) {\n"
+    "   if (id.x < gridSize.x && id.y < gridSize.y) {\n"
+    "       C[id.y * ld[2] + id.x] = half(float(A[id.y * ld[0] + id.x]) +\n"
+    "                                     float(B[id.y * ld[1] + id.x]));\n"
+    "   }\n"
+    "}\n"
+    "kernel void matrix_addition_bfloat(const device ushort* A [[buffer(0)]],\n"
+    "                                   const device ushort* B [[buffer(1)]],\n"
+    "                                   device ushort* C [[buffer(2)]],\n"
+    "                                   constant uint* ld [[buffer(3)]],\n"
+    "                                   uint2 id [[thread_position_in_grid]],\n"
+    "                                   uint2 gridSize [[threads_per_grid]]) "
+    "{\n"
+    "   if (id.x < gridSize.x && id.y < gridSize.y) {\n"
+    "       C[id.y * ld[2] + id.x] =\n"
+    "           toBFloat(fromBFloat(A[id.y * ld[0] + id.x]) +\n"
+    "                    fromBFloat(B[id.y * ld[1] + id.x]));\n"
     "   }\n"
     "}";
 
+/*
+ * Element (row, col) of op(A) (M x K) and op(B) (K x N) for the
+ * GEMM_TRANSPOSE_A (1) and GEMM_TRANSPOSE_B (2) flags, whose stored rows are
+ * lda and ldb apart: a transposed operand is read from its K x M or N x K
+ * storage.
+ */
+#define TRANSPOSE_HELPERS                                                      \
+  "inline uint indexA(uint row, uint col, uint lda, uint transpose) {\n"       \
+  "   return (transpose & 1) ? col * lda + row : row * lda + col;\n"           \
+  "}\n"                                                                        \
+  "inline uint indexB(uint row, uint col, uint ldb, uint transpose) {\n"       \
+  "   return (transpose & 2) ? col * ldb + row : row * ldb + col;\n"           \
+  "}\n"
+
 const char *matrixMultiplicationShader =
     "#include <metal_stdlib>\n"
-    "using namespace metal;\n"
+    "using namespace metal;\n" PRECISION_HELPERS TRANSPOSE_HELPERS
     "kernel void matrix_multiplication(const device float* A [[buffer(0)]],\n"
     "                                  const device float* B [[buffer(1)]],\n"
     "                                  device float* C [[buffer(2)]],\n"
     "                                  constant uint& M [[buffer(3)]],\n"
     "                                  constant uint& N [[buffer(4)]],\n"
     "                                  constant uint& K [[buffer(5)]],\n"
+    "                                  constant uint& transpose "
+    "[[buffer(6)]],\n"
+    "                                  constant uint* ld [[buffer(7)]],\n"
     "                                  uint2 id [[thread_position_in_grid]]) "
     "{\n"
     "   if (id.x >= N || id.y >= M) return;\n"
     "   float sum = 0.0f;\n"
     "   for (uint i = 0; i < K; ++i) {\n"
-    "       sum += A[id.y * K + i] * B[i * N + id.x];\n"
+    "       sum += A[indexA(id.y, i, ld[0], transpose)] *\n"
+    "              B[indexB(i, id.x, ld[1], transpose)];\n"
+    "   }\n"
+    "   C[id.y * ld[2] + id.x] = sum;\n"
+    "}\n"
+    "kernel void matrix_multiplication_batched(\n"
+    "    const device float* A [[buffer(0)]],\n"
+    "    const device float* B [[buffer(1)]],\n"
+    "    device float* C [[buffer(2)]],\n"
+    "    constant uint& M [[buffer(3)]],\n"
+    "    constant uint& N [[buffer(4)]],\n"
+    "    constant uint& K [[buffer(5)]],\n"
+    "    constant uint& strideA [[buffer(6)]],\n"
+    "    constant uint& strideB [[buffer(7)]],\n"
+    "    constant uint& strideC [[buffer(8)]],\n"
+    "    constant uint* ld [[buffer(9)]],\n"
+    "    uint3 id [[thread_position_in_grid]]) {\n"
+    "   if (id.x >= N || id.y >= M) return;\n"
+    "   A += id.z * strideA;\n"
+    "   B += id.z * strideB;\n"
+    "   float sum = 0.0f;\n"
+    "   for (uint i = 0; i < K; ++i) {\n"
+    "       sum += A[id.y * ld[0] + i] * B[i * ld[1] + id.x];\n"
+    "   }\n"
+    "   C[id.z * strideC + id.y * ld[2] + id.x] = sum;\n"
+    "}\n"
+    "kernel void matrix_multiplication_half(const device half* A [[buffer(0)]],\n"
+    "                                       const device half* B [[buffer(1)]],\n"
+    "                                       device uchar* C [[buffer(2)]],\n"
+    "                                       constant uint& M [[buffer(3)]],\n"
+    "                                       constant uint& N [[buffer(4)]],\n"
+    "                                       constant uint& K [[buffer(5)]],\n"
+    "                                       constant uint& transpose "
+    "[[buffer(6)]],\n"
+    "                                       constant uint& typeC "
+    "[[buffer(7)]],\n"
+    "                                       constant uint* ld [[buffer(8)]],\n"
+    "                                       uint2 id "
+    "[[thread_position_in_grid]]) {\n"
+    "   if (id.x >= N || id.y >= M) return;\n"
+    "   float sum = 0.0f;\n"
+    "   for (uint i = 0; i < K; ++i) {\n"
+    "       sum += float(A[indexA(id.y, i, ld[0], transpose)]) *\n"
+    "              float(B[indexB(i, id.x, ld[1], transpose)]);\n"
     "   }\n"
-    "   C[id.y * N + id.x] = sum;\n"
+    "   storeAs(C, id.y * ld[2] + id.x, sum, typeC);\n"
+    "}\n"
+    "kernel void matrix_multiplication_half_batched(\n"
+    "    const device half* A [[buffer(0)]],\n"
+    "    const device half* B [[buffer(1)]],\n"
+    "    device uchar* C [[buffer(2)]],\n"
+    "    constant uint& M [[buffer(3)]],\n"
+    "    constant uint& N [[buffer(4)]],\n"
+    "    constant uint& K [[buffer(5)]],\n"
+    "    constant uint& strideA [[buffer(6)]],\n"
+    "    constant uint& strideB [[buffer(7)]],\n"
+    "    constant uint& strideC [[buffer(8)]],\n"
+    "    constant uint& typeC [[buffer(9)]],\n"
+    "    constant uint* ld [[buffer(10)]],\n"
+    "    uint3 id [[thread_position_in_grid]]) {\n"
+    "   if (id.x >= N || id.y >= M) return;\n"
+    "   A += id.z * strideA;\n"
+    "   B += id.z * strideB;\n"
+    "   float sum = 0.0f;\n"
+    "   for (uint i = 0; i < K; ++i) {\n"
+    "       sum += float(A[id.y * ld[0] + i]) * float(B[i * ld[1] + id.x]);\n"
+    "   }\n"
+    "   storeAs(C, id.z * strideC + id.y * ld[2] + id.x, sum, typeC);\n"
+    "}\n"
+    "kernel void matrix_multiplication_bfloat(\n"
+    "    const device ushort* A [[buffer(0)]],\n"
+    "    const device ushort* B [[buffer(1)]],\n"
+    "    device uchar* C [[buffer(2)]],\n"
+    "    constant uint& M [[buffer(3)]],\n"
+    "    constant uint& N [[buffer(4)]],\n"
+    "    constant uint& K [[buffer(5)]],\n"
+    "    constant uint& transpose [[buffer(6)]],\n"
+    "    constant uint& typeC [[buffer(7)]],\n"
+    "    constant uint* ld [[buffer(8)]],\n"
+    "    uint2 id [[thread_position_in_grid]]) {\n"
+    "   if (id.x >= N || id.y >= M) return;\n"
+    "   float sum = 0.0f;\n"
+    "   for (uint i = 0; i < K; ++i) {\n"
+    "       sum += fromBFloat(A[indexA(id.y, i, ld[0], transpose)]) *\n"
+    "              fromBFloat(B[indexB(i, id.x, ld[1], transpose)]);\n"
+    "   }\n"
+    "   storeAs(C, id.y * ld[2] + id.x, sum, typeC);\n"
+    "}\n"
+    "kernel void matrix_multiplication_bfloat_batched(\n"
+    "    const device ushort* A [[buffer(0)]],\n"
+    "    const device ushort* B [[buffer(1)]],\n"
+    "    device uchar* C [[buffer(2)]],\n"
+    "    constant uint& M [[buffer(3)]],\n"
+    "    constant uint& N [[buffer(4)]],\n"
+    "    constant uint& K [[buffer(5)]],\n"
+    "    constant uint& strideA [[buffer(6)]],\n"
+    "    constant uint& strideB [[buffer(7)]],\n"
+    "    constant uint& strideC [[buffer(8)]],\n"
+    "    constant uint& typeC [[buffer(9)]],\n"
+    "    constant uint* ld [[buffer(10)]],\n"
+    "    uint3 id [[thread_position_in_grid]]) {\n"
+    "   if (id.x >= N || id.y >= M) return;\n"
+    "   A += id.z * strideA;\n"
+    "   B += id.z * strideB;\n"
+    "   float sum = 0.0f;\n"
+    "   for (uint i = 0; i < K; ++i) {\n"
+    "       sum += fromBFloat(A[id.y * ld[0] + i]) *\n"
+    "              fromBFloat(B[i * ld[1] + id.x]);\n"
+    "   }\n"
+    "   storeAs(C, id.z * strideC + id.y * ld[2] + id.x, sum, typeC);\n"
+    "}\n"
+    "kernel void matrix_multiplication_int8(const device char* A [[buffer(0)]],\n"
+    "                                       const device char* B [[buffer(1)]],\n"
+    "                                       device int* C [[buffer(2)]],\n"
+    "                                       constant uint& M [[buffer(3)]],\n"
+    "                                       constant uint& N [[buffer(4)]],\n"
+    "                                       constant uint& K [[buffer(5)]],\n"
+    "                                       constant uint* ld [[buffer(6)]],\n"
+    "                                       uint2 id "
+    "[[thread_position_in_grid]]) {\n"
+    "   if (id.x >= N || id.y >= M) return;\n"
+    "   int sum = 0;\n"
+    "   for (uint i = 0; i < K; ++i) {\n"
+    "       sum += int(A[id.y * ld[0] + i]) * int(B[i * ld[1] + id.x]);\n"
+    "   }\n"
+    "   C[id.y * ld[2] + id.x] = sum;\n"
     "}";
 
+const char *matrixTranspositionShader =
+    "#include <metal_stdlib>\n"
+    "using namespace metal;\n"
+    "inline void copyElement(device uchar* dst, uint to,\n"
+    "                        const device uchar* src, uint from, uint size) {\n"
+    "   for (uint b = 0; b < size; ++b)\n"
+    "       dst[to * size + b] = src[from * size + b];\n"
+    "}\n"
+    "kernel void transpose_matrix(const device uchar* src [[buffer(0)]],\n"
+    "                             device uchar* dst [[buffer(1)]],\n"
+    "                             constant uint& size [[buffer(2)]],\n"
+    "                             constant uint* ld [[buffer(3)]],\n"
+    "                             uint2 id [[thread_position_in_grid]],\n"
+    "                             uint2 gridSize [[threads_per_grid]]) {\n"
+    "   // the grid is dst's shape: id.x is a row of src, id.y a column\n"
+    "   if (id.x < gridSize.x && id.y < gridSize.y)\n"
+    "       copyElement(dst, id.y * ld[1] + id.x, src, id.x * ld[0] + id.y,\n"
+    "                   size);\n"
+    "}\n"
+    "kernel void transpose_matrix_in_place(device uchar* data [[buffer(0)]],\n"
+    "                                      constant uint& size [[buffer(1)]],\n"
+    "                                      constant uint* ld [[buffer(2)]],\n"
+    "                                      uint2 id "
+    "[[thread_position_in_grid]],\n"
+    "                                      uint2 gridSize "
+    "[[threads_per_grid]]) {\n"
+    "   // each element above the diagonal swaps with its mirror\n"
+    "   if (id.x >= gridSize.x || id.y >= id.x) return;\n"
+    "   uint upper = id.y * ld[0] + id.x;\n"
+    "   uint lower = id.x * ld[0] + id.y;\n"
+    "   for (uint b = 0; b < size; ++b) {\n"
+    "       uchar t = data[upper * size + b];\n"
+    "       data[upper * size + b] = data[lower * size + b];\n"
+    "       data[lower * size + b] = t;\n"
+    "   }\n"
+    "}";
+
+const char *matrixConversionShader =
+    "#include <metal_stdlib>\n"
+    "using namespace metal;\n" PRECISION_HELPERS
+    "kernel void convert_matrix(const device uchar* src [[buffer(0)]],\n"
+    "                           device uchar* dst [[buffer(1)]],\n"
+    "                           constant uint& srcType [[buffer(2)]],\n"
+    "                           constant uint& dstType [[buffer(3)]],\n"
+    "                           constant uint* ld [[buffer(4)]],\n"
+    "                           uint2 id [[thread_position_in_grid]],\n"
+    "                           uint2 gridSize [[threads_per_grid]]) {\n"
+    "   if (id.x < gridSize.x && id.y < gridSize.y) {\n"
+    "       storeAs(dst, id.y * ld[1] + id.x,\n"
+    "               loadAs(src, id.y * ld[0] + id.x, srcType), dstType);\n"
+    "   }\n"
+    "}";
+
+/* The kernels for each element type the inputs may have; NULL where the type
+ * does not support the operation. */
+typedef struct TypedKernels {
+  MtDataType type;
+  const char *addition;
+  const char *multiplication;
+  const char *batchedMultiplication;
+} TypedKernels;
+
+static const TypedKernels typedKernels[] = {
+    {MtDataTypeFloat, "matrix_addition", "matrix_multiplication",
+     "matrix_multiplication_batched"},
+    {MtDataTypeHalf, "matrix_addition_half", "matrix_multiplication_half",
+     "matrix_multiplication_half_batched"},
+    {MtDataTypeBFloat, "matrix_addition_bfloat", "matrix_multiplication_bfloat",
+     "matrix_multiplication_bfloat_batched"},
+    {MtDataTypeChar, NULL, "matrix_multiplication_int8", NULL},
+};
+
+static const TypedKernels *kernelsFor(MtDataType type) {
+  for (size_t i = 0; i < sizeof(typedKernels) / sizeof(typedKernels[0]); ++i) {
+    if (typedKernels[i].type == type)
+      return &typedKernels[i];
+  }
+  return NULL;
+}
+
+// the types whose values convert_matrix and the float kernels load and store
+static bool isFloatingType(MtDataType type) {
+  return type == MtDataTypeFloat || type == MtDataTypeHalf ||
+         type == MtDataTypeBFloat;
+}
+
+// the demo driver; other programs (the benchmark) define ALLOY_NO_MAIN
+#ifndef ALLOY_NO_MAIN
+/* Products whose sides fall short of, straddle or are not multiples of the
+ * microkernels' tiles (4x16, 6x16 and 12x32), the 256-deep K blocks and the
+ * threadgroup tiles, each also with a and b stored transposed. */
+static const size_t checkShapes[][3] = {
+    {1, 1, 1},    {3, 5, 2},     {4, 16, 7},    {6, 16, 256},
+    {11, 31, 255}, {12, 32, 257}, {13, 33, 300}, {37, 53, 513},
+    {130, 70, 64},
+};
+
+// Checks a M x N x K product, computed as op says, against a naive one.
+static int checkMultiplication(AlloyContext *ctx, size_t M, size_t N,
+                               size_t K, MatrixOperation op) {
+  const bool transA = op & MATRIX_OP_TRANSPOSE_A;
+  const bool transB = op & MATRIX_OP_TRANSPOSE_B;
+  Matrix a = transA ? createMatrix(K, M) : createMatrix(M, K);
+  Matrix b = transB ? createMatrix(N, K) : createMatrix(K, N);
+  Matrix c = createMatrix(M, N);
+  int status = -1;
+
+  CHECK_ERROR(a.data && b.data && c.data, "Failed to create matrices");
+  fillMatrixRandom(&a);
+  fillMatrixRandom(&b);
+  CHECK_ERROR(performMatrixOperation(ctx, &a, &b, &c, op) == 0,
+              "Matrix multiplication failed");
+
+  const size_t lda = matrixLd(&a), ldb = matrixLd(&b), ldc = matrixLd(&c);
+  for (size_t i = 0; i < M; ++i) {
+    for (size_t j = 0; j < N; ++j) {
+      double ref = 0.0;
+      for (size_t k = 0; k < K; ++k)
+        ref += (double)a.data[transA ? k * lda + i : i * lda + k] *
+               b.data[transB ? j * ldb + k : k * ldb + j];
+      // the operands lie in [0, 1), so the sums only grow
+      if (fabs(c.data[i * ldc + j] - ref) > 1e-5 * ref + 1e-6) {
+        fprintf(stderr,
+                "%zux%zux%zu product%s%s: C[%zu][%zu] is %g, not %g\n", M, N,
+                K, transA ? " (A transposed)" : "",
+                transB ? " (B transposed)" : "", i, j, c.data[i * ldc + j],
+                ref);
+        goto cleanup;
+      }
+    }
+  }
+  status = 0;
+
+cleanup:
+  freeMatrix(&a);
+  freeMatrix(&b);
+  freeMatrix(&c);
+  return status;
+}
+
+static int checkMultiplications(AlloyContext *ctx) {
+  for (size_t i = 0; i < sizeof(checkShapes) / sizeof(checkShapes[0]); ++i) {
+    for (unsigned trans = 0; trans < 4; ++trans) {
+      const MatrixOperation op =
+          MATRIX_OP_MULTIPLY | (trans & 1 ? MATRIX_OP_TRANSPOSE_A : 0) |
+          (trans & 2 ? MATRIX_OP_TRANSPOSE_B : 0);
+      if (checkMultiplication(ctx, checkShapes[i][0], checkShapes[i][1],
+                              checkShapes[i][2], op) != 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/* Row sums over grids that are narrower than a threadgroup or leave a
+ * partial threadgroup at the bottom, and over single columns. */
+static const size_t rowSumShapes[][2] = {
+    {37, 53}, {130, 300}, {1000, 5}, {3, 1}, {17, 1000},
+};
+
+// Checks the row sums of a rows x cols matrix against naive ones.
+static int checkRowSums(AlloyContext *ctx, size_t rows, size_t cols) {
+  Matrix src = createMatrix(rows, cols);
+  Matrix sums = createMatrix(rows, 1);
+  int status = -1;
+
+  CHECK_ERROR(src.data && sums.data, "Failed to create matrices");
+  fillMatrixRandom(&src);
+  CHECK_ERROR(performMatrixRowSums(ctx, &src, &sums) == 0,
+              "Row sums failed");
+
+  for (size_t i = 0; i < rows; ++i) {
+    double ref = 0.0;
+    for (size_t j = 0; j < cols; ++j)
+      ref += src.data[i * matrixLd(&src) + j];
+    if (fabs(sums.data[i] - ref) > 1e-5 * ref + 1e-6) {
+      fprintf(stderr, "%zux%zu row sums: row %zu sums to %g, not %g\n", rows,
+              cols, i, sums.data[i], ref);
+      goto cleanup;
+    }
+  }
+  status = 0;
+
+cleanup:
+  freeMatrix(&src);
+  freeMatrix(&sums);
+  return status;
+}
+
+// The largest error of an element of row i, column j quantized with params:
+// half a step, as the ranges computeQuantParams picks are never clamped.
+static double quantError(const QuantParams *params, size_t i, size_t j) {
+  return 0.5 * params->scales[params->axis == QUANT_PER_ROW      ? i
+                              : params->axis == QUANT_PER_COLUMN ? j
+                                                                 : 0];
+}
+
+// The value q of row i, column j stands for under params.
+static double dequantized(const QuantParams *params, int8_t q, size_t i,
+                          size_t j) {
+  const size_t p = params->axis == QUANT_PER_ROW      ? i
+                   : params->axis == QUANT_PER_COLUMN ? j
+                                                      : 0;
+  const int32_t zeroPoint = params->zeroPoints ? params->zeroPoints[p] : 0;
+  return params->scales[p] * (q - zeroPoint);
+}
+
+// Checks the product c of the float a and b, quantized into qA and qB with qa
+// and qb, against their float product ref, which a[i][k] * b[k][j] may differ
+// from by |a| db + |b| da + da db; and, on a sample of rows, against the
+// product of the dequantized qA and qB, which it should match to rounding.
+static int checkQuantizedProduct(const Matrix *a, const Matrix *qA,
+                                 const QuantParams *qa, const Matrix *b,
+                                 const Matrix *qB, const QuantParams *qb,
+                                 const Matrix *c, const Matrix *ref) {
+  const size_t M = a->rows, N = b->cols, K = a->cols;
+  double *rowAbs = calloc(M, sizeof(double));
+  double *colAbs = calloc(N, sizeof(double));
+  int status = -1;
+
+  CHECK_ERROR(rowAbs && colAbs, "Failed to allocate bounds");
+  for (size_t i = 0; i < M; ++i)
+    for (size_t k = 0; k < K; ++k)
+      rowAbs[i] += fabsf(a->data[i * matrixLd(a) + k]);
+  for (size_t k = 0; k < K; ++k)
+    for (size_t j = 0; j < N; ++j)
+      colAbs[j] += fabsf(b->data[k * matrixLd(b) + j]);
+
+  for (size_t i = 0; i < M; ++i) {
+    for (size_t j = 0; j < N; ++j) {
+      const double da = quantError(qa, i, 0), db = quantError(qb, 0, j);
+      const double want = ref->data[i * matrixLd(ref) + j];
+      const double got = c->data[i * matrixLd(c) + j];
+      if (fabs(got - want) > rowAbs[i] * db + colAbs[j] * da + K * da * db +
+                                 1e-5 * fabs(want) + 1e-6) {
+        fprintf(stderr,
+                "%zux%zux%zu int8 product: C[%zu][%zu] is %g, not about %g\n",
+                M, N, K, i, j, got, want);
+        goto cleanup;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < M; i += 1 + M / 16) {
+    for (size_t j = 0; j < N; ++j) {
+      double exact = 0.0, magnitude = 0.0;
+      for (size_t k = 0; k < K; ++k) {
+        const double term =
+            dequantized(qa, qA->data8[i * matrixLd(qA) + k], i, k) *
+            dequantized(qb, qB->data8[k * matrixLd(qB) + j], k, j);
+        exact += term;
+        magnitude += fabs(term);
+      }
+      const double got = c->data[i * matrixLd(c) + j];
+      if (fabs(got - exact) > 1e-5 * magnitude + 1e-6) {
+        fprintf(stderr, "%zux%zux%zu int8 product: C[%zu][%zu] is %g, not %g\n",
+                M, N, K, i, j, got, exact);
+        goto cleanup;
+      }
+    }
+  }
+  status = 0;
+
+cleanup:
+  free(rowAbs);
+  free(colAbs);
+  return status;
+}
+
+// Checks an int8 product of signed values with a quantized asymmetrically
+// per row and b per column, against the float one.
+static int checkQuantizedMultiplication(AlloyContext *ctx, size_t M, size_t N,
+                                        size_t K) {
+  Matrix a = createMatrix(M, K), b = createMatrix(K, N);
+  Matrix ref = createMatrix(M, N), c = createMatrix(M, N);
+  Matrix aInt8 = createMatrixOfType(M, K, MtDataTypeChar);
+  Matrix bInt8 = createMatrixOfType(K, N, MtDataTypeChar);
+  QuantParams qa = {0}, qb = {0};
+  int status = -1;
+
+  CHECK_ERROR(a.data && b.data && ref.data && c.data && aInt8.data &&
+                  bInt8.data,
+              "Failed to create matrices");
+  fillMatrixRandom(&a);
+  fillMatrixRandom(&b);
+  for (size_t i = 0; i < M * K; ++i)
+    a.data[i] -= 0.5f;
+  for (size_t i = 0; i < K * N; ++i)
+    b.data[i] = 4.0f * b.data[i] - 1.0f;
+
+  status = performMatrixOperation(ctx, &a, &b, &ref, MATRIX_OP_MULTIPLY);
+  if (status == 0)
+    status = computeQuantParams(&a, QUANT_PER_ROW, false, &qa);
+  if (status == 0)
+    status = computeQuantParams(&b, QUANT_PER_COLUMN, false, &qb);
+  if (status == 0)
+    status = performMatrixQuantization(ctx, &a, &aInt8, &qa);
+  if (status == 0)
+    status = performMatrixQuantization(ctx, &b, &bInt8, &qb);
+  if (status == 0)
+    status = performQuantizedMatrixMultiply(ctx, &aInt8, &qa, &bInt8, &qb, &c);
+  CHECK_ERROR(status == 0, "Quantized matrix multiplication failed");
+  status = checkQuantizedProduct(&a, &aInt8, &qa, &b, &bInt8, &qb, &c, &ref);
+
+cleanup:
+  freeMatrix(&a);
+  freeMatrix(&b);
+  freeMatrix(&ref);
+  freeMatrix(&c);
+  freeMatrix(&aInt8);
+  freeMatrix(&bInt8);
+  freeQuantParams(&qa);
+  freeQuantParams(&qb);
+  return status;
+}
+
+/* Floats and what they round to as half and as bfloat16, widened back:
+ * ties to even both ways, subnormals, overflow and the special values. */
+static const float conversionCases[][3] = {
+    {1.0f, 1.0f, 1.0f},
+    {-2.5f, -2.5f, -2.5f},
+    {-0.0f, -0.0f, -0.0f},
+    {1.0f + 0x1p-11f, 1.0f, 1.0f},                    /* half tie, down */
+    {1.0f + 0x3p-11f, 1.0f + 0x1p-9f, 1.0f},          /* half tie, up */
+    {1.0f + 0x1p-8f, 1.0f + 0x1p-8f, 1.0f},           /* bfloat16 tie, down */
+    {1.0f + 0x3p-8f, 1.0f + 0x3p-8f, 1.0f + 0x1p-6f}, /* bfloat16 tie, up */
+    {0x1p-20f, 0x1p-20f, 0x1p-20f},                   /* half subnormal */
+    {0x3p-26f, 0x1p-24f, 0x3p-26f},  /* rounds up to the least half */
+    {0x1p-25f, 0.0f, 0x1p-25f},      /* half tie with 0 */
+    {0x1p-130f, 0.0f, 0x1p-130f},    /* float and bfloat16 subnormal */
+    {65519.0f, 65504.0f, 65536.0f},  /* the largest half */
+    {65520.0f, INFINITY, 65536.0f},  /* half overflow, a tie */
+    {FLT_MAX, INFINITY, INFINITY},   /* bfloat16 overflow */
+    {-INFINITY, -INFINITY, -INFINITY},
+    {NAN, NAN, NAN},
+};
+
+// Rounds conversionCases to half and to bfloat16 and back, and checks the
+// results bit for bit (any NaN for a NaN).
+static int checkConversions(AlloyContext *ctx) {
+  const size_t count = sizeof(conversionCases) / sizeof(conversionCases[0]);
+  const MtDataType types[] = {MtDataTypeHalf, MtDataTypeBFloat};
+  Matrix src = createMatrix(1, count), back = createMatrix(1, count);
+  Matrix narrow = {0};
+  int status = -1;
+
+  CHECK_ERROR(src.data && back.data, "Failed to create matrices");
+  for (size_t i = 0; i < count; ++i)
+    src.data[i] = conversionCases[i][0];
+
+  for (size_t t = 0; t < 2; ++t) {
+    narrow = createMatrixOfType(1, count, types[t]);
+    CHECK_ERROR(narrow.data, "Failed to create matrices");
+    CHECK_ERROR(performMatrixConversion(ctx, &src, &narrow) == 0 &&
+                    performMatrixConversion(ctx, &narrow, &back) == 0,
+                "Matrix conversion failed");
+    for (size_t i = 0; i < count; ++i) {
+      const float want = conversionCases[i][1 + t], got = back.data[i];
+      if (isnan(want) ? !isnan(got)
+                      : got != want || signbit(got) != signbit(want)) {
+        fprintf(stderr, "%a as %s is %a, not %a\n", conversionCases[i][0],
+                t ? "bfloat16" : "half", got, want);
+        goto cleanup;
+      }
+    }
+    freeMatrix(&narrow);
+  }
+  status = 0;
+
+cleanup:
+  freeMatrix(&src);
+  freeMatrix(&back);
+  freeMatrix(&narrow);
+  return status;
+}
+
+// Tile callbacks for a streamed matrix kept in the Matrix userData.
+static int readTile(void *userData, size_t row, size_t col, size_t rows,
+                    size_t cols, float *dst, size_t ld) {
+  const Matrix *mat = userData;
+  for (size_t i = 0; i < rows; ++i)
+    memcpy(dst + i * ld, mat->data + (row + i) * matrixLd(mat) + col,
+           cols * sizeof(float));
+  return 0;
+}
+
+static int writeTile(void *userData, size_t row, size_t col, size_t rows,
+                     size_t cols, const float *src, size_t ld) {
+  Matrix *mat = userData;
+  for (size_t i = 0; i < rows; ++i)
+    memcpy(mat->data + (row + i) * matrixLd(mat) + col, src + i * ld,
+           cols * sizeof(float));
+  return 0;
+}
+
+// Streams a M x N x K product through budget bytes of tiles, a from a matrix
+// and b and c through callbacks, and checks it against the product in one.
+static int checkStreamingMultiplication(AlloyContext *ctx, size_t M, size_t N,
+                                        size_t K, size_t budget) {
+  Matrix a = createMatrix(M, K), b = createMatrix(K, N);
+  Matrix c = createMatrix(M, N), ref = createMatrix(M, N);
+  int status = -1;
+
+  CHECK_ERROR(a.data && b.data && c.data && ref.data,
+              "Failed to create matrices");
+  fillMatrixRandom(&a);
+  fillMatrixRandom(&b);
+  CHECK_ERROR(performMatrixOperation(ctx, &a, &b, &ref, MATRIX_OP_MULTIPLY) ==
+                  0,
+              "Matrix multiplication failed");
+
+  const AlloyMatrixStream as = {.matrix = &a};
+  const AlloyMatrixStream bs = {
+      .rows = K, .cols = N, .read = readTile, .userData = &b};
+  const AlloyMatrixStream cs = {
+      .rows = M, .cols = N, .write = writeTile, .userData = &c};
+  CHECK_ERROR(performStreamingMatrixMultiply(ctx, &as, &bs, &cs, budget) == 0,
+              "Streaming matrix multiplication failed");
+
+  for (size_t i = 0; i < M; ++i) {
+    for (size_t j = 0; j < N; ++j) {
+      const double want = ref.data[i * N + j], got = c.data[i * N + j];
+      if (fabs(got - want) > 1e-5 * want + 1e-6) {
+        fprintf(stderr, "%zux%zux%zu streamed product: C[%zu][%zu] is %g, "
+                "not %g\n", M, N, K, i, j, got, want);
+        goto cleanup;
+      }
+    }
+  }
+  status = 0;
+
+cleanup:
+  freeMatrix(&a);
+  freeMatrix(&b);
+  freeMatrix(&c);
+  freeMatrix(&ref);
+  return status;
+}
+
+// Checks got against want, both rows x cols, to float rounding of sums of
+// non-negative terms.
+static int checkClose(const char *what, const Matrix *got, const Matrix *want) {
+  for (size_t i = 0; i < want->rows; ++i) {
+    for (size_t j = 0; j < want->cols; ++j) {
+      const double w = want->data[i * matrixLd(want) + j];
+      const double g = got->data[i * matrixLd(got) + j];
+      if (fabs(g - w) > 1e-5 * w + 1e-6) {
+        fprintf(stderr, "%s: [%zu][%zu] is %g, not %g\n", what, i, j, g, w);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Builds a sparse matrix of format from a rows x cols one about a quarter
+// full, with an empty row, and checks its products with a vector and with a
+// matrix, and its sum with a matrix in place, against the dense ones.
+static int checkSparse(AlloyContext *ctx, size_t rows, size_t cols,
+                       SparseFormat format, size_t blockSize) {
+  Matrix dense = createMatrix(rows, cols);
+  Matrix x = createMatrix(cols, 1), b = createMatrix(cols, 7);
+  Matrix sum = createMatrix(rows, cols);
+  Matrix y = createMatrix(rows, 1), yRef = createMatrix(rows, 1);
+  Matrix c = createMatrix(rows, 7), cRef = createMatrix(rows, 7);
+  SparseMatrix sparse = {0};
+  int status = -1;
+
+  CHECK_ERROR(dense.data && x.data && b.data && sum.data && y.data &&
+                  yRef.data && c.data && cRef.data,
+              "Failed to create matrices");
+  fillMatrixRandom(&dense);
+  for (size_t i = 0; i < rows * cols; ++i)
+    if (dense.data[i] < 0.75f || i / cols == rows / 2)
+      dense.data[i] = 0.0f;
+  fillMatrixRandom(&x);
+  fillMatrixRandom(&b);
+  fillMatrixRandom(&sum);
+
+  CHECK_ERROR(createSparseMatrix(ctx, &dense, format, blockSize, &sparse) == 0,
+              "Failed to create sparse matrix");
+  status = performSparseMatrixOperation(ctx, &sparse, &x, &y,
+                                        MATRIX_OP_MULTIPLY);
+  if (status == 0)
+    status = performSparseMatrixOperation(ctx, &sparse, &b, &c,
+                                          MATRIX_OP_MULTIPLY);
+  if (status == 0)
+    status = performMatrixOperation(ctx, &dense, &x, &yRef,
+                                    MATRIX_OP_MULTIPLY);
+  if (status == 0)
+    status = performMatrixOperation(ctx, &dense, &b, &cRef,
+                                    MATRIX_OP_MULTIPLY);
+  CHECK_ERROR(status == 0, "Sparse matrix multiplication failed");
+  status = checkClose("Sparse matrix-vector product", &y, &yRef);
+  if (status == 0)
+    status = checkClose("Sparse matrix product", &c, &cRef);
+  CHECK_ERROR(status == 0, "Sparse matrix multiplication is wrong");
+
+  status = -1;
+  for (size_t i = 0; i < rows * cols; ++i)
+    dense.data[i] += sum.data[i];
+  CHECK_ERROR(performSparseMatrixOperation(ctx, &sparse, &sum, &sum,
+                                           MATRIX_OP_ADD) == 0,
+              "Sparse matrix addition failed");
+  status = checkClose("Sparse matrix sum", &sum, &dense);
+
+cleanup:
+  freeSparseMatrix(&sparse);
+  freeMatrix(&dense);
+  freeMatrix(&x);
+  freeMatrix(&b);
+  freeMatrix(&sum);
+  freeMatrix(&y);
+  freeMatrix(&yRef);
+  freeMatrix(&c);
+  freeMatrix(&cRef);
+  return status;
+}
+
 int main() {
-  MtDevice *device = NULL;
-  MtCommandQueue *cmdQueue = NULL;
-  Matrix a, b, result;
+  AlloyContext *ctx = NULL;
+  Matrix a = {0}, b = {0}, result = {0}, reference = {0};
+  Matrix aHalf = {0}, bHalf = {0}, aInt8 = {0}, bInt8 = {0};
+  QuantParams qa = {0}, qb = {0};
   int status = -1;
 
   srand(time(NULL));
 
-  device = mtCreateSystemDefaultDevice();
-  CHECK_ERROR(device, "Failed to create Metal device");
+  ctx = createContext();
+  CHECK_ERROR(ctx, "Failed to create context");
 
-  cmdQueue = mtNewCommandQueue(device);
-  CHECK_ERROR(cmdQueue, "Failed to create command queue");
-
-  // test matrix addition
-  a = createMatrix(1024, 1024);
-  b = createMatrix(1024, 1024);
-  result = createMatrix(1024, 1024);
+  // test matrix addition; the power-of-two widths get padded rows
+  a = createPaddedSharedMatrix(ctx, 1024, 1024);
+  b = createPaddedSharedMatrix(ctx, 1024, 1024);
+  result = createPaddedSharedMatrix(ctx, 1024, 1024);
   CHECK_ERROR(a.data && b.data && result.data, "Failed to create matrices");
 
   fillMatrixRandom(&a);
   fillMatrixRandom(&b);
 
   printf("Performing matrix addition...\n");
-  status =
-      performMatrixOperation(device, cmdQueue, &a, &b, &result, MATRIX_OP_ADD);
+  status = performMatrixOperation(ctx, &a, &b, &result, MATRIX_OP_ADD);
   CHECK_ERROR(status == 0, "Matrix addition failed");
 
   // test matrix multiplication
   freeMatrix(&b);
   freeMatrix(&result);
-  b = createMatrix(1024, 512);
-  result = createMatrix(1024, 512);
+  b = createPaddedSharedMatrix(ctx, 1024, 512);
+  result = createPaddedSharedMatrix(ctx, 1024, 512);
   CHECK_ERROR(b.data && result.data,
               "Failed to create matrices for multiplication");
 
   fillMatrixRandom(&b);
 
   printf("Performing matrix multiplication...\n");
-  status = performMatrixOperation(device, cmdQueue, &a, &b, &result,
-                                  MATRIX_OP_MULTIPLY);
+  status = performMatrixOperation(ctx, &a, &b, &result, MATRIX_OP_MULTIPLY);
   CHECK_ERROR(status == 0, "Matrix multiplication failed");
 
+  // kept to check the reduced-precision products below against
+  reference = createMatrix(1024, 512);
+  CHECK_ERROR(reference.data, "Failed to create the reference matrix");
+  packMatrix(&result, reference.data);
+
+  printf("Checking edge-shaped products against a reference...\n");
+  status = checkMultiplications(ctx);
+  CHECK_ERROR(status == 0, "Matrix multiplication is wrong");
+
+  // 65 x 65 tiles of c and panels 66 deep: every dimension ends in a
+  // partial tile, and each tile sums eight panels
+  printf("Checking a streamed product against an in-memory one...\n");
+  status = checkStreamingMultiplication(ctx, 300, 200, 500, 120000);
+  CHECK_ERROR(status == 0, "Streaming matrix multiplication is wrong");
+
+  // 4 x 4 blocks leave partial ones along the bottom and the right
+  printf("Checking sparse products and sums against dense ones...\n");
+  status = checkSparse(ctx, 53, 41, SPARSE_CSR, 1);
+  if (status == 0)
+    status = checkSparse(ctx, 50, 37, SPARSE_BSR, 4);
+  CHECK_ERROR(status == 0, "Sparse matrix operations are wrong");
+
+  printf("Checking row sums against a reference...\n");
+  for (size_t i = 0; i < sizeof(rowSumShapes) / sizeof(rowSumShapes[0]); ++i) {
+    status = checkRowSums(ctx, rowSumShapes[i][0], rowSumShapes[i][1]);
+    CHECK_ERROR(status == 0, "Row sums are wrong");
+  }
+
+  // the same product from half-precision storage, accumulated in float
+  aHalf = createPaddedSharedMatrixOfType(ctx, 1024, 1024, MtDataTypeHalf);
+  bHalf = createPaddedSharedMatrixOfType(ctx, 1024, 512, MtDataTypeHalf);
+  CHECK_ERROR(aHalf.data && bHalf.data, "Failed to create half matrices");
+
+  printf("Performing half-precision matrix multiplication...\n");
+  status = performMatrixConversion(ctx, &a, &aHalf);
+  if (status == 0)
+    status = performMatrixConversion(ctx, &b, &bHalf);
+  if (status == 0)
+    status = performMatrixOperation(ctx, &aHalf, &bHalf, &result,
+                                    MATRIX_OP_MULTIPLY);
+  CHECK_ERROR(status == 0, "Half-precision matrix multiplication failed");
+  // each operand is within 2^-11 of its half, relatively, and subnormal
+  // halves are within 2^-25; the operands are not negative
+  for (size_t i = 0; i < 1024; ++i) {
+    for (size_t j = 0; j < 512; ++j) {
+      const double want = reference.data[i * 512 + j];
+      const double got = result.data[i * matrixLd(&result) + j];
+      CHECK_ERROR(fabs(got - want) <= 0x1.01p-10 * want + 1024 * 0x1p-25,
+                  "Half-precision matrix multiplication is wrong");
+    }
+  }
+
+  printf("Checking half and bfloat16 rounding...\n");
+  status = checkConversions(ctx);
+  CHECK_ERROR(status == 0, "Matrix conversion is wrong");
+
+  // and from int8: a asymmetric per tensor, b symmetric per column
+  aInt8 = createPaddedSharedMatrixOfType(ctx, 1024, 1024, MtDataTypeChar);
+  bInt8 = createPaddedSharedMatrixOfType(ctx, 1024, 512, MtDataTypeChar);
+  CHECK_ERROR(aInt8.data && bInt8.data, "Failed to create int8 matrices");
+
+  printf("Performing int8 quantized matrix multiplication...\n");
+  status = computeQuantParams(&a, QUANT_PER_TENSOR, false, &qa);
+  if (status == 0)
+    status = computeQuantParams(&b, QUANT_PER_COLUMN, true, &qb);
+  if (status == 0)
+    status = performMatrixQuantization(ctx, &a, &aInt8, &qa);
+  if (status == 0)
+    status = performMatrixQuantization(ctx, &b, &bInt8, &qb);
+  if (status == 0)
+    status = performQuantizedMatrixMultiply(ctx, &aInt8, &qa, &bInt8, &qb,
+                                            &result);
+  CHECK_ERROR(status == 0, "Quantized matrix multiplication failed");
+  status = checkQuantizedProduct(&a, &aInt8, &qa, &b, &bInt8, &qb, &result,
+                                 &reference);
+  CHECK_ERROR(status == 0, "Quantized matrix multiplication is wrong");
+
+  printf("Checking an asymmetric per-row and per-column int8 product...\n");
+  status = checkQuantizedMultiplication(ctx, 37, 29, 23);
+  CHECK_ERROR(status == 0, "Quantized matrix multiplication is wrong");
+
+  AlloyBufferPoolStats poolStats = getBufferPoolStats(ctx->bufferPool);
+  printf("Buffer pool: %zu/%zu hits (%.0f%%), %zu bytes resident.\n",
+         poolStats.hits, poolStats.requests, poolStats.hitRate * 100.0,
+         poolStats.residentBytes);
+#ifndef __APPLE__
+  NsUInteger hugeRequested, hugeBacked;
+  if (mtHostHugePageStats(&hugeRequested, &hugeBacked))
+    printf("Huge pages: %zu of %zu mapped bytes backed by huge pages.\n",
+           (size_t)hugeBacked, (size_t)hugeRequested);
+#endif
+
   printf("Operations completed successfully.\n");
   status = 0;
 
@@ -123,60 +890,83 @@ cleanup:
   freeMatrix(&a);
   freeMatrix(&b);
   freeMatrix(&result);
-  if (cmdQueue)
-    mtReleaseCommandQueue(cmdQueue);
-  if (device)
-    mtReleaseDevice(device);
+  freeMatrix(&reference);
+  freeMatrix(&aHalf);
+  freeMatrix(&bHalf);
+  freeMatrix(&aInt8);
+  freeMatrix(&bInt8);
+  freeQuantParams(&qa);
+  freeQuantParams(&qb);
+  freeContext(ctx);
 
   return status;
 }
+#endif
 
-Matrix createMatrix(size_t rows, size_t cols) {
-  Matrix mat = {
-      .rows = rows, .cols = cols, .data = malloc(rows * cols * sizeof(float))};
-  if (!mat.data) {
-    fprintf(stderr, "Failed to allocate memory for matrix.\n");
-  }
-  return mat;
+MtBuffer *createBuffer(MtDevice *device, size_t size,
+                       MtResourceOptions options) {
+  return mtDeviceNewBufferWithLength(device, size, options);
 }
 
-void freeMatrix(Matrix *mat) {
-  if (mat && mat->data) {
-    free(mat->data);
-    mat->data = NULL;
-  }
-}
+MtSize threadgroupSizeFor(MtComputePipelineState *pipelineState,
+                          MtSize gridSize) {
+  // square-ish tile: widest power-of-two multiple of the SIMD width whose
+  // square still fits the pipeline's thread limit
+  NsUInteger simdWidth = mtComputePipelineThreadExecutionWidth(pipelineState);
+  NsUInteger maxThreads =
+      mtComputePipelineMaxTotalThreadsPerThreadgroup(pipelineState);
+  NsUInteger width = simdWidth ? simdWidth : 1;
+  while (width * 2 * width * 2 <= maxThreads && width < gridSize.width)
+    width *= 2;
 
-void fillMatrixRandom(Matrix *mat) {
-  for (size_t i = 0; i < mat->rows * mat->cols; ++i) {
-    mat->data[i] = (float)rand() / RAND_MAX;
-  }
+  MtSize size = {width, maxThreads / width, 1};
+  if (size.height > gridSize.height)
+    size.height = gridSize.height ? gridSize.height : 1;
+  return size;
 }
 
-void printMatrix(const Matrix *mat) {
-  for (size_t i = 0; i < mat->rows; ++i) {
-    for (size_t j = 0; j < mat->cols; ++j) {
-      printf("%f ", mat->data[i * mat->cols + j]);
-    }
-    printf("\n");
-  }
+MtSize rowThreadgroupSizeFor(MtComputePipelineState *pipelineState,
+                             MtSize gridSize) {
+  // whole rows where possible, so each threadgroup streams contiguous memory
+  NsUInteger maxThreads =
+      mtComputePipelineMaxTotalThreadsPerThreadgroup(pipelineState);
+  NsUInteger width = gridSize.width < maxThreads ? gridSize.width : maxThreads;
+  if (!width)
+    width = 1;
+
+  MtSize size = {width, maxThreads / width, 1};
+  if (size.height > gridSize.height)
+    size.height = gridSize.height ? gridSize.height : 1;
+  return size;
 }
 
-MtBuffer *createBuffer(MtDevice *device, size_t size,
-                       MtResourceOptions options) {
-  return mtDeviceNewBufferWithLength(device, size, options);
+const char *shaderSource(const char *filename) {
+  if (strcmp(filename, "addition.metal") == 0)
+    return matrixAdditionShader;
+  if (strcmp(filename, "multiplication.metal") == 0)
+    return matrixMultiplicationShader;
+  if (strcmp(filename, "fusion.metal") == 0)
+    return fusedElementwiseShader;
+  if (strcmp(filename, "conversion.metal") == 0)
+    return matrixConversionShader;
+  if (strcmp(filename, "transposition.metal") == 0)
+    return matrixTranspositionShader;
+  if (strcmp(filename, "quantization.metal") == 0)
+    return matrixQuantizationShader;
+  if (strcmp(filename, "sparse.metal") == 0)
+    return matrixSparseShader;
+  if (strcmp(filename, "reduction.metal") == 0)
+    return matrixReductionShader;
+  return NULL;
 }
 
 MtLibrary *createLibraryFromFile(MtDevice *device, const char *filename) {
   NsError *error = NULL;
   MtLibrary *lib = NULL;
+  const char *source = shaderSource(filename);
 
-  if (strcmp(filename, "addition.metal") == 0) {
-    lib = mtNewLibraryWithSource(device, (char *)matrixAdditionShader, NULL,
-                                 &error);
-  } else if (strcmp(filename, "multiplication.metal") == 0) {
-    lib = mtNewLibraryWithSource(device, (char *)matrixMultiplicationShader,
-                                 NULL, &error);
+  if (source) {
+    lib = mtNewLibraryWithSource(device, (char *)source, NULL, &error);
   }
 
   if (!lib && error) {
@@ -186,100 +976,400 @@ MtLibrary *createLibraryFromFile(MtDevice *device, const char *filename) {
   return lib;
 }
 
-int performMatrixOperation(MtDevice *device, MtCommandQueue *cmdQueue,
-                           Matrix *a, Matrix *b, Matrix *result,
-                           MatrixOperation op) {
-  MtLibrary *lib = NULL;
-  MtFunction *func = NULL;
+// Returns the buffer a kernel binds for the first size bytes of mat, with
+// the byte offset of mat's first element in it and the elements between its
+// rows. That is the matrix's own storage when it is device-visible,
+// otherwise a pooled staging buffer holding the rows packed, filled from
+// mat->data when upload is set.
+static MtBuffer *operandBuffer(AlloyContext *ctx, const Matrix *mat,
+                               size_t size, bool upload, size_t *offset,
+                               size_t *ld) {
+  const bool packed = matrixIsPacked(mat);
+  const size_t elementSize = matrixElementSize(mat);
+
+  if (mat->buffer) {
+    // an operand may span more than itself (a batch, say)
+    const size_t extent = matrixExtent(mat);
+    const size_t end =
+        mat->offset * elementSize + (size > extent ? size : extent);
+    *offset = mat->offset * elementSize;
+    *ld = matrixLd(mat);
+    return mtBufferLength(mat->buffer) >= end ? mat->buffer : NULL;
+  }
+
+  *offset = 0;
+  *ld = mat->cols;
+  if (!packed && size != matrixBytes(mat))
+    return NULL;
+  MtBuffer *buffer =
+      acquireBuffer(ctx->bufferPool, size, MtResourceStorageModeShared);
+  if (buffer && upload) {
+    if (packed)
+      parallelCopy(mtBufferContents(buffer), mat->data, size);
+    else
+      packMatrix(mat, mtBufferContents(buffer));
+  }
+  return buffer;
+}
+
+AlloyOperation *submitOperation(AlloyContext *ctx, const OperationDesc *desc) {
   MtComputePipelineState *pipelineState = NULL;
   MtCommandBuffer *cmdBuffer = NULL;
   MtCommandEncoder *computeEncoder = NULL;
-  MtBuffer *bufferA = NULL, *bufferB = NULL, *bufferC = NULL;
-  NsError *error = NULL;
-  int status = -1;
+  MtBuffer *buffers[OPERATION_MAX_OPERANDS] = {NULL};
+  size_t offsets[OPERATION_MAX_OPERANDS] = {0};
+  size_t lds[OPERATION_MAX_OPERANDS] = {0};
+  uint32_t ld32[OPERATION_MAX_OPERANDS] = {0};
+  bool owned[OPERATION_MAX_OPERANDS] = {false}; // staged here, not reused
+  AlloyOperation *operation = NULL;
+  const size_t count = desc->operandCount;
+  const size_t last = count - 1;
+  Matrix *result = desc->operands[last];
+  const double submitted = latencyClock();
 
-  const char *shaderFile =
-      (op == MATRIX_OP_ADD) ? "addition.metal" : "multiplication.metal";
-  const char *funcName =
-      (op == MATRIX_OP_ADD) ? "matrix_addition" : "matrix_multiplication";
-
-  lib = createLibraryFromFile(device, shaderFile);
-  CHECK_ERROR(lib, "Failed to create library");
-
-  func = mtNewFunctionWithName(lib, funcName);
-  CHECK_ERROR(func, "Failed to create function");
-
-  pipelineState = mtNewComputePipelineStateWithFunction(device, func, error);
-  CHECK_ERROR(pipelineState, "Failed to create compute pipeline state");
-
-  size_t bufferSize = a->rows * a->cols * sizeof(float);
-  bufferA = createBuffer(device, bufferSize, MtResourceStorageModeShared);
-  bufferB = createBuffer(device, bufferSize, MtResourceStorageModeShared);
-  bufferC = createBuffer(device, bufferSize, MtResourceStorageModeShared);
-  CHECK_ERROR(bufferA && bufferB && bufferC, "Failed to create buffers");
-
-  memcpy(mtBufferContents(bufferA), a->data, bufferSize);
-  memcpy(mtBufferContents(bufferB), b->data, bufferSize);
-
-  cmdBuffer = mtCommandQueueCommandBuffer(cmdQueue);
-  computeEncoder = mtCommandBufferComputeEncoder(cmdBuffer);
-  CHECK_ERROR(cmdBuffer && computeEncoder,
-              "Failed to create command buffer or encoder");
-
-  mtSetComputePipelineState(computeEncoder, pipelineState);
-  mtSetBuffer(computeEncoder, bufferA, 0, 0);
-  mtSetBuffer(computeEncoder, bufferB, 0, 1);
-  mtSetBuffer(computeEncoder, bufferC, 0, 2);
-
-  if (op == MATRIX_OP_MULTIPLY) {
-    MtBuffer *bufferM =
-        createBuffer(device, sizeof(uint32_t), MtResourceStorageModeShared);
-    MtBuffer *bufferN =
-        createBuffer(device, sizeof(uint32_t), MtResourceStorageModeShared);
-    MtBuffer *bufferK =
-        createBuffer(device, sizeof(uint32_t), MtResourceStorageModeShared);
-    CHECK_ERROR(bufferM && bufferN && bufferK,
-                "Failed to create dimension buffers");
-
-    uint32_t M = a->rows, N = b->cols, K = a->cols;
-    memcpy(mtBufferContents(bufferM), &M, sizeof(uint32_t));
-    memcpy(mtBufferContents(bufferN), &N, sizeof(uint32_t));
-    memcpy(mtBufferContents(bufferK), &K, sizeof(uint32_t));
-
-    mtSetBuffer(computeEncoder, bufferM, 0, 3);
-    mtSetBuffer(computeEncoder, bufferN, 0, 4);
-    mtSetBuffer(computeEncoder, bufferK, 0, 5);
+  pipelineState = getComputePipeline(ctx, desc->shaderFile, desc->funcName);
+  CHECK_ERROR(pipelineState, "Failed to get compute pipeline state");
+
+  for (size_t i = 0; i < count; ++i) {
+    CHECK_ERROR(matrixLd(desc->operands[i]) >= desc->operands[i]->cols,
+                "Matrix rows overlap");
+    // a matrix passed more than once (say, as input and result) shares one
+    // buffer, so it is staged and uploaded only once
+    for (size_t j = 0; j < i && !buffers[i]; ++j) {
+      if (desc->operands[j] == desc->operands[i]) {
+        buffers[i] = buffers[j];
+        offsets[i] = offsets[j];
+        lds[i] = lds[j];
+      }
+    }
+    if (!buffers[i]) {
+      buffers[i] = operandBuffer(ctx, desc->operands[i], desc->sizes[i],
+                                 i != last || desc->readsResult, &offsets[i],
+                                 &lds[i]);
+      CHECK_ERROR(buffers[i], "Failed to create buffers");
+      owned[i] = buffers[i] != desc->operands[i]->buffer;
+    }
+    CHECK_ERROR(lds[i] <= UINT32_MAX, "Matrix rows too far apart");
+    ld32[i] = (uint32_t)lds[i];
   }
 
-  MtSize gridSize = {a->cols, a->rows, 1};
-  MtSize threadGroupSize = {16, 16, 1};
-  mtDispatchThreads(computeEncoder, gridSize, threadGroupSize);
+  cmdBuffer = mtNewCommandBuffer(ctx->cmdQueue);
+  CHECK_ERROR(cmdBuffer, "Failed to create command buffer");
+  // names the operation in captures and traces
+  mtCommandBufferPushDebugGroup(cmdBuffer, (char *)desc->funcName);
+  computeEncoder = mtNewComputeCommandEncoder(cmdBuffer);
+  CHECK_ERROR(computeEncoder, "Failed to create compute encoder");
 
-  mtEndEncoding(computeEncoder);
-  mtCommitCommandBuffer(cmdBuffer);
-  mtWaitUntilCompleted(cmdBuffer);
+  mtComputeCommandEncoderSetComputePipelineState(computeEncoder,
+                                                 pipelineState);
+  for (size_t i = 0; i < count; ++i)
+    mtComputeCommandEncoderSetBufferOffsetAtIndex(computeEncoder, buffers[i],
+                                                  offsets[i], i);
 
-  memcpy(result->data, mtBufferContents(bufferC), bufferSize);
+  // small arguments travel with the command buffer instead of in buffers
+  for (size_t i = 0; i < desc->bytesCount; ++i)
+    mtComputeCommandEncoderSetBytesLengthAtIndex(
+        computeEncoder, desc->bytes[i], desc->byteLengths[i], count + i);
+  mtComputeCommandEncoderSetBytesLengthAtIndex(
+      computeEncoder, ld32, count * sizeof(uint32_t), count + desc->bytesCount);
 
-  status = 0;
+  MtSize threadGroupSize;
+  if (!tunedThreadgroupSize(ctx, desc->funcName, pipelineState,
+                            desc->gridSize, &threadGroupSize))
+    threadGroupSize =
+        desc->threadgroupSize
+            ? desc->threadgroupSize(pipelineState, desc->gridSize)
+            : threadgroupSizeFor(pipelineState, desc->gridSize);
+  // Metal wants threadgroup memory lengths in multiples of 16 bytes
+  if (desc->threadgroupMemoryPerThread)
+    mtComputeCommandEncoderSetThreadgroupMemoryLengthAtIndex(
+        computeEncoder,
+        (threadGroupSize.width * threadGroupSize.height *
+             threadGroupSize.depth * desc->threadgroupMemoryPerThread +
+         15) & ~(size_t)15,
+        0);
+  mtComputeCommandEncoderDispatchThread_threadsPerThreadgroup(
+      computeEncoder, desc->gridSize, threadGroupSize);
+
+  mtComputeCommandEncoderEndEncoding(computeEncoder);
+  mtCommandBufferPopDebugGroup(cmdBuffer);
+
+  operation = createOperation(ctx, cmdBuffer, desc->funcName, submitted);
+  CHECK_ERROR(operation, "Failed to create operation");
+
+  // staged operands belong to the operation from here on: a staged result is
+  // read back, then all of them return to the pool, once the work completes
+  if (buffers[last] != result->buffer) {
+    const size_t size = matrixElementSize(result);
+    if (matrixIsPacked(result))
+      operationSetReadback(operation, buffers[last], result->data,
+                           desc->resultItems, desc->resultStride * size,
+                           desc->resultStride * size, matrixBytes(result));
+    else // a view, staged packed, goes back a row at a time
+      operationSetReadback(operation, buffers[last], result->data,
+                           result->rows, lds[last] * size,
+                           matrixLd(result) * size, result->cols * size);
+  }
+  for (size_t i = 0; i < count; ++i) {
+    if (owned[i])
+      operationAddStaged(operation, buffers[i]);
+    owned[i] = false;
+  }
+
+  commitOperation(operation);
 
 cleanup:
-  if (bufferA)
-    mtReleaseBuffer(bufferA);
-  if (bufferB)
-    mtReleaseBuffer(bufferB);
-  if (bufferC)
-    mtReleaseBuffer(bufferC);
-  if (cmdBuffer)
-    mtReleaseCommandBuffer(cmdBuffer);
+  for (size_t i = 0; i < count; ++i) {
+    if (owned[i])
+      releaseBuffer(ctx->bufferPool, buffers[i]);
+  }
   if (computeEncoder)
-    mtReleaseCommandEncoder(computeEncoder);
-  if (pipelineState)
-    mtReleaseComputePipelineState(pipelineState);
-  if (func)
-    mtReleaseFunction(func);
-  if (lib)
-    mtReleaseLibrary(lib);
+    mtRelease(computeEncoder);
+  if (cmdBuffer)
+    mtRelease(cmdBuffer);
+
+  return operation;
+}
+
+AlloyOperation *submitMatrixOperation(AlloyContext *ctx, Matrix *a, Matrix *b,
+                                      Matrix *result, MatrixOperation op) {
+  const MtDataType type = matrixType(a);
+  const TypedKernels *kernels = kernelsFor(type);
+  const bool transA = op & MATRIX_OP_TRANSPOSE_A;
+  const bool transB = op & MATRIX_OP_TRANSPOSE_B;
+  // the shape of the product as used, whichever way a and b are stored
+  const size_t M = transA ? a->cols : a->rows, K = transA ? a->rows : a->cols;
+  const size_t N = transB ? b->rows : b->cols;
+  // the kernels' GEMM_TRANSPOSE_A and GEMM_TRANSPOSE_B bits, then the
+  // element type of C for the 16-bit products
+  uint32_t constants[] = {M, N, K, (transA ? 1u : 0u) | (transB ? 2u : 0u),
+                          matrixType(result)};
+  OperationDesc desc = {
+      .operands = {a, b, result},
+      .sizes = {matrixBytes(a), matrixBytes(b), matrixBytes(result)},
+      .operandCount = 3,
+      .gridSize = {result->cols, result->rows, 1},
+      .resultItems = 1,
+  };
+  op &= ~(MATRIX_OP_TRANSPOSE_A | MATRIX_OP_TRANSPOSE_B);
+
+  CHECK_ERROR(kernels && matrixType(b) == type,
+              "Operands must share a supported element type");
+  CHECK_ERROR(op == MATRIX_OP_ADD || op == MATRIX_OP_MULTIPLY,
+              "Invalid matrix operation");
+
+  if (op == MATRIX_OP_ADD) {
+    CHECK_ERROR(!transA && !transB, "Only products take transpose flags");
+    CHECK_ERROR(a->rows == b->rows && a->cols == b->cols &&
+                    result->rows == a->rows && result->cols == a->cols,
+                "Add shapes do not match");
+    CHECK_ERROR(kernels->addition, "Addition does not support int8 matrices");
+    CHECK_ERROR(matrixType(result) == type,
+                "Sum must have the operands' element type");
+    desc.shaderFile = "addition.metal";
+    desc.funcName = kernels->addition;
+    desc.threadgroupSize = rowThreadgroupSizeFor;
+  } else {
+    CHECK_ERROR((transB ? b->cols : b->rows) == K && result->rows == M &&
+                    result->cols == N,
+                "Multiply shapes do not match");
+    if (type == MtDataTypeChar) {
+      CHECK_ERROR(matrixType(result) == MtDataTypeInt,
+                  "Product of int8 matrices must be int32");
+      CHECK_ERROR(!transA && !transB,
+                  "Products of int8 matrices do not take transpose flags");
+    } else {
+      CHECK_ERROR(matrixType(result) == type ||
+                      matrixType(result) == MtDataTypeFloat,
+                  "Product must be float or have the operands' element type");
+    }
+    desc.shaderFile = "multiplication.metal";
+    desc.funcName = kernels->multiplication;
+    desc.bytesCount = type == MtDataTypeChar                           ? 3
+                      : type == MtDataTypeHalf || type == MtDataTypeBFloat ? 5
+                                                                           : 4;
+    for (size_t i = 0; i < desc.bytesCount; ++i) {
+      desc.bytes[i] = &constants[i];
+      desc.byteLengths[i] = sizeof(uint32_t);
+    }
+  }
+
+  return submitOperation(ctx, &desc);
+
+cleanup:
+  return NULL;
+}
+
+int performMatrixOperation(AlloyContext *ctx, Matrix *a, Matrix *b,
+                           Matrix *result, MatrixOperation op) {
+  AlloyOperation *operation = submitMatrixOperation(ctx, a, b, result, op);
+  if (!operation)
+    return -1;
+
+  int status = waitOperation(operation);
+  releaseOperation(operation);
+  return status;
+}
+
+// bytes spanned by count items of mat spaced stride elements apart
+static size_t batchExtent(const Matrix *mat, size_t stride, size_t count) {
+  return (count - 1) * stride * matrixElementSize(mat) + matrixExtent(mat);
+}
+
+AlloyOperation *submitBatchedMatrixMultiply(AlloyContext *ctx, Matrix *a,
+                                            size_t strideA, Matrix *b,
+                                            size_t strideB, Matrix *result,
+                                            size_t strideC,
+                                            size_t batchCount) {
+  const MtDataType type = matrixType(a);
+  const TypedKernels *kernels = kernelsFor(type);
+
+  CHECK_ERROR(batchCount, "Batch is empty");
+  CHECK_ERROR(kernels && matrixType(b) == type,
+              "Operands must share a supported element type");
+  CHECK_ERROR(kernels->batchedMultiplication,
+              "Batched multiply does not support int8 matrices");
+  CHECK_ERROR(matrixType(result) == type ||
+                  matrixType(result) == MtDataTypeFloat,
+              "Product must be float or have the operands' element type");
+  CHECK_ERROR(a->cols == b->rows && result->rows == a->rows &&
+                  result->cols == b->cols,
+              "Batched multiply shapes do not match");
+  CHECK_ERROR(batchCount == 1 ||
+                  strideC * matrixElementSize(result) >= matrixExtent(result),
+              "Batched multiply results overlap");
+  // a staged operand is packed, which would move every item but the first
+  CHECK_ERROR((matrixIsPacked(a) || a->buffer) &&
+                  (matrixIsPacked(b) || b->buffer) &&
+                  (matrixIsPacked(result) || result->buffer),
+              "Batched multiply of padded rows needs shared matrices");
+
+  OperationDesc desc = {
+      .shaderFile = "multiplication.metal",
+      .funcName = kernels->batchedMultiplication,
+      .operands = {a, b, result},
+      .sizes = {batchExtent(a, strideA, batchCount),
+                batchExtent(b, strideB, batchCount),
+                batchExtent(result, strideC, batchCount)},
+      .operandCount = 3,
+      // one dispatch for the whole batch: the batch index is the grid's depth
+      .gridSize = {result->cols, result->rows, batchCount},
+      // item by item, so the gaps between strided results are untouched
+      .resultItems = strideC ? batchCount : 1,
+      .resultStride = strideC,
+  };
+
+  // the kernel indexes with 32-bit offsets
+  for (int i = 0; i < 3; ++i)
+    CHECK_ERROR(desc.sizes[i] / matrixElementSize(desc.operands[i]) <=
+                    UINT32_MAX,
+                "Batch too large");
+
+  uint32_t constants[] = {a->rows, b->cols, a->cols,          strideA,
+                          strideB, strideC, matrixType(result)};
+  desc.bytesCount = type == MtDataTypeFloat ? 6 : 7;
+  for (size_t i = 0; i < desc.bytesCount; ++i) {
+    desc.bytes[i] = &constants[i];
+    desc.byteLengths[i] = sizeof(uint32_t);
+  }
+  return submitOperation(ctx, &desc);
+
+cleanup:
+  return NULL;
+}
+
+int performBatchedMatrixMultiply(AlloyContext *ctx, Matrix *a, size_t strideA,
+                                 Matrix *b, size_t strideB, Matrix *result,
+                                 size_t strideC, size_t batchCount) {
+  if (!batchCount)
+    return 0;
+
+  AlloyOperation *operation = submitBatchedMatrixMultiply(
+      ctx, a, strideA, b, strideB, result, strideC, batchCount);
+  if (!operation)
+    return -1;
+
+  int status = waitOperation(operation);
+  releaseOperation(operation);
+  return status;
+}
+
+AlloyOperation *submitMatrixConversion(AlloyContext *ctx, Matrix *src,
+                                       Matrix *dst) {
+  uint32_t types[] = {matrixType(src), matrixType(dst)};
+
+  CHECK_ERROR(isFloatingType(matrixType(src)) &&
+                  isFloatingType(matrixType(dst)),
+              "Conversion supports float, half and bfloat16 matrices");
+  CHECK_ERROR(src->rows == dst->rows && src->cols == dst->cols,
+              "Conversion shapes do not match");
+  CHECK_ERROR(src != dst, "Conversion needs a separate destination");
+
+  OperationDesc desc = {
+      .shaderFile = "conversion.metal",
+      .funcName = "convert_matrix",
+      .operands = {src, dst},
+      .sizes = {matrixBytes(src), matrixBytes(dst)},
+      .operandCount = 2,
+      .bytes = {&types[0], &types[1]},
+      .byteLengths = {sizeof(uint32_t), sizeof(uint32_t)},
+      .bytesCount = 2,
+      .gridSize = {dst->cols, dst->rows, 1},
+      .threadgroupSize = rowThreadgroupSizeFor,
+      .resultItems = 1,
+  };
+  return submitOperation(ctx, &desc);
+
+cleanup:
+  return NULL;
+}
+
+int performMatrixConversion(AlloyContext *ctx, Matrix *src, Matrix *dst) {
+  AlloyOperation *operation = submitMatrixConversion(ctx, src, dst);
+  if (!operation)
+    return -1;
+
+  int status = waitOperation(operation);
+  releaseOperation(operation);
+  return status;
+}
+
+AlloyOperation *submitMatrixTranspose(AlloyContext *ctx, Matrix *src,
+                                      Matrix *dst) {
+  uint32_t size = matrixElementSize(src);
+
+  CHECK_ERROR(size && matrixType(dst) == matrixType(src),
+              "Transpose needs matching, supported element types");
+  CHECK_ERROR(dst->rows == src->cols && dst->cols == src->rows,
+              "Transpose shapes do not match");
+  CHECK_ERROR(src != dst || src->rows == src->cols,
+              "Only square matrices transpose in place");
+
+  OperationDesc desc = {
+      .shaderFile = "transposition.metal",
+      .funcName = src == dst ? "transpose_matrix_in_place" : "transpose_matrix",
+      .operands = {src, dst},
+      .sizes = {matrixBytes(src), matrixBytes(dst)},
+      .operandCount = src == dst ? 1 : 2,
+      .bytes = {&size},
+      .byteLengths = {sizeof(size)},
+      .bytesCount = 1,
+      .gridSize = {dst->cols, dst->rows, 1},
+      .resultItems = 1,
+      .readsResult = src == dst,
+  };
+  return submitOperation(ctx, &desc);
+
+cleanup:
+  return NULL;
+}
+
+int performMatrixTranspose(AlloyContext *ctx, Matrix *src, Matrix *dst) {
+  AlloyOperation *operation = submitMatrixTranspose(ctx, src, dst);
+  if (!operation)
+    return -1;
 
+  int status = waitOperation(operation);
+  releaseOperation(operation);
   return status;
 }
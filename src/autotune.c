@@ -0,0 +1,379 @@
+#define _POSIX_C_SOURCE 200809L
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Tuned threadgroup shapes, keyed by kernel and grid bucket for the
+ * context's device. A grid falls in the bucket of its dimensions rounded up
+ * to powers of two, so one measurement serves every shape of about the same
+ * size. The database file is text, one shape per line:
+ *
+ *   device<TAB>kernel<TAB>bucket w h d<TAB>threadgroup w h d<TAB>seconds
+ *
+ * with bucket dimensions as base-2 logarithms. Lines for other devices are
+ * kept as read and written back, so one file can serve several machines.
+ */
+
+#define TUNING_BUCKETS 64
+#define TUNING_MAGIC "# alloy tuning database 1"
+/* candidates below this share of the pipeline's thread limit are skipped */
+#define TUNING_MIN_OCCUPANCY 16
+
+typedef struct TuningEntry {
+  uint64_t hash;
+  unsigned bucket[3];
+  MtSize size;
+  double seconds; /* median time measured for size */
+  struct TuningEntry *next;
+  char kernel[]; /* terminated */
+} TuningEntry;
+
+struct AlloyTuningDb {
+  pthread_mutex_t lock;
+  const char *device;
+  TuningEntry *entries[TUNING_BUCKETS];
+  size_t count;
+  char **foreign; /* lines of other devices, newline included */
+  size_t foreignCount;
+};
+
+/* What the tuning thread's submissions do: report the dispatch they would
+ * make, or use a forced threadgroup shape. */
+typedef struct TuningProbe {
+  AlloyContext *ctx;
+  bool forcing;
+  MtSize forced;
+  size_t dispatches;
+  char kernel[64];
+  MtSize grid;
+  NsUInteger maxThreads, simdWidth;
+} TuningProbe;
+
+static _Thread_local TuningProbe *activeProbe;
+
+static unsigned ceilLog2(NsUInteger x) {
+  return x > 1 ? 64 - (unsigned)__builtin_clzll((unsigned long long)x - 1)
+               : 0;
+}
+
+static uint64_t tuningKey(const char *kernel, const unsigned *bucket) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (; *kernel; ++kernel)
+    hash = (hash ^ (unsigned char)*kernel) * 0x100000001b3ULL;
+  for (int i = 0; i < 3; ++i)
+    hash = (hash ^ bucket[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+static void gridBucket(MtSize grid, unsigned *bucket) {
+  bucket[0] = ceilLog2(grid.width);
+  bucket[1] = ceilLog2(grid.height);
+  bucket[2] = ceilLog2(grid.depth);
+}
+
+static TuningEntry *findEntry(AlloyTuningDb *db, uint64_t hash,
+                              const char *kernel, const unsigned *bucket) {
+  TuningEntry *entry = db->entries[hash % TUNING_BUCKETS];
+  for (; entry; entry = entry->next) {
+    if (entry->hash == hash && !memcmp(entry->bucket, bucket,
+                                       sizeof(entry->bucket)) &&
+        !strcmp(entry->kernel, kernel))
+      return entry;
+  }
+  return NULL;
+}
+
+// Records size for kernel in bucket, replacing any earlier shape. Called
+// with the lock held.
+static bool storeEntry(AlloyTuningDb *db, const char *kernel,
+                       const unsigned *bucket, MtSize size, double seconds) {
+  uint64_t hash = tuningKey(kernel, bucket);
+  TuningEntry *entry = findEntry(db, hash, kernel, bucket);
+  if (!entry) {
+    size_t nameSize = strlen(kernel) + 1;
+    entry = calloc(1, sizeof(*entry) + nameSize);
+    if (!entry)
+      return false;
+    memcpy(entry->kernel, kernel, nameSize);
+    memcpy(entry->bucket, bucket, sizeof(entry->bucket));
+    entry->hash = hash;
+    entry->next = db->entries[hash % TUNING_BUCKETS];
+    db->entries[hash % TUNING_BUCKETS] = entry;
+    db->count++;
+  }
+  entry->size = size;
+  entry->seconds = seconds;
+  return true;
+}
+
+static void removeEntry(AlloyTuningDb *db, const char *kernel,
+                        const unsigned *bucket) {
+  uint64_t hash = tuningKey(kernel, bucket);
+  TuningEntry **link = &db->entries[hash % TUNING_BUCKETS];
+  for (; *link; link = &(*link)->next) {
+    TuningEntry *entry = *link;
+    if (entry->hash == hash &&
+        !memcmp(entry->bucket, bucket, sizeof(entry->bucket)) &&
+        !strcmp(entry->kernel, kernel)) {
+      *link = entry->next;
+      free(entry);
+      db->count--;
+      return;
+    }
+  }
+}
+
+static void clearEntries(AlloyTuningDb *db) {
+  for (size_t i = 0; i < TUNING_BUCKETS; ++i) {
+    TuningEntry *entry = db->entries[i];
+    while (entry) {
+      TuningEntry *next = entry->next;
+      free(entry);
+      entry = next;
+    }
+    db->entries[i] = NULL;
+  }
+  for (size_t i = 0; i < db->foreignCount; ++i)
+    free(db->foreign[i]);
+  free(db->foreign);
+  db->foreign = NULL;
+  db->foreignCount = 0;
+  db->count = 0;
+}
+
+AlloyTuningDb *createTuningDb(MtDevice *device) {
+  AlloyTuningDb *db = calloc(1, sizeof(*db));
+  if (!db)
+    return NULL;
+  db->device = mtDeviceName(device);
+  pthread_mutex_init(&db->lock, NULL);
+  return db;
+}
+
+void freeTuningDb(AlloyTuningDb *db) {
+  if (!db)
+    return;
+  clearEntries(db);
+  pthread_mutex_destroy(&db->lock);
+  free(db);
+}
+
+bool tunedThreadgroupSize(AlloyContext *ctx, const char *kernel,
+                          MtComputePipelineState *pipelineState,
+                          MtSize grid, MtSize *size) {
+  TuningProbe *probe = activeProbe;
+  NsUInteger maxThreads =
+      mtComputePipelineMaxTotalThreadsPerThreadgroup(pipelineState);
+
+  if (probe && probe->ctx == ctx) {
+    if (probe->forcing) {
+      *size = probe->forced;
+      return true;
+    }
+    if (probe->dispatches++ == 0) {
+      snprintf(probe->kernel, sizeof(probe->kernel), "%s", kernel);
+      probe->grid = grid;
+      probe->maxThreads = maxThreads;
+      probe->simdWidth = mtComputePipelineThreadExecutionWidth(pipelineState);
+    }
+    return false;
+  }
+
+  AlloyTuningDb *db = ctx->tuning;
+  unsigned bucket[3];
+  bool found = false;
+  gridBucket(grid, bucket);
+
+  pthread_mutex_lock(&db->lock);
+  if (db->count) {
+    TuningEntry *entry = findEntry(db, tuningKey(kernel, bucket), kernel,
+                                   bucket);
+    // a shape tuned for a different build of the kernel may no longer fit
+    if (entry && entry->size.width * entry->size.height *
+                         entry->size.depth <= maxThreads) {
+      *size = entry->size;
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&db->lock);
+  return found;
+}
+
+int loadTuningDatabase(AlloyContext *ctx, const char *path) {
+  AlloyTuningDb *db = ctx->tuning;
+  FILE *file = fopen(path, "r");
+  char line[512];
+  int status = -1;
+
+  if (!file)
+    return -1;
+  pthread_mutex_lock(&db->lock);
+  clearEntries(db);
+  CHECK_ERROR(fgets(line, sizeof(line), file) &&
+                  !strncmp(line, TUNING_MAGIC, strlen(TUNING_MAGIC)),
+              "Not a tuning database");
+
+  while (fgets(line, sizeof(line), file)) {
+    char *device = line, *kernel = strchr(line, '\t'), *fields;
+    if (!kernel || !(fields = strchr(kernel + 1, '\t')))
+      continue;
+    *kernel++ = '\0';
+    *fields++ = '\0';
+
+    if (strcmp(device, db->device) != 0) {
+      char **grown = realloc(db->foreign,
+                             (db->foreignCount + 1) * sizeof(*grown));
+      CHECK_ERROR(grown, "Failed to read tuning database");
+      db->foreign = grown;
+      kernel[-1] = fields[-1] = '\t';
+      CHECK_ERROR(db->foreign[db->foreignCount] = strdup(line),
+                  "Failed to read tuning database");
+      db->foreignCount++;
+      continue;
+    }
+
+    unsigned bucket[3];
+    unsigned long long w, h, d;
+    double seconds;
+    if (sscanf(fields, "%u %u %u\t%llu %llu %llu\t%lf", &bucket[0],
+               &bucket[1], &bucket[2], &w, &h, &d, &seconds) != 7 ||
+        !w || !h || !d)
+      continue;
+    MtSize size = {w, h, d};
+    CHECK_ERROR(storeEntry(db, kernel, bucket, size, seconds),
+                "Failed to read tuning database");
+  }
+  status = 0;
+
+cleanup:
+  pthread_mutex_unlock(&db->lock);
+  fclose(file);
+  return status;
+}
+
+int saveTuningDatabase(AlloyContext *ctx, const char *path) {
+  AlloyTuningDb *db = ctx->tuning;
+  FILE *file = fopen(path, "w");
+  if (!file)
+    return -1;
+
+  pthread_mutex_lock(&db->lock);
+  fprintf(file, "%s\n", TUNING_MAGIC);
+  for (size_t i = 0; i < db->foreignCount; ++i)
+    fputs(db->foreign[i], file);
+  for (size_t i = 0; i < TUNING_BUCKETS; ++i) {
+    for (TuningEntry *e = db->entries[i]; e; e = e->next)
+      fprintf(file, "%s\t%s\t%u %u %u\t%llu %llu %llu\t%.9f\n", db->device,
+              e->kernel, e->bucket[0], e->bucket[1], e->bucket[2],
+              (unsigned long long)e->size.width,
+              (unsigned long long)e->size.height,
+              (unsigned long long)e->size.depth, e->seconds);
+  }
+  pthread_mutex_unlock(&db->lock);
+  return fclose(file) == 0 ? 0 : -1;
+}
+
+static int compareDoubles(const void *x, const void *y) {
+  const double a = *(const double *)x, b = *(const double *)y;
+  return (a > b) - (a < b);
+}
+
+// The median time of repeat runs, or a negative value if one fails.
+static double timeRuns(AlloyContext *ctx, AlloyTuneFn run, void *userData,
+                       int repeat, double *times) {
+  for (int i = 0; i < repeat; ++i) {
+    const double start = latencyClock();
+    if (run(ctx, userData) != 0)
+      return -1.0;
+    times[i] = latencyClock() - start;
+  }
+  qsort(times, repeat, sizeof(double), compareDoubles);
+  return repeat % 2 ? times[repeat / 2]
+                    : (times[repeat / 2 - 1] + times[repeat / 2]) / 2.0;
+}
+
+// The power of two after x, or 0 once x covers extent.
+static NsUInteger nextCandidate(NsUInteger x, NsUInteger extent) {
+  return x < extent ? x * 2 : 0;
+}
+
+int autotuneOperation(AlloyContext *ctx, AlloyTuneFn run, void *userData,
+                      int repeat) {
+  TuningProbe probe = {.ctx = ctx};
+  double *times = NULL;
+  double best = -1.0;
+  MtSize bestSize = {0, 0, 0};
+  unsigned bucket[3];
+  int status = -1;
+
+  if (repeat < 1)
+    repeat = 5;
+  times = malloc(repeat * sizeof(double));
+  CHECK_ERROR(times, "Failed to allocate tuning timings");
+
+  // a first run finds the dispatch, warms caches and sets the baseline
+  activeProbe = &probe;
+  CHECK_ERROR(run(ctx, userData) == 0, "Operation to tune failed");
+  CHECK_ERROR(probe.dispatches == 1,
+              "Autotuning needs an operation with a single dispatch");
+  best = timeRuns(ctx, run, userData, repeat, times);
+  CHECK_ERROR(best >= 0.0, "Operation to tune failed");
+
+  // widths are multiples of the SIMD width, heights fill the rest of the
+  // thread limit; both stop once they cover the grid
+  const NsUInteger simd = probe.simdWidth ? probe.simdWidth : 1;
+  const NsUInteger minThreads =
+      probe.maxThreads / TUNING_MIN_OCCUPANCY ? probe.maxThreads /
+                                                    TUNING_MIN_OCCUPANCY
+                                              : 1;
+  probe.forcing = true;
+  for (NsUInteger w = simd; w && w <= probe.maxThreads;
+       w = nextCandidate(w, probe.grid.width)) {
+    for (NsUInteger h = 1; h && w * h <= probe.maxThreads;
+         h = nextCandidate(h, probe.grid.height)) {
+      if (w * h < minThreads && (w < probe.grid.width ||
+                                 h < probe.grid.height))
+        continue;
+      probe.forced = (MtSize){w, h, 1};
+      double t = timeRuns(ctx, run, userData, repeat, times);
+      CHECK_ERROR(t >= 0.0, "Operation to tune failed");
+      if (t < best) {
+        best = t;
+        bestSize = probe.forced;
+      }
+    }
+  }
+  status = 0;
+
+  // when nothing beat the heuristic shape, it stays in use
+  gridBucket(probe.grid, bucket);
+  pthread_mutex_lock(&ctx->tuning->lock);
+  if (!bestSize.width)
+    removeEntry(ctx->tuning, probe.kernel, bucket);
+  else if (!storeEntry(ctx->tuning, probe.kernel, bucket, bestSize, best))
+    status = -1;
+  pthread_mutex_unlock(&ctx->tuning->lock);
+
+cleanup:
+  activeProbe = NULL;
+  free(times);
+  return status;
+}
+
+typedef struct MatrixTuneArgs {
+  Matrix *a, *b, *result;
+  MatrixOperation op;
+} MatrixTuneArgs;
+
+static int runMatrixOperation(AlloyContext *ctx, void *userData) {
+  MatrixTuneArgs *args = userData;
+  return performMatrixOperation(ctx, args->a, args->b, args->result,
+                                args->op);
+}
+
+int autotuneMatrixOperation(AlloyContext *ctx, Matrix *a, Matrix *b,
+                            Matrix *result, MatrixOperation op, int repeat) {
+  MatrixTuneArgs args = {a, b, result, op};
+  return autotuneOperation(ctx, runMatrixOperation, &args, repeat);
+}
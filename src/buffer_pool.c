@@ -0,0 +1,264 @@
+#include "../include/alloy/alloy.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Buffers are bucketed into size classes four to a power of two (256, 320,
+ * 384, 448, 512, 640, ...), so a recycled buffer wastes at most a quarter of
+ * its length. Each class keeps a free list of idle buffers; a request is
+ * served from the list when a buffer with the same resource options is
+ * cached, and from the device otherwise. Idle buffers are also kept in the
+ * order they were released: when caching one would take the idle bytes past
+ * the pool's limit, the longest idle ones go back to the device first.
+ */
+
+#define POOL_MIN_SHIFT 8
+#define POOL_MIN_SIZE ((size_t)1 << POOL_MIN_SHIFT)
+#define POOL_STEPS 4
+#define POOL_CLASSES (POOL_STEPS * (64 - POOL_MIN_SHIFT) + 1)
+
+typedef struct AlloyPoolNode {
+  MtBuffer *buffer;
+  MtResourceOptions options;
+  struct AlloyPoolNode *next;          /* in its class, or spare */
+  struct AlloyPoolNode *older, *newer; /* among all idle buffers */
+} AlloyPoolNode;
+
+struct AlloyBufferPool {
+  MtDevice *device;
+  pthread_mutex_t lock;
+  AlloyPoolNode *classes[POOL_CLASSES];
+  AlloyPoolNode *spareNodes;
+  AlloyPoolNode *oldest, *newest;
+  size_t cacheLimit;
+  size_t requests;
+  size_t hits;
+  size_t evictions;
+  size_t residentBytes;
+  size_t cachedBytes;
+};
+
+typedef struct AlloyPendingRelease {
+  AlloyBufferPool *pool;
+  size_t count;
+  MtBuffer *buffers[];
+} AlloyPendingRelease;
+
+/* Maps a request size to its class index and rounded class size. */
+static size_t sizeClass(size_t size, size_t *classSize) {
+  if (size <= POOL_MIN_SIZE) {
+    *classSize = POOL_MIN_SIZE;
+    return 0;
+  }
+  /* size lies in (2^shift, 2^(shift + 1)] */
+  unsigned shift = 63 - __builtin_clzll((unsigned long long)(size - 1));
+  size_t step = (size_t)1 << (shift - 2);
+  size_t steps = (size + step - 1) >> (shift - 2); /* 5..8 */
+  *classSize = steps << (shift - 2);
+  return (shift - POOL_MIN_SHIFT) * POOL_STEPS + (steps - POOL_STEPS);
+}
+
+AlloyBufferPool *createBufferPool(MtDevice *device) {
+  AlloyBufferPool *pool = calloc(1, sizeof(*pool));
+  if (!pool)
+    return NULL;
+  pool->device = device;
+  pool->cacheLimit = ALLOY_POOL_DEFAULT_CACHE_LIMIT;
+  pthread_mutex_init(&pool->lock, NULL);
+  return pool;
+}
+
+static void unlinkIdle(AlloyBufferPool *pool, AlloyPoolNode *node) {
+  if (node->older)
+    node->older->newer = node->newer;
+  else
+    pool->oldest = node->newer;
+  if (node->newer)
+    node->newer->older = node->older;
+  else
+    pool->newest = node->older;
+}
+
+/* Releases the longest idle buffers until caching length more bytes stays
+ * within the limit. Called with the lock held. */
+static void evictIdle(AlloyBufferPool *pool, size_t length) {
+  while (pool->oldest && pool->cachedBytes + length > pool->cacheLimit) {
+    AlloyPoolNode *node = pool->oldest;
+    const size_t size = mtBufferLength(node->buffer);
+    size_t classSize;
+    AlloyPoolNode **link = &pool->classes[sizeClass(size, &classSize)];
+    while (*link != node)
+      link = &(*link)->next;
+    *link = node->next;
+    unlinkIdle(pool, node);
+
+    pool->cachedBytes -= size;
+    pool->residentBytes -= size;
+    pool->evictions++;
+    mtRelease(node->buffer);
+    node->next = pool->spareNodes;
+    pool->spareNodes = node;
+  }
+}
+
+void setBufferPoolLimit(AlloyBufferPool *pool, size_t maxCachedBytes) {
+  pthread_mutex_lock(&pool->lock);
+  pool->cacheLimit = maxCachedBytes;
+  evictIdle(pool, 0);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void trimBufferPool(AlloyBufferPool *pool) {
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  for (size_t i = 0; i < POOL_CLASSES; ++i) {
+    AlloyPoolNode *node = pool->classes[i];
+    while (node) {
+      AlloyPoolNode *next = node->next;
+      pool->residentBytes -= mtBufferLength(node->buffer);
+      mtRelease(node->buffer);
+      node->next = pool->spareNodes;
+      pool->spareNodes = node;
+      node = next;
+    }
+    pool->classes[i] = NULL;
+  }
+  pool->oldest = pool->newest = NULL;
+  pool->cachedBytes = 0;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void freeBufferPool(AlloyBufferPool *pool) {
+  if (!pool)
+    return;
+
+  trimBufferPool(pool);
+  while (pool->spareNodes) {
+    AlloyPoolNode *next = pool->spareNodes->next;
+    free(pool->spareNodes);
+    pool->spareNodes = next;
+  }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+MtBuffer *acquireBuffer(AlloyBufferPool *pool, size_t size,
+                        MtResourceOptions options) {
+  size_t classSize;
+  size_t index = sizeClass(size, &classSize);
+  MtBuffer *buffer = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->requests++;
+  for (AlloyPoolNode **link = &pool->classes[index]; *link;
+       link = &(*link)->next) {
+    AlloyPoolNode *node = *link;
+    if (node->options != options)
+      continue;
+    *link = node->next;
+    unlinkIdle(pool, node);
+    buffer = node->buffer;
+    node->next = pool->spareNodes;
+    pool->spareNodes = node;
+    pool->hits++;
+    pool->cachedBytes -= classSize;
+    break;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (buffer)
+    return buffer;
+
+  buffer = createBuffer(pool->device, classSize, options);
+  if (buffer) {
+    pthread_mutex_lock(&pool->lock);
+    pool->residentBytes += classSize;
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return buffer;
+}
+
+void releaseBuffer(AlloyBufferPool *pool, MtBuffer *buffer) {
+  if (!buffer)
+    return;
+
+  size_t length = mtBufferLength(buffer);
+  size_t classSize;
+  size_t index = sizeClass(length, &classSize);
+
+  pthread_mutex_lock(&pool->lock);
+  AlloyPoolNode *node = pool->spareNodes;
+  if (node)
+    pool->spareNodes = node->next;
+  else
+    node = malloc(sizeof(*node));
+
+  if (!node || classSize != length || length > pool->cacheLimit) {
+    /* not one of ours, no memory to track it, or too large to keep: let it
+     * go */
+    if (node) {
+      node->next = pool->spareNodes;
+      pool->spareNodes = node;
+    }
+    if (classSize == length)
+      pool->residentBytes -= length;
+    pthread_mutex_unlock(&pool->lock);
+    mtRelease(buffer);
+    return;
+  }
+
+  evictIdle(pool, length);
+  node->buffer = buffer;
+  node->options = mtResourceOptions(buffer);
+  node->next = pool->classes[index];
+  pool->classes[index] = node;
+  node->older = pool->newest;
+  node->newer = NULL;
+  if (pool->newest)
+    pool->newest->newer = node;
+  else
+    pool->oldest = node;
+  pool->newest = node;
+  pool->cachedBytes += length;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void releasePending(void *__restrict sender,
+                           MtCommandBuffer *__restrict cmdb) {
+  AlloyPendingRelease *pending = sender;
+  (void)cmdb;
+  for (size_t i = 0; i < pending->count; ++i)
+    releaseBuffer(pending->pool, pending->buffers[i]);
+  free(pending);
+}
+
+bool releaseBuffersOnCompletion(AlloyBufferPool *pool, MtCommandBuffer *cmdb,
+                                MtBuffer **buffers, size_t count) {
+  AlloyPendingRelease *pending =
+      malloc(sizeof(*pending) + count * sizeof(MtBuffer *));
+  if (!pending)
+    return false;
+
+  pending->pool = pool;
+  pending->count = count;
+  memcpy(pending->buffers, buffers, count * sizeof(MtBuffer *));
+  mtCommandBufferOnComplete(cmdb, pending, releasePending);
+  return true;
+}
+
+AlloyBufferPoolStats getBufferPoolStats(AlloyBufferPool *pool) {
+  AlloyBufferPoolStats stats = {0};
+
+  pthread_mutex_lock(&pool->lock);
+  stats.requests = pool->requests;
+  stats.hits = pool->hits;
+  stats.evictions = pool->evictions;
+  stats.residentBytes = pool->residentBytes;
+  stats.cachedBytes = pool->cachedBytes;
+  pthread_mutex_unlock(&pool->lock);
+
+  stats.hitRate = stats.requests ? (double)stats.hits / stats.requests : 0.0;
+  return stats;
+}
@@ -0,0 +1,169 @@
+#include "internal.h"
+#include "../include/cmt/error_handling.h"
+#ifndef __APPLE__
+#include "kernels/kernels.h"
+#endif
+#include <string.h>
+
+struct AlloyCacheEntry {
+  uint64_t hash;
+  const char *source; /* static shader text, compared on hash match */
+  char *funcName;     /* stored after the entry; NULL for libraries */
+  void *object;       /* MtLibrary or MtComputePipelineState */
+  AlloyCacheEntry *next;
+};
+
+static uint64_t fnv1a(uint64_t hash, const char *str) {
+  for (; *str; ++str) {
+    hash ^= (unsigned char)*str;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static uint64_t cacheKey(const char *source, const char *funcName) {
+  uint64_t hash = fnv1a(0xcbf29ce484222325ULL, source);
+  if (funcName) {
+    hash *= 0x100000001b3ULL; /* separator */
+    hash = fnv1a(hash, funcName);
+  }
+  return hash;
+}
+
+static AlloyCacheEntry *cacheFind(AlloyContext *ctx, uint64_t hash,
+                                  const char *source, const char *funcName) {
+  AlloyCacheEntry *entry = ctx->cache[hash % ALLOY_CACHE_BUCKETS];
+  for (; entry; entry = entry->next) {
+    if (entry->hash != hash || strcmp(entry->source, source) != 0)
+      continue;
+    if (!funcName ? !entry->funcName
+                  : entry->funcName && strcmp(entry->funcName, funcName) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+static void *cacheInsert(AlloyContext *ctx, uint64_t hash, const char *source,
+                         const char *funcName, void *object) {
+  size_t nameSize = funcName ? strlen(funcName) + 1 : 0;
+  AlloyCacheEntry *entry = calloc(1, sizeof(*entry) + nameSize);
+  if (!entry) {
+    mtRelease(object);
+    return NULL;
+  }
+  if (funcName)
+    entry->funcName = memcpy(entry + 1, funcName, nameSize);
+  entry->hash = hash;
+  entry->source = source;
+  entry->object = object;
+  entry->next = ctx->cache[hash % ALLOY_CACHE_BUCKETS];
+  ctx->cache[hash % ALLOY_CACHE_BUCKETS] = entry;
+  return object;
+}
+
+static MtLibrary *cachedLibrary(AlloyContext *ctx, const char *shaderFile,
+                                const char *source) {
+  uint64_t hash = cacheKey(source, NULL);
+  AlloyCacheEntry *entry = cacheFind(ctx, hash, source, NULL);
+  if (entry)
+    return entry->object;
+
+  MtLibrary *lib = createLibraryFromFile(ctx->device, shaderFile);
+  return lib ? cacheInsert(ctx, hash, source, NULL, lib) : NULL;
+}
+
+MtComputePipelineState *getComputePipeline(AlloyContext *ctx,
+                                           const char *shaderFile,
+                                           const char *funcName) {
+  const char *source = shaderSource(shaderFile);
+  if (!source)
+    return NULL;
+
+  uint64_t hash = cacheKey(source, funcName);
+  MtComputePipelineState *pipelineState = NULL;
+  MtFunction *func = NULL;
+
+  pthread_mutex_lock(&ctx->cacheLock);
+  AlloyCacheEntry *entry = cacheFind(ctx, hash, source, funcName);
+  if (entry) {
+    pipelineState = entry->object;
+    goto cleanup;
+  }
+
+  MtLibrary *lib = cachedLibrary(ctx, shaderFile, source);
+  CHECK_ERROR(lib, "Failed to create library");
+
+  func = mtNewFunctionWithName(lib, funcName);
+  CHECK_ERROR(func, "Failed to create function");
+
+  pipelineState = mtNewComputePipelineStateWithFunction(ctx->device, func,
+                                                        NULL);
+  CHECK_ERROR(pipelineState, "Failed to create compute pipeline state");
+  pipelineState = cacheInsert(ctx, hash, source, funcName, pipelineState);
+
+cleanup:
+  pthread_mutex_unlock(&ctx->cacheLock);
+  if (func)
+    mtRelease(func);
+  return pipelineState;
+}
+
+AlloyContext *createContext(void) {
+  AlloyContext *ctx = calloc(1, sizeof(*ctx));
+  if (!ctx)
+    return NULL;
+  pthread_mutex_init(&ctx->cacheLock, NULL);
+
+  ctx->device = mtCreateSystemDefaultDevice();
+  CHECK_ERROR(ctx->device, "Failed to create Metal device");
+
+#ifndef __APPLE__
+  registerHostKernels();
+#endif
+
+  ctx->cmdQueue = mtNewCommandQueue(ctx->device);
+  CHECK_ERROR(ctx->cmdQueue, "Failed to create command queue");
+
+  ctx->bufferPool = createBufferPool(ctx->device);
+  CHECK_ERROR(ctx->bufferPool, "Failed to create buffer pool");
+
+  ctx->latency = createLatencyRecorder();
+  CHECK_ERROR(ctx->latency, "Failed to create latency recorder");
+
+  ctx->tuning = createTuningDb(ctx->device);
+  CHECK_ERROR(ctx->tuning, "Failed to create tuning database");
+  const char *tuningPath = getenv("ALLOY_TUNING_DB");
+  // a database yet to be written is not an error
+  if (tuningPath && *tuningPath)
+    loadTuningDatabase(ctx, tuningPath);
+  return ctx;
+
+cleanup:
+  freeContext(ctx);
+  return NULL;
+}
+
+void freeContext(AlloyContext *ctx) {
+  if (!ctx)
+    return;
+
+  for (size_t i = 0; i < ALLOY_CACHE_BUCKETS; ++i) {
+    AlloyCacheEntry *entry = ctx->cache[i];
+    while (entry) {
+      AlloyCacheEntry *next = entry->next;
+      mtRelease(entry->object);
+      free(entry);
+      entry = next;
+    }
+  }
+
+  freeBufferPool(ctx->bufferPool);
+  freeLatencyRecorder(ctx->latency);
+  freeTuningDb(ctx->tuning);
+  if (ctx->cmdQueue)
+    mtRelease(ctx->cmdQueue);
+  if (ctx->device)
+    mtRelease(ctx->device);
+  pthread_mutex_destroy(&ctx->cacheLock);
+  free(ctx);
+}
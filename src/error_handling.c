@@ -0,0 +1,8 @@
+#include "../include/cmt/error_handling.h"
+#include <stdio.h>
+
+void printNSError(NsError *error) {
+  const char *description = mtErrorLocalizedDescription(error);
+  fprintf(stderr, "Error: %s, Code: %ld\n",
+          description ? description : "(unknown)", (long)mtErrorCode(error));
+}
@@ -0,0 +1,321 @@
+#include "internal.h"
+#include "kernels/kernels.h"
+#include <string.h>
+
+/*
+ * Elementwise expressions are recorded as a DAG and only compiled when
+ * evaluated: the whole expression becomes one straight-line register program
+ * run by the fused_elementwise kernel, so each input is read once and the
+ * result written once no matter how many operators the expression chains.
+ * Shared subexpressions are computed once; registers are recycled as soon as
+ * their last use has been emitted.
+ */
+
+const char *fusedElementwiseShader =
+    "#include <metal_stdlib>\n"
+    "using namespace metal;\n"
+    "struct FusedInstr { uchar op, dst, a, b; float imm; };\n"
+    "kernel void fused_elementwise(const device float* in0 [[buffer(0)]],\n"
+    "                              const device float* in1 [[buffer(1)]],\n"
+    "                              const device float* in2 [[buffer(2)]],\n"
+    "                              const device float* in3 [[buffer(3)]],\n"
+    "                              const device float* in4 [[buffer(4)]],\n"
+    "                              const device float* in5 [[buffer(5)]],\n"
+    "                              const device float* in6 [[buffer(6)]],\n"
+    "                              const device float* in7 [[buffer(7)]],\n"
+    "                              device float* out [[buffer(8)]],\n"
+    "                              constant FusedInstr* prog [[buffer(9)]],\n"
+    "                              constant uint& count [[buffer(10)]],\n"
+    "                              constant uint* ld [[buffer(11)]],\n"
+    "                              uint2 id [[thread_position_in_grid]]) {\n"
+    "   float r[16];\n"
+    "   for (uint pc = 0; pc < count; ++pc) {\n"
+    "       FusedInstr in = prog[pc];\n"
+    "       float a = r[in.a & 15], b = r[in.b & 15], v = 0.0f;\n"
+    "       switch (in.op) {\n"
+    "       case 0:\n"
+    "           switch (in.a) {\n"
+    "           case 0: v = in0[id.y * ld[0] + id.x]; break;\n"
+    "           case 1: v = in1[id.y * ld[1] + id.x]; break;\n"
+    "           case 2: v = in2[id.y * ld[2] + id.x]; break;\n"
+    "           case 3: v = in3[id.y * ld[3] + id.x]; break;\n"
+    "           case 4: v = in4[id.y * ld[4] + id.x]; break;\n"
+    "           case 5: v = in5[id.y * ld[5] + id.x]; break;\n"
+    "           case 6: v = in6[id.y * ld[6] + id.x]; break;\n"
+    "           default: v = in7[id.y * ld[7] + id.x]; break;\n"
+    "           }\n"
+    "           break;\n"
+    "       case 1: v = in.imm; break;\n"
+    "       case 2: v = a + b; break;\n"
+    "       case 3: v = a - b; break;\n"
+    "       case 4: v = a * b; break;\n"
+    "       case 5: v = a / b; break;\n"
+    "       case 6: v = min(a, b); break;\n"
+    "       case 7: v = max(a, b); break;\n"
+    "       case 8: v = -a; break;\n"
+    "       case 9: v = fabs(a); break;\n"
+    "       case 10: v = max(a, 0.0f); break;\n"
+    "       case 11: v = sqrt(a); break;\n"
+    "       case 12: v = exp(a); break;\n"
+    "       case 13: out[id.y * ld[8] + id.x] = a; continue;\n"
+    "       }\n"
+    "       r[in.dst] = v;\n"
+    "   }\n"
+    "}";
+
+typedef enum ExprKind {
+  EXPR_MATRIX,
+  EXPR_CONSTANT,
+  EXPR_UNARY,
+  EXPR_BINARY
+} ExprKind;
+
+struct AlloyExpr {
+  AlloyGraph *graph;
+  ExprKind kind;
+  ExprOp op;
+  Matrix *mat;
+  float value;
+  AlloyExpr *x, *y;
+
+  /* compile state, valid while epoch matches the graph's */
+  unsigned epoch;
+  unsigned uses;
+  int reg;
+};
+
+struct AlloyGraph {
+  AlloyExpr **nodes;
+  size_t count;
+  size_t capacity;
+  unsigned epoch;
+};
+
+typedef struct FusionProgram {
+  FusedInstr code[FUSED_MAX_INSTRS];
+  uint32_t count;
+  Matrix *inputs[FUSED_MAX_INPUTS];
+  size_t inputCount;
+  uint32_t usedRegs; /* bitmask */
+  bool failed;
+} FusionProgram;
+
+static const FusedOpcode opcodes[] = {
+    [EXPR_OP_ADD] = FUSED_ADD,   [EXPR_OP_SUB] = FUSED_SUB,
+    [EXPR_OP_MUL] = FUSED_MUL,   [EXPR_OP_DIV] = FUSED_DIV,
+    [EXPR_OP_MIN] = FUSED_MIN,   [EXPR_OP_MAX] = FUSED_MAX,
+    [EXPR_OP_NEG] = FUSED_NEG,   [EXPR_OP_ABS] = FUSED_ABS,
+    [EXPR_OP_RELU] = FUSED_RELU, [EXPR_OP_SQRT] = FUSED_SQRT,
+    [EXPR_OP_EXP] = FUSED_EXP,
+};
+
+AlloyGraph *createGraph(void) { return calloc(1, sizeof(AlloyGraph)); }
+
+void freeGraph(AlloyGraph *graph) {
+  if (!graph)
+    return;
+  for (size_t i = 0; i < graph->count; ++i)
+    free(graph->nodes[i]);
+  free(graph->nodes);
+  free(graph);
+}
+
+static AlloyExpr *newExpr(AlloyGraph *graph, ExprKind kind) {
+  if (graph->count == graph->capacity) {
+    size_t capacity = graph->capacity ? graph->capacity * 2 : 16;
+    AlloyExpr **nodes = realloc(graph->nodes, capacity * sizeof(*nodes));
+    if (!nodes)
+      return NULL;
+    graph->nodes = nodes;
+    graph->capacity = capacity;
+  }
+
+  AlloyExpr *expr = calloc(1, sizeof(*expr));
+  if (!expr)
+    return NULL;
+  expr->graph = graph;
+  expr->kind = kind;
+  graph->nodes[graph->count++] = expr;
+  return expr;
+}
+
+AlloyExpr *exprMatrix(AlloyGraph *graph, Matrix *mat) {
+  AlloyExpr *expr = mat ? newExpr(graph, EXPR_MATRIX) : NULL;
+  if (expr)
+    expr->mat = mat;
+  return expr;
+}
+
+AlloyExpr *exprConstant(AlloyGraph *graph, float value) {
+  AlloyExpr *expr = newExpr(graph, EXPR_CONSTANT);
+  if (expr)
+    expr->value = value;
+  return expr;
+}
+
+AlloyExpr *exprUnary(AlloyGraph *graph, ExprOp op, AlloyExpr *x) {
+  if (!x || op < EXPR_OP_NEG || op > EXPR_OP_EXP)
+    return NULL;
+  AlloyExpr *expr = newExpr(graph, EXPR_UNARY);
+  if (expr) {
+    expr->op = op;
+    expr->x = x;
+  }
+  return expr;
+}
+
+AlloyExpr *exprBinary(AlloyGraph *graph, ExprOp op, AlloyExpr *x,
+                      AlloyExpr *y) {
+  if (!x || !y || op > EXPR_OP_MAX)
+    return NULL;
+  AlloyExpr *expr = newExpr(graph, EXPR_BINARY);
+  if (expr) {
+    expr->op = op;
+    expr->x = x;
+    expr->y = y;
+  }
+  return expr;
+}
+
+static void countUses(AlloyExpr *expr, unsigned epoch) {
+  if (expr->epoch == epoch) {
+    expr->uses++;
+    return;
+  }
+  expr->epoch = epoch;
+  expr->uses = 1;
+  expr->reg = -1;
+  if (expr->x)
+    countUses(expr->x, epoch);
+  if (expr->y)
+    countUses(expr->y, epoch);
+}
+
+static int allocReg(FusionProgram *prog) {
+  for (int r = 0; r < FUSED_MAX_REGS; ++r) {
+    if (!(prog->usedRegs & (1u << r))) {
+      prog->usedRegs |= 1u << r;
+      return r;
+    }
+  }
+  prog->failed = true;
+  return 0;
+}
+
+/* Called once per use; frees the register after the last one. */
+static void releaseExpr(FusionProgram *prog, AlloyExpr *expr) {
+  if (--expr->uses == 0 && expr->reg >= 0)
+    prog->usedRegs &= ~(1u << expr->reg);
+}
+
+static void emit(FusionProgram *prog, FusedOpcode op, int dst, int a, int b,
+                 float imm) {
+  if (prog->count == FUSED_MAX_INSTRS) {
+    prog->failed = true;
+    return;
+  }
+  FusedInstr in = {op, dst, a, b, imm};
+  prog->code[prog->count++] = in;
+}
+
+static int inputSlot(FusionProgram *prog, Matrix *mat) {
+  for (size_t i = 0; i < prog->inputCount; ++i) {
+    if (prog->inputs[i] == mat)
+      return i;
+  }
+  if (prog->inputCount == FUSED_MAX_INPUTS) {
+    prog->failed = true;
+    return 0;
+  }
+  prog->inputs[prog->inputCount] = mat;
+  return prog->inputCount++;
+}
+
+/* Emits code for expr (once) and returns the register holding it. */
+static int compile(FusionProgram *prog, AlloyExpr *expr) {
+  if (expr->reg >= 0 || prog->failed)
+    return expr->reg >= 0 ? expr->reg : 0;
+
+  int x = expr->x ? compile(prog, expr->x) : 0;
+  int y = expr->y ? compile(prog, expr->y) : 0;
+  /* operands are dead before the result is written, so it may reuse one */
+  if (expr->x)
+    releaseExpr(prog, expr->x);
+  if (expr->y)
+    releaseExpr(prog, expr->y);
+  expr->reg = allocReg(prog);
+
+  switch (expr->kind) {
+  case EXPR_MATRIX:
+    emit(prog, FUSED_LOAD, expr->reg, inputSlot(prog, expr->mat), 0, 0.0f);
+    break;
+  case EXPR_CONSTANT:
+    emit(prog, FUSED_CONST, expr->reg, 0, 0, expr->value);
+    break;
+  case EXPR_UNARY:
+  case EXPR_BINARY:
+    emit(prog, opcodes[expr->op], expr->reg, x, y, 0.0f);
+    break;
+  }
+  return expr->reg;
+}
+
+static bool sameShape(const Matrix *a, const Matrix *b) {
+  return a->rows == b->rows && a->cols == b->cols;
+}
+
+AlloyOperation *submitExpr(AlloyContext *ctx, AlloyExpr *expr,
+                           Matrix *result) {
+  FusionProgram prog = {0};
+
+  CHECK_ERROR(expr, "Invalid expression");
+  countUses(expr, ++expr->graph->epoch);
+  int root = compile(&prog, expr);
+  emit(&prog, FUSED_STORE, 0, root, 0, 0.0f);
+  CHECK_ERROR(!prog.failed, "Expression too large to fuse");
+
+  CHECK_ERROR(matrixType(result) == MtDataTypeFloat,
+              "Fused expressions only support float matrices");
+  for (size_t i = 0; i < prog.inputCount; ++i) {
+    CHECK_ERROR(sameShape(prog.inputs[i], result),
+                "Expression operands do not match the result shape");
+    CHECK_ERROR(matrixType(prog.inputs[i]) == MtDataTypeFloat,
+                "Fused expressions only support float matrices");
+  }
+
+  OperationDesc desc = {
+      .shaderFile = "fusion.metal",
+      .funcName = "fused_elementwise",
+      .operandCount = FUSED_MAX_INPUTS + 1,
+      .bytes = {prog.code, &prog.count},
+      .byteLengths = {prog.count * sizeof(FusedInstr), sizeof(uint32_t)},
+      .bytesCount = 2,
+      .gridSize = {result->cols, result->rows, 1},
+      .threadgroupSize = rowThreadgroupSizeFor,
+      .resultItems = 1,
+  };
+  /* unused input slots alias a real operand so every binding is valid */
+  for (size_t i = 0; i < FUSED_MAX_INPUTS; ++i) {
+    desc.operands[i] = i < prog.inputCount ? prog.inputs[i]
+                       : prog.inputCount ? prog.inputs[0]
+                                         : result;
+    desc.sizes[i] = result->rows * result->cols * sizeof(float);
+  }
+  desc.operands[FUSED_OUTPUT_INDEX] = result;
+  desc.sizes[FUSED_OUTPUT_INDEX] = result->rows * result->cols * sizeof(float);
+
+  return submitOperation(ctx, &desc);
+
+cleanup:
+  return NULL;
+}
+
+int evaluateExpr(AlloyContext *ctx, AlloyExpr *expr, Matrix *result) {
+  AlloyOperation *operation = submitExpr(ctx, expr, result);
+  if (!operation)
+    return -1;
+
+  int status = waitOperation(operation);
+  releaseOperation(operation);
+  return status;
+}
@@ -0,0 +1,126 @@
+#include "internal.h"
+#include <string.h>
+
+#define MT_HOST_BUFFER_ZERO_GRAIN ((size_t)1 << 20)
+
+static void destroyBuffer(MtHostObject *obj) {
+  MtHostBuffer *buf = (MtHostBuffer *)obj;
+  if (buf->ownsContents) {
+    mtHostFree(buf->contents, buf->mapped);
+    atomic_fetch_sub(&buf->device->allocatedSize, buf->length);
+  }
+  mtRelease(buf->device);
+  free(buf);
+}
+
+static MtHostBuffer *newBuffer(MtDevice *device, void *contents,
+                               NsUInteger length, MtResourceOptions opts,
+                               bool ownsContents) {
+  MtHostBuffer *buf = calloc(1, sizeof(*buf));
+  if (!buf)
+    return NULL;
+
+  mtHostObjectInit(&buf->base, MtHostKindBuffer, destroyBuffer);
+  buf->device = mtRetain(device);
+  buf->contents = contents;
+  buf->length = length;
+  buf->options = opts;
+  buf->ownsContents = ownsContents;
+  if (ownsContents)
+    atomic_fetch_add(&buf->device->allocatedSize, length);
+  return buf;
+}
+
+static void zeroRange(void *ctx, NsUInteger begin, NsUInteger end) {
+  memset((char *)ctx + begin, 0, end - begin);
+}
+
+MT_EXPORT
+MtBuffer *mtDeviceNewBufferWithLength(MtDevice *device, NsUInteger length,
+                                      MtResourceOptions opts) {
+  size_t size = length ? length : 1, mapped;
+  void *contents = mtHostAllocate(size, 0, opts, &mapped);
+  if (!contents)
+    return NULL;
+  mtHostInterleaveMemory(contents, size);
+  // a mapping is zero already; its pages are placed as they are first used
+  if (!mapped)
+    mtHostPoolFor(((MtHostDevice *)device)->pool, size,
+                  MT_HOST_BUFFER_ZERO_GRAIN, zeroRange, contents,
+                  "clear buffer");
+
+  MtHostBuffer *buf = newBuffer(device, contents, length, opts, true);
+  if (!buf) {
+    mtHostFree(contents, mapped);
+    return NULL;
+  }
+  buf->mapped = mapped;
+  return buf;
+}
+
+MT_EXPORT
+MtBuffer *mtDeviceNewBufferWithBytes(MtDevice *device, const void *ptr,
+                                     NsUInteger length,
+                                     MtResourceOptions opts) {
+  MtHostBuffer *buf = mtDeviceNewBufferWithLength(device, length, opts);
+  if (buf && ptr && length)
+    memcpy(buf->contents, ptr, length);
+  return buf;
+}
+
+MT_EXPORT
+MtBuffer *mtDeviceNewBufferWithBytesNoCopy(MtDevice *device, void *ptr,
+                                           NsUInteger length,
+                                           MtResourceOptions opts) {
+  if (!ptr)
+    return NULL;
+  return newBuffer(device, ptr, length, opts, false);
+}
+
+MT_EXPORT
+void *mtBufferContents(MtBuffer *buf) {
+  return ((MtHostBuffer *)buf)->contents;
+}
+
+MT_EXPORT
+NsUInteger mtBufferLength(MtBuffer *buf) {
+  return ((MtHostBuffer *)buf)->length;
+}
+
+MT_EXPORT
+void mtBufferDidModifyRange(MtBuffer *buf, NsRange ran) {
+  /* Host memory is always coherent. */
+  (void)buf;
+  (void)ran;
+}
+
+MT_EXPORT
+MtDevice *mtResourceDevice(MtResource *res) {
+  return ((MtHostBuffer *)res)->device;
+}
+
+MT_EXPORT
+const char *mtResourceLabel(MtResource *res) {
+  (void)res;
+  return NULL;
+}
+
+MT_EXPORT
+MtCPUCacheMode mtResourceCPUCacheMode(MtResource *res) {
+  return (MtCPUCacheMode)(((MtHostBuffer *)res)->options & 0xf);
+}
+
+MT_EXPORT
+MtStorageMode mtResourceStorageMode(MtResource *res) {
+  return (MtStorageMode)((((MtHostBuffer *)res)->options >> 4) & 0xf);
+}
+
+MT_EXPORT
+MtHazardTrackingMode mtResourceHazardTrackingMode(MtResource *res) {
+  return (MtHazardTrackingMode)((((MtHostBuffer *)res)->options >> 8) & 0xf);
+}
+
+MT_EXPORT
+MtResourceOptions mtResourceOptions(MtResource *res) {
+  return ((MtHostBuffer *)res)->options;
+}
@@ -0,0 +1,334 @@
+#include "internal.h"
+#include <stdio.h>
+#include <string.h>
+
+static void releaseResources(MtHostCommandBuffer *cmdb) {
+  for (size_t i = 0; i < cmdb->retainedCount; ++i)
+    mtRelease(cmdb->retained[i]);
+  cmdb->retainedCount = 0;
+}
+
+static void destroyCommandBuffer(MtHostObject *obj) {
+  MtHostCommandBuffer *cmdb = (MtHostCommandBuffer *)obj;
+
+  releaseResources(cmdb);
+  for (size_t i = 0; i < cmdb->arenaCount; ++i)
+    free(cmdb->arena[i]);
+  free(cmdb->arena);
+  free(cmdb->retained);
+  free(cmdb->dispatches);
+  free(cmdb->scheduled);
+  free(cmdb->completed);
+  free(cmdb->markers);
+  if (cmdb->error)
+    mtRelease(cmdb->error);
+  pthread_cond_destroy(&cmdb->cond);
+  pthread_mutex_destroy(&cmdb->lock);
+  mtRelease(cmdb->queue);
+  free(cmdb);
+}
+
+static MtCommandBuffer *newCommandBuffer(MtCommandQueue *cmdq,
+                                         bool retainReferences) {
+  MtHostCommandQueue *queue = cmdq;
+  MtHostCommandBuffer *cmdb = calloc(1, sizeof(*cmdb));
+  if (!cmdb)
+    return NULL;
+
+  mtHostObjectInit(&cmdb->base, MtHostKindCommandBuffer,
+                   destroyCommandBuffer);
+  cmdb->queue = mtRetain(queue);
+  cmdb->device = queue->device;
+  cmdb->retainReferences = retainReferences;
+  atomic_init(&cmdb->status, MtCommandBufferStatusNotEnqueued);
+  pthread_mutex_init(&cmdb->lock, NULL);
+  pthread_cond_init(&cmdb->cond, NULL);
+  return cmdb;
+}
+
+static bool grow(void **items, size_t *capacity, size_t count, size_t size) {
+  if (count < *capacity)
+    return true;
+  size_t newCapacity = *capacity ? *capacity * 2 : 8;
+  void *grown = realloc(*items, newCapacity * size);
+  if (!grown)
+    return false;
+  *items = grown;
+  *capacity = newCapacity;
+  return true;
+}
+
+void mtHostCommandBufferRetain(MtHostCommandBuffer *cmdb, MtHostObject *obj) {
+  if (!obj || !cmdb->retainReferences)
+    return;
+  if (!grow((void **)&cmdb->retained, &cmdb->retainedCapacity,
+            cmdb->retainedCount, sizeof(*cmdb->retained)))
+    return;
+  cmdb->retained[cmdb->retainedCount++] = mtRetain(obj);
+}
+
+void *mtHostCommandBufferCopyBytes(MtHostCommandBuffer *cmdb, const void *ptr,
+                                   size_t length) {
+  char **arena = realloc(cmdb->arena, (cmdb->arenaCount + 1) * sizeof(char *));
+  if (!arena)
+    return NULL;
+  cmdb->arena = arena;
+
+  /* 16-byte aligned so kernels can read scalars and vectors directly */
+  void *copy = NULL;
+  if (posix_memalign(&copy, 16, length ? length : 1) != 0)
+    return NULL;
+  memcpy(copy, ptr, length);
+  cmdb->arena[cmdb->arenaCount++] = copy;
+  return copy;
+}
+
+bool mtHostCommandBufferAppendDispatch(MtHostCommandBuffer *cmdb,
+                                       const MtHostDispatch *dispatch) {
+  size_t capacity = cmdb->dispatchCapacity;
+  if (!grow((void **)&cmdb->dispatches, &capacity, cmdb->dispatchCount,
+            sizeof(*cmdb->dispatches)))
+    return false;
+  cmdb->dispatchCapacity = capacity;
+  cmdb->dispatches[cmdb->dispatchCount++] = *dispatch;
+  mtHostCommandBufferRetain(cmdb, &dispatch->pipeline->base);
+  return true;
+}
+
+void mtHostCommandBufferMark(MtHostCommandBuffer *cmdb, char phase,
+                             const char *name) {
+  if (!mtHostTracing())
+    return;
+  mtHostTraceEvent(phase, MtHostTraceEncode, name, mtHostNow(), 0, 0);
+
+  size_t capacity = cmdb->markerCapacity;
+  if (!grow((void **)&cmdb->markers, &capacity, cmdb->markerCount,
+            sizeof(*cmdb->markers)))
+    return;
+  cmdb->markerCapacity = capacity;
+  MtHostMarker *marker = &cmdb->markers[cmdb->markerCount++];
+  marker->dispatch = cmdb->dispatchCount;
+  marker->phase = phase;
+  snprintf(marker->name, sizeof(marker->name), "%s", name ? name : "");
+}
+
+// Traces the markers kept for dispatch, from *next on.
+static void traceMarkers(const MtHostCommandBuffer *cmdb, size_t dispatch,
+                         size_t *next) {
+  for (; *next < cmdb->markerCount &&
+         cmdb->markers[*next].dispatch == dispatch;
+       ++*next)
+    mtHostTraceEvent(cmdb->markers[*next].phase, MtHostTraceExecute,
+                     cmdb->markers[*next].name, mtHostNow(), 0,
+                     cmdb->traceId);
+}
+
+static void runHandlers(MtHostCommandBuffer *cmdb, MtHostHandler *handlers,
+                        size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    if (handlers[i].fn)
+      handlers[i].fn(cmdb);
+    else if (handlers[i].onComplete)
+      handlers[i].onComplete(handlers[i].sender, cmdb);
+  }
+}
+
+void mtHostCommandBufferExecute(MtHostCommandBuffer *cmdb) {
+  atomic_store(&cmdb->status, MtCommandBufferStatusScheduled);
+  runHandlers(cmdb, cmdb->scheduled, cmdb->scheduledCount);
+  pthread_mutex_lock(&cmdb->lock);
+  pthread_cond_broadcast(&cmdb->cond);
+  pthread_mutex_unlock(&cmdb->lock);
+
+  const bool tracing = cmdb->traceId && mtHostTracing();
+  size_t marker = 0;
+  cmdb->gpuStart = cmdb->kernelStart = mtHostNow();
+  if (tracing)
+    mtHostTraceEvent('e', MtHostTraceQueue, "queued", cmdb->kernelStart, 0,
+                     cmdb->traceId);
+  // as on a GPU, a failed dispatch ends the command buffer
+  bool ok = true;
+  for (size_t i = 0; ok && i < cmdb->dispatchCount; ++i) {
+    if (!tracing) {
+      ok = mtHostExecuteDispatch(cmdb->device, &cmdb->dispatches[i],
+                                 &cmdb->error);
+      continue;
+    }
+    traceMarkers(cmdb, i, &marker);
+    const double start = mtHostNow();
+    ok = mtHostExecuteDispatch(cmdb->device, &cmdb->dispatches[i],
+                               &cmdb->error);
+    const MtHostComputePipeline *pipeline = cmdb->dispatches[i].pipeline;
+    mtHostTraceEvent('X', MtHostTraceExecute,
+                     pipeline ? pipeline->name : "dispatch", start,
+                     mtHostNow() - start, cmdb->traceId);
+  }
+  if (tracing)
+    traceMarkers(cmdb, cmdb->dispatchCount, &marker);
+  cmdb->gpuEnd = cmdb->kernelEnd = mtHostNow();
+
+  atomic_store(&cmdb->status, ok ? MtCommandBufferStatusCompleted
+                                 : MtCommandBufferStatusError);
+  runHandlers(cmdb, cmdb->completed, cmdb->completedCount);
+  if (tracing)
+    mtHostTraceEvent('X', MtHostTraceExecute, "command buffer",
+                     cmdb->kernelStart, mtHostNow() - cmdb->kernelStart,
+                     cmdb->traceId);
+  releaseResources(cmdb);
+
+  pthread_mutex_lock(&cmdb->lock);
+  pthread_cond_broadcast(&cmdb->cond);
+  pthread_mutex_unlock(&cmdb->lock);
+}
+
+MT_EXPORT
+MtCommandBuffer *mtNewCommandBuffer(MtCommandQueue *cmdq) {
+  return newCommandBuffer(cmdq, true);
+}
+
+MT_EXPORT
+MtCommandBuffer *mtNewCommandBufferWithUnretainedReferences(
+    MtCommandQueue *cmdq) {
+  return newCommandBuffer(cmdq, false);
+}
+
+static void addHandler(MtHostHandler **handlers, size_t *count,
+                       MtHostHandler handler) {
+  MtHostHandler *grown = realloc(*handlers, (*count + 1) * sizeof(*grown));
+  if (!grown)
+    return;
+  grown[(*count)++] = handler;
+  *handlers = grown;
+}
+
+MT_EXPORT
+void mtCommandBufferOnComplete(MtCommandQueue *__restrict cmdb,
+                               void *__restrict sender,
+                               MtCommandBufferOnCompleteFn oncomplete) {
+  MtHostCommandBuffer *cb = cmdb;
+  MtHostHandler handler = {.onComplete = oncomplete, .sender = sender};
+  addHandler(&cb->completed, &cb->completedCount, handler);
+}
+
+MT_EXPORT
+void mtCommandBufferAddScheduledHandler(MtCommandBuffer *cmdb,
+                                        MtCommandBufferHandlerFun handler) {
+  MtHostCommandBuffer *cb = cmdb;
+  MtHostHandler h = {.fn = handler};
+  addHandler(&cb->scheduled, &cb->scheduledCount, h);
+}
+
+MT_EXPORT
+void mtCommandBufferAddCompletedHandler(MtCommandBuffer *cmdb,
+                                        MtCommandBufferHandlerFun handler) {
+  MtHostCommandBuffer *cb = cmdb;
+  MtHostHandler h = {.fn = handler};
+  addHandler(&cb->completed, &cb->completedCount, h);
+}
+
+MT_EXPORT
+void mtCommandBufferEqueue(MtCommandBuffer *cmdb) {
+  MtHostCommandBuffer *cb = cmdb;
+  int expected = MtCommandBufferStatusNotEnqueued;
+  atomic_compare_exchange_strong(&cb->status, &expected,
+                                 MtCommandBufferStatusEnqueued);
+}
+
+MT_EXPORT
+void mtCommandBufferCommit(MtCommandBuffer *cmdb) {
+  MtHostCommandBuffer *cb = cmdb;
+  int status = atomic_load(&cb->status);
+  if (status != MtCommandBufferStatusNotEnqueued &&
+      status != MtCommandBufferStatusEnqueued)
+    return;
+
+  atomic_store(&cb->status, MtCommandBufferStatusCommitted);
+  if (mtHostTracing()) {
+    const double now = mtHostNow();
+    cb->traceId = mtHostTraceNextId();
+    mtHostTraceEvent('i', MtHostTraceQueue, "commit", now, 0, cb->traceId);
+    mtHostTraceEvent('b', MtHostTraceQueue, "queued", now, 0, cb->traceId);
+  }
+  mtHostQueueSubmit(cb->queue, cb);
+}
+
+static void waitForStatus(MtHostCommandBuffer *cb, int status) {
+  if (atomic_load(&cb->status) < MtCommandBufferStatusCommitted)
+    return;
+  pthread_mutex_lock(&cb->lock);
+  while (atomic_load(&cb->status) < status)
+    pthread_cond_wait(&cb->cond, &cb->lock);
+  pthread_mutex_unlock(&cb->lock);
+}
+
+MT_EXPORT
+void mtCommandBufferWaitUntilScheduled(MtCommandBuffer *cmdb) {
+  waitForStatus(cmdb, MtCommandBufferStatusScheduled);
+}
+
+MT_EXPORT
+void mtCommandBufferWaitUntilCompleted(MtCommandBuffer *cmdb) {
+  waitForStatus(cmdb, MtCommandBufferStatusCompleted);
+}
+
+MT_EXPORT
+MtCommandBufferStatus mtCommandBufferStatus(MtCommandBuffer *cmdb) {
+  return (MtCommandBufferStatus)atomic_load(
+      &((MtHostCommandBuffer *)cmdb)->status);
+}
+
+MT_EXPORT
+NsError *mtCommandBufferError(MtCommandBuffer *cmdb) {
+  return ((MtHostCommandBuffer *)cmdb)->error;
+}
+
+MT_EXPORT
+CfTimeInterval mtCommandBufferKernelStartTime(MtCommandBuffer *cmdb) {
+  return ((MtHostCommandBuffer *)cmdb)->kernelStart;
+}
+
+MT_EXPORT
+CfTimeInterval mtCommandBufferKernelEndTime(MtCommandBuffer *cmdb) {
+  return ((MtHostCommandBuffer *)cmdb)->kernelEnd;
+}
+
+MT_EXPORT
+CfTimeInterval mtCommandBufferGPUStartTime(MtCommandBuffer *cmdb) {
+  return ((MtHostCommandBuffer *)cmdb)->gpuStart;
+}
+
+MT_EXPORT
+CfTimeInterval mtCommandBufferGPUEndTime(MtCommandBuffer *cmdb) {
+  return ((MtHostCommandBuffer *)cmdb)->gpuEnd;
+}
+
+MT_EXPORT
+bool mtCommandBufferRetainedReferences(MtCommandBuffer *cmdb) {
+  return ((MtHostCommandBuffer *)cmdb)->retainReferences;
+}
+
+MT_EXPORT
+MtDevice *mtCommandBufferDevice(MtCommandBuffer *cmdb) {
+  return ((MtHostCommandBuffer *)cmdb)->device;
+}
+
+MT_EXPORT
+MtCommandQueue *mtCommandBufferCommandQueue(MtCommandBuffer *cmdb) {
+  return ((MtHostCommandBuffer *)cmdb)->queue;
+}
+
+MT_EXPORT
+const char *mtCommandBufferLabel(MtCommandBuffer *cmdb) {
+  (void)cmdb;
+  return NULL;
+}
+
+MT_EXPORT
+void mtCommandBufferPushDebugGroup(MtCommandBuffer *cmdb, char *str) {
+  mtHostCommandBufferMark(cmdb, 'B', str);
+}
+
+MT_EXPORT
+void mtCommandBufferPopDebugGroup(MtCommandBuffer *cmdb) {
+  mtHostCommandBufferMark(cmdb, 'E', NULL);
+}
@@ -0,0 +1,421 @@
+#include "internal.h"
+#include <stdatomic.h>
+#include <string.h>
+
+/* Threadgroup memory and per-thread state are carved out of one scratch
+ * block per worker, at these offsets; offsets[i] is -1 for an unset index. */
+typedef struct MtHostDispatchRun {
+  const MtHostDispatch *dispatch;
+  MtHostKernelArgs args;
+  MtSize threadgroupsPerGrid;
+  size_t memoryOffsets[MT_HOST_MAX_THREADGROUP_MEMORY_BINDINGS];
+  size_t staticOffset, stateOffset, scratchSize;
+  _Atomic(const char *) failure; /* the first mtHostKernelFail reason */
+  atomic_long failureCode;
+} MtHostDispatchRun;
+
+#define MT_HOST_NO_MEMORY ((size_t)-1)
+
+/* Grows only, so after the first threadgroups a worker's scratch is reused
+ * as is and stays cache-resident. */
+typedef struct MtHostScratch {
+  size_t size;
+  void *data;
+} MtHostScratch;
+
+static pthread_key_t scratchKey;
+static pthread_once_t scratchOnce = PTHREAD_ONCE_INIT;
+
+static void freeScratch(void *ptr) {
+  MtHostScratch *scratch = ptr;
+  free(scratch->data);
+  free(scratch);
+}
+
+static void createScratchKey(void) {
+  pthread_key_create(&scratchKey, freeScratch);
+}
+
+static void *threadgroupScratch(size_t size) {
+  pthread_once(&scratchOnce, createScratchKey);
+  MtHostScratch *scratch = pthread_getspecific(scratchKey);
+  if (!scratch) {
+    if (!(scratch = calloc(1, sizeof(*scratch))))
+      return NULL;
+    pthread_setspecific(scratchKey, scratch);
+  }
+  if (scratch->size < size) {
+    void *grown = NULL;
+    if (posix_memalign(&grown, 64, size) != 0)
+      return NULL;
+    free(scratch->data);
+    scratch->data = grown;
+    scratch->size = size;
+  }
+  return scratch->data;
+}
+
+static NsUInteger ceilDiv(NsUInteger a, NsUInteger b) {
+  return (a + b - 1) / b;
+}
+
+static NsUInteger clip(NsUInteger origin, NsUInteger size, NsUInteger limit) {
+  return origin + size > limit ? limit - origin : size;
+}
+
+static size_t align16(size_t x) { return (x + 15) & ~(size_t)15; }
+
+static void failRun(MtHostDispatchRun *run, NsInteger code,
+                    const char *reason) {
+  const char *none = NULL;
+  if (atomic_compare_exchange_strong(&run->failure, &none, reason))
+    atomic_store(&run->failureCode, code);
+}
+
+MT_EXPORT
+void mtHostKernelFail(const MtHostKernelArgs *args, NsInteger code,
+                      const char *reason) {
+  // kernels are only ever handed the args of a run
+  failRun((MtHostDispatchRun *)((char *)args -
+                                offsetof(MtHostDispatchRun, args)),
+          code, reason);
+}
+
+// Runs a per-thread kernel over tg: each phase for every SIMD-group, then
+// the phase they chose next. A SIMD-group is up to threadExecutionWidth
+// consecutive threads of one row, with the state of that many threads.
+static void runPhases(const MtHostDispatchRun *run, const MtHostThreadgroup *tg,
+                      char *state) {
+  const MtHostKernelDesc *kernel = &run->dispatch->pipeline->kernel;
+  const MtSize size = tg->threadsPerThreadgroup;
+  const NsUInteger lanes = kernel->threadExecutionWidth;
+  const NsUInteger rowGroups =
+      ceilDiv(run->dispatch->threadsPerThreadgroup.width, lanes);
+  const size_t groupStateLength = lanes * kernel->threadStateLength;
+  MtHostThread thread;
+  NsUInteger phase = 0;
+
+  while (phase < kernel->phaseCount) {
+    const MtHostThreadFn fn = kernel->phases[phase];
+    NsUInteger next = MT_HOST_PHASE_END;
+    NsUInteger row = 0;
+    for (NsUInteger z = 0; z < size.depth; ++z) {
+      for (NsUInteger y = 0; y < size.height; ++y, ++row) {
+        NsUInteger group = row * rowGroups;
+        for (NsUInteger x = 0; x < size.width; x += lanes, ++group) {
+          thread.threadPositionInThreadgroup = (MtOrigin){x, y, z};
+          thread.threadPositionInGrid =
+              (MtOrigin){tg->threadOrigin.x + x, tg->threadOrigin.y + y,
+                         tg->threadOrigin.z + z};
+          thread.threadIndexInThreadgroup = row * size.width + x;
+          thread.activeLanes = lanes < size.width - x ? lanes : size.width - x;
+          thread.state = state ? state + group * groupStateLength : NULL;
+          next = fn(&run->args, tg, &thread);
+        }
+      }
+    }
+    phase = next;
+  }
+}
+
+static void runThreadgroup(void *ctx, size_t index) {
+  MtHostDispatchRun *run = ctx;
+  const MtSize groups = run->threadgroupsPerGrid;
+  const MtSize size = run->dispatch->threadsPerThreadgroup;
+  const MtSize grid = run->args.threadsPerGrid;
+  MtHostThreadgroup tg;
+
+  if (atomic_load_explicit(&run->failure, memory_order_relaxed))
+    return;
+  tg.threadgroupPositionInGrid.width = index % groups.width;
+  tg.threadgroupPositionInGrid.height = (index / groups.width) % groups.height;
+  tg.threadgroupPositionInGrid.depth = index / (groups.width * groups.height);
+
+  tg.threadOrigin.x = tg.threadgroupPositionInGrid.width * size.width;
+  tg.threadOrigin.y = tg.threadgroupPositionInGrid.height * size.height;
+  tg.threadOrigin.z = tg.threadgroupPositionInGrid.depth * size.depth;
+
+  tg.threadsPerThreadgroup.width = clip(tg.threadOrigin.x, size.width,
+                                        grid.width);
+  tg.threadsPerThreadgroup.height = clip(tg.threadOrigin.y, size.height,
+                                         grid.height);
+  tg.threadsPerThreadgroup.depth = clip(tg.threadOrigin.z, size.depth,
+                                        grid.depth);
+
+  char *scratch = NULL;
+  if (run->scratchSize && !(scratch = threadgroupScratch(run->scratchSize))) {
+    failRun(run, MtCommandBufferErrorOutOfMemory,
+            "out of threadgroup scratch memory");
+    return;
+  }
+  for (int i = 0; i < MT_HOST_MAX_THREADGROUP_MEMORY_BINDINGS; ++i)
+    tg.threadgroupMemory[i] = run->memoryOffsets[i] == MT_HOST_NO_MEMORY
+                                  ? NULL
+                                  : scratch + run->memoryOffsets[i];
+  tg.staticThreadgroupMemory = scratch ? scratch + run->staticOffset : NULL;
+
+  const MtHostKernelDesc *kernel = &run->dispatch->pipeline->kernel;
+  if (kernel->fn)
+    kernel->fn(&run->args, &tg);
+  else
+    runPhases(run, &tg, scratch ? scratch + run->stateOffset : NULL);
+}
+
+bool mtHostExecuteDispatch(MtHostDevice *device,
+                           const MtHostDispatch *dispatch, NsError **error) {
+  const MtSize grid = dispatch->threadsPerGrid;
+  const MtSize size = dispatch->threadsPerThreadgroup;
+  if (!dispatch->pipeline || !grid.width || !grid.height || !grid.depth ||
+      !size.width || !size.height || !size.depth)
+    return true;
+
+  MtHostDispatchRun run = {.dispatch = dispatch};
+  for (int i = 0; i < MT_HOST_MAX_BUFFER_BINDINGS; ++i) {
+    const MtHostBinding *b = &dispatch->bindings[i];
+    if (b->buffer) {
+      run.args.buffers[i] = (char *)b->buffer->contents + b->offset;
+      run.args.lengths[i] = b->buffer->length - b->offset;
+    } else if (b->bytes) {
+      run.args.buffers[i] = b->bytes;
+      run.args.lengths[i] = b->length;
+    }
+  }
+
+  run.threadgroupsPerGrid.width = ceilDiv(grid.width, size.width);
+  run.threadgroupsPerGrid.height = ceilDiv(grid.height, size.height);
+  run.threadgroupsPerGrid.depth = ceilDiv(grid.depth, size.depth);
+  run.args.threadsPerGrid = grid;
+  run.args.threadgroupsPerGrid = run.threadgroupsPerGrid;
+
+  const MtHostKernelDesc *kernel = &dispatch->pipeline->kernel;
+  for (int i = 0; i < MT_HOST_MAX_THREADGROUP_MEMORY_BINDINGS; ++i) {
+    const NsUInteger length = dispatch->threadgroupMemoryLengths[i];
+    run.memoryOffsets[i] = length ? run.scratchSize : MT_HOST_NO_MEMORY;
+    run.scratchSize += align16(length);
+  }
+  run.staticOffset = run.scratchSize;
+  run.scratchSize += align16(kernel->threadgroupMemoryLength);
+  run.stateOffset = run.scratchSize;
+  if (!kernel->fn)
+    run.scratchSize +=
+        align16(kernel->threadStateLength * kernel->threadExecutionWidth *
+                ceilDiv(size.width, kernel->threadExecutionWidth) *
+                size.height * size.depth);
+
+  size_t count = run.threadgroupsPerGrid.width *
+                 run.threadgroupsPerGrid.height *
+                 run.threadgroupsPerGrid.depth;
+  mtHostPoolRun(device->pool, count, runThreadgroup, &run,
+                dispatch->pipeline->name);
+
+  const char *failure = atomic_load(&run.failure);
+  if (!failure)
+    return true;
+  *error = mtHostErrorCreate("MTLCommandBufferErrorDomain",
+                             atomic_load(&run.failureCode), "%s: %s",
+                             dispatch->pipeline->name, failure);
+  return false;
+}
+
+static void destroyEncoder(MtHostObject *obj) {
+  MtHostComputeEncoder *enc = (MtHostComputeEncoder *)obj;
+  mtRelease(enc->cmdb);
+  free(enc);
+}
+
+MT_EXPORT
+MtComputeCommandEncoder *
+mtNewComputeCommandEncoderWithDispatchType(MtCommandBuffer *cmdb,
+                                           MtDispatchType dtype) {
+  MtHostComputeEncoder *enc = calloc(1, sizeof(*enc));
+  if (!enc)
+    return NULL;
+
+  mtHostObjectInit(&enc->base, MtHostKindComputeEncoder, destroyEncoder);
+  enc->cmdb = mtRetain(cmdb);
+  enc->dispatchType = dtype;
+  return enc;
+}
+
+MT_EXPORT
+MtComputeCommandEncoder *mtNewComputeCommandEncoder(MtCommandBuffer *cmdb) {
+  return mtNewComputeCommandEncoderWithDispatchType(cmdb,
+                                                    MtDispatchTypeSerial);
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderEndEncoding(MtComputeCommandEncoder *cce) {
+  ((MtHostComputeEncoder *)cce)->ended = true;
+}
+
+MT_EXPORT
+void mtCommandEncoderEndEncoding(MtCommandEncoder *ce) {
+  mtComputeCommandEncoderEndEncoding(ce);
+}
+
+MT_EXPORT
+MtDevice *mtCommandEncoderDevice(MtCommandEncoder *ce) {
+  return ((MtHostComputeEncoder *)ce)->cmdb->device;
+}
+
+MT_EXPORT
+const char *mtCommandEncoderLabel(MtCommandEncoder *ce) {
+  (void)ce;
+  return NULL;
+}
+
+MT_EXPORT
+void mtCommandEncoderInsertDebugSignpost(MtCommandEncoder *ce, char *string) {
+  mtHostCommandBufferMark(((MtHostComputeEncoder *)ce)->cmdb, 'i', string);
+}
+
+MT_EXPORT
+void mtCommandEncoderPushDebugGroup(MtCommandEncoder *ce, char *string) {
+  mtHostCommandBufferMark(((MtHostComputeEncoder *)ce)->cmdb, 'B', string);
+}
+
+MT_EXPORT
+void mtCommandEncoderPopDebugGroup(MtCommandEncoder *ce) {
+  mtHostCommandBufferMark(((MtHostComputeEncoder *)ce)->cmdb, 'E', NULL);
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderSetComputePipelineState(
+    MtComputeCommandEncoder *cce, MtComputePipelineState *state) {
+  ((MtHostComputeEncoder *)cce)->state.pipeline = state;
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderSetBufferOffsetAtIndex(MtComputeCommandEncoder *cce,
+                                                   MtBuffer *buf,
+                                                   NsUInteger offset,
+                                                   NsUInteger indx) {
+  MtHostComputeEncoder *enc = cce;
+  if (indx >= MT_HOST_MAX_BUFFER_BINDINGS)
+    return;
+
+  MtHostBinding binding = {.buffer = buf, .offset = offset};
+  enc->state.bindings[indx] = binding;
+  mtHostCommandBufferRetain(enc->cmdb, buf);
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderSetBuffersOffsetsWithRange(
+    MtComputeCommandEncoder *cce, MtBuffer **bufs, const NsUInteger *offsets,
+    NsRange range) {
+  for (NsUInteger i = 0; i < range.length; ++i)
+    mtComputeCommandEncoderSetBufferOffsetAtIndex(cce, bufs[i], offsets[i],
+                                                  range.location + i);
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderBufferSetOffsetAtIndex(MtComputeCommandEncoder *cce,
+                                                   NsUInteger offset,
+                                                   NsUInteger indx) {
+  MtHostComputeEncoder *enc = cce;
+  if (indx < MT_HOST_MAX_BUFFER_BINDINGS)
+    enc->state.bindings[indx].offset = offset;
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderSetBytesLengthAtIndex(MtComputeCommandEncoder *cce,
+                                                  const void *ptr,
+                                                  NsUInteger length,
+                                                  NsUInteger indx) {
+  MtHostComputeEncoder *enc = cce;
+  if (indx >= MT_HOST_MAX_BUFFER_BINDINGS)
+    return;
+
+  MtHostBinding binding = {
+      .bytes = mtHostCommandBufferCopyBytes(enc->cmdb, ptr, length),
+      .length = length};
+  enc->state.bindings[indx] = binding;
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderSetThreadgroupMemoryLengthAtIndex(
+    MtComputeCommandEncoder *cce, NsUInteger length, NsUInteger indx) {
+  MtHostComputeEncoder *enc = cce;
+  if (indx < MT_HOST_MAX_THREADGROUP_MEMORY_BINDINGS)
+    enc->state.threadgroupMemoryLengths[indx] = length;
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderDispatchThreadgroups_threadsPerThreadgroup(
+    MtComputeCommandEncoder *cce, MtSize threadgroupsPerGrid,
+    MtSize threadsPerThreadgroup) {
+  MtHostComputeEncoder *enc = cce;
+  MtHostDispatch dispatch = enc->state;
+  dispatch.threadsPerThreadgroup = threadsPerThreadgroup;
+  dispatch.threadsPerGrid.width =
+      threadgroupsPerGrid.width * threadsPerThreadgroup.width;
+  dispatch.threadsPerGrid.height =
+      threadgroupsPerGrid.height * threadsPerThreadgroup.height;
+  dispatch.threadsPerGrid.depth =
+      threadgroupsPerGrid.depth * threadsPerThreadgroup.depth;
+  mtHostCommandBufferAppendDispatch(enc->cmdb, &dispatch);
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderDispatchThread_threadsPerThreadgroup(
+    MtComputeCommandEncoder *cce, MtSize threadsPerGrid,
+    MtSize threadsPerThreadgroup) {
+  MtHostComputeEncoder *enc = cce;
+  MtHostDispatch dispatch = enc->state;
+  dispatch.threadsPerGrid = threadsPerGrid;
+  dispatch.threadsPerThreadgroup = threadsPerThreadgroup;
+  mtHostCommandBufferAppendDispatch(enc->cmdb, &dispatch);
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderDispatchThreadgroupsWithIndirectBuffer_IndirectBufferOffset_threadsPerThreadgroup(
+    MtComputeCommandEncoder *cce, MtBuffer *indirectBuffer,
+    NsUInteger indirectBufferOffset, MtSize threadsPerThreadgroup) {
+  /* Host memory is coherent, so the arguments can be read at encode time. */
+  const MtDispatchThreadgroupsIndirectArguments *args =
+      (const void *)((char *)mtBufferContents(indirectBuffer) +
+                     indirectBufferOffset);
+  MtSize groups = {args->threadgroupsPerGrid[0], args->threadgroupsPerGrid[1],
+                   args->threadgroupsPerGrid[2]};
+  mtComputeCommandEncoderDispatchThreadgroups_threadsPerThreadgroup(
+      cce, groups, threadsPerThreadgroup);
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderUseResourceUsage(MtComputeCommandEncoder *cce,
+                                             MtResource *res,
+                                             MtResourceUsage usage) {
+  (void)usage;
+  mtHostCommandBufferRetain(((MtHostComputeEncoder *)cce)->cmdb, res);
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderUseResourcesCountUsage(MtComputeCommandEncoder *cce,
+                                                   MtResource **res,
+                                                   NsUInteger count,
+                                                   MtResourceUsage usage) {
+  for (NsUInteger i = 0; i < count; ++i)
+    mtComputeCommandEncoderUseResourceUsage(cce, res[i], usage);
+}
+
+MT_EXPORT
+MtDispatchType
+mtComputeCommandEncoderDispatchType(MtComputeCommandEncoder *cce) {
+  return ((MtHostComputeEncoder *)cce)->dispatchType;
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderMemoryBarrierWithScope(MtComputeCommandEncoder *cce,
+                                                   MtBarrierScope scope) {
+  /* Dispatches execute in encoding order; nothing to do. */
+  (void)cce;
+  (void)scope;
+}
+
+MT_EXPORT
+void mtComputeCommandEncoderMemoryBarrierWithResource(
+    MtComputeCommandEncoder *cce, MtResource **resources, NsUInteger count) {
+  (void)cce;
+  (void)resources;
+  (void)count;
+}
@@ -0,0 +1,111 @@
+#include "internal.h"
+
+/*
+ * Each queue owns a scheduler thread that executes committed command buffers
+ * in commit order; dispatches inside a command buffer fan out to the device
+ * worker pool.
+ */
+
+static void freeQueue(MtHostCommandQueue *queue) {
+  pthread_cond_destroy(&queue->cond);
+  pthread_mutex_destroy(&queue->lock);
+  mtRelease(queue->device);
+  free(queue);
+}
+
+static void *schedulerMain(void *arg) {
+  MtHostCommandQueue *queue = arg;
+  mtHostTraceThreadName("scheduler");
+
+  pthread_mutex_lock(&queue->lock);
+  for (;;) {
+    while (!queue->head && !queue->stopping)
+      pthread_cond_wait(&queue->cond, &queue->lock);
+    if (!queue->head)
+      break;
+
+    MtHostCommandBuffer *cmdb = queue->head;
+    queue->head = cmdb->next;
+    if (!queue->head)
+      queue->tail = NULL;
+    pthread_mutex_unlock(&queue->lock);
+
+    mtHostCommandBufferExecute(cmdb);
+    mtRelease(cmdb); /* reference taken at commit */
+
+    if (queue->orphaned) {
+      /* The release above dropped the last queue reference. */
+      pthread_detach(pthread_self());
+      freeQueue(queue);
+      return NULL;
+    }
+    pthread_mutex_lock(&queue->lock);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return NULL;
+}
+
+static void destroyQueue(MtHostObject *obj) {
+  MtHostCommandQueue *queue = (MtHostCommandQueue *)obj;
+
+  /* The last reference may be dropped by a command buffer released on the
+   * scheduler thread itself; that thread frees the queue on its way out. */
+  if (queue->threadStarted && pthread_equal(queue->thread, pthread_self())) {
+    queue->orphaned = true;
+    return;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  queue->stopping = true;
+  pthread_cond_signal(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+
+  if (queue->threadStarted)
+    pthread_join(queue->thread, NULL);
+  freeQueue(queue);
+}
+
+void mtHostQueueSubmit(MtHostCommandQueue *queue, MtHostCommandBuffer *cmdb) {
+  mtRetain(cmdb);
+
+  pthread_mutex_lock(&queue->lock);
+  if (!queue->threadStarted) {
+    if (pthread_create(&queue->thread, NULL, schedulerMain, queue) != 0) {
+      pthread_mutex_unlock(&queue->lock);
+      /* No scheduler thread: run synchronously on the caller. */
+      mtHostCommandBufferExecute(cmdb);
+      mtRelease(cmdb);
+      return;
+    }
+    queue->threadStarted = true;
+  }
+
+  cmdb->next = NULL;
+  if (queue->tail)
+    queue->tail->next = cmdb;
+  else
+    queue->head = cmdb;
+  queue->tail = cmdb;
+  pthread_cond_signal(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+MT_EXPORT
+MtCommandQueue *mtNewCommandQueue(MtDevice *device) {
+  MtHostCommandQueue *queue = calloc(1, sizeof(*queue));
+  if (!queue)
+    return NULL;
+
+  mtHostObjectInit(&queue->base, MtHostKindCommandQueue, destroyQueue);
+  queue->device = mtRetain(device);
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->cond, NULL);
+  return queue;
+}
+
+MT_EXPORT
+MtCommandQueue *mtNewCommandQueueWithMaxCommandBufferCount(MtDevice *device,
+                                                           NsUInteger count) {
+  (void)count;
+  return mtNewCommandQueue(device);
+}
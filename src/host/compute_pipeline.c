@@ -0,0 +1,62 @@
+#include "internal.h"
+#include <string.h>
+
+static void destroyPipeline(MtHostObject *obj) {
+  MtHostComputePipeline *pip = (MtHostComputePipeline *)obj;
+  free(pip->name);
+  mtRelease(pip->device);
+  free(pip);
+}
+
+MT_EXPORT
+MtComputePipelineState *mtNewComputePipelineStateWithFunction(MtDevice *device,
+                                                              MtFunction *fun,
+                                                              NsError *error) {
+  (void)error;
+  MtHostFunction *function = fun;
+  if (!function)
+    return NULL;
+
+  MtHostComputePipeline *pip = calloc(1, sizeof(*pip));
+  if (!pip)
+    return NULL;
+  mtHostObjectInit(&pip->base, MtHostKindComputePipeline, destroyPipeline);
+  pip->device = mtRetain(device);
+  pip->kernel = function->kernel;
+  pip->name = strdup(function->name);
+  pip->kernel.name = pip->name;
+
+  if (!pip->kernel.maxTotalThreadsPerThreadgroup)
+    pip->kernel.maxTotalThreadsPerThreadgroup =
+        mtMaxThreadsPerThreadgroup(device).width;
+  if (!pip->kernel.threadExecutionWidth)
+    pip->kernel.threadExecutionWidth = 1;
+  return pip;
+}
+
+MT_EXPORT
+MtDevice *mtComputePipelineDevice(MtComputePipelineState *pip) {
+  return ((MtHostComputePipeline *)pip)->device;
+}
+
+MT_EXPORT
+const char *mtComputePipelineLabel(MtComputePipelineState *pip) {
+  return ((MtHostComputePipeline *)pip)->name;
+}
+
+MT_EXPORT
+NsUInteger
+mtComputePipelineMaxTotalThreadsPerThreadgroup(MtComputePipelineState *pip) {
+  return ((MtHostComputePipeline *)pip)->kernel.maxTotalThreadsPerThreadgroup;
+}
+
+MT_EXPORT
+NsUInteger mtComputePipelineThreadExecutionWidth(MtComputePipelineState *pip) {
+  return ((MtHostComputePipeline *)pip)->kernel.threadExecutionWidth;
+}
+
+MT_EXPORT
+NsUInteger
+mtComputePipelineStaticThreadgroupMemoryLength(MtComputePipelineState *pip) {
+  return ((MtHostComputePipeline *)pip)->kernel.threadgroupMemoryLength;
+}
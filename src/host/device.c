@@ -0,0 +1,131 @@
+#include "internal.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MT_HOST_MAX_THREADS_PER_THREADGROUP 1024
+#define MT_HOST_MAX_THREADGROUP_MEMORY (32u * 1024u)
+
+static MtHostDevice *systemDevice;
+static pthread_once_t systemDeviceOnce = PTHREAD_ONCE_INIT;
+
+static unsigned hostThreadCount(void) {
+  const char *env = getenv("MT_HOST_NUM_THREADS");
+  if (env && atoi(env) > 0)
+    return (unsigned)atoi(env);
+
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (unsigned)n : 1;
+}
+
+static const char *tracePath;
+
+static void writeTrace(void) {
+  if (!mtHostTraceWrite(tracePath))
+    fprintf(stderr, "cmt host: failed to write trace to %s\n", tracePath);
+}
+
+static void destroyDevice(MtHostObject *obj) {
+  /* The system device lives for the whole process; keep one reference. */
+  atomic_store(&obj->refs, 1);
+}
+
+static void createSystemDevice(void) {
+  MtHostDevice *dev = calloc(1, sizeof(*dev));
+  if (!dev)
+    return;
+
+  mtHostObjectInit(&dev->base, MtHostKindDevice, destroyDevice);
+  atomic_init(&dev->allocatedSize, 0);
+  dev->pool = mtHostPoolCreate(hostThreadCount());
+  if (!dev->pool) {
+    free(dev);
+    return;
+  }
+  if (mtHostNumaNodeCount() > 1)
+    snprintf(dev->name, sizeof(dev->name), "Host CPU (%u threads, %u nodes)",
+             mtHostPoolThreadCount(dev->pool), mtHostNumaNodeCount());
+  else
+    snprintf(dev->name, sizeof(dev->name), "Host CPU (%u threads)",
+             mtHostPoolThreadCount(dev->pool));
+  systemDevice = dev;
+
+  tracePath = getenv("MT_HOST_TRACE");
+  if (tracePath && *tracePath && mtHostTraceStart(0))
+    atexit(writeTrace);
+}
+
+double mtHostNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+MT_EXPORT
+MtDevice *mtCreateSystemDefaultDevice(void) {
+  pthread_once(&systemDeviceOnce, createSystemDevice);
+  return mtRetain(systemDevice);
+}
+
+MT_EXPORT
+MtDevice **mtCopyAllDevices(void) {
+  MtDevice **devices = calloc(2, sizeof(MtDevice *));
+  if (devices)
+    devices[0] = mtCreateSystemDefaultDevice();
+  return devices;
+}
+
+MT_EXPORT
+const char *mtDeviceName(MtDevice *device) {
+  return ((MtHostDevice *)device)->name;
+}
+
+MT_EXPORT
+bool mtDeviceHeadless(MtDevice *device) {
+  (void)device;
+  return true;
+}
+
+MT_EXPORT
+bool mtDeviceLowPower(MtDevice *device) {
+  (void)device;
+  return false;
+}
+
+MT_EXPORT
+bool mtDeviceHasUnifiedMemory(MtDevice *device) {
+  (void)device;
+  return true;
+}
+
+MT_EXPORT
+NsUInteger mtDeviceCurrentAllocatedSize(MtDevice *device) {
+  return atomic_load(&((MtHostDevice *)device)->allocatedSize);
+}
+
+MT_EXPORT
+NsUInteger mtDeviceMaxThreadgroupMemoryLength(MtDevice *device) {
+  (void)device;
+  return MT_HOST_MAX_THREADGROUP_MEMORY;
+}
+
+MT_EXPORT
+MtSize mtMaxThreadsPerThreadgroup(MtDevice *device) {
+  (void)device;
+  MtSize size = {MT_HOST_MAX_THREADS_PER_THREADGROUP,
+                 MT_HOST_MAX_THREADS_PER_THREADGROUP,
+                 MT_HOST_MAX_THREADS_PER_THREADGROUP};
+  return size;
+}
+
+MT_EXPORT
+NsUInteger mtDeviceMaxBufferLength(MtDevice *device) {
+  (void)device;
+  return (NsUInteger)PTRDIFF_MAX;
+}
+
+MT_EXPORT
+NsUInteger mtHostDeviceThreadCount(MtDevice *device) {
+  return mtHostPoolThreadCount(((MtHostDevice *)device)->pool);
+}
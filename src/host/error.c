@@ -0,0 +1,67 @@
+#include "internal.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+static void destroyError(MtHostObject *obj) {
+  MtHostError *err = (MtHostError *)obj;
+  free(err->domain);
+  free(err->description);
+  free(err);
+}
+
+NsError *mtHostErrorCreate(const char *domain, NsInteger code,
+                           const char *fmt, ...) {
+  MtHostError *err = calloc(1, sizeof(*err));
+  if (!err)
+    return NULL;
+
+  char description[256];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(description, sizeof(description), fmt, ap);
+  va_end(ap);
+
+  mtHostObjectInit(&err->base, MtHostKindError, destroyError);
+  err->code = code;
+  err->domain = strdup(domain);
+  err->description = strdup(description);
+  return (NsError *)err;
+}
+
+MT_EXPORT
+NsInteger mtErrorCode(NsError *err) { return ((MtHostError *)err)->code; }
+
+MT_EXPORT
+const char *mtErrorDomain(NsError *err) {
+  return ((MtHostError *)err)->domain;
+}
+
+MT_EXPORT
+const char *mtErrorUserInfo(NsError *err) {
+  (void)err;
+  return NULL;
+}
+
+MT_EXPORT
+const char *mtErrorLocalizedDescription(NsError *err) {
+  return ((MtHostError *)err)->description;
+}
+
+MT_EXPORT
+const char **mtErrorLocalizedRecoveryOptions(NsError *err) {
+  (void)err;
+  return NULL;
+}
+
+MT_EXPORT
+const char *mtErrorLocalizedRecoverySuggestion(NsError *err) {
+  (void)err;
+  return NULL;
+}
+
+MT_EXPORT
+const char *mtErrorLocalizedFailureReason(NsError *err) {
+  (void)err;
+  return NULL;
+}
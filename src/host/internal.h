@@ -0,0 +1,274 @@
+#ifndef cmt_host_internal_h
+#define cmt_host_internal_h
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "../../include/cmt/cmt.h"
+#include "../../include/cmt/host.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef enum MtHostObjectKind {
+  MtHostKindDevice = 1,
+  MtHostKindCommandQueue,
+  MtHostKindCommandBuffer,
+  MtHostKindComputeEncoder,
+  MtHostKindBuffer,
+  MtHostKindLibrary,
+  MtHostKindFunction,
+  MtHostKindComputePipeline,
+  MtHostKindError
+} MtHostObjectKind;
+
+typedef struct MtHostObject MtHostObject;
+struct MtHostObject {
+  MtHostObjectKind kind;
+  atomic_long refs;
+  void (*destroy)(MtHostObject *obj);
+};
+
+void mtHostObjectInit(MtHostObject *obj, MtHostObjectKind kind,
+                      void (*destroy)(MtHostObject *obj));
+
+/* trace.c */
+
+#define MT_HOST_TRACE_NAME_LENGTH 38 /* makes an event 64 bytes */
+
+typedef enum MtHostTraceCategory {
+  MtHostTraceEncode,  /* debug groups and signposts as encoded */
+  MtHostTraceQueue,   /* command buffers from commit to execution */
+  MtHostTraceExecute, /* command buffers, dispatches, groups as run */
+  MtHostTraceWorker   /* threadgroups run by each pool thread */
+} MtHostTraceCategory;
+
+/* One Chrome trace event: phase is 'B', 'E', 'X' (with dur), 'i', or 'b'
+ * and 'e' (with arg as the async id). Times are mtHostNow seconds. */
+typedef struct MtHostTraceEvent {
+  double ts;
+  double dur;
+  uint64_t arg; /* command buffer id, or threadgroups run; 0 for none */
+  char phase;
+  uint8_t category;
+  char name[MT_HOST_TRACE_NAME_LENGTH];
+} MtHostTraceEvent;
+
+extern atomic_bool mtHostTraceOn;
+
+static inline bool mtHostTracing(void) {
+  return atomic_load_explicit(&mtHostTraceOn, memory_order_relaxed);
+}
+
+/* Appends an event to the calling thread's ring; name is copied,
+ * truncated. */
+void mtHostTraceEvent(char phase, MtHostTraceCategory category,
+                      const char *name, double ts, double dur, uint64_t arg);
+/* Names the calling thread in traces; name must outlive its first event. */
+void mtHostTraceThreadName(const char *name);
+/* A new id for a traced command buffer, never 0. */
+uint64_t mtHostTraceNextId(void);
+
+/* pool.c */
+
+typedef void (*MtHostTaskFn)(void *ctx, size_t index);
+
+typedef struct MtHostPool MtHostPool;
+
+MtHostPool *mtHostPoolCreate(unsigned threadCount);
+void mtHostPoolDestroy(MtHostPool *pool);
+unsigned mtHostPoolThreadCount(const MtHostPool *pool);
+/* Runs fn(ctx, begin, end) over [0, count) on the pool, in ranges of grain
+ * items (0: 1) that idle threads steal from busy ones; the caller
+ * participates and returns once every range has completed. It may be
+ * called from within fn. name labels the work in traces. */
+void mtHostPoolFor(MtHostPool *pool, size_t count, size_t grain,
+                   MtHostRangeFn fn, void *ctx, const char *name);
+/* mtHostPoolFor calling fn(ctx, i) for each index, one to a range. */
+void mtHostPoolRun(MtHostPool *pool, size_t count, MtHostTaskFn fn,
+                   void *ctx, const char *name);
+
+/* numa.c */
+
+/* Nodes with CPUs, 1 unless there are several and MT_HOST_NUMA is not 0. */
+unsigned mtHostNumaNodeCount(void);
+/* Pins the calling pool worker to the CPUs of a node picked by its index. */
+void mtHostNumaPinWorker(unsigned index);
+
+/* memory.c */
+
+/* size bytes, zeroed only when *mapped comes back nonzero: huge-page
+ * backed where options and size call for it (*mapped is then the length
+ * of the mapping), otherwise alignment-aligned (0: 64 bytes) from the
+ * allocator. A mapping is aligned to at least a page. */
+void *mtHostAllocate(size_t size, size_t alignment, NsUInteger options,
+                     size_t *mapped);
+void mtHostFree(void *ptr, size_t mapped);
+
+/* device.c */
+
+typedef struct MtHostDevice {
+  MtHostObject base;
+  MtHostPool *pool;
+  char name[64];
+  atomic_size_t allocatedSize;
+} MtHostDevice;
+
+double mtHostNow(void);
+
+/* buffer.c */
+
+typedef struct MtHostBuffer {
+  MtHostObject base;
+  MtHostDevice *device;
+  void *contents;
+  NsUInteger length;
+  MtResourceOptions options;
+  bool ownsContents;
+  size_t mapped; /* of owned contents; see mtHostAllocate */
+} MtHostBuffer;
+
+/* library.c */
+
+typedef struct MtHostLibrary {
+  MtHostObject base;
+  MtHostDevice *device;
+  char **names;
+  size_t count;
+} MtHostLibrary;
+
+typedef struct MtHostFunction {
+  MtHostObject base;
+  MtHostDevice *device;
+  MtHostKernelDesc kernel;
+  char *name;
+} MtHostFunction;
+
+typedef struct MtHostComputePipeline {
+  MtHostObject base;
+  MtHostDevice *device;
+  MtHostKernelDesc kernel;
+  char *name;
+} MtHostComputePipeline;
+
+bool mtHostLookupKernel(const char *name, MtHostKernelDesc *out);
+
+/* error.c */
+
+typedef struct MtHostError {
+  MtHostObject base;
+  NsInteger code;
+  char *domain;
+  char *description;
+} MtHostError;
+
+NsError *mtHostErrorCreate(const char *domain, NsInteger code,
+                           const char *fmt, ...);
+
+/* command_queue.c / command_buf.c */
+
+typedef struct MtHostCommandBuffer MtHostCommandBuffer;
+
+typedef struct MtHostCommandQueue {
+  MtHostObject base;
+  MtHostDevice *device;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  bool threadStarted;
+  bool stopping;
+  bool orphaned;
+  MtHostCommandBuffer *head, *tail;
+} MtHostCommandQueue;
+
+void mtHostQueueSubmit(MtHostCommandQueue *queue, MtHostCommandBuffer *cmdb);
+void mtHostCommandBufferExecute(MtHostCommandBuffer *cmdb);
+
+typedef struct MtHostBinding {
+  MtHostBuffer *buffer; /* NULL for inline bytes */
+  void *bytes;
+  NsUInteger offset;
+  NsUInteger length;
+} MtHostBinding;
+
+typedef struct MtHostDispatch {
+  MtHostComputePipeline *pipeline;
+  MtHostBinding bindings[MT_HOST_MAX_BUFFER_BINDINGS];
+  NsUInteger threadgroupMemoryLengths[MT_HOST_MAX_THREADGROUP_MEMORY_BINDINGS];
+  MtSize threadsPerGrid;
+  MtSize threadsPerThreadgroup;
+} MtHostDispatch;
+
+/* A debug group boundary or signpost, replayed when execution reaches
+ * dispatch. */
+typedef struct MtHostMarker {
+  size_t dispatch;
+  char phase; /* 'B', 'E' or 'i' */
+  char name[MT_HOST_TRACE_NAME_LENGTH];
+} MtHostMarker;
+
+typedef struct MtHostHandler {
+  MtCommandBufferHandlerFun fn;
+  MtCommandBufferOnCompleteFn onComplete;
+  void *sender;
+} MtHostHandler;
+
+struct MtHostCommandBuffer {
+  MtHostObject base;
+  MtHostCommandQueue *queue;
+  MtHostDevice *device;
+  bool retainReferences;
+  atomic_int status;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  MtHostDispatch *dispatches;
+  size_t dispatchCount, dispatchCapacity;
+
+  MtHostObject **retained;
+  size_t retainedCount, retainedCapacity;
+
+  MtHostHandler *scheduled;
+  size_t scheduledCount;
+  MtHostHandler *completed;
+  size_t completedCount;
+
+  char **arena; /* inline setBytes storage */
+  size_t arenaCount;
+
+  MtHostMarker *markers; /* only kept while tracing */
+  size_t markerCount, markerCapacity;
+  uint64_t traceId; /* 0 unless committed while tracing */
+
+  double kernelStart, kernelEnd, gpuStart, gpuEnd;
+  NsError *error; /* of the dispatch that failed it, if one did */
+  MtHostCommandBuffer *next; /* queue FIFO link */
+};
+
+void mtHostCommandBufferRetain(MtHostCommandBuffer *cmdb, MtHostObject *obj);
+void *mtHostCommandBufferCopyBytes(MtHostCommandBuffer *cmdb, const void *ptr,
+                                   size_t length);
+bool mtHostCommandBufferAppendDispatch(MtHostCommandBuffer *cmdb,
+                                       const MtHostDispatch *dispatch);
+/* Traces a debug group boundary or signpost as encoded, and keeps it to be
+ * traced again when execution reaches it. */
+void mtHostCommandBufferMark(MtHostCommandBuffer *cmdb, char phase,
+                             const char *name);
+
+/* command_enc_compute.c */
+
+typedef struct MtHostComputeEncoder {
+  MtHostObject base;
+  MtHostCommandBuffer *cmdb;
+  MtDispatchType dispatchType;
+  bool ended;
+  MtHostDispatch state;
+} MtHostComputeEncoder;
+
+/* Runs dispatch; false, with *error set, if a kernel failed it (see
+ * mtHostKernelFail). */
+bool mtHostExecuteDispatch(MtHostDevice *device,
+                           const MtHostDispatch *dispatch, NsError **error);
+
+#endif /* cmt_host_internal_h */
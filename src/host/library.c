@@ -0,0 +1,260 @@
+#include "internal.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Kernel registry: Metal function names mapped to host implementations. */
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static MtHostKernelDesc *registry;
+static size_t registryCount, registryCapacity;
+
+static MtHostKernelDesc *findKernelLocked(const char *name) {
+  for (size_t i = 0; i < registryCount; ++i) {
+    if (strcmp(registry[i].name, name) == 0)
+      return &registry[i];
+  }
+  return NULL;
+}
+
+MT_EXPORT
+bool mtHostRegisterKernel(const MtHostKernelDesc *desc) {
+  if (!desc || !desc->name ||
+      !(desc->fn || (desc->phases && desc->phaseCount)))
+    return false;
+
+  bool ok = false;
+  pthread_mutex_lock(&registryLock);
+  MtHostKernelDesc *entry = findKernelLocked(desc->name);
+  if (entry) {
+    const char *name = entry->name;
+    *entry = *desc;
+    entry->name = name;
+    ok = true;
+    goto unlock;
+  }
+
+  if (registryCount == registryCapacity) {
+    size_t capacity = registryCapacity * 2 + 8;
+    MtHostKernelDesc *grown = realloc(registry, capacity * sizeof(*grown));
+    if (!grown)
+      goto unlock;
+    registry = grown;
+    registryCapacity = capacity;
+  }
+
+  char *name = strdup(desc->name);
+  if (!name)
+    goto unlock;
+  entry = &registry[registryCount++];
+  *entry = *desc;
+  entry->name = name;
+  ok = true;
+
+unlock:
+  pthread_mutex_unlock(&registryLock);
+  return ok;
+}
+
+bool mtHostLookupKernel(const char *name, MtHostKernelDesc *out) {
+  pthread_mutex_lock(&registryLock);
+  MtHostKernelDesc *entry = findKernelLocked(name);
+  if (entry)
+    *out = *entry;
+  pthread_mutex_unlock(&registryLock);
+  return entry != NULL;
+}
+
+static void destroyLibrary(MtHostObject *obj) {
+  MtHostLibrary *lib = (MtHostLibrary *)obj;
+  for (size_t i = 0; i < lib->count; ++i)
+    free(lib->names[i]);
+  free(lib->names);
+  mtRelease(lib->device);
+  free(lib);
+}
+
+static MtHostLibrary *newLibrary(MtDevice *device) {
+  MtHostLibrary *lib = calloc(1, sizeof(*lib));
+  if (!lib)
+    return NULL;
+  mtHostObjectInit(&lib->base, MtHostKindLibrary, destroyLibrary);
+  lib->device = mtRetain(device);
+  return lib;
+}
+
+static bool addName(MtHostLibrary *lib, const char *name, size_t len) {
+  /* names is NULL-terminated for mtLibraryFunctionNames */
+  char **names = realloc(lib->names, (lib->count + 2) * sizeof(char *));
+  if (!names)
+    return false;
+  lib->names = names;
+  if (!(names[lib->count] = strndup(name, len)))
+    return false;
+  names[++lib->count] = NULL;
+  return true;
+}
+
+static const char *skipSpace(const char *p) {
+  while (isspace((unsigned char)*p))
+    p++;
+  return p;
+}
+
+static bool isIdent(char c) {
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+/* Collects the names of `kernel void name(...)` declarations in source. */
+static bool scanKernels(MtHostLibrary *lib, const char *src) {
+  for (const char *p = src; (p = strstr(p, "kernel")); p += 6) {
+    if ((p > src && isIdent(p[-1])) || !isspace((unsigned char)p[6]))
+      continue;
+    const char *q = skipSpace(p + 6);
+    if (strncmp(q, "void", 4) != 0 || !isspace((unsigned char)q[4]))
+      continue;
+    q = skipSpace(q + 4);
+    size_t len = 0;
+    while (isIdent(q[len]))
+      len++;
+    if (len && !addName(lib, q, len))
+      return false;
+  }
+  return true;
+}
+
+MT_EXPORT
+MtLibrary *mtNewLibraryWithSource(MtDevice *device, char *source,
+                                  MtCompileOptions *opts, NsError **error) {
+  (void)opts;
+  MtHostLibrary *lib = newLibrary(device);
+  if (!lib || !scanKernels(lib, source)) {
+    mtRelease(lib);
+    return NULL;
+  }
+
+  MtHostKernelDesc desc;
+  for (size_t i = 0; i < lib->count; ++i) {
+    if (!mtHostLookupKernel(lib->names[i], &desc)) {
+      if (error)
+        *error = mtHostErrorCreate("MTLLibraryErrorDomain",
+                                   MtLibraryErrorFunctionNotFound,
+                                   "no host implementation for kernel '%s'",
+                                   lib->names[i]);
+      mtRelease(lib);
+      return NULL;
+    }
+  }
+  return lib;
+}
+
+MT_EXPORT
+MtLibrary *mtNewLibraryWithFile(MtDevice *device, char *filepath,
+                                NsError *error) {
+  (void)error;
+  FILE *fp = fopen(filepath, "rb");
+  if (!fp)
+    return NULL;
+
+  char *source = NULL;
+  long size = -1;
+  if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 &&
+      fseek(fp, 0, SEEK_SET) == 0 && (source = malloc((size_t)size + 1)) &&
+      fread(source, 1, (size_t)size, fp) == (size_t)size) {
+    source[size] = '\0';
+  } else {
+    free(source);
+    source = NULL;
+  }
+  fclose(fp);
+
+  MtLibrary *lib = source ? mtNewLibraryWithSource(device, source, NULL, NULL)
+                          : NULL;
+  free(source);
+  return lib;
+}
+
+MT_EXPORT
+MtLibrary *mtNewDefaultLibrary(MtDevice *device) {
+  MtHostLibrary *lib = newLibrary(device);
+  if (!lib)
+    return NULL;
+
+  pthread_mutex_lock(&registryLock);
+  bool ok = true;
+  for (size_t i = 0; ok && i < registryCount; ++i)
+    ok = addName(lib, registry[i].name, strlen(registry[i].name));
+  pthread_mutex_unlock(&registryLock);
+
+  if (!ok) {
+    mtRelease(lib);
+    return NULL;
+  }
+  return lib;
+}
+
+MT_EXPORT
+MtDevice *mtLibraryDevice(MtLibrary *lib) {
+  return ((MtHostLibrary *)lib)->device;
+}
+
+MT_EXPORT
+const char *mtLibraryLabel(MtLibrary *lib) {
+  (void)lib;
+  return NULL;
+}
+
+MT_EXPORT
+const char **mtLibraryFunctionNames(MtLibrary *lib) {
+  return (const char **)((MtHostLibrary *)lib)->names;
+}
+
+static void destroyFunction(MtHostObject *obj) {
+  MtHostFunction *fun = (MtHostFunction *)obj;
+  free(fun->name);
+  mtRelease(fun->device);
+  free(fun);
+}
+
+MT_EXPORT
+MtFunction *mtNewFunctionWithName(MtLibrary *library, const char *name) {
+  MtHostLibrary *lib = library;
+  bool found = false;
+  for (size_t i = 0; !found && i < lib->count; ++i)
+    found = strcmp(lib->names[i], name) == 0;
+
+  MtHostKernelDesc desc;
+  if (!found || !mtHostLookupKernel(name, &desc))
+    return NULL;
+
+  MtHostFunction *fun = calloc(1, sizeof(*fun));
+  if (!fun)
+    return NULL;
+  mtHostObjectInit(&fun->base, MtHostKindFunction, destroyFunction);
+  fun->device = mtRetain(lib->device);
+  fun->kernel = desc;
+  fun->name = strdup(name);
+  fun->kernel.name = fun->name;
+  return fun;
+}
+
+MT_EXPORT
+MtDevice *mtFunctionDevice(MtFunction *fun) {
+  return ((MtHostFunction *)fun)->device;
+}
+
+MT_EXPORT
+const char *mtFunctionLabel(MtFunction *fun) {
+  (void)fun;
+  return NULL;
+}
+
+MT_EXPORT
+MtFunctionType mtFunctionType(MtFunction *fun) {
+  (void)fun;
+  return MtFunctionTypeKernel;
+}
+
+MT_EXPORT
+const char *mtFunctionName(MtFunction *fun) {
+  return ((MtHostFunction *)fun)->name;
+}
@@ -0,0 +1,197 @@
+#include "internal.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Large allocations on huge pages. A GEMM over operands of hundreds of MB
+ * touches far more 4 KB pages than the TLB holds; on 2 MB pages it misses
+ * 512 times less. Allocations of MT_HOST_HUGE_PAGE or more (or any size,
+ * with MT_HOST_RESOURCE_HUGE_PAGES) are mapped on their own, aligned to
+ * 2 MB and marked MADV_HUGEPAGE for transparent huge pages. Opting in also
+ * tries reserved hugetlb pages first, 1 GB ones for allocations that large,
+ * then 2 MB ones. Each step falls back to the next, down to the allocator,
+ * and the kernel may still back a transparent mapping with small pages, so
+ * mtHostHugePageStats reports what actually landed on huge pages.
+ *
+ * Mappings are zero already and are left untouched, so each page is first
+ * touched (and placed, on NUMA machines) by the thread that first uses it.
+ */
+
+#define MT_HOST_HUGE_PAGE ((size_t)2 << 20)
+#define MT_HOST_GIANT_PAGE ((size_t)1 << 30)
+#define MT_HOST_ALLOCATION_ALIGNMENT 64
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define MT_HOST_MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define MT_HOST_MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+
+/* Huge-page mappings still live, for the stats. */
+typedef struct MtHostHugeMapping MtHostHugeMapping;
+struct MtHostHugeMapping {
+  uintptr_t begin, end;
+  MtHostHugeMapping *next;
+};
+
+static pthread_mutex_t mappingLock = PTHREAD_MUTEX_INITIALIZER;
+static MtHostHugeMapping *mappings; /* guarded by mappingLock */
+
+static size_t roundUp(size_t size, size_t to) {
+  return (size + to - 1) / to * to;
+}
+
+#ifdef MAP_HUGETLB
+// Reserved huge pages of pageSize, or NULL if there are not enough.
+static void *mapHugetlb(size_t size, size_t pageSize, int sizeFlag) {
+  void *ptr = mmap(NULL, roundUp(size, pageSize), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | sizeFlag, -1,
+                   0);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+#endif
+
+// A 2 MB-aligned anonymous mapping of size (a multiple of 2 MB) marked for
+// transparent huge pages, or NULL.
+static void *mapTransparent(size_t size) {
+  char *ptr = mmap(NULL, size + MT_HOST_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+  // trim to the aligned part
+  char *aligned = (char *)roundUp((uintptr_t)ptr, MT_HOST_HUGE_PAGE);
+  if (aligned > ptr)
+    munmap(ptr, (size_t)(aligned - ptr));
+  munmap(aligned + size, (size_t)(ptr + MT_HOST_HUGE_PAGE - aligned));
+#ifdef MADV_HUGEPAGE
+  madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+  return aligned;
+}
+
+void *mtHostAllocate(size_t size, size_t alignment, NsUInteger options,
+                     size_t *mapped) {
+  const bool optIn = options & MT_HOST_RESOURCE_HUGE_PAGES;
+  const bool optOut = options & MT_HOST_RESOURCE_NO_HUGE_PAGES;
+  void *ptr = NULL;
+  *mapped = 0;
+  if (!size)
+    size = 1;
+
+  if (!optOut && (optIn || size >= MT_HOST_HUGE_PAGE)) {
+    size_t length = roundUp(size, MT_HOST_HUGE_PAGE);
+#ifdef MAP_HUGETLB
+    if (optIn && size >= MT_HOST_GIANT_PAGE &&
+        (ptr = mapHugetlb(size, MT_HOST_GIANT_PAGE, MT_HOST_MAP_HUGE_1GB)))
+      length = roundUp(size, MT_HOST_GIANT_PAGE);
+    else if (optIn)
+      ptr = mapHugetlb(size, MT_HOST_HUGE_PAGE, MT_HOST_MAP_HUGE_2MB);
+#endif
+    if (!ptr)
+      ptr = mapTransparent(length);
+    MtHostHugeMapping *mapping = ptr ? malloc(sizeof(*mapping)) : NULL;
+    if (mapping) {
+      mapping->begin = (uintptr_t)ptr;
+      mapping->end = (uintptr_t)ptr + length;
+      pthread_mutex_lock(&mappingLock);
+      mapping->next = mappings;
+      mappings = mapping;
+      pthread_mutex_unlock(&mappingLock);
+      *mapped = length;
+      return ptr;
+    }
+    if (ptr)
+      munmap(ptr, length);
+  }
+
+  if (posix_memalign(&ptr, alignment ? alignment : MT_HOST_ALLOCATION_ALIGNMENT,
+                     size) != 0)
+    return NULL;
+  return ptr;
+}
+
+void mtHostFree(void *ptr, size_t mapped) {
+  if (!mapped) {
+    free(ptr);
+    return;
+  }
+
+  pthread_mutex_lock(&mappingLock);
+  for (MtHostHugeMapping **m = &mappings; *m; m = &(*m)->next) {
+    if ((*m)->begin == (uintptr_t)ptr) {
+      MtHostHugeMapping *mapping = *m;
+      *m = mapping->next;
+      free(mapping);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mappingLock);
+  munmap(ptr, mapped);
+}
+
+MT_EXPORT
+void *mtHostAllocateMemory(NsUInteger length, NsUInteger options,
+                           NsUInteger alignment, NsUInteger *mapped) {
+  size_t size = 0;
+  void *ptr = mtHostAllocate(length, alignment, options, &size);
+  *mapped = size;
+  return ptr;
+}
+
+MT_EXPORT
+void mtHostFreeMemory(void *ptr, NsUInteger mapped) {
+  mtHostFree(ptr, mapped);
+}
+
+// Bytes of [begin, end) that some huge mapping covers.
+static size_t mappedOverlap(uintptr_t begin, uintptr_t end) {
+  size_t bytes = 0;
+  for (MtHostHugeMapping *m = mappings; m; m = m->next) {
+    const uintptr_t lo = m->begin > begin ? m->begin : begin;
+    const uintptr_t hi = m->end < end ? m->end : end;
+    if (lo < hi)
+      bytes += hi - lo;
+  }
+  return bytes;
+}
+
+MT_EXPORT
+bool mtHostHugePageStats(NsUInteger *requested, NsUInteger *backed) {
+  size_t wanted = 0, landed = 0;
+  FILE *smaps = fopen("/proc/self/smaps", "r");
+
+  pthread_mutex_lock(&mappingLock);
+  for (MtHostHugeMapping *m = mappings; m; m = m->next)
+    wanted += m->end - m->begin;
+
+  // each area's huge pages, up to the part of it that is ours: areas
+  // of neighbouring mappings may have been merged into one
+  if (smaps) {
+    char line[512];
+    size_t ours = 0;
+    while (fgets(line, sizeof(line), smaps)) {
+      unsigned long begin, end, kb;
+      char perms[8];
+      if (sscanf(line, "%lx-%lx %7s", &begin, &end, perms) == 3) {
+        ours = mappedOverlap(begin, end);
+      } else if (ours && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+                          sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1 ||
+                          sscanf(line, "Shared_Hugetlb: %lu kB", &kb) == 1)) {
+        const size_t bytes = (size_t)kb * 1024 < ours ? (size_t)kb * 1024
+                                                      : ours;
+        landed += bytes;
+        ours -= bytes;
+      }
+    }
+    fclose(smaps);
+  }
+  pthread_mutex_unlock(&mappingLock);
+
+  if (requested)
+    *requested = wanted;
+  if (backed)
+    *backed = landed;
+  return smaps != NULL;
+}
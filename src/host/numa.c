@@ -0,0 +1,132 @@
+#include "internal.h"
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * NUMA placement. On a machine with more than one node (with CPUs), large
+ * allocations are interleaved page by page across the nodes, so a matrix
+ * filled by one thread is not left on one socket and every node serves its
+ * share of a kernel's traffic; and the pool's workers are pinned to the
+ * nodes in turn, so the bandwidth of every socket is used. On one node, or
+ * anywhere but Linux, all of this does nothing. MT_HOST_NUMA=0 turns it
+ * off.
+ */
+
+#define MT_HOST_MAX_NODES 64
+/* smaller allocations stay where the allocator puts them */
+#define MT_HOST_INTERLEAVE_MIN ((size_t)2 << 20)
+#define MT_HOST_MPOL_INTERLEAVE 3 /* from linux/mempolicy.h */
+
+static unsigned nodeCount = 1;
+static unsigned nodeIds[MT_HOST_MAX_NODES];
+#ifdef __linux__
+static cpu_set_t nodeCpus[MT_HOST_MAX_NODES];
+#endif
+static pthread_once_t topologyOnce = PTHREAD_ONCE_INIT;
+
+#ifdef __linux__
+// Reads a sysfs list such as "0-3,8-11" from path, calling add for each
+// number in it; false if the file cannot be read.
+static bool readList(const char *path, void (*add)(void *, unsigned),
+                     void *ctx) {
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return false;
+  char line[4096];
+  const bool ok = fgets(line, sizeof(line), file) != NULL;
+  fclose(file);
+  if (!ok)
+    return false;
+
+  for (char *p = line; *p && *p != '\n';) {
+    char *end;
+    unsigned first = (unsigned)strtoul(p, &end, 10), last = first;
+    if (end == p)
+      break;
+    if (*end == '-')
+      last = (unsigned)strtoul(end + 1, &end, 10);
+    for (unsigned i = first; i <= last; ++i)
+      add(ctx, i);
+    p = *end == ',' ? end + 1 : end;
+  }
+  return true;
+}
+
+static void addNode(void *ctx, unsigned node) {
+  (void)ctx;
+  if (node < MT_HOST_MAX_NODES && nodeCount < MT_HOST_MAX_NODES)
+    nodeIds[nodeCount++] = node;
+}
+
+static void addCpu(void *ctx, unsigned cpu) {
+  if (cpu < CPU_SETSIZE)
+    CPU_SET(cpu, (cpu_set_t *)ctx);
+}
+#endif
+
+static void readTopology(void) {
+  const char *env = getenv("MT_HOST_NUMA");
+  if (env && strcmp(env, "0") == 0)
+    return;
+#ifdef __linux__
+  nodeCount = 0;
+  if (!readList("/sys/devices/system/node/has_cpu", addNode, NULL) ||
+      nodeCount < 2) {
+    nodeCount = 1;
+    return;
+  }
+  for (unsigned i = 0; i < nodeCount; ++i) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist",
+             nodeIds[i]);
+    CPU_ZERO(&nodeCpus[i]);
+    if (!readList(path, addCpu, &nodeCpus[i]) || !CPU_COUNT(&nodeCpus[i])) {
+      nodeCount = 1;
+      return;
+    }
+  }
+#endif
+}
+
+unsigned mtHostNumaNodeCount(void) {
+  pthread_once(&topologyOnce, readTopology);
+  return nodeCount;
+}
+
+void mtHostNumaPinWorker(unsigned index) {
+  if (mtHostNumaNodeCount() < 2)
+    return;
+#ifdef __linux__
+  // neighbouring workers on different nodes, so even a few use them all
+  sched_setaffinity(0, sizeof(cpu_set_t), &nodeCpus[index % nodeCount]);
+#else
+  (void)index;
+#endif
+}
+
+MT_EXPORT
+NsUInteger mtHostNodeCount(void) { return mtHostNumaNodeCount(); }
+
+MT_EXPORT
+void mtHostInterleaveMemory(void *ptr, NsUInteger length) {
+  if (length < MT_HOST_INTERLEAVE_MIN || mtHostNumaNodeCount() < 2)
+    return;
+#ifdef __linux__
+  // the policy covers whole pages, and applies to those not yet touched
+  const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = ((uintptr_t)ptr + page - 1) & ~(page - 1);
+  const uintptr_t end = ((uintptr_t)ptr + length) & ~(page - 1);
+  if (end <= begin)
+    return;
+  unsigned long mask = 0;
+  for (unsigned i = 0; i < nodeCount; ++i)
+    mask |= 1ul << nodeIds[i];
+  syscall(SYS_mbind, (void *)begin, (unsigned long)(end - begin),
+          MT_HOST_MPOL_INTERLEAVE, &mask, sizeof(mask) * 8 + 1, 0u);
+#endif
+}
@@ -0,0 +1,25 @@
+#include "internal.h"
+
+void mtHostObjectInit(MtHostObject *obj, MtHostObjectKind kind,
+                      void (*destroy)(MtHostObject *obj)) {
+  obj->kind = kind;
+  atomic_init(&obj->refs, 1);
+  obj->destroy = destroy;
+}
+
+MT_EXPORT
+void *mtRetain(void *obj) {
+  if (obj)
+    atomic_fetch_add_explicit(&((MtHostObject *)obj)->refs, 1,
+                              memory_order_relaxed);
+  return obj;
+}
+
+MT_EXPORT
+void mtRelease(void *obj) {
+  MtHostObject *o = obj;
+  if (!o)
+    return;
+  if (atomic_fetch_sub_explicit(&o->refs, 1, memory_order_acq_rel) == 1)
+    o->destroy(o);
+}
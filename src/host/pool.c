@@ -0,0 +1,306 @@
+#include "internal.h"
+#include <stdio.h>
+
+/*
+ * Work stealing over ranges of chunks. A job's count items are cut into
+ * chunks of grain items, and each thread taking part in the job owns a slot
+ * holding a range of them: the submitting thread starts with all of them,
+ * the others with none. Owners take chunks from the front of their own
+ * range; a thread whose range is empty steals the back half of the largest
+ * other one. Each thread so works through long runs of neighbouring chunks,
+ * and the job splits only as far as there are idle threads to take the
+ * halves. A range is one 64-bit word, begin << 32 | end, updated by
+ * compare-and-swap; it cannot come back to a value it held, since every
+ * chunk is taken once.
+ *
+ * A task may itself submit work: it becomes the first thread of a new job,
+ * which idle workers join, and it waits only on that job's chunks.
+ */
+
+#define MT_HOST_INLINE_SLOTS 16
+
+typedef struct MtHostSlot {
+  _Alignas(64) _Atomic uint64_t range;
+} MtHostSlot;
+
+typedef struct MtHostJob MtHostJob;
+struct MtHostJob {
+  MtHostRangeFn fn;
+  void *ctx;
+  const char *name;
+  size_t count, grain;
+  uint32_t chunks;
+  MtHostSlot *slots;
+  unsigned slotCount;
+  unsigned joined;   /* slots handed out, guarded by pool lock */
+  atomic_size_t done; /* chunks completed */
+  int users; /* workers currently holding the job, guarded by pool lock */
+  MtHostJob *prev, *nextJob;
+  MtHostSlot inlineSlots[MT_HOST_INLINE_SLOTS];
+};
+
+struct MtHostPool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t finished;
+  pthread_t *threads;
+  unsigned threadCount; /* workers, excluding submitting threads */
+  bool stopping;
+  MtHostJob *jobs;
+};
+
+static uint64_t packRange(uint32_t begin, uint32_t end) {
+  return (uint64_t)begin << 32 | end;
+}
+
+static uint32_t rangeBegin(uint64_t range) { return (uint32_t)(range >> 32); }
+static uint32_t rangeEnd(uint64_t range) { return (uint32_t)range; }
+static uint32_t rangeSize(uint64_t range) {
+  return rangeEnd(range) - rangeBegin(range);
+}
+
+// Takes the first chunk of slot into *chunk; false once the slot is empty.
+static bool takeChunk(MtHostSlot *slot, uint32_t *chunk) {
+  uint64_t range = atomic_load_explicit(&slot->range, memory_order_relaxed);
+  while (rangeSize(range)) {
+    if (atomic_compare_exchange_weak_explicit(
+            &slot->range, &range,
+            packRange(rangeBegin(range) + 1, rangeEnd(range)),
+            memory_order_relaxed, memory_order_relaxed)) {
+      *chunk = rangeBegin(range);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Moves the back half of the largest other range into the (empty) slot
+// self; false once no chunk is left to steal.
+static bool stealChunks(MtHostJob *job, unsigned self) {
+  for (;;) {
+    MtHostSlot *victim = NULL;
+    uint64_t range = 0;
+    for (unsigned i = 0; i < job->slotCount; ++i) {
+      uint64_t r =
+          atomic_load_explicit(&job->slots[i].range, memory_order_relaxed);
+      if (i != self && rangeSize(r) > rangeSize(range)) {
+        victim = &job->slots[i];
+        range = r;
+      }
+    }
+    if (!victim)
+      return false;
+
+    const uint32_t mid = rangeBegin(range) + rangeSize(range) / 2;
+    if (atomic_compare_exchange_weak_explicit(
+            &victim->range, &range, packRange(rangeBegin(range), mid),
+            memory_order_relaxed, memory_order_relaxed)) {
+      atomic_store_explicit(&job->slots[self].range,
+                            packRange(mid, rangeEnd(range)),
+                            memory_order_relaxed);
+      return true;
+    }
+  }
+}
+
+static bool jobHasWork(MtHostJob *job) {
+  for (unsigned i = 0; i < job->slotCount; ++i) {
+    if (rangeSize(atomic_load_explicit(&job->slots[i].range,
+                                       memory_order_relaxed)))
+      return true;
+  }
+  return false;
+}
+
+static void runJob(MtHostJob *job, unsigned self) {
+  const double start = mtHostTracing() ? mtHostNow() : 0.0;
+  MtHostSlot *slot = &job->slots[self];
+  size_t ran = 0;
+  uint32_t chunk;
+  while (takeChunk(slot, &chunk) || (stealChunks(job, self) &&
+                                     takeChunk(slot, &chunk))) {
+    const size_t begin = (size_t)chunk * job->grain;
+    const size_t end =
+        job->count - begin < job->grain ? job->count : begin + job->grain;
+    job->fn(job->ctx, begin, end);
+    atomic_fetch_add_explicit(&job->done, 1, memory_order_release);
+    ran += end - begin;
+  }
+  if (start > 0.0 && ran)
+    mtHostTraceEvent('X', MtHostTraceWorker, job->name, start,
+                     mtHostNow() - start, ran);
+}
+
+static MtHostJob *findJob(MtHostPool *pool) {
+  for (MtHostJob *job = pool->jobs; job; job = job->nextJob) {
+    if (job->joined < job->slotCount && jobHasWork(job))
+      return job;
+  }
+  return NULL;
+}
+
+typedef struct MtHostWorkerStart {
+  MtHostPool *pool;
+  unsigned index;
+} MtHostWorkerStart;
+
+static void *workerMain(void *arg) {
+  MtHostWorkerStart *start = arg;
+  MtHostPool *pool = start->pool;
+  char name[32];
+  snprintf(name, sizeof(name), "worker %u", start->index);
+  mtHostNumaPinWorker(start->index - 1);
+  free(start);
+  mtHostTraceThreadName(name);
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    MtHostJob *job;
+    while (!pool->stopping && !(job = findJob(pool)))
+      pthread_cond_wait(&pool->work, &pool->lock);
+    if (pool->stopping)
+      break;
+
+    const unsigned self = job->joined++;
+    job->users++;
+    pthread_mutex_unlock(&pool->lock);
+    runJob(job, self);
+    pthread_mutex_lock(&pool->lock);
+    job->users--;
+    pthread_cond_broadcast(&pool->finished);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+MtHostPool *mtHostPoolCreate(unsigned threadCount) {
+  MtHostPool *pool = calloc(1, sizeof(*pool));
+  if (!pool)
+    return NULL;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+
+  unsigned workers = threadCount > 1 ? threadCount - 1 : 0;
+  pool->threads = workers ? calloc(workers, sizeof(pthread_t)) : NULL;
+  for (unsigned i = 0; i < workers && pool->threads; ++i) {
+    MtHostWorkerStart *start = malloc(sizeof(*start));
+    if (!start)
+      break;
+    start->pool = pool;
+    start->index = i + 1;
+    if (pthread_create(&pool->threads[i], NULL, workerMain, start) != 0) {
+      free(start);
+      break;
+    }
+    pool->threadCount++;
+  }
+  return pool;
+}
+
+void mtHostPoolDestroy(MtHostPool *pool) {
+  if (!pool)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (unsigned i = 0; i < pool->threadCount; ++i)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_cond_destroy(&pool->finished);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+unsigned mtHostPoolThreadCount(const MtHostPool *pool) {
+  return pool->threadCount + 1;
+}
+
+void mtHostPoolFor(MtHostPool *pool, size_t count, size_t grain,
+                   MtHostRangeFn fn, void *ctx, const char *name) {
+  if (count == 0)
+    return;
+  if (grain == 0)
+    grain = 1;
+  // chunk indices are 32-bit
+  if ((count - 1) / grain >= UINT32_MAX)
+    grain = (count - 1) / (UINT32_MAX - 1) + 1;
+
+  MtHostJob job = {.fn = fn, .ctx = ctx, .name = name, .count = count,
+                   .grain = grain};
+  job.chunks = (uint32_t)((count - 1) / grain + 1);
+  job.slotCount = job.chunks == 1 ? 1 : pool->threadCount + 1;
+  if (job.slotCount > job.chunks)
+    job.slotCount = job.chunks;
+  job.slots = job.inlineSlots;
+  if (job.slotCount > MT_HOST_INLINE_SLOTS &&
+      !(job.slots = aligned_alloc(_Alignof(MtHostSlot),
+                                  job.slotCount * sizeof(MtHostSlot)))) {
+    job.slots = job.inlineSlots;
+    job.slotCount = 1;
+  }
+  atomic_init(&job.slots[0].range, packRange(0, job.chunks));
+  for (unsigned i = 1; i < job.slotCount; ++i)
+    atomic_init(&job.slots[i].range, 0);
+  atomic_init(&job.done, 0);
+  job.joined = 1;
+
+  if (job.slotCount == 1) {
+    runJob(&job, 0);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  job.nextJob = pool->jobs;
+  if (pool->jobs)
+    pool->jobs->prev = &job;
+  pool->jobs = &job;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  runJob(&job, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (job.users > 0 ||
+         atomic_load_explicit(&job.done, memory_order_acquire) < job.chunks)
+    pthread_cond_wait(&pool->finished, &pool->lock);
+  if (job.prev)
+    job.prev->nextJob = job.nextJob;
+  else
+    pool->jobs = job.nextJob;
+  if (job.nextJob)
+    job.nextJob->prev = job.prev;
+  pthread_mutex_unlock(&pool->lock);
+
+  if (job.slots != job.inlineSlots)
+    free(job.slots);
+}
+
+typedef struct MtHostTasks {
+  MtHostTaskFn fn;
+  void *ctx;
+} MtHostTasks;
+
+static void runTasks(void *ctx, NsUInteger begin, NsUInteger end) {
+  const MtHostTasks *tasks = ctx;
+  for (size_t i = begin; i < end; ++i)
+    tasks->fn(tasks->ctx, i);
+}
+
+void mtHostPoolRun(MtHostPool *pool, size_t count, MtHostTaskFn fn,
+                   void *ctx, const char *name) {
+  MtHostTasks tasks = {fn, ctx};
+  mtHostPoolFor(pool, count, 1, runTasks, &tasks, name);
+}
+
+MT_EXPORT
+void mtHostParallelFor(MtDevice *device, NsUInteger count, NsUInteger grain,
+                       MtHostRangeFn fn, void *ctx) {
+  mtHostPoolFor(((MtHostDevice *)device)->pool, count, grain, fn, ctx,
+                "parallel for");
+}
@@ -0,0 +1,216 @@
+#include "internal.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Every thread that records an event while tracing gets its own ring of
+ * events, so recording takes no lock: the owning thread fills the slot at
+ * head and publishes it by advancing head. A full ring overwrites its
+ * oldest events. Rings are registered once, under a lock, and kept for the
+ * life of the process so that the events of threads that have exited can
+ * still be written; starting a new trace empties them (each ring notices
+ * the new epoch on its next event).
+ *
+ * Writing reads the rings while their threads may still record, so it
+ * should follow the traced work rather than overlap it.
+ */
+
+#define MT_HOST_TRACE_DEFAULT_EVENTS ((size_t)1 << 16)
+
+typedef struct MtHostTraceRing MtHostTraceRing;
+struct MtHostTraceRing {
+  MtHostTraceEvent *events;
+  size_t mask; /* capacity - 1, a power of two */
+  atomic_size_t head;
+  atomic_uint epoch;
+  unsigned tid;
+  char threadName[MT_HOST_TRACE_NAME_LENGTH];
+  MtHostTraceRing *next;
+};
+
+atomic_bool mtHostTraceOn;
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static MtHostTraceRing *traceRings; /* guarded by traceLock */
+static unsigned traceThreads;       /* guarded by traceLock */
+static atomic_size_t traceCapacity;
+static atomic_uint traceEpoch;
+static atomic_uint_least64_t traceNextId;
+static double traceOrigin; /* mtHostNow at the start of the trace */
+
+static _Thread_local MtHostTraceRing *localRing;
+static _Thread_local const char *localThreadName;
+
+static const char *categoryNames[] = {"encode", "queue", "execute", "worker"};
+
+static void copyName(char *dst, const char *src) {
+  size_t length = src ? strlen(src) : 0;
+  if (length >= MT_HOST_TRACE_NAME_LENGTH)
+    length = MT_HOST_TRACE_NAME_LENGTH - 1;
+  memcpy(dst, src ? src : "", length);
+  dst[length] = '\0';
+}
+
+static MtHostTraceRing *newRing(void) {
+  size_t capacity = atomic_load(&traceCapacity);
+  MtHostTraceRing *ring = calloc(1, sizeof(*ring));
+  if (!ring)
+    return NULL;
+  ring->events = malloc(capacity * sizeof(*ring->events));
+  if (!ring->events) {
+    free(ring);
+    return NULL;
+  }
+  ring->mask = capacity - 1;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->epoch, atomic_load(&traceEpoch));
+
+  pthread_mutex_lock(&traceLock);
+  ring->tid = ++traceThreads;
+  if (localThreadName)
+    copyName(ring->threadName, localThreadName);
+  else
+    snprintf(ring->threadName, sizeof(ring->threadName), "thread %u",
+             ring->tid);
+  ring->next = traceRings;
+  traceRings = ring;
+  pthread_mutex_unlock(&traceLock);
+  return ring;
+}
+
+void mtHostTraceEvent(char phase, MtHostTraceCategory category,
+                      const char *name, double ts, double dur, uint64_t arg) {
+  MtHostTraceRing *ring = localRing;
+  if (!ring && !(ring = localRing = newRing()))
+    return;
+
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  const unsigned epoch = atomic_load_explicit(&traceEpoch,
+                                              memory_order_relaxed);
+  if (atomic_load_explicit(&ring->epoch, memory_order_relaxed) != epoch) {
+    head = 0;
+    atomic_store_explicit(&ring->epoch, epoch, memory_order_relaxed);
+  }
+
+  MtHostTraceEvent *event = &ring->events[head & ring->mask];
+  event->ts = ts;
+  event->dur = dur;
+  event->arg = arg;
+  event->phase = phase;
+  event->category = (uint8_t)category;
+  copyName(event->name, name);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void mtHostTraceThreadName(const char *name) {
+  localThreadName = name;
+  if (localRing) {
+    pthread_mutex_lock(&traceLock);
+    copyName(localRing->threadName, name);
+    pthread_mutex_unlock(&traceLock);
+  }
+}
+
+uint64_t mtHostTraceNextId(void) {
+  return atomic_fetch_add(&traceNextId, 1) + 1;
+}
+
+MT_EXPORT
+bool mtHostTraceStart(NsUInteger eventsPerThread) {
+  size_t capacity = 1;
+  if (!eventsPerThread)
+    eventsPerThread = MT_HOST_TRACE_DEFAULT_EVENTS;
+  while (capacity < eventsPerThread)
+    capacity *= 2;
+
+  pthread_mutex_lock(&traceLock);
+  // rings already allocated keep their size
+  atomic_store(&traceCapacity, capacity);
+  traceOrigin = mtHostNow();
+  atomic_fetch_add(&traceEpoch, 1);
+  atomic_store(&mtHostTraceOn, true);
+  pthread_mutex_unlock(&traceLock);
+  return true;
+}
+
+MT_EXPORT
+void mtHostTraceStop(void) { atomic_store(&mtHostTraceOn, false); }
+
+static void writeString(FILE *out, const char *str) {
+  fputc('"', out);
+  for (; *str; ++str) {
+    unsigned char c = (unsigned char)*str;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+static void writeEvent(FILE *out, int pid, unsigned tid,
+                       const MtHostTraceEvent *e, bool *first) {
+  fprintf(out, "%s\n{\"name\":", *first ? "" : ",");
+  *first = false;
+  writeString(out, e->name);
+  fprintf(out, ",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%u,"
+               "\"ts\":%.3f",
+          categoryNames[e->category], e->phase, pid, tid,
+          (e->ts - traceOrigin) * 1e6);
+  if (e->phase == 'X')
+    fprintf(out, ",\"dur\":%.3f", e->dur * 1e6);
+  else if (e->phase == 'i')
+    fprintf(out, ",\"s\":\"t\"");
+  if (e->phase == 'b' || e->phase == 'e')
+    fprintf(out, ",\"id\":%llu", (unsigned long long)e->arg);
+  else if (e->arg)
+    fprintf(out, ",\"args\":{\"%s\":%llu}",
+            e->category == MtHostTraceWorker ? "threadgroups"
+                                             : "command_buffer",
+            (unsigned long long)e->arg);
+  fputc('}', out);
+}
+
+MT_EXPORT
+bool mtHostTraceWrite(const char *path) {
+  FILE *out = fopen(path, "w");
+  if (!out)
+    return false;
+
+  const int pid = (int)getpid();
+  const unsigned epoch = atomic_load(&traceEpoch);
+  bool first = true;
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  fprintf(out, "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+               "\"args\":{\"name\":\"cmt host\"}}",
+          pid);
+  first = false;
+
+  pthread_mutex_lock(&traceLock);
+  for (MtHostTraceRing *ring = traceRings; ring; ring = ring->next) {
+    if (atomic_load(&ring->epoch) != epoch)
+      continue;
+    const size_t head = atomic_load_explicit(&ring->head,
+                                             memory_order_acquire);
+    const size_t capacity = ring->mask + 1;
+    if (!head)
+      continue;
+
+    fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                 "\"tid\":%u,\"args\":{\"name\":",
+            pid, ring->tid);
+    writeString(out, ring->threadName);
+    fprintf(out, "}}");
+    // an overwritten ring holds the last capacity events
+    for (size_t i = head > capacity ? head - capacity : 0; i < head; ++i)
+      writeEvent(out, pid, ring->tid, &ring->events[i & ring->mask], &first);
+  }
+  pthread_mutex_unlock(&traceLock);
+
+  fprintf(out, "\n]}\n");
+  return fclose(out) == 0;
+}
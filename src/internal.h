@@ -0,0 +1,118 @@
+#ifndef alloy_internal_h
+#define alloy_internal_h
+
+#include "../include/alloy/alloy.h"
+
+/* Reports message and jumps to the enclosing function's cleanup label. */
+#define CHECK_ERROR(condition, message)                                        \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "Error: %s\n", message);                                 \
+      goto cleanup;                                                            \
+    }                                                                          \
+  } while (0)
+
+/*
+ * Library-private helpers shared between the operation front ends
+ * (alloy.c, fusion.c, quantization.c, reduction.c, sparse.c), the handle
+ * lifecycle in operation.c, the latency histograms in latency.c, the
+ * threadgroup tuning in autotune.c and the host loops in parallel.c.
+ */
+
+/* Metal source of the fused_elementwise kernel, in fusion.c */
+extern const char *fusedElementwiseShader;
+/* Metal source of the int8 quantization kernels, in quantization.c */
+extern const char *matrixQuantizationShader;
+/* Metal source of the sparse kernels, in sparse.c */
+extern const char *matrixSparseShader;
+/* Metal source of the reduction kernels, in reduction.c */
+extern const char *matrixReductionShader;
+
+/* The element type of mat, with 0 read as MtDataTypeFloat. */
+MtDataType matrixType(const Matrix *mat);
+/* Bytes spanned by the elements of mat, packed. */
+size_t matrixBytes(const Matrix *mat);
+/* Elements from one row of mat to the next. */
+size_t matrixLd(const Matrix *mat);
+/* Whether mat's rows follow one another without gaps. */
+bool matrixIsPacked(const Matrix *mat);
+/* Bytes from mat's first element to just past its last, gaps included. */
+size_t matrixExtent(const Matrix *mat);
+/* Copies mat's rows, back to back, to dst. */
+void packMatrix(const Matrix *mat, void *dst);
+/* The leading dimension createPadded* gives rows of cols elements. */
+size_t paddedLd(size_t cols, size_t elementSize);
+/* A parallelFor grain for items of itemBytes each: enough of them to be
+ * worth another thread. */
+size_t parallelGrain(size_t itemBytes);
+
+#define OPERATION_MAX_OPERANDS 16
+#define OPERATION_MAX_BYTES 8
+
+/*
+ * Everything needed to encode one kernel: operands are bound at buffer
+ * indices 0..operandCount-1 (inputs first, the result last) and the small
+ * arguments with setBytes from index operandCount on, followed by each
+ * operand's leading dimension as a uint array, so views are addressed in
+ * place.
+ */
+typedef struct OperationDesc {
+  const char *shaderFile;
+  const char *funcName;
+  Matrix *operands[OPERATION_MAX_OPERANDS];
+  size_t sizes[OPERATION_MAX_OPERANDS]; /* bytes each operand spans */
+  size_t operandCount;
+  const void *bytes[OPERATION_MAX_BYTES];
+  size_t byteLengths[OPERATION_MAX_BYTES];
+  size_t bytesCount;
+  MtSize gridSize;
+  /* picks the threadgroup shape; threadgroupSizeFor when NULL */
+  MtSize (*threadgroupSize)(MtComputePipelineState *pipelineState,
+                            MtSize gridSize);
+  size_t resultItems;  /* result blocks read back when staged */
+  size_t resultStride; /* elements between result blocks */
+  bool readsResult;    /* the result is an input too (work in place) */
+  /* bytes of threadgroup memory 0 for each thread of a threadgroup */
+  size_t threadgroupMemoryPerThread;
+} OperationDesc;
+
+/* Encodes desc into a new command buffer on ctx's queue and commits it. */
+AlloyOperation *submitOperation(AlloyContext *ctx, const OperationDesc *desc);
+
+/* Creates the handle for work encoded into cmdBuffer, which it retains; its
+ * latencies are recorded under kernel, from submitted (latencyClock) on. */
+AlloyOperation *createOperation(AlloyContext *ctx, MtCommandBuffer *cmdBuffer,
+                                const char *kernel, double submitted);
+/* Hands a pooled staging buffer to op; it returns to the pool on completion.
+ * On failure the buffer is released immediately. */
+bool operationAddStaged(AlloyOperation *op, MtBuffer *buffer);
+/* On completion, copies items blocks of itemBytes from src back to dst,
+ * srcStride and dstStride bytes apart. */
+void operationSetReadback(AlloyOperation *op, MtBuffer *src, void *dst,
+                          size_t items, size_t srcStride, size_t dstStride,
+                          size_t itemBytes);
+/* Registers the completion handler and commits the command buffer. */
+void commitOperation(AlloyOperation *op);
+
+AlloyTuningDb *createTuningDb(MtDevice *device);
+void freeTuningDb(AlloyTuningDb *db);
+/* The threadgroup shape to dispatch kernel over grid with: the tuned one for
+ * the grid's bucket, or the one being tried while autotuning. Returns false
+ * when there is none and the operation's own choice applies. */
+bool tunedThreadgroupSize(AlloyContext *ctx, const char *kernel,
+                          MtComputePipelineState *pipelineState,
+                          MtSize grid, MtSize *size);
+
+/* Seconds on the clock command buffers time their kernels with. */
+double latencyClock(void);
+AlloyLatencyRecorder *createLatencyRecorder(void);
+void freeLatencyRecorder(AlloyLatencyRecorder *recorder);
+/* The histograms for the kernel called name, created on first use; NULL if
+ * they could not be allocated. */
+AlloyLatencyKernel *latencyKernel(AlloyLatencyRecorder *recorder,
+                                  const char *name);
+/* Records seconds[phase] for each phase with recorded[phase] set. */
+void recordLatencies(AlloyLatencyKernel *kernel, const double *seconds,
+                     const bool *recorded);
+
+#endif /* alloy_internal_h */
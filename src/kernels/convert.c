@@ -0,0 +1,360 @@
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86 1
+#endif
+
+/*
+ * Vector conversions between float and 16-bit storage: F16C for half,
+ * AVX-512 BF16 (or an AVX2 rounding sequence) for bfloat16. Widening
+ * bfloat16 is just a shift into the top of each float.
+ */
+
+/* The vector loops clear the upper register state themselves before their
+ * scalar tails: GCC omits vzeroupper ahead of tail calls, and the SSE code
+ * that runs next would otherwise stall on it. */
+
+#define CONVERT_CHUNK 256
+#define CONVERT_LANES 4
+
+/* explicit vectors, as in fused_elementwise.c, so sums vectorize at -O2 */
+typedef float ConvertVec __attribute__((vector_size(CONVERT_LANES * 4)));
+
+static void halfToFloatScalar(const uint16_t *src, float *dst, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = halfToFloat(src[i]);
+}
+
+static void floatToHalfScalar(const float *src, uint16_t *dst, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = floatToHalf(src[i]);
+}
+
+static void bfloatToFloatScalar(const uint16_t *src, float *dst, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = bfloatToFloat(src[i]);
+}
+
+static void floatToBFloatScalar(const float *src, uint16_t *dst, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = floatToBFloat(src[i]);
+}
+
+#ifdef CONVERT_X86
+__attribute__((target("avx,f16c"))) static void
+halfToFloatF16c(const uint16_t *src, float *dst, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(
+                                  (const __m128i *)(src + i))));
+  _mm256_zeroupper();
+  halfToFloatScalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx,f16c"))) static void
+floatToHalfF16c(const float *src, uint16_t *dst, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm256_cvtps_ph(_mm256_loadu_ps(src + i),
+                                     _MM_FROUND_TO_NEAREST_INT));
+  _mm256_zeroupper();
+  floatToHalfScalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void
+halfToFloatAvx512(const uint16_t *src, float *dst, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256(
+                                  (const __m256i *)(src + i))));
+  _mm256_zeroupper();
+  halfToFloatF16c(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void
+floatToHalfAvx512(const float *src, uint16_t *dst, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm512_cvtps_ph(_mm512_loadu_ps(src + i),
+                                        _MM_FROUND_TO_NEAREST_INT));
+  _mm256_zeroupper();
+  floatToHalfF16c(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+bfloatToFloatAvx2(const uint16_t *src, float *dst, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i wide = _mm256_cvtepu16_epi32(
+        _mm_loadu_si128((const __m128i *)(src + i)));
+    _mm256_storeu_ps(dst + i,
+                     _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16)));
+  }
+  _mm256_zeroupper();
+  bfloatToFloatScalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void
+bfloatToFloatAvx512(const uint16_t *src, float *dst, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i wide = _mm512_cvtepu16_epi32(
+        _mm256_loadu_si256((const __m256i *)(src + i)));
+    _mm512_storeu_ps(dst + i,
+                     _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16)));
+  }
+  _mm256_zeroupper();
+  bfloatToFloatAvx2(src + i, dst + i, n - i);
+}
+
+/* Round to nearest even on the integer bits, as floatToBFloat does. */
+__attribute__((target("avx2"))) static void
+floatToBFloatAvx2(const float *src, uint16_t *dst, size_t n) {
+  const __m256i bias = _mm256_set1_epi32(0x7fff);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i quiet = _mm256_set1_epi32(0x40);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps(src + i);
+    __m256i bits = _mm256_castps_si256(x);
+    __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+    __m256i rounded = _mm256_srli_epi32(
+        _mm256_add_epi32(bits, _mm256_add_epi32(bias, lsb)), 16);
+    __m256i nan = _mm256_or_si256(_mm256_srli_epi32(bits, 16), quiet);
+    __m256 isNan = _mm256_cmp_ps(x, x, _CMP_UNORD_Q);
+    rounded = _mm256_castps_si256(_mm256_blendv_ps(
+        _mm256_castsi256_ps(rounded), _mm256_castsi256_ps(nan), isNan));
+    /* packus works per 128-bit lane: gather both halves into the low one */
+    __m256i packed = _mm256_permute4x64_epi64(
+        _mm256_packus_epi32(rounded, rounded), 0x08);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm256_castsi256_si128(packed));
+  }
+  _mm256_zeroupper();
+  floatToBFloatScalar(src + i, dst + i, n - i);
+}
+
+/* vcvtneps2bf16 treats subnormal inputs as zero, so blocks holding any are
+ * rounded on the integer bits instead. */
+__attribute__((target("avx512f,avx512bf16"))) static void
+floatToBFloatAvx512(const float *src, uint16_t *dst, size_t n) {
+  const __m512i exponent = _mm512_set1_epi32(0x7f800000);
+  const __m512i mantissa = _mm512_set1_epi32(0x007fffff);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 x = _mm512_loadu_ps(src + i);
+    __m512i bits = _mm512_castps_si512(x);
+    if (_mm512_testn_epi32_mask(bits, exponent) &
+        _mm512_test_epi32_mask(bits, mantissa)) {
+      floatToBFloatAvx2(src + i, dst + i, 16);
+      continue;
+    }
+    _mm256_storeu_si256((__m256i *)(dst + i), (__m256i)_mm512_cvtneps_pbh(x));
+  }
+  _mm256_zeroupper();
+  floatToBFloatAvx2(src + i, dst + i, n - i);
+}
+#endif
+
+static void halfToFloatRow(const uint16_t *src, float *dst, size_t n) {
+#ifdef CONVERT_X86
+  if (__builtin_cpu_supports("avx512f")) {
+    halfToFloatAvx512(src, dst, n);
+    return;
+  }
+  if (__builtin_cpu_supports("f16c")) {
+    halfToFloatF16c(src, dst, n);
+    return;
+  }
+#endif
+  halfToFloatScalar(src, dst, n);
+}
+
+static void floatToHalfRow(const float *src, uint16_t *dst, size_t n) {
+#ifdef CONVERT_X86
+  if (__builtin_cpu_supports("avx512f")) {
+    floatToHalfAvx512(src, dst, n);
+    return;
+  }
+  if (__builtin_cpu_supports("f16c")) {
+    floatToHalfF16c(src, dst, n);
+    return;
+  }
+#endif
+  floatToHalfScalar(src, dst, n);
+}
+
+static void bfloatToFloatRow(const uint16_t *src, float *dst, size_t n) {
+#ifdef CONVERT_X86
+  if (__builtin_cpu_supports("avx512f")) {
+    bfloatToFloatAvx512(src, dst, n);
+    return;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    bfloatToFloatAvx2(src, dst, n);
+    return;
+  }
+#endif
+  bfloatToFloatScalar(src, dst, n);
+}
+
+static void floatToBFloatRow(const float *src, uint16_t *dst, size_t n) {
+#ifdef CONVERT_X86
+  if (__builtin_cpu_supports("avx512bf16")) {
+    floatToBFloatAvx512(src, dst, n);
+    return;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    floatToBFloatAvx2(src, dst, n);
+    return;
+  }
+#endif
+  floatToBFloatScalar(src, dst, n);
+}
+
+size_t elementSize(MtDataType type) {
+  switch (type) {
+  case MtDataTypeFloat:
+  case MtDataTypeInt:
+    return sizeof(float);
+  case MtDataTypeHalf:
+  case MtDataTypeBFloat:
+    return sizeof(uint16_t);
+  case MtDataTypeChar:
+    return sizeof(int8_t);
+  default:
+    return 0;
+  }
+}
+
+void toFloat(const void *src, MtDataType type, float *dst, size_t n) {
+  switch (type) {
+  case MtDataTypeHalf:
+    halfToFloatRow(src, dst, n);
+    break;
+  case MtDataTypeBFloat:
+    bfloatToFloatRow(src, dst, n);
+    break;
+  default:
+    memmove(dst, src, n * sizeof(float));
+    break;
+  }
+}
+
+void fromFloat(const float *src, void *dst, MtDataType type, size_t n) {
+  switch (type) {
+  case MtDataTypeHalf:
+    floatToHalfRow(src, dst, n);
+    break;
+  case MtDataTypeBFloat:
+    floatToBFloatRow(src, dst, n);
+    break;
+  default:
+    memmove(dst, src, n * sizeof(float));
+    break;
+  }
+}
+
+void convertElements(const void *src, MtDataType srcType, void *dst,
+                     MtDataType dstType, size_t n) {
+  if (srcType == dstType) {
+    memmove(dst, src, n * elementSize(srcType));
+  } else if (srcType == MtDataTypeFloat) {
+    fromFloat(src, dst, dstType, n);
+  } else if (dstType == MtDataTypeFloat) {
+    toFloat(src, srcType, dst, n);
+  } else {
+    /* half <-> bfloat16 through a float chunk */
+    float tmp[CONVERT_CHUNK];
+    const uint16_t *in = src;
+    uint16_t *out = dst;
+    for (size_t i = 0; i < n; i += CONVERT_CHUNK) {
+      size_t len = n - i < CONVERT_CHUNK ? n - i : CONVERT_CHUNK;
+      toFloat(in + i, srcType, tmp, len);
+      fromFloat(tmp, out + i, dstType, len);
+    }
+  }
+}
+
+typedef void (*SpanFn)(const MtHostKernelArgs *args, const uint32_t *ld,
+                       size_t row, size_t col, size_t n);
+
+/* Calls fn for each run of elements the threadgroup covers that is
+ * contiguous in all count operands, whose rows are ld[i] apart: the whole
+ * tile when it spans full rows of packed operands, otherwise one run per
+ * row. */
+static void forEachSpan(const MtHostKernelArgs *args,
+                        const MtHostThreadgroup *tg, const uint32_t *ld,
+                        size_t count, SpanFn fn) {
+  const size_t width = args->threadsPerGrid.width;
+  const size_t tileWidth = tg->threadsPerThreadgroup.width;
+  bool packed = tileWidth == width;
+
+  for (size_t i = 0; i < count && packed; ++i)
+    packed = ld[i] == width;
+  if (packed) {
+    fn(args, ld, tg->threadOrigin.y, 0,
+       width * tg->threadsPerThreadgroup.height);
+    return;
+  }
+  for (size_t y = 0; y < tg->threadsPerThreadgroup.height; ++y)
+    fn(args, ld, tg->threadOrigin.y + y, tg->threadOrigin.x, tileWidth);
+}
+
+static void convertSpan(const MtHostKernelArgs *args, const uint32_t *ld,
+                        size_t row, size_t col, size_t n) {
+  const MtDataType srcType = *(const uint32_t *)args->buffers[2];
+  const MtDataType dstType = *(const uint32_t *)args->buffers[3];
+  convertElements((const char *)args->buffers[0] +
+                      (row * ld[0] + col) * elementSize(srcType),
+                  srcType,
+                  (char *)args->buffers[1] +
+                      (row * ld[1] + col) * elementSize(dstType),
+                  dstType, n);
+}
+
+void convertMatrixKernel(const MtHostKernelArgs *args,
+                         const MtHostThreadgroup *tg) {
+  forEachSpan(args, tg, args->buffers[4], 2, convertSpan);
+}
+
+/* C = A + B for 16-bit storage, widened to float a chunk at a time. */
+static void addSpan(const MtHostKernelArgs *args, const uint32_t *ld,
+                    size_t row, size_t col, size_t n, MtDataType type) {
+  const uint16_t *A = (const uint16_t *)args->buffers[0] + row * ld[0] + col;
+  const uint16_t *B = (const uint16_t *)args->buffers[1] + row * ld[1] + col;
+  uint16_t *C = (uint16_t *)args->buffers[2] + row * ld[2] + col;
+  ConvertVec a[CONVERT_CHUNK / CONVERT_LANES], b[CONVERT_CHUNK / CONVERT_LANES];
+
+  for (size_t i = 0; i < n; i += CONVERT_CHUNK) {
+    size_t len = n - i < CONVERT_CHUNK ? n - i : CONVERT_CHUNK;
+    toFloat(A + i, type, (float *)a, len);
+    toFloat(B + i, type, (float *)b, len);
+    /* lanes past len hold stale sums that are never stored */
+    for (size_t j = 0; j < (len + CONVERT_LANES - 1) / CONVERT_LANES; ++j)
+      a[j] += b[j];
+    fromFloat((float *)a, C + i, type, len);
+  }
+}
+
+static void addHalfSpan(const MtHostKernelArgs *args, const uint32_t *ld,
+                        size_t row, size_t col, size_t n) {
+  addSpan(args, ld, row, col, n, MtDataTypeHalf);
+}
+
+static void addBFloatSpan(const MtHostKernelArgs *args, const uint32_t *ld,
+                          size_t row, size_t col, size_t n) {
+  addSpan(args, ld, row, col, n, MtDataTypeBFloat);
+}
+
+void matrixAdditionHalfKernel(const MtHostKernelArgs *args,
+                              const MtHostThreadgroup *tg) {
+  forEachSpan(args, tg, args->buffers[3], 3, addHalfSpan);
+}
+
+void matrixAdditionBFloatKernel(const MtHostKernelArgs *args,
+                                const MtHostThreadgroup *tg) {
+  forEachSpan(args, tg, args->buffers[3], 3, addBFloatSpan);
+}
@@ -0,0 +1,71 @@
+#ifndef alloy_float16_h
+#define alloy_float16_h
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Scalar conversions between float and the two 16-bit storage formats,
+ * IEEE half and bfloat16 (the top half of a float). Narrowing rounds to
+ * nearest even like the F16C and AVX-512 BF16 instructions, so scalar tails
+ * match the vector bodies.
+ */
+
+static inline float halfToFloat(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+  uint32_t bits;
+  float f;
+
+  if (exp == 0x1f) {
+    bits = sign | 0x7f800000 | (mant << 13) | (mant ? 0x400000 : 0);
+  } else if (exp) {
+    bits = sign | ((exp + 112) << 23) | (mant << 13);
+  } else {
+    f = (float)mant * 0x1p-24f; /* zero or subnormal */
+    memcpy(&bits, &f, sizeof(bits));
+    bits |= sign;
+  }
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static inline uint16_t floatToHalf(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  uint16_t sign = (bits >> 16) & 0x8000;
+  uint32_t abs = bits & 0x7fffffff;
+
+  if (abs > 0x7f800000)
+    return sign | 0x7e00 | (uint16_t)((abs >> 13) & 0x3ff);
+  if (abs >= 0x477ff000) /* rounds past 65504 */
+    return sign | 0x7c00;
+  if (abs < 0x38800000) {
+    /* subnormal: units of 2^-24, rounded by the FPU */
+    float a;
+    memcpy(&a, &abs, sizeof(a));
+    a = (a * 0x1p24f + 0x1p23f) - 0x1p23f;
+    return sign | (uint16_t)a;
+  }
+  abs -= 112u << 23;
+  abs += 0xfff + ((abs >> 13) & 1);
+  return sign | (uint16_t)(abs >> 13);
+}
+
+static inline float bfloatToFloat(uint16_t b) {
+  uint32_t bits = (uint32_t)b << 16;
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static inline uint16_t floatToBFloat(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  if ((bits & 0x7fffffff) > 0x7f800000)
+    return (uint16_t)(bits >> 16) | 0x40; /* keep NaNs quiet */
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return (uint16_t)(bits >> 16);
+}
+
+#endif /* alloy_float16_h */
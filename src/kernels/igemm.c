@@ -0,0 +1,491 @@
+#include "kernels.h"
+#include "lanes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IGEMM_X86 1
+#endif
+
+/*
+ * Int8 GEMM for one threadgroup tile, blocked and packed like sgemm.c. The
+ * dot-product instructions (VNNI vpdpbusd) multiply unsigned bytes by signed
+ * ones and add four adjacent products into each int32 lane, so B is packed
+ * with its sign bits flipped (b + 128), four k to a column lane, and A is
+ * copied as is and broadcast four bytes at a time. The 128 * rowsum(A) this
+ * adds to every sum is taken back on the last K block, by the same epilogue
+ * that applies the zero points and scales while the micro-tile is in L1.
+ *
+ * Sums wrap modulo 2^32 like the instructions do, so they are exact whenever
+ * the true result fits in an int32.
+ */
+
+#define IGEMM_KC 512 /* bytes per packed A row; a multiple of 4 */
+#define IGEMM_MAX_MR 12
+#define IGEMM_MAX_NR 32
+
+/* Everything the last K block needs to finish a micro-tile of C. */
+typedef struct IgemmEpilogue {
+  size_t K;
+  const int32_t *acc; /* sums of the earlier K blocks, or NULL */
+  size_t ldAcc;
+  const int32_t *rowSums; /* of A, per tile row */
+  const int32_t *colSums; /* of B per tile column, when A has zero points */
+  const QuantScales *qa;  /* NULL for int32 output */
+  const float *scaleB;    /* B's parameters, one per tile column */
+  const int32_t *zeroB;   /* NULL when B is symmetric */
+  void *C;
+  size_t ldc;
+} IgemmEpilogue;
+
+typedef void (*IgemmMicrokernel)(size_t kc, const int8_t *a, const uint8_t *b,
+                                 int32_t *c, size_t ldc, bool accumulate);
+typedef void (*IgemmFinish)(const IgemmEpilogue *e, const int32_t *tile,
+                            size_t ldt, size_t i, size_t j, size_t rows,
+                            size_t cols);
+
+typedef struct IgemmImpl {
+  size_t mr, nr;
+  IgemmMicrokernel kernel;
+  IgemmFinish finish;
+} IgemmImpl;
+
+/* Turns the biased sums of the micro-tile at (i, j) into C: int32 sums, or
+ * sa * sb * sum((a - za) * (b - zb)) expanded into terms of the plain sum
+ * and the row and column sums. */
+LANES_INLINE void finishTile(const IgemmEpilogue *e, const int32_t *tile,
+                             size_t ldt, size_t i, size_t j, size_t rows,
+                             size_t cols) {
+  for (size_t r = 0; r < rows; ++r) {
+    const size_t row = i + r;
+    const uint32_t rowSum = e->rowSums[row];
+    float sa = 0.0f;
+    uint32_t za = 0;
+    if (e->qa) {
+      sa = e->qa->scales[row * e->qa->scaleStep];
+      za = e->qa->zeros ? e->qa->zeros[row * e->qa->zeroStep] : 0;
+    }
+
+    for (size_t x = 0; x < cols; x += LANES) {
+      const size_t n = cols - x < LANES ? cols - x : LANES;
+      LaneUInt v, prev = {0};
+      memcpy(&v, tile + r * ldt + x, sizeof(v));
+      if (e->acc)
+        loadLanes(&prev, e->acc + row * e->ldAcc + j + x, n, sizeof(int32_t));
+      v += prev - 128u * rowSum;
+
+      if (!e->qa) {
+        storeLanes((int32_t *)e->C + row * e->ldc + j + x, &v, n,
+                   sizeof(int32_t));
+        continue;
+      }
+      if (e->zeroB) {
+        LaneUInt zb;
+        memcpy(&zb, e->zeroB + j + x, sizeof(zb));
+        v -= zb * (rowSum - (uint32_t)e->K * za);
+      }
+      if (za) {
+        LaneUInt colSum;
+        memcpy(&colSum, e->colSums + j + x, sizeof(colSum));
+        v -= za * colSum;
+      }
+      LaneFloat sb;
+      memcpy(&sb, e->scaleB + j + x, sizeof(sb));
+      LaneFloat out = __builtin_convertvector((LaneInt)v, LaneFloat) * (sa * sb);
+      storeLanes((float *)e->C + row * e->ldc + j + x, &out, n, sizeof(float));
+    }
+  }
+}
+
+static void microkernelGeneric(size_t kc, const int8_t *a, const uint8_t *b,
+                               int32_t *c, size_t ldc, bool accumulate) {
+  enum { MR = 4, NR = 16 };
+  uint32_t acc[MR][NR] = {{0}};
+
+  for (size_t k = 0; k < kc; k += 4, b += 4 * NR) {
+    for (size_t r = 0; r < MR; ++r) {
+      for (size_t j = 0; j < NR; ++j) {
+        for (size_t t = 0; t < 4; ++t)
+          acc[r][j] += (uint32_t)(a[r * IGEMM_KC + k + t] * b[j * 4 + t]);
+      }
+    }
+  }
+  for (size_t r = 0; r < MR; ++r) {
+    for (size_t j = 0; j < NR; ++j)
+      c[r * ldc + j] = (int32_t)(accumulate ? (uint32_t)c[r * ldc + j] +
+                                                  acc[r][j]
+                                            : acc[r][j]);
+  }
+}
+
+static void finishGeneric(const IgemmEpilogue *e, const int32_t *tile,
+                          size_t ldt, size_t i, size_t j, size_t rows,
+                          size_t cols) {
+  finishTile(e, tile, ldt, i, j, rows, cols);
+}
+
+#ifdef IGEMM_X86
+__attribute__((target("avx2,avxvnni"))) static void
+microkernelVnni256(size_t kc, const int8_t *a, const uint8_t *b, int32_t *c,
+                   size_t ldc, bool accumulate) {
+  enum { MR = 6 };
+  __m256i acc[MR][2];
+  for (int r = 0; r < MR; ++r)
+    acc[r][0] = acc[r][1] = _mm256_setzero_si256();
+
+  for (size_t k = 0; k < kc; k += 4, b += 64) {
+    const __m256i b0 = _mm256_load_si256((const __m256i *)b);
+    const __m256i b1 = _mm256_load_si256((const __m256i *)(b + 32));
+#pragma GCC unroll 6
+    for (int r = 0; r < MR; ++r) {
+      int32_t quad;
+      memcpy(&quad, a + r * IGEMM_KC + k, sizeof(quad));
+      const __m256i ar = _mm256_set1_epi32(quad);
+      acc[r][0] = _mm256_dpbusd_avx_epi32(acc[r][0], b0, ar);
+      acc[r][1] = _mm256_dpbusd_avx_epi32(acc[r][1], b1, ar);
+    }
+  }
+
+  for (int r = 0; r < MR; ++r) {
+    __m256i *cr = (__m256i *)(c + r * ldc);
+    if (accumulate) {
+      acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_loadu_si256(cr));
+      acc[r][1] = _mm256_add_epi32(acc[r][1], _mm256_loadu_si256(cr + 1));
+    }
+    _mm256_storeu_si256(cr, acc[r][0]);
+    _mm256_storeu_si256(cr + 1, acc[r][1]);
+  }
+}
+
+__attribute__((target("avx512f,avx512vnni"))) static void
+microkernelVnni512(size_t kc, const int8_t *a, const uint8_t *b, int32_t *c,
+                   size_t ldc, bool accumulate) {
+  enum { MR = 12 };
+  __m512i acc[MR][2];
+  for (int r = 0; r < MR; ++r)
+    acc[r][0] = acc[r][1] = _mm512_setzero_si512();
+
+  for (size_t k = 0; k < kc; k += 4, b += 128) {
+    const __m512i b0 = _mm512_load_si512(b);
+    const __m512i b1 = _mm512_load_si512(b + 64);
+#pragma GCC unroll 12
+    for (int r = 0; r < MR; ++r) {
+      int32_t quad;
+      memcpy(&quad, a + r * IGEMM_KC + k, sizeof(quad));
+      const __m512i ar = _mm512_set1_epi32(quad);
+      acc[r][0] = _mm512_dpbusd_epi32(acc[r][0], b0, ar);
+      acc[r][1] = _mm512_dpbusd_epi32(acc[r][1], b1, ar);
+    }
+  }
+
+  for (int r = 0; r < MR; ++r) {
+    int32_t *cr = c + r * ldc;
+    if (accumulate) {
+      acc[r][0] = _mm512_add_epi32(acc[r][0], _mm512_loadu_si512(cr));
+      acc[r][1] = _mm512_add_epi32(acc[r][1], _mm512_loadu_si512(cr + 16));
+    }
+    _mm512_storeu_si512(cr, acc[r][0]);
+    _mm512_storeu_si512(cr + 16, acc[r][1]);
+  }
+}
+
+__attribute__((target("avx2"))) static void
+finishAvx2(const IgemmEpilogue *e, const int32_t *tile, size_t ldt, size_t i,
+           size_t j, size_t rows, size_t cols) {
+  finishTile(e, tile, ldt, i, j, rows, cols);
+}
+
+__attribute__((target("avx512f"))) static void
+finishAvx512(const IgemmEpilogue *e, const int32_t *tile, size_t ldt,
+             size_t i, size_t j, size_t rows, size_t cols) {
+  finishTile(e, tile, ldt, i, j, rows, cols);
+}
+#endif
+
+static const IgemmImpl *igemmImpl(void) {
+  static const IgemmImpl generic = {4, 16, microkernelGeneric, finishGeneric};
+#ifdef IGEMM_X86
+  static const IgemmImpl vnni256 = {6, 16, microkernelVnni256, finishAvx2};
+  static const IgemmImpl vnni512 = {12, 32, microkernelVnni512, finishAvx512};
+  if (__builtin_cpu_supports("avx512vnni"))
+    return &vnni512;
+  if (__builtin_cpu_supports("avxvnni"))
+    return &vnni256;
+#endif
+  return &generic;
+}
+
+static size_t roundUp(size_t x, size_t m) { return (x + m - 1) / m * m; }
+
+/* Copies kc bytes of src to dst, zero-padded to kc4, and returns their
+ * sum. */
+static int32_t copyRow(const int8_t *src, int8_t *dst, size_t kc,
+                       size_t kc4) {
+  size_t k = 0;
+  int32_t sum = 0;
+#ifdef __SSE2__
+  /* psadbw sums unsigned bytes: flip the signs and take 128 a byte back */
+  const __m128i flip = _mm_set1_epi8((char)0x80);
+  __m128i total = _mm_setzero_si128();
+  for (; k + 16 <= kc; k += 16) {
+    const __m128i x = _mm_loadu_si128((const __m128i *)(src + k));
+    _mm_storeu_si128((__m128i *)(dst + k), x);
+    total = _mm_add_epi64(total, _mm_sad_epu8(_mm_xor_si128(x, flip),
+                                              _mm_setzero_si128()));
+  }
+  int64_t halves[2];
+  _mm_storeu_si128((__m128i *)halves, total);
+  sum = (int32_t)(halves[0] + halves[1] - 128 * (int64_t)k);
+#endif
+  for (; k < kc; ++k) {
+    dst[k] = src[k];
+    sum += src[k];
+  }
+  memset(dst + kc, 0, kc4 - kc);
+  return sum;
+}
+
+/* Copies rows [0, mc) x cols [0, kc) of A into MR-row micro-panels whose rows
+ * are IGEMM_KC bytes apart, zero-padded to kc4 columns and MR rows, and adds
+ * the sum of each row to rowSums. */
+static void packA(size_t mc, size_t kc, size_t kc4, const int8_t *A,
+                  size_t lda, size_t mr, int8_t *dst, int32_t *rowSums) {
+  for (size_t i = 0; i < mc; i += mr, dst += mr * IGEMM_KC) {
+    size_t rows = mc - i < mr ? mc - i : mr;
+    for (size_t r = 0; r < rows; ++r)
+      rowSums[i + r] +=
+          copyRow(A + (i + r) * lda, dst + r * IGEMM_KC, kc, kc4);
+    for (size_t r = rows; r < mr; ++r)
+      memset(dst + r * IGEMM_KC, 0, kc4);
+  }
+}
+
+#ifdef __SSE2__
+static __m128i widenLow(__m128i x) {
+  return _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8);
+}
+
+static __m128i widenHigh(__m128i x) {
+  return _mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8);
+}
+
+/* Adds 16 columns of 16-bit sums to sums. */
+static void flushColumnSums(int32_t *sums, __m128i low, __m128i high) {
+  const __m128i parts[4] = {
+      _mm_srai_epi32(_mm_unpacklo_epi16(low, low), 16),
+      _mm_srai_epi32(_mm_unpackhi_epi16(low, low), 16),
+      _mm_srai_epi32(_mm_unpacklo_epi16(high, high), 16),
+      _mm_srai_epi32(_mm_unpackhi_epi16(high, high), 16),
+  };
+  for (int q = 0; q < 4; ++q) {
+    __m128i *dst = (__m128i *)(sums + 4 * q);
+    _mm_storeu_si128(dst, _mm_add_epi32(_mm_loadu_si128(dst), parts[q]));
+  }
+}
+
+/* packColumns for 16 whole columns, four rows at a time: two rounds of
+ * unpacks turn four rows into four bytes per column. Returns the rows
+ * packed. Column sums gather in 16 bits, which 32 groups cannot overflow. */
+static size_t packColumns16(size_t kc, const int8_t *B, size_t ldb,
+                            size_t nr, uint8_t *dst, int32_t *colSums) {
+  const __m128i flip = _mm_set1_epi8((char)0x80);
+  __m128i sumLow = _mm_setzero_si128(), sumHigh = _mm_setzero_si128();
+  unsigned pending = 0;
+  size_t k = 0;
+
+  for (; k + 4 <= kc; k += 4) {
+    __m128i r0 = _mm_loadu_si128((const __m128i *)(B + k * ldb));
+    __m128i r1 = _mm_loadu_si128((const __m128i *)(B + (k + 1) * ldb));
+    __m128i r2 = _mm_loadu_si128((const __m128i *)(B + (k + 2) * ldb));
+    __m128i r3 = _mm_loadu_si128((const __m128i *)(B + (k + 3) * ldb));
+
+    if (colSums) {
+      sumLow = _mm_add_epi16(
+          sumLow, _mm_add_epi16(_mm_add_epi16(widenLow(r0), widenLow(r1)),
+                                _mm_add_epi16(widenLow(r2), widenLow(r3))));
+      sumHigh = _mm_add_epi16(
+          sumHigh,
+          _mm_add_epi16(_mm_add_epi16(widenHigh(r0), widenHigh(r1)),
+                        _mm_add_epi16(widenHigh(r2), widenHigh(r3))));
+      if (++pending == 32) {
+        flushColumnSums(colSums, sumLow, sumHigh);
+        sumLow = sumHigh = _mm_setzero_si128();
+        pending = 0;
+      }
+    }
+
+    r0 = _mm_xor_si128(r0, flip);
+    r1 = _mm_xor_si128(r1, flip);
+    r2 = _mm_xor_si128(r2, flip);
+    r3 = _mm_xor_si128(r3, flip);
+    const __m128i low01 = _mm_unpacklo_epi8(r0, r1);
+    const __m128i high01 = _mm_unpackhi_epi8(r0, r1);
+    const __m128i low23 = _mm_unpacklo_epi8(r2, r3);
+    const __m128i high23 = _mm_unpackhi_epi8(r2, r3);
+    __m128i *out = (__m128i *)(dst + k * nr);
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(low01, low23));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(low01, low23));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(high01, high23));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(high01, high23));
+  }
+  if (colSums && pending)
+    flushColumnSums(colSums, sumLow, sumHigh);
+  return k;
+}
+#endif
+
+/* Packs n <= 16 columns of B into a 16-column slice of a panel NR columns
+ * wide, adding their sums to colSums unless it is NULL. */
+static void packColumns(size_t kc, size_t kc4, size_t n, const int8_t *B,
+                        size_t ldb, size_t nr, uint8_t *dst,
+                        int32_t *colSums) {
+  size_t k = 0;
+#ifdef __SSE2__
+  if (n == 16)
+    k = packColumns16(kc, B, ldb, nr, dst, colSums);
+#endif
+  for (; k < kc4; k += 4) {
+    uint8_t *out = dst + k * nr;
+    for (size_t x = 0; x < 16; ++x) {
+      for (size_t t = 0; t < 4; ++t) {
+        const bool inside = x < n && k + t < kc;
+        const int8_t v = inside ? B[(k + t) * ldb + x] : 0;
+        out[x * 4 + t] = inside ? (uint8_t)v ^ 0x80 : 0;
+        if (inside && colSums)
+          colSums[x] += v;
+      }
+    }
+  }
+}
+
+/* Packs rows [0, kc) x cols [0, nc) of B into NR-column micro-panels: each
+ * group of four rows holds, column by column, their four bytes with the sign
+ * bit flipped, zero-padded to NR columns and kc4 rows. */
+static void packB(size_t kc, size_t kc4, size_t nc, const int8_t *B,
+                  size_t ldb, size_t nr, uint8_t *dst, int32_t *colSums) {
+  for (size_t j = 0; j < nc; j += nr, dst += nr * kc4) {
+    for (size_t c = 0; c < nr; c += 16) {
+      const size_t first = j + c;
+      const size_t n = first >= nc ? 0 : nc - first < 16 ? nc - first : 16;
+      packColumns(kc, kc4, n, B + first, ldb, nr, dst + c * 4,
+                  colSums && n ? colSums + first : NULL);
+    }
+  }
+}
+
+bool igemm(size_t M, size_t N, size_t K, const int8_t *A, size_t lda,
+           const int8_t *B, size_t ldb, const QuantScales *qa,
+           const QuantScales *qb, void *C, size_t ldc) {
+  const IgemmImpl *impl = igemmImpl();
+  const size_t mr = impl->mr, nr = impl->nr;
+  const bool dequantize = qa && qb;
+
+  if (!M || !N)
+    return true;
+  if (!K) {
+    /* int32 and float zeros share their bits */
+    for (size_t i = 0; i < M; ++i)
+      memset((int32_t *)C + i * ldc, 0, N * sizeof(int32_t));
+    return true;
+  }
+
+  /* zero points of A call for the column sums of B */
+  bool zeroA = false;
+  if (dequantize && qa->zeros) {
+    for (size_t i = 0; i < M && !zeroA; ++i)
+      zeroA = qa->zeros[i * qa->zeroStep] != 0;
+  }
+
+  /* 64-byte aligned regions: the packed panels, the row and column sums, B's
+   * parameters per column and, for a float C that takes several K blocks,
+   * the int32 sums so far */
+  const size_t rowsA = roundUp(M, mr), colsB = roundUp(N, nr);
+  const size_t kcMax = roundUp(K < IGEMM_KC ? K : IGEMM_KC, 4);
+  const size_t colBytes = roundUp(colsB * sizeof(int32_t), 64);
+  const size_t offB = rowsA * IGEMM_KC;
+  const size_t offRows = offB + roundUp(colsB * kcMax, 64);
+  const size_t offCols = offRows + roundUp(rowsA * sizeof(int32_t), 64);
+  const size_t offScales = offCols + colBytes;
+  const size_t offZeros = offScales + (dequantize ? colBytes : 0);
+  const size_t offAcc = offZeros + (dequantize ? colBytes : 0);
+  const size_t size =
+      offAcc + (dequantize && K > IGEMM_KC ? M * N * sizeof(int32_t) : 0);
+  char *scratch = gemmScratch(size);
+  if (!scratch)
+    return false;
+
+  int8_t *packedA = (int8_t *)scratch;
+  uint8_t *packedB = (uint8_t *)scratch + offB;
+  int32_t *rowSums = (int32_t *)(scratch + offRows);
+  int32_t *colSums = (int32_t *)(scratch + offCols);
+  memset(rowSums, 0, rowsA * sizeof(int32_t));
+  memset(colSums, 0, colsB * sizeof(int32_t));
+
+  IgemmEpilogue e = {
+      .K = K,
+      .rowSums = rowSums,
+      .colSums = zeroA ? colSums : NULL,
+      .qa = dequantize ? qa : NULL,
+      .C = C,
+      .ldc = ldc,
+  };
+  if (dequantize) {
+    float *scaleB = (float *)(scratch + offScales);
+    int32_t *zeroB = (int32_t *)(scratch + offZeros);
+    for (size_t j = 0; j < colsB; ++j) {
+      scaleB[j] = j < N ? qb->scales[j * qb->scaleStep] : 0.0f;
+      zeroB[j] = j < N && qb->zeros ? qb->zeros[j * qb->zeroStep] : 0;
+    }
+    e.scaleB = scaleB;
+    e.zeroB = qb->zeros ? zeroB : NULL;
+  }
+
+  /* earlier K blocks accumulate straight into an int32 C */
+  int32_t *acc = dequantize ? (int32_t *)(scratch + offAcc) : C;
+  const size_t ldAcc = dequantize ? N : ldc;
+  if (K > IGEMM_KC) {
+    e.acc = acc;
+    e.ldAcc = ldAcc;
+  }
+
+  int32_t edge[IGEMM_MAX_MR * IGEMM_MAX_NR] __attribute__((aligned(64)));
+
+  for (size_t p = 0; p < K; p += IGEMM_KC) {
+    const size_t kc = K - p < IGEMM_KC ? K - p : IGEMM_KC;
+    const size_t kc4 = roundUp(kc, 4);
+    const bool accumulate = p > 0, last = K - p <= IGEMM_KC;
+
+    packB(kc, kc4, N, B + p * ldb, ldb, nr, packedB, zeroA ? colSums : NULL);
+    packA(M, kc, kc4, A + p, lda, mr, packedA, rowSums);
+
+    for (size_t i = 0; i < M; i += mr) {
+      const int8_t *a = packedA + i * IGEMM_KC;
+      const size_t rows = M - i < mr ? M - i : mr;
+
+      for (size_t j = 0; j < N; j += nr) {
+        const uint8_t *b = packedB + j * kc4;
+        const size_t cols = N - j < nr ? N - j : nr;
+        int32_t *c = acc + i * ldAcc + j;
+
+        if (last) {
+          impl->kernel(kc4, a, b, edge, nr, false);
+          impl->finish(&e, edge, nr, i, j, rows, cols);
+          continue;
+        }
+        if (rows == mr && cols == nr) {
+          impl->kernel(kc4, a, b, c, ldAcc, accumulate);
+          continue;
+        }
+
+        impl->kernel(kc4, a, b, edge, nr, false);
+        for (size_t r = 0; r < rows; ++r) {
+          for (size_t x = 0; x < cols; ++x) {
+            uint32_t v = edge[r * nr + x];
+            c[r * ldAcc + x] =
+                (int32_t)(accumulate ? (uint32_t)c[r * ldAcc + x] + v : v);
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
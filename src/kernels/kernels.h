@@ -0,0 +1,179 @@
+#ifndef alloy_kernels_h
+#define alloy_kernels_h
+
+#include "../../include/cmt/host.h"
+#include "float16.h"
+
+/*
+ * Host implementations of the Metal kernels in alloy.c. Each one runs a whole
+ * threadgroup, unless noted, and is registered under the Metal function
+ * name, so the same library/function/pipeline code path works on both
+ * backends. All of them take one more argument after those listed: the
+ * leading dimension of every operand, as a uint array.
+ */
+
+/* matrix_addition is per-thread, in SPMD form: its single phase for this
+ * CPU, and the threads it runs per call. */
+const MtHostThreadFn *matrixAdditionPhases(void);
+NsUInteger matrixAdditionLanes(void);
+void matrixMultiplicationKernel(const MtHostKernelArgs *args,
+                                const MtHostThreadgroup *tg);
+void matrixMultiplicationBatchedKernel(const MtHostKernelArgs *args,
+                                       const MtHostThreadgroup *tg);
+
+/* 16-bit storage variants. The multiplications take the element type of C
+ * (float or the input type) as one more constant after the sizes (and, for
+ * those that are not batched, after the GEMM_TRANSPOSE_* flags that all
+ * non-batched float-family multiplications take). */
+void matrixAdditionHalfKernel(const MtHostKernelArgs *args,
+                              const MtHostThreadgroup *tg);
+void matrixAdditionBFloatKernel(const MtHostKernelArgs *args,
+                                const MtHostThreadgroup *tg);
+void matrixMultiplicationHalfKernel(const MtHostKernelArgs *args,
+                                    const MtHostThreadgroup *tg);
+void matrixMultiplicationHalfBatchedKernel(const MtHostKernelArgs *args,
+                                           const MtHostThreadgroup *tg);
+void matrixMultiplicationBFloatKernel(const MtHostKernelArgs *args,
+                                      const MtHostThreadgroup *tg);
+void matrixMultiplicationBFloatBatchedKernel(const MtHostKernelArgs *args,
+                                             const MtHostThreadgroup *tg);
+void convertMatrixKernel(const MtHostKernelArgs *args,
+                         const MtHostThreadgroup *tg);
+
+/* int8 variants. matrix_multiplication_int8 takes A, B, C (int32 sums), M,
+ * N and K; its dequantizing form A, B, A's scales and zero points, B's,
+ * float C, M, N, K and the axes of those four parameters as a uint4.
+ * quantize_matrix and dequantize_matrix take the source, scales, zero points
+ * and destination, then the source type (dequantize_matrix only) and the
+ * axes of the scales and zero points as a uint2. */
+#define QUANT_AXIS_TENSOR 0 /* the QuantAxis values of alloy.h */
+#define QUANT_AXIS_ROW 1
+#define QUANT_AXIS_COLUMN 2
+
+void matrixMultiplicationInt8Kernel(const MtHostKernelArgs *args,
+                                    const MtHostThreadgroup *tg);
+void matrixMultiplicationInt8DequantizeKernel(const MtHostKernelArgs *args,
+                                              const MtHostThreadgroup *tg);
+void quantizeMatrixKernel(const MtHostKernelArgs *args,
+                          const MtHostThreadgroup *tg);
+void dequantizeMatrixKernel(const MtHostKernelArgs *args,
+                            const MtHostThreadgroup *tg);
+
+/* Sparse A times or plus dense B: A's row offsets, column indices, values
+ * and partition bounds, B, C, then uint4 dims {rows, cols, columns of B and
+ * C, block size}. Threadgroup rows are partitions of A. */
+void sparseMultiplicationKernel(const MtHostKernelArgs *args,
+                                const MtHostThreadgroup *tg);
+void sparseAdditionKernel(const MtHostKernelArgs *args,
+                          const MtHostThreadgroup *tg);
+
+/* transpose_matrix takes src, dst and the element size, over dst's shape;
+ * transpose_matrix_in_place the square matrix and the element size. */
+void transposeMatrixKernel(const MtHostKernelArgs *args,
+                           const MtHostThreadgroup *tg);
+void transposeMatrixInPlaceKernel(const MtHostKernelArgs *args,
+                                  const MtHostThreadgroup *tg);
+
+void fusedElementwiseKernel(const MtHostKernelArgs *args,
+                            const MtHostThreadgroup *tg);
+
+/* matrix_row_sums takes A, the sums (one per row, ld[1] apart) and uint2
+ * dims {rows, cols}, with one float of threadgroup memory 0 per thread. It is
+ * per-thread, run LANES threads to a call: its four phases for this CPU. Its
+ * threadgroups hold at most ROW_SUMS_MAX_THREADS threads, the length of the
+ * static array its sums are gathered in, in the shader too. */
+#define ROW_SUMS_MAX_THREADS 1024
+const MtHostThreadFn *matrixRowSumsPhases(void);
+
+/*
+ * Fused elementwise programs (built in fusion.c): straight-line register code
+ * evaluated for every element of the grid. Inputs are bound at buffers
+ * 0..FUSED_MAX_INPUTS-1, the output at FUSED_OUTPUT_INDEX, the program and
+ * its length after it. FusedInstr has the same layout in the Metal shader.
+ */
+#define FUSED_MAX_INPUTS 8
+#define FUSED_MAX_REGS 16
+#define FUSED_MAX_INSTRS 64
+#define FUSED_OUTPUT_INDEX FUSED_MAX_INPUTS
+
+typedef enum FusedOpcode {
+  FUSED_LOAD,  /* dst = input[a] */
+  FUSED_CONST, /* dst = imm */
+  FUSED_ADD,   /* dst = a op b ... */
+  FUSED_SUB,
+  FUSED_MUL,
+  FUSED_DIV,
+  FUSED_MIN,
+  FUSED_MAX,
+  FUSED_NEG, /* dst = op a ... */
+  FUSED_ABS,
+  FUSED_RELU,
+  FUSED_SQRT,
+  FUSED_EXP,
+  FUSED_STORE /* output = a */
+} FusedOpcode;
+
+typedef struct FusedInstr {
+  uint8_t op, dst, a, b;
+  float imm;
+} FusedInstr;
+
+/* C[M x N] = A[M x K] * B[K x N] for row-major operands with leading
+ * dimensions lda/ldb/ldc, using packed panels and SIMD microkernels on the
+ * system device's worker pool. False, with C partly written at most, if
+ * there is no memory to pack into. */
+bool sgemm(size_t M, size_t N, size_t K, const float *A, size_t lda,
+           const float *B, size_t ldb, float *C, size_t ldc);
+/* As sgemm for A and B stored as type and C as outType, each one of
+ * MtDataTypeFloat, Half or BFloat. Products accumulate in float. With
+ * GEMM_TRANSPOSE_A, A is stored K x M (lda apart) and used transposed;
+ * likewise B, stored N x K, with GEMM_TRANSPOSE_B. */
+#define GEMM_TRANSPOSE_A 1u
+#define GEMM_TRANSPOSE_B 2u
+bool gemm(size_t M, size_t N, size_t K, MtDataType type, const void *A,
+          size_t lda, const void *B, size_t ldb, MtDataType outType, void *C,
+          size_t ldc, unsigned transpose);
+/* float lanes per vector of the microkernel selected for this CPU */
+NsUInteger sgemmVectorWidth(void);
+/* The calling thread's packing memory, at least size bytes and 64-byte
+ * aligned, shared by the GEMMs; NULL if it cannot grow. */
+void *gemmScratch(size_t size);
+
+/*
+ * Quantization of one int8 GEMM operand, value = scale * (q - zero): steps
+ * are 0 for a single parameter and 1 for one per row of A or per column of
+ * B. zeros may be NULL for symmetric operands.
+ */
+typedef struct QuantScales {
+  const float *scales;
+  const int32_t *zeros;
+  size_t scaleStep, zeroStep;
+} QuantScales;
+
+/* C[M x N] = A[M x K] * B[K x N] for int8 A and B with dot-product
+ * instructions. With qa and qb NULL, C receives the int32 sums (modulo
+ * 2^32); otherwise they are dequantized into float C. False, with C
+ * unwritten, if there is no memory to pack into. */
+bool igemm(size_t M, size_t N, size_t K, const int8_t *A, size_t lda,
+           const int8_t *B, size_t ldb, const QuantScales *qa,
+           const QuantScales *qb, void *C, size_t ldc);
+
+/* Writes the transpose of the rows x cols block at src, whose rows are lds
+ * elements apart, to dst, whose rows are ldd apart, for elements of size 1,
+ * 2 or 4 bytes. */
+void transposeElements(const void *src, size_t lds, void *dst, size_t ldd,
+                       size_t rows, size_t cols, size_t size);
+
+/* Bytes per element of MtDataTypeFloat, Half, BFloat, Char and Int; 0 for
+ * others. */
+size_t elementSize(MtDataType type);
+/* Widens (or copies) n elements of type to float, and back. */
+void toFloat(const void *src, MtDataType type, float *dst, size_t n);
+void fromFloat(const float *src, void *dst, MtDataType type, size_t n);
+void convertElements(const void *src, MtDataType srcType, void *dst,
+                     MtDataType dstType, size_t n);
+
+/* Registers every kernel above; safe to call more than once. */
+void registerHostKernels(void);
+
+#endif /* alloy_kernels_h */
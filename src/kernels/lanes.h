@@ -0,0 +1,50 @@
+#ifndef alloy_lanes_h
+#define alloy_lanes_h
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * 16-lane GCC vectors for the kernels that do not go through the GEMM
+ * microkernels: the per-thread float ones (a SIMD-group of matrix_addition
+ * or matrix_row_sums is one vector), sparse products and the int8 ones.
+ * Their bodies are written once as always-inline functions on these types
+ * and instantiated in functions with different target attributes, so the
+ * same source compiles to one AVX-512 register, two AVX2 ones or four SSE2
+ * ones per vector.
+ */
+
+#define LANES 16
+#define LANES_INLINE static inline __attribute__((always_inline))
+
+typedef int32_t LaneInt __attribute__((vector_size(LANES * 4)));
+typedef uint32_t LaneUInt __attribute__((vector_size(LANES * 4)));
+typedef float LaneFloat __attribute__((vector_size(LANES * 4)));
+typedef int8_t LaneChar __attribute__((vector_size(LANES)));
+
+/* Loads the first n <= LANES elements of size bytes from src, zeroing the
+ * lanes past them. */
+LANES_INLINE void loadLanes(void *v, const void *src, size_t n, size_t size) {
+  if (n == LANES) {
+    memcpy(v, src, LANES * size);
+    return;
+  }
+  memset(v, 0, LANES * size);
+  memcpy(v, src, n * size);
+}
+
+/* Stores the first n <= LANES elements of v to dst. */
+LANES_INLINE void storeLanes(void *dst, const void *v, size_t n, size_t size) {
+  if (n == LANES)
+    memcpy(dst, v, LANES * size);
+  else
+    memcpy(dst, v, n * size);
+}
+
+/* Lane-wise mask ? a : b of the given vector type, for masks as vector
+ * comparisons produce them: all ones or all zeros in each lane. A macro, as
+ * passing these vectors by value would change the ABI on baseline targets. */
+#define selectLanes(type, mask, a, b)                                          \
+  ((type)(((mask) & (LaneInt)(a)) | (~(mask) & (LaneInt)(b))))
+
+#endif /* alloy_lanes_h */
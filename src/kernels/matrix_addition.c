@@ -0,0 +1,71 @@
+#include "kernels.h"
+#include "lanes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ADDITION_X86 1
+#endif
+
+/*
+ * matrix_addition as the shader has it, one thread per element, run LANES
+ * threads to a call by one body instantiated for AVX-512, AVX2 and baseline
+ * targets. The shader's bounds check is the partial load and store of the
+ * last SIMD-group of a threadgroup row.
+ */
+
+LANES_INLINE NsUInteger additionLanes(const MtHostKernelArgs *args,
+                                      const MtHostThread *thread) {
+  const float *A = args->buffers[0];
+  const float *B = args->buffers[1];
+  float *C = args->buffers[2];
+  const uint32_t *ld = args->buffers[3];
+  const size_t row = thread->threadPositionInGrid.y;
+  const size_t col = thread->threadPositionInGrid.x;
+  const size_t n = thread->activeLanes;
+
+  LaneFloat a, b;
+  loadLanes(&a, A + row * ld[0] + col, n, sizeof(float));
+  loadLanes(&b, B + row * ld[1] + col, n, sizeof(float));
+  a += b;
+  storeLanes(C + row * ld[2] + col, &a, n, sizeof(float));
+  return MT_HOST_PHASE_END;
+}
+
+static NsUInteger matrixAdditionGeneric(const MtHostKernelArgs *args,
+                                        const MtHostThreadgroup *tg,
+                                        const MtHostThread *thread) {
+  (void)tg;
+  return additionLanes(args, thread);
+}
+
+static const MtHostThreadFn genericPhases[] = {matrixAdditionGeneric};
+
+#ifdef ADDITION_X86
+__attribute__((target("avx2"))) static NsUInteger
+matrixAdditionAvx2(const MtHostKernelArgs *args, const MtHostThreadgroup *tg,
+                   const MtHostThread *thread) {
+  (void)tg;
+  return additionLanes(args, thread);
+}
+
+__attribute__((target("avx512f"))) static NsUInteger
+matrixAdditionAvx512(const MtHostKernelArgs *args, const MtHostThreadgroup *tg,
+                     const MtHostThread *thread) {
+  (void)tg;
+  return additionLanes(args, thread);
+}
+
+static const MtHostThreadFn avx2Phases[] = {matrixAdditionAvx2};
+static const MtHostThreadFn avx512Phases[] = {matrixAdditionAvx512};
+#endif
+
+const MtHostThreadFn *matrixAdditionPhases(void) {
+#ifdef ADDITION_X86
+  if (__builtin_cpu_supports("avx512f"))
+    return avx512Phases;
+  if (__builtin_cpu_supports("avx2"))
+    return avx2Phases;
+#endif
+  return genericPhases;
+}
+
+NsUInteger matrixAdditionLanes(void) { return LANES; }
@@ -0,0 +1,178 @@
+#include "kernels.h"
+
+/* A threadgroup's tile of an M x N product, clipped to it. */
+typedef struct Tile {
+  size_t x0, y0, width, height;
+} Tile;
+
+/* Returns false when the tile lies outside the product. */
+static bool clipTile(const MtHostThreadgroup *tg, uint32_t M, uint32_t N,
+                     Tile *tile) {
+  tile->x0 = tg->threadOrigin.x;
+  tile->y0 = tg->threadOrigin.y;
+  if (tile->x0 >= N || tile->y0 >= M)
+    return false;
+  tile->width = tg->threadsPerThreadgroup.width;
+  tile->height = tg->threadsPerThreadgroup.height;
+  if (tile->x0 + tile->width > N)
+    tile->width = N - tile->x0;
+  if (tile->y0 + tile->height > M)
+    tile->height = M - tile->y0;
+  return true;
+}
+
+/* Each threadgroup owns a height x width tile of an M x N product whose
+ * operands' rows are lda, ldb and ldc apart. A transposed A is stored K x M
+ * and a transposed B N x K, so their tiles start t.y0 columns and t.x0 rows
+ * in. False if the GEMM could not run. */
+static bool multiplyTile(MtDataType type, const char *A, size_t lda,
+                         const char *B, size_t ldb, MtDataType outType,
+                         char *C, size_t ldc, uint32_t M, uint32_t N,
+                         uint32_t K, unsigned transpose,
+                         const MtHostThreadgroup *tg) {
+  Tile t;
+  if (!clipTile(tg, M, N, &t))
+    return true;
+
+  const bool transA = transpose & GEMM_TRANSPOSE_A;
+  const bool transB = transpose & GEMM_TRANSPOSE_B;
+  const size_t size = elementSize(type), outSize = elementSize(outType);
+  return gemm(t.height, t.width, K, type,
+              A + (transA ? t.y0 : t.y0 * lda) * size, lda,
+              B + (transB ? t.x0 * ldb : t.x0) * size, ldb, outType,
+              C + (t.y0 * ldc + t.x0) * outSize, ldc, transpose);
+}
+
+static void failPacking(const MtHostKernelArgs *args) {
+  mtHostKernelFail(args, MtCommandBufferErrorOutOfMemory,
+                   "out of GEMM packing memory");
+}
+
+/* Arguments are A, B, C, M, N, K, then strideA, strideB, strideC when
+ * batched or the GEMM_TRANSPOSE_* flags when not, then the type of C for
+ * 16-bit inputs and the leading dimensions. */
+static void multiply(const MtHostKernelArgs *args, const MtHostThreadgroup *tg,
+                     MtDataType type, bool batched) {
+  const char *A = args->buffers[0];
+  const char *B = args->buffers[1];
+  char *C = args->buffers[2];
+  const uint32_t M = *(const uint32_t *)args->buffers[3];
+  const uint32_t N = *(const uint32_t *)args->buffers[4];
+  const uint32_t K = *(const uint32_t *)args->buffers[5];
+  const size_t constants = batched ? 9 : 7;
+  const MtDataType outType =
+      type == MtDataTypeFloat
+          ? MtDataTypeFloat
+          : (MtDataType) * (const uint32_t *)args->buffers[constants];
+  const uint32_t *ld =
+      args->buffers[type == MtDataTypeFloat ? constants : constants + 1];
+  const size_t size = elementSize(type), outSize = elementSize(outType);
+
+  if (!batched) {
+    if (!multiplyTile(type, A, ld[0], B, ld[1], outType, C, ld[2], M, N, K,
+                      *(const uint32_t *)args->buffers[6], tg))
+      failPacking(args);
+    return;
+  }
+
+  const uint32_t strideA = *(const uint32_t *)args->buffers[6];
+  const uint32_t strideB = *(const uint32_t *)args->buffers[7];
+  const uint32_t strideC = *(const uint32_t *)args->buffers[8];
+
+  /* z is the batch index */
+  for (size_t z = 0; z < tg->threadsPerThreadgroup.depth; ++z) {
+    size_t item = tg->threadOrigin.z + z;
+    if (!multiplyTile(type, A + item * strideA * size, ld[0],
+                      B + item * strideB * size, ld[1], outType,
+                      C + item * strideC * outSize, ld[2], M, N, K, 0, tg)) {
+      failPacking(args);
+      return;
+    }
+  }
+}
+
+void matrixMultiplicationKernel(const MtHostKernelArgs *args,
+                                const MtHostThreadgroup *tg) {
+  multiply(args, tg, MtDataTypeFloat, false);
+}
+
+void matrixMultiplicationBatchedKernel(const MtHostKernelArgs *args,
+                                       const MtHostThreadgroup *tg) {
+  multiply(args, tg, MtDataTypeFloat, true);
+}
+
+void matrixMultiplicationHalfKernel(const MtHostKernelArgs *args,
+                                    const MtHostThreadgroup *tg) {
+  multiply(args, tg, MtDataTypeHalf, false);
+}
+
+void matrixMultiplicationHalfBatchedKernel(const MtHostKernelArgs *args,
+                                           const MtHostThreadgroup *tg) {
+  multiply(args, tg, MtDataTypeHalf, true);
+}
+
+void matrixMultiplicationBFloatKernel(const MtHostKernelArgs *args,
+                                      const MtHostThreadgroup *tg) {
+  multiply(args, tg, MtDataTypeBFloat, false);
+}
+
+void matrixMultiplicationBFloatBatchedKernel(const MtHostKernelArgs *args,
+                                             const MtHostThreadgroup *tg) {
+  multiply(args, tg, MtDataTypeBFloat, true);
+}
+
+void matrixMultiplicationInt8Kernel(const MtHostKernelArgs *args,
+                                    const MtHostThreadgroup *tg) {
+  const int8_t *A = args->buffers[0];
+  const int8_t *B = args->buffers[1];
+  int32_t *C = args->buffers[2];
+  const uint32_t M = *(const uint32_t *)args->buffers[3];
+  const uint32_t N = *(const uint32_t *)args->buffers[4];
+  const uint32_t K = *(const uint32_t *)args->buffers[5];
+  const uint32_t *ld = args->buffers[6];
+  Tile t;
+
+  if (clipTile(tg, M, N, &t) &&
+      !igemm(t.height, t.width, K, A + t.y0 * ld[0], ld[0], B + t.x0, ld[1],
+             NULL, NULL, C + t.y0 * ld[2] + t.x0, ld[2]))
+    failPacking(args);
+}
+
+/* A's parameters go per row or for the whole tensor, B's per column or for
+ * the whole tensor; either way the tile starts at its own. */
+void matrixMultiplicationInt8DequantizeKernel(const MtHostKernelArgs *args,
+                                              const MtHostThreadgroup *tg) {
+  const int8_t *A = args->buffers[0];
+  const int8_t *B = args->buffers[1];
+  const float *scalesA = args->buffers[2];
+  const int32_t *zerosA = args->buffers[3];
+  const float *scalesB = args->buffers[4];
+  const int32_t *zerosB = args->buffers[5];
+  float *C = args->buffers[6];
+  const uint32_t M = *(const uint32_t *)args->buffers[7];
+  const uint32_t N = *(const uint32_t *)args->buffers[8];
+  const uint32_t K = *(const uint32_t *)args->buffers[9];
+  const uint32_t *axes = args->buffers[10];
+  const uint32_t *ld = args->buffers[11];
+  Tile t;
+
+  if (!clipTile(tg, M, N, &t))
+    return;
+
+  QuantScales qa = {
+      .scaleStep = axes[0] == QUANT_AXIS_ROW,
+      .zeroStep = axes[1] == QUANT_AXIS_ROW,
+  };
+  QuantScales qb = {
+      .scaleStep = axes[2] == QUANT_AXIS_COLUMN,
+      .zeroStep = axes[3] == QUANT_AXIS_COLUMN,
+  };
+  qa.scales = scalesA + qa.scaleStep * t.y0;
+  qa.zeros = zerosA + qa.zeroStep * t.y0;
+  qb.scales = scalesB + qb.scaleStep * t.x0;
+  qb.zeros = zerosB + qb.zeroStep * t.x0;
+
+  if (!igemm(t.height, t.width, K, A + t.y0 * ld[0], ld[0], B + t.x0, ld[1],
+             &qa, &qb, C + t.y0 * ld[6] + t.x0, ld[6]))
+    failPacking(args);
+}
@@ -0,0 +1,196 @@
+#include "kernels.h"
+#include "lanes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define QUANTIZE_X86 1
+#endif
+
+/*
+ * Quantization to int8 and back. Each row is processed LANES elements at a
+ * time by one body instantiated for AVX-512, AVX2 and baseline targets; the
+ * partial vector at the end of a row goes through the same code, so tails
+ * round exactly like the rest.
+ */
+
+/* dst = clamp(rint(src / scale) + zero, -128, 127). The quotient is first
+ * clamped to +-256 (NaN to -256), which keeps the conversion to int exact and
+ * lets adding and subtracting 1.5 * 2^23 round it to nearest even. */
+LANES_INLINE void quantizeLanes(const float *src, int8_t *dst, size_t n,
+                                const QuantScales *q) {
+  const LaneFloat zero = {0};
+  for (size_t x = 0; x < n; x += LANES) {
+    const size_t len = n - x < LANES ? n - x : LANES;
+    LaneFloat v, scale;
+    LaneInt zeroPoint;
+    loadLanes(&v, src + x, len, sizeof(float));
+    if (q->scaleStep)
+      loadLanes(&scale, q->scales + x, len, sizeof(float));
+    else
+      scale = zero + q->scales[0];
+    if (q->zeroStep)
+      loadLanes(&zeroPoint, q->zeros + x, len, sizeof(int32_t));
+    else
+      zeroPoint = (LaneInt){0} + q->zeros[0];
+
+    LaneFloat y = v / scale;
+    y = selectLanes(LaneFloat, y > -256.0f, y, zero - 256.0f);
+    y = selectLanes(LaneFloat, y < 256.0f, y, zero + 256.0f);
+    y = (y + 0x1.8p23f) - 0x1.8p23f;
+    LaneInt i = __builtin_convertvector(y, LaneInt) + zeroPoint;
+    i = selectLanes(LaneInt, i > -128, i, (LaneInt){0} - 128);
+    i = selectLanes(LaneInt, i < 127, i, (LaneInt){0} + 127);
+
+    const LaneChar out = __builtin_convertvector(i, LaneChar);
+    storeLanes(dst + x, &out, len, sizeof(int8_t));
+  }
+}
+
+/* dst = (src - zero) * scale for int8 or int32 src; the difference wraps
+ * like the int arithmetic of the shader. */
+LANES_INLINE void dequantizeLanes(const void *src, MtDataType type,
+                                  float *dst, size_t n, const QuantScales *q) {
+  for (size_t x = 0; x < n; x += LANES) {
+    const size_t len = n - x < LANES ? n - x : LANES;
+    LaneInt value, zeroPoint;
+    LaneFloat scale;
+    if (type == MtDataTypeChar) {
+      LaneChar narrow;
+      loadLanes(&narrow, (const int8_t *)src + x, len, sizeof(int8_t));
+      value = __builtin_convertvector(narrow, LaneInt);
+    } else {
+      loadLanes(&value, (const int32_t *)src + x, len, sizeof(int32_t));
+    }
+    if (q->scaleStep)
+      loadLanes(&scale, q->scales + x, len, sizeof(float));
+    else
+      scale = (LaneFloat){0} + q->scales[0];
+    if (q->zeroStep)
+      loadLanes(&zeroPoint, q->zeros + x, len, sizeof(int32_t));
+    else
+      zeroPoint = (LaneInt){0} + q->zeros[0];
+
+    const LaneInt diff = (LaneInt)((LaneUInt)value - (LaneUInt)zeroPoint);
+    const LaneFloat out = __builtin_convertvector(diff, LaneFloat) * scale;
+    storeLanes(dst + x, &out, len, sizeof(float));
+  }
+}
+
+static void quantizeRowGeneric(const float *src, int8_t *dst, size_t n,
+                               const QuantScales *q) {
+  quantizeLanes(src, dst, n, q);
+}
+
+static void dequantizeRowGeneric(const void *src, MtDataType type,
+                                 float *dst, size_t n, const QuantScales *q) {
+  dequantizeLanes(src, type, dst, n, q);
+}
+
+#ifdef QUANTIZE_X86
+__attribute__((target("avx2"))) static void
+quantizeRowAvx2(const float *src, int8_t *dst, size_t n,
+                const QuantScales *q) {
+  quantizeLanes(src, dst, n, q);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+quantizeRowAvx512(const float *src, int8_t *dst, size_t n,
+                  const QuantScales *q) {
+  quantizeLanes(src, dst, n, q);
+}
+
+__attribute__((target("avx2"))) static void
+dequantizeRowAvx2(const void *src, MtDataType type, float *dst, size_t n,
+                  const QuantScales *q) {
+  dequantizeLanes(src, type, dst, n, q);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+dequantizeRowAvx512(const void *src, MtDataType type, float *dst, size_t n,
+                    const QuantScales *q) {
+  dequantizeLanes(src, type, dst, n, q);
+}
+#endif
+
+static void quantizeRow(const float *src, int8_t *dst, size_t n,
+                        const QuantScales *q) {
+#ifdef QUANTIZE_X86
+  if (__builtin_cpu_supports("avx512bw")) {
+    quantizeRowAvx512(src, dst, n, q);
+    return;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    quantizeRowAvx2(src, dst, n, q);
+    return;
+  }
+#endif
+  quantizeRowGeneric(src, dst, n, q);
+}
+
+static void dequantizeRow(const void *src, MtDataType type, float *dst,
+                          size_t n, const QuantScales *q) {
+#ifdef QUANTIZE_X86
+  if (__builtin_cpu_supports("avx512bw")) {
+    dequantizeRowAvx512(src, type, dst, n, q);
+    return;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    dequantizeRowAvx2(src, type, dst, n, q);
+    return;
+  }
+#endif
+  dequantizeRowGeneric(src, type, dst, n, q);
+}
+
+static size_t paramIndex(uint32_t axis, size_t row, size_t col) {
+  return axis == QUANT_AXIS_ROW ? row : axis == QUANT_AXIS_COLUMN ? col : 0;
+}
+
+/* The parameters from (row, col) along the row, per the axes of the scales
+ * and zero points. */
+static QuantScales rowParams(const MtHostKernelArgs *args,
+                             const uint32_t *axes, size_t row, size_t col) {
+  const float *scales = args->buffers[1];
+  const int32_t *zeros = args->buffers[2];
+  QuantScales q = {
+      .scales = scales + paramIndex(axes[0], row, col),
+      .zeros = zeros + paramIndex(axes[1], row, col),
+      .scaleStep = axes[0] == QUANT_AXIS_COLUMN,
+      .zeroStep = axes[1] == QUANT_AXIS_COLUMN,
+  };
+  return q;
+}
+
+void quantizeMatrixKernel(const MtHostKernelArgs *args,
+                          const MtHostThreadgroup *tg) {
+  const float *src = args->buffers[0];
+  int8_t *dst = args->buffers[3];
+  const uint32_t *axes = args->buffers[4];
+  const uint32_t *ld = args->buffers[5];
+  const size_t x0 = tg->threadOrigin.x;
+
+  for (size_t y = 0; y < tg->threadsPerThreadgroup.height; ++y) {
+    const size_t row = tg->threadOrigin.y + y;
+    const QuantScales q = rowParams(args, axes, row, x0);
+    quantizeRow(src + row * ld[0] + x0, dst + row * ld[3] + x0,
+                tg->threadsPerThreadgroup.width, &q);
+  }
+}
+
+void dequantizeMatrixKernel(const MtHostKernelArgs *args,
+                            const MtHostThreadgroup *tg) {
+  const char *src = args->buffers[0];
+  float *dst = args->buffers[3];
+  const MtDataType type = *(const uint32_t *)args->buffers[4];
+  const uint32_t *axes = args->buffers[5];
+  const uint32_t *ld = args->buffers[6];
+  const size_t x0 = tg->threadOrigin.x;
+  const size_t size = elementSize(type);
+
+  for (size_t y = 0; y < tg->threadsPerThreadgroup.height; ++y) {
+    const size_t row = tg->threadOrigin.y + y;
+    const QuantScales q = rowParams(args, axes, row, x0);
+    dequantizeRow(src + (row * ld[0] + x0) * size, type,
+                  dst + row * ld[3] + x0, tg->threadsPerThreadgroup.width,
+                  &q);
+  }
+}
@@ -0,0 +1,142 @@
+#include "kernels.h"
+#include "lanes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define REDUCE_X86 1
+#endif
+
+/*
+ * matrix_row_sums as the shader has it, in the phases between its barriers:
+ * each threadgroup row sums one row of A, its threads taking every w-th
+ * column into threadgroup memory (w the threadgroup width), then halving
+ * those partial sums in a tree, one phase per level. The threadgroup's sums
+ * are gathered in its static memory and stored by its first threads. The
+ * tree's next stride is the SIMD-group's state, in its first thread's slot.
+ */
+
+enum { ROW_SUMS_ACCUMULATE, ROW_SUMS_HALVE, ROW_SUMS_GATHER, ROW_SUMS_STORE };
+
+/* The largest power of two below w, or 0 when there is one partial sum. */
+static uint32_t firstStride(size_t w) {
+  return w > 1 ? 1u << (31 - __builtin_clz((uint32_t)(w - 1))) : 0;
+}
+
+LANES_INLINE NsUInteger accumulateLanes(const MtHostKernelArgs *args,
+                                        const MtHostThreadgroup *tg,
+                                        const MtHostThread *thread) {
+  const float *A = args->buffers[0];
+  const uint32_t *dims = args->buffers[2];
+  const uint32_t *ld = args->buffers[3];
+  float *partial = tg->threadgroupMemory[0];
+  const size_t w = tg->threadsPerThreadgroup.width;
+  const size_t x = thread->threadPositionInThreadgroup.x;
+  const size_t n = thread->activeLanes;
+  const float *row = A + thread->threadPositionInGrid.y * ld[0];
+
+  LaneFloat sum = {0}, v;
+  for (size_t j = x; j < dims[1]; j += w) {
+    loadLanes(&v, row + j, dims[1] - j < n ? dims[1] - j : n, sizeof(float));
+    sum += v;
+  }
+  storeLanes(partial + thread->threadPositionInThreadgroup.y * w + x, &sum, n,
+             sizeof(float));
+
+  uint32_t *stride = thread->state;
+  *stride = firstStride(w);
+  return *stride ? ROW_SUMS_HALVE : ROW_SUMS_GATHER;
+}
+
+static NsUInteger rowSumsAccumulateGeneric(const MtHostKernelArgs *args,
+                                           const MtHostThreadgroup *tg,
+                                           const MtHostThread *thread) {
+  return accumulateLanes(args, tg, thread);
+}
+
+/* Adds partial[i + s] into partial[i] for the lanes i < s whose partner is
+ * inside the row, then loops back with half the stride. */
+static NsUInteger rowSumsHalve(const MtHostKernelArgs *args,
+                               const MtHostThreadgroup *tg,
+                               const MtHostThread *thread) {
+  (void)args;
+  const size_t w = tg->threadsPerThreadgroup.width;
+  const size_t x = thread->threadPositionInThreadgroup.x;
+  uint32_t *stride = thread->state;
+  const size_t s = *stride;
+  const size_t limit = w - s < s ? w - s : s;
+
+  if (x < limit) {
+    float *partial = (float *)tg->threadgroupMemory[0] +
+                     thread->threadPositionInThreadgroup.y * w + x;
+    const size_t n =
+        limit - x < thread->activeLanes ? limit - x : thread->activeLanes;
+    LaneFloat a, b;
+    loadLanes(&a, partial, n, sizeof(float));
+    loadLanes(&b, partial + s, n, sizeof(float));
+    a += b;
+    storeLanes(partial, &a, n, sizeof(float));
+  }
+
+  *stride >>= 1;
+  return *stride ? ROW_SUMS_HALVE : ROW_SUMS_GATHER;
+}
+
+static NsUInteger rowSumsGather(const MtHostKernelArgs *args,
+                                const MtHostThreadgroup *tg,
+                                const MtHostThread *thread) {
+  (void)args;
+  const size_t y = thread->threadPositionInThreadgroup.y;
+  const float *partial = tg->threadgroupMemory[0];
+  float *totals = tg->staticThreadgroupMemory;
+
+  if (thread->threadPositionInThreadgroup.x == 0)
+    totals[y] = partial[y * tg->threadsPerThreadgroup.width];
+  return ROW_SUMS_STORE;
+}
+
+static NsUInteger rowSumsStore(const MtHostKernelArgs *args,
+                               const MtHostThreadgroup *tg,
+                               const MtHostThread *thread) {
+  float *sums = args->buffers[1];
+  const uint32_t *ld = args->buffers[3];
+  const float *totals = tg->staticThreadgroupMemory;
+  const size_t h = tg->threadsPerThreadgroup.height;
+  const size_t first = thread->threadIndexInThreadgroup;
+
+  for (size_t i = first; i < h && i < first + thread->activeLanes; ++i)
+    sums[(tg->threadOrigin.y + i) * ld[1]] = totals[i];
+  return MT_HOST_PHASE_END;
+}
+
+static const MtHostThreadFn genericPhases[] = {
+    rowSumsAccumulateGeneric, rowSumsHalve, rowSumsGather, rowSumsStore};
+
+#ifdef REDUCE_X86
+__attribute__((target("avx2"))) static NsUInteger
+rowSumsAccumulateAvx2(const MtHostKernelArgs *args,
+                      const MtHostThreadgroup *tg,
+                      const MtHostThread *thread) {
+  return accumulateLanes(args, tg, thread);
+}
+
+__attribute__((target("avx512f"))) static NsUInteger
+rowSumsAccumulateAvx512(const MtHostKernelArgs *args,
+                        const MtHostThreadgroup *tg,
+                        const MtHostThread *thread) {
+  return accumulateLanes(args, tg, thread);
+}
+
+static const MtHostThreadFn avx2Phases[] = {
+    rowSumsAccumulateAvx2, rowSumsHalve, rowSumsGather, rowSumsStore};
+static const MtHostThreadFn avx512Phases[] = {
+    rowSumsAccumulateAvx512, rowSumsHalve, rowSumsGather, rowSumsStore};
+#endif
+
+const MtHostThreadFn *matrixRowSumsPhases(void) {
+#ifdef REDUCE_X86
+  if (__builtin_cpu_supports("avx512f"))
+    return avx512Phases;
+  if (__builtin_cpu_supports("avx2"))
+    return avx2Phases;
+#endif
+  return genericPhases;
+}
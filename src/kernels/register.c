@@ -0,0 +1,99 @@
+#include "kernels.h"
+#include "lanes.h"
+
+/* A float, half or bfloat16 matrix_multiplication* threadgroup is the whole
+ * product (up to 16384 x 16384), which the SGEMM blocks and spreads over
+ * the pool itself, so that each packed panel is shared by every task that
+ * reads it. */
+#define SGEMM_PRODUCT_THREADS ((NsUInteger)1 << 28)
+/* An int8 threadgroup is one tile of C, packed and multiplied on its own. */
+#define IGEMM_TILE_THREADS (256 * 256)
+/* Elementwise threadgroups are sized the same way, so each one covers enough
+ * elements to amortize interpreting a fused program or widening 16-bit
+ * storage a chunk at a time. */
+#define ELEMENTWISE_TILE_THREADS (256 * 256)
+/* A sparse threadgroup is one partition of rows; this many result columns
+ * keep a tile of B rows in cache while it walks them. */
+#define SPARSE_TILE_THREADS 512
+
+void registerHostKernels(void) {
+  const MtHostKernelDesc kernels[] = {
+      {.name = "matrix_addition",
+       .phases = matrixAdditionPhases(),
+       .phaseCount = 1,
+       .threadExecutionWidth = matrixAdditionLanes()},
+      {.name = "matrix_addition_half",
+       .fn = matrixAdditionHalfKernel,
+       .maxTotalThreadsPerThreadgroup = ELEMENTWISE_TILE_THREADS},
+      {.name = "matrix_addition_bfloat",
+       .fn = matrixAdditionBFloatKernel,
+       .maxTotalThreadsPerThreadgroup = ELEMENTWISE_TILE_THREADS},
+      {.name = "matrix_multiplication",
+       .fn = matrixMultiplicationKernel,
+       .maxTotalThreadsPerThreadgroup = SGEMM_PRODUCT_THREADS,
+       .threadExecutionWidth = sgemmVectorWidth()},
+      {.name = "matrix_multiplication_batched",
+       .fn = matrixMultiplicationBatchedKernel,
+       .maxTotalThreadsPerThreadgroup = SGEMM_PRODUCT_THREADS,
+       .threadExecutionWidth = sgemmVectorWidth()},
+      {.name = "matrix_multiplication_half",
+       .fn = matrixMultiplicationHalfKernel,
+       .maxTotalThreadsPerThreadgroup = SGEMM_PRODUCT_THREADS,
+       .threadExecutionWidth = sgemmVectorWidth()},
+      {.name = "matrix_multiplication_half_batched",
+       .fn = matrixMultiplicationHalfBatchedKernel,
+       .maxTotalThreadsPerThreadgroup = SGEMM_PRODUCT_THREADS,
+       .threadExecutionWidth = sgemmVectorWidth()},
+      {.name = "matrix_multiplication_bfloat",
+       .fn = matrixMultiplicationBFloatKernel,
+       .maxTotalThreadsPerThreadgroup = SGEMM_PRODUCT_THREADS,
+       .threadExecutionWidth = sgemmVectorWidth()},
+      {.name = "matrix_multiplication_bfloat_batched",
+       .fn = matrixMultiplicationBFloatBatchedKernel,
+       .maxTotalThreadsPerThreadgroup = SGEMM_PRODUCT_THREADS,
+       .threadExecutionWidth = sgemmVectorWidth()},
+      {.name = "matrix_multiplication_int8",
+       .fn = matrixMultiplicationInt8Kernel,
+       .maxTotalThreadsPerThreadgroup = IGEMM_TILE_THREADS,
+       .threadExecutionWidth = sgemmVectorWidth()},
+      {.name = "matrix_multiplication_int8_dequantize",
+       .fn = matrixMultiplicationInt8DequantizeKernel,
+       .maxTotalThreadsPerThreadgroup = IGEMM_TILE_THREADS,
+       .threadExecutionWidth = sgemmVectorWidth()},
+      {.name = "quantize_matrix",
+       .fn = quantizeMatrixKernel,
+       .maxTotalThreadsPerThreadgroup = ELEMENTWISE_TILE_THREADS},
+      {.name = "dequantize_matrix",
+       .fn = dequantizeMatrixKernel,
+       .maxTotalThreadsPerThreadgroup = ELEMENTWISE_TILE_THREADS},
+      {.name = "sparse_multiplication",
+       .fn = sparseMultiplicationKernel,
+       .maxTotalThreadsPerThreadgroup = SPARSE_TILE_THREADS},
+      {.name = "sparse_addition",
+       .fn = sparseAdditionKernel,
+       .maxTotalThreadsPerThreadgroup = SPARSE_TILE_THREADS},
+      {.name = "transpose_matrix",
+       .fn = transposeMatrixKernel,
+       .maxTotalThreadsPerThreadgroup = ELEMENTWISE_TILE_THREADS},
+      {.name = "transpose_matrix_in_place",
+       .fn = transposeMatrixInPlaceKernel,
+       .maxTotalThreadsPerThreadgroup = ELEMENTWISE_TILE_THREADS},
+      {.name = "convert_matrix",
+       .fn = convertMatrixKernel,
+       .maxTotalThreadsPerThreadgroup = ELEMENTWISE_TILE_THREADS},
+      {.name = "fused_elementwise",
+       .fn = fusedElementwiseKernel,
+       .maxTotalThreadsPerThreadgroup = ELEMENTWISE_TILE_THREADS,
+       .threadExecutionWidth = sgemmVectorWidth()},
+      {.name = "matrix_row_sums",
+       .phases = matrixRowSumsPhases(),
+       .phaseCount = 4,
+       .maxTotalThreadsPerThreadgroup = ROW_SUMS_MAX_THREADS,
+       .threadExecutionWidth = LANES,
+       .threadStateLength = sizeof(uint32_t),
+       .threadgroupMemoryLength = ROW_SUMS_MAX_THREADS * sizeof(float)},
+  };
+
+  for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i)
+    mtHostRegisterKernel(&kernels[i]);
+}
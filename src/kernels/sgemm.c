@@ -0,0 +1,444 @@
+#include "kernels.h"
+#include "../../include/cmt/device.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SGEMM_X86 1
+#endif
+
+/*
+ * GotoBLAS/BLIS-style SGEMM. C is cut into NC-column strips and the K
+ * dimension into KC-deep blocks. For each block, a strip packs its KC x NC
+ * slice of B into NR-column micro-panels once, and its MC-row blocks then
+ * each pack their MC x KC slice of A into MR-row micro-panels and multiply
+ * it by the shared B panels, so the register-tiled microkernel reads both
+ * operands with unit stride. An A micro-panel stays in L1 while the B panels
+ * stream from L2 with the A block. Strips, and the row blocks of each, run
+ * in parallel on the host pool's threads.
+ *
+ * Half and bfloat16 operands are widened to float while they are packed:
+ * each element of B is converted once per K block of a strip, and of A once
+ * per strip. Products accumulate in float, and a 16-bit C is rounded once,
+ * after the last K block.
+ */
+
+#define SGEMM_KC 256
+/* at most this many rows in a block and columns in a strip; multiples of
+ * every MR and NR */
+#define SGEMM_MC 240
+#define SGEMM_NC 512
+#define SGEMM_MAX_MR 12
+#define SGEMM_MAX_NR 32
+
+typedef void (*SgemmMicrokernel)(size_t kc, const float *a, const float *b,
+                                 float *c, size_t ldc, bool accumulate);
+
+typedef struct SgemmImpl {
+  size_t mr, nr;
+  NsUInteger vectorWidth;
+  SgemmMicrokernel kernel;
+} SgemmImpl;
+
+static void microkernelGeneric(size_t kc, const float *a, const float *b,
+                               float *c, size_t ldc, bool accumulate) {
+  enum { MR = 4, NR = 16 };
+  float acc[MR][NR] = {{0}};
+
+  for (size_t k = 0; k < kc; ++k, b += NR) {
+    for (size_t r = 0; r < MR; ++r) {
+      for (size_t j = 0; j < NR; ++j)
+        acc[r][j] += a[r * SGEMM_KC + k] * b[j];
+    }
+  }
+  for (size_t r = 0; r < MR; ++r) {
+    for (size_t j = 0; j < NR; ++j)
+      c[r * ldc + j] = accumulate ? c[r * ldc + j] + acc[r][j] : acc[r][j];
+  }
+}
+
+#ifdef SGEMM_X86
+__attribute__((target("avx2,fma"))) static void
+microkernelAvx2(size_t kc, const float *a, const float *b, float *c,
+                size_t ldc, bool accumulate) {
+  enum { MR = 6 };
+  __m256 acc[MR][2];
+  for (int r = 0; r < MR; ++r)
+    acc[r][0] = acc[r][1] = _mm256_setzero_ps();
+
+  for (size_t k = 0; k < kc; ++k, a++, b += 16) {
+    const __m256 b0 = _mm256_load_ps(b);
+    const __m256 b1 = _mm256_load_ps(b + 8);
+#pragma GCC unroll 6
+    for (int r = 0; r < MR; ++r) {
+      const __m256 ar = _mm256_broadcast_ss(a + r * SGEMM_KC);
+      acc[r][0] = _mm256_fmadd_ps(ar, b0, acc[r][0]);
+      acc[r][1] = _mm256_fmadd_ps(ar, b1, acc[r][1]);
+    }
+  }
+
+  for (int r = 0; r < MR; ++r) {
+    float *cr = c + r * ldc;
+    if (accumulate) {
+      acc[r][0] = _mm256_add_ps(acc[r][0], _mm256_loadu_ps(cr));
+      acc[r][1] = _mm256_add_ps(acc[r][1], _mm256_loadu_ps(cr + 8));
+    }
+    _mm256_storeu_ps(cr, acc[r][0]);
+    _mm256_storeu_ps(cr + 8, acc[r][1]);
+  }
+}
+
+__attribute__((target("avx512f"))) static void
+microkernelAvx512(size_t kc, const float *a, const float *b, float *c,
+                  size_t ldc, bool accumulate) {
+  enum { MR = 12 };
+  __m512 acc[MR][2];
+  for (int r = 0; r < MR; ++r)
+    acc[r][0] = acc[r][1] = _mm512_setzero_ps();
+
+  for (size_t k = 0; k < kc; ++k, a++, b += 32) {
+    const __m512 b0 = _mm512_load_ps(b);
+    const __m512 b1 = _mm512_load_ps(b + 16);
+#pragma GCC unroll 12
+    for (int r = 0; r < MR; ++r) {
+      const __m512 ar = _mm512_set1_ps(a[r * SGEMM_KC]);
+      acc[r][0] = _mm512_fmadd_ps(ar, b0, acc[r][0]);
+      acc[r][1] = _mm512_fmadd_ps(ar, b1, acc[r][1]);
+    }
+  }
+
+  for (int r = 0; r < MR; ++r) {
+    float *cr = c + r * ldc;
+    if (accumulate) {
+      acc[r][0] = _mm512_add_ps(acc[r][0], _mm512_loadu_ps(cr));
+      acc[r][1] = _mm512_add_ps(acc[r][1], _mm512_loadu_ps(cr + 16));
+    }
+    _mm512_storeu_ps(cr, acc[r][0]);
+    _mm512_storeu_ps(cr + 16, acc[r][1]);
+  }
+}
+#endif
+
+static const SgemmImpl *selectedImpl;
+static pthread_once_t selectOnce = PTHREAD_ONCE_INIT;
+
+/* The widest microkernel the CPU runs; MT_HOST_SGEMM=avx2 or generic caps
+ * it, so each one can be checked on a machine that has them all. */
+static void selectImpl(void) {
+  static const SgemmImpl generic = {4, 16, 4, microkernelGeneric};
+  const char *env = getenv("MT_HOST_SGEMM");
+  selectedImpl = &generic;
+  if (env && strcmp(env, "generic") == 0)
+    return;
+#ifdef SGEMM_X86
+  static const SgemmImpl avx2 = {6, 16, 8, microkernelAvx2};
+  static const SgemmImpl avx512 = {12, 32, 16, microkernelAvx512};
+  if (__builtin_cpu_supports("avx512f") && !(env && strcmp(env, "avx2") == 0))
+    selectedImpl = &avx512;
+  else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    selectedImpl = &avx2;
+#endif
+}
+
+static const SgemmImpl *sgemmImpl(void) {
+  pthread_once(&selectOnce, selectImpl);
+  return selectedImpl;
+}
+
+NsUInteger sgemmVectorWidth(void) { return sgemmImpl()->vectorWidth; }
+
+/* Packs rows [0, mc) x cols [0, kc) of A into MR-row micro-panels. Rows of
+ * a panel are SGEMM_KC floats apart, so the microkernel addresses them with
+ * constant displacements and packing is a plain row copy (or widening). Rows
+ * past mc are zero-filled. A transposed A is stored kc x mc and each panel
+ * is transposed out of it, through tmp when it needs widening too. */
+static void packA(size_t mc, size_t kc, const void *A, size_t lda,
+                  MtDataType type, bool trans, size_t mr, float *dst) {
+  const size_t size = elementSize(type);
+  uint16_t tmp[SGEMM_MAX_MR * SGEMM_KC];
+  for (size_t i = 0; i < mc; i += mr, dst += mr * SGEMM_KC) {
+    size_t rows = mc - i < mr ? mc - i : mr;
+    if (!trans) {
+      for (size_t r = 0; r < rows; ++r)
+        toFloat((const char *)A + (i + r) * lda * size, type,
+                dst + r * SGEMM_KC, kc);
+    } else if (type == MtDataTypeFloat) {
+      transposeElements((const float *)A + i, lda, dst, SGEMM_KC, kc, rows,
+                        sizeof(float));
+    } else {
+      transposeElements((const char *)A + i * size, lda, tmp, kc, kc, rows,
+                        size);
+      for (size_t r = 0; r < rows; ++r)
+        toFloat(tmp + r * kc, type, dst + r * SGEMM_KC, kc);
+    }
+    for (size_t r = rows; r < mr; ++r)
+      memset(dst + r * SGEMM_KC, 0, kc * sizeof(float));
+  }
+}
+
+/* Packs rows [0, kc) x cols [0, nc) of B into NR-column micro-panels, each
+ * stored k-major and zero-padded to NR columns. A transposed B is stored
+ * nc x kc and transposed into the panels as A is. */
+static void packB(size_t kc, size_t nc, const void *B, size_t ldb,
+                  MtDataType type, bool trans, size_t nr, float *dst) {
+  const size_t size = elementSize(type);
+  uint16_t tmp[SGEMM_KC * SGEMM_MAX_NR];
+  for (size_t j = 0; j < nc; j += nr, dst += nr * kc) {
+    size_t cols = nc - j < nr ? nc - j : nr;
+    if (trans && type == MtDataTypeFloat)
+      transposeElements((const float *)B + j * ldb, ldb, dst, nr, cols, kc,
+                        sizeof(float));
+    else if (trans)
+      transposeElements((const char *)B + j * ldb * size, ldb, tmp, nr, cols,
+                        kc, size);
+    for (size_t k = 0; k < kc; ++k) {
+      if (!trans)
+        toFloat((const char *)B + (k * ldb + j) * size, type, dst + k * nr,
+                cols);
+      else if (type != MtDataTypeFloat)
+        toFloat(tmp + k * nr, type, dst + k * nr, cols);
+      memset(dst + k * nr + cols, 0, (nr - cols) * sizeof(float));
+    }
+  }
+}
+
+static size_t roundUp(size_t x, size_t m) { return (x + m - 1) / m * m; }
+
+/* Packing panels are kept per thread and only grow, so steady-state GEMMs
+ * (and small batched ones in particular) never touch the allocator. Slot 0
+ * holds a row block's A panels, and the int8 GEMM packs into it too; slot 1
+ * a strip's B panels. A thread that waits on a strip's row blocks only runs
+ * row blocks meanwhile, so neither slot is reentered. */
+enum { SCRATCH_BLOCK, SCRATCH_STRIP, SCRATCH_SLOTS };
+
+typedef struct SgemmScratch {
+  size_t size[SCRATCH_SLOTS];
+  float *data[SCRATCH_SLOTS];
+} SgemmScratch;
+
+static pthread_key_t scratchKey;
+static pthread_once_t scratchOnce = PTHREAD_ONCE_INIT;
+
+static void freeScratch(void *ptr) {
+  SgemmScratch *scratch = ptr;
+  for (int i = 0; i < SCRATCH_SLOTS; ++i)
+    free(scratch->data[i]);
+  free(scratch);
+}
+
+static void createScratchKey(void) {
+  pthread_key_create(&scratchKey, freeScratch);
+}
+
+static void *scratchSlot(int slot, size_t size) {
+  pthread_once(&scratchOnce, createScratchKey);
+  SgemmScratch *scratch = pthread_getspecific(scratchKey);
+  if (!scratch) {
+    if (!(scratch = calloc(1, sizeof(*scratch))))
+      return NULL;
+    pthread_setspecific(scratchKey, scratch);
+  }
+  if (scratch->size[slot] < size) {
+    void *grown = NULL;
+    if (posix_memalign(&grown, 64, size) != 0)
+      return NULL;
+    free(scratch->data[slot]);
+    scratch->data[slot] = grown;
+    scratch->size[slot] = size;
+  }
+  return scratch->data[slot];
+}
+
+void *gemmScratch(size_t size) { return scratchSlot(SCRATCH_BLOCK, size); }
+
+static MtDevice *gemmDevice;
+static pthread_once_t gemmDeviceOnce = PTHREAD_ONCE_INIT;
+
+static void openGemmDevice(void) {
+  // the system device, and so its pool, lives as long as the process
+  gemmDevice = mtCreateSystemDefaultDevice();
+}
+
+/* Runs fn over [0, count) on the pool the kernels run on, or inline when
+ * there is only one item (or no pool). */
+static void gemmFor(size_t count, MtHostRangeFn fn, void *ctx) {
+  pthread_once(&gemmDeviceOnce, openGemmDevice);
+  if (gemmDevice && count > 1)
+    mtHostParallelFor(gemmDevice, count, 1, fn, ctx);
+  else if (count)
+    fn(ctx, 0, count);
+}
+
+/* A GEMM cut into blocks of mc rows by strips of nc columns, the last of
+ * each clipped to the product. */
+typedef struct Gemm {
+  const SgemmImpl *impl;
+  MtDataType type, outType;
+  bool transA, transB;
+  const char *A, *B;
+  char *C;
+  size_t lda, ldb, ldc;
+  size_t M, N, K;
+  size_t mc, nc, blocks, strips;
+  atomic_bool failed;
+} Gemm;
+
+/* One K block of a strip: B packed, and the rows of A and the columns of
+ * C (or of its float accumulator) it multiplies. */
+typedef struct GemmPanel {
+  Gemm *g;
+  const char *A;
+  const float *packedB;
+  float *acc;
+  size_t ldAcc, kc, cols;
+  bool accumulate;
+} GemmPanel;
+
+static void multiplyBlocks(void *ctx, NsUInteger begin, NsUInteger end) {
+  const GemmPanel *panel = ctx;
+  Gemm *g = panel->g;
+  const SgemmImpl *impl = g->impl;
+  const size_t mr = impl->mr, nr = impl->nr, kc = panel->kc;
+  const size_t ldAcc = panel->ldAcc;
+  float edge[SGEMM_MAX_MR * SGEMM_MAX_NR] __attribute__((aligned(64)));
+
+  float *packedA = gemmScratch(roundUp(g->mc, mr) * SGEMM_KC * sizeof(float));
+  if (!packedA) {
+    atomic_store(&g->failed, true);
+    return;
+  }
+
+  for (size_t block = begin; block < end; ++block) {
+    const size_t i0 = block * g->mc;
+    const size_t mc = g->M - i0 < g->mc ? g->M - i0 : g->mc;
+    packA(mc, kc,
+          panel->A + (g->transA ? i0 : i0 * g->lda) * elementSize(g->type),
+          g->lda, g->type, g->transA, mr, packedA);
+
+    for (size_t i = 0; i < mc; i += mr) {
+      const float *a = packedA + i * SGEMM_KC;
+      const size_t rows = mc - i < mr ? mc - i : mr;
+
+      for (size_t j = 0; j < panel->cols; j += nr) {
+        const float *b = panel->packedB + j * kc;
+        const size_t cols = panel->cols - j < nr ? panel->cols - j : nr;
+        float *c = panel->acc + (i0 + i) * ldAcc + j;
+
+        if (rows == mr && cols == nr) {
+          impl->kernel(kc, a, b, c, ldAcc, panel->accumulate);
+          continue;
+        }
+
+        impl->kernel(kc, a, b, edge, nr, false);
+        for (size_t r = 0; r < rows; ++r) {
+          for (size_t x = 0; x < cols; ++x) {
+            float v = edge[r * nr + x];
+            c[r * ldAcc + x] = panel->accumulate ? c[r * ldAcc + x] + v : v;
+          }
+        }
+      }
+    }
+  }
+}
+
+static void multiplyStrips(void *ctx, NsUInteger begin, NsUInteger end) {
+  Gemm *g = ctx;
+  const size_t nr = g->impl->nr;
+  const size_t size = elementSize(g->type), outSize = elementSize(g->outType);
+  const size_t kcMax = g->K < SGEMM_KC ? g->K : SGEMM_KC;
+  /* a 16-bit C is accumulated in float and rounded at the end */
+  const bool round = g->outType != MtDataTypeFloat;
+
+  for (size_t strip = begin; strip < end; ++strip) {
+    const size_t j0 = strip * g->nc;
+    const size_t cols = g->N - j0 < g->nc ? g->N - j0 : g->nc;
+    const size_t sizeB = roundUp(cols, nr) * kcMax;
+    float *packedB = scratchSlot(
+        SCRATCH_STRIP, (sizeB + (round ? g->M * cols : 0)) * sizeof(float));
+    if (!packedB) {
+      atomic_store(&g->failed, true);
+      return;
+    }
+
+    GemmPanel panel = {
+        .g = g,
+        .packedB = packedB,
+        .acc = round ? packedB + sizeB : (float *)g->C + j0,
+        .ldAcc = round ? cols : g->ldc,
+        .cols = cols,
+    };
+    for (size_t p = 0; p < g->K; p += SGEMM_KC) {
+      panel.kc = g->K - p < SGEMM_KC ? g->K - p : SGEMM_KC;
+      panel.accumulate = p > 0;
+      // the K block starts p columns into A and p rows into B, as used
+      panel.A = g->A + (g->transA ? p * g->lda : p) * size;
+      packB(panel.kc, cols,
+            g->B + (g->transB ? j0 * g->ldb + p : p * g->ldb + j0) * size,
+            g->ldb, g->type, g->transB, nr, packedB);
+      gemmFor(g->blocks, multiplyBlocks, &panel);
+      if (atomic_load(&g->failed))
+        return;
+    }
+
+    if (round) {
+      for (size_t i = 0; i < g->M; ++i)
+        fromFloat(panel.acc + i * cols, g->C + (i * g->ldc + j0) * outSize,
+                  g->outType, cols);
+    }
+  }
+}
+
+/* Splits extent into the fewest parts of at most limit, as even as a
+ * multiple of step allows; returns the part and sets *count. */
+static size_t splitEvenly(size_t extent, size_t limit, size_t step,
+                          size_t *count) {
+  *count = (extent + limit - 1) / limit;
+  const size_t part = roundUp((extent + *count - 1) / *count, step);
+  *count = (extent + part - 1) / part;
+  return part;
+}
+
+bool sgemm(size_t M, size_t N, size_t K, const float *A, size_t lda,
+           const float *B, size_t ldb, float *C, size_t ldc) {
+  return gemm(M, N, K, MtDataTypeFloat, A, lda, B, ldb, MtDataTypeFloat, C,
+              ldc, 0);
+}
+
+bool gemm(size_t M, size_t N, size_t K, MtDataType type, const void *A,
+          size_t lda, const void *B, size_t ldb, MtDataType outType, void *C,
+          size_t ldc, unsigned transpose) {
+  const SgemmImpl *impl = sgemmImpl();
+  const size_t outSize = elementSize(outType);
+
+  if (!M || !N)
+    return true;
+  if (!K) {
+    for (size_t i = 0; i < M; ++i)
+      memset((char *)C + i * ldc * outSize, 0, N * outSize);
+    return true;
+  }
+
+  Gemm g = {
+      .impl = impl,
+      .type = type,
+      .outType = outType,
+      .transA = transpose & GEMM_TRANSPOSE_A,
+      .transB = transpose & GEMM_TRANSPOSE_B,
+      .A = A,
+      .B = B,
+      .C = C,
+      .lda = lda,
+      .ldb = ldb,
+      .ldc = ldc,
+      .M = M,
+      .N = N,
+      .K = K,
+  };
+  g.mc = splitEvenly(M, SGEMM_MC, impl->mr, &g.blocks);
+  g.nc = splitEvenly(N, SGEMM_NC, impl->nr, &g.strips);
+  atomic_init(&g.failed, false);
+  gemmFor(g.strips, multiplyStrips, &g);
+  return !atomic_load(&g.failed);
+}
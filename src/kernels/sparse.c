@@ -0,0 +1,250 @@
+#include "kernels.h"
+#include "lanes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPARSE_X86 1
+#endif
+
+/*
+ * Sparse times dense and sparse plus dense. A threadgroup covers a run of
+ * result columns for one or more partitions of the sparse rows. Products
+ * with several columns stream rows of B through LANES-wide accumulators,
+ * one row of C at a time; a CSR product with a single column is a
+ * matrix-vector product, which gathers x instead.
+ */
+
+typedef struct SparseArgs {
+  const int32_t *rowOffsets;
+  const int32_t *colIndices;
+  const float *values;
+  const int32_t *partitions;
+  const float *B;
+  float *C;
+  size_t rows, cols, n, blockSize;
+  size_t ldb, ldc;
+} SparseArgs;
+
+static SparseArgs sparseArgs(const MtHostKernelArgs *args) {
+  const uint32_t *dims = args->buffers[6];
+  const uint32_t *ld = args->buffers[7];
+  SparseArgs s = {
+      .rowOffsets = args->buffers[0],
+      .colIndices = args->buffers[1],
+      .values = args->buffers[2],
+      .partitions = args->buffers[3],
+      .B = args->buffers[4],
+      .C = args->buffers[5],
+      .rows = dims[0],
+      .cols = dims[1],
+      .n = dims[2],
+      .blockSize = dims[3],
+      .ldb = ld[4],
+      .ldc = ld[5],
+  };
+  return s;
+}
+
+/* C[row, x0 .. x0 + w) = A[row, :] * B[:, x0 .. x0 + w) for row r of block
+ * row br of A (for CSR, r is 0 and br the row), four vectors of columns at a
+ * time and then one. */
+LANES_INLINE void rowLanes(const SparseArgs *s, size_t br, size_t r,
+                           size_t x0, size_t w) {
+  const size_t bs = s->blockSize;
+  const size_t begin = s->rowOffsets[br], end = s->rowOffsets[br + 1];
+  const float *b = s->B + x0;
+  float *c = s->C + (br * bs + r) * s->ldc + x0;
+  size_t x = 0;
+
+  for (; x + 4 * LANES <= w; x += 4 * LANES) {
+    LaneFloat acc[4] = {{0}};
+    for (size_t k = begin; k < end; ++k) {
+      const size_t col0 = (size_t)s->colIndices[k] * bs;
+      const size_t width = s->cols - col0 < bs ? s->cols - col0 : bs;
+      const float *v = s->values + (k * bs + r) * bs;
+      for (size_t i = 0; i < width; ++i) {
+        const float *src = b + (col0 + i) * s->ldb + x;
+        for (int j = 0; j < 4; ++j) {
+          LaneFloat bv;
+          memcpy(&bv, src + j * LANES, sizeof(bv));
+          acc[j] += v[i] * bv;
+        }
+      }
+    }
+    memcpy(c + x, acc, sizeof(acc));
+  }
+  for (; x < w; x += LANES) {
+    const size_t len = w - x < LANES ? w - x : LANES;
+    LaneFloat acc = {0};
+    for (size_t k = begin; k < end; ++k) {
+      const size_t col0 = (size_t)s->colIndices[k] * bs;
+      const size_t width = s->cols - col0 < bs ? s->cols - col0 : bs;
+      const float *v = s->values + (k * bs + r) * bs;
+      for (size_t i = 0; i < width; ++i) {
+        LaneFloat bv;
+        loadLanes(&bv, b + (col0 + i) * s->ldb + x, len, sizeof(float));
+        acc += v[i] * bv;
+      }
+    }
+    storeLanes(c + x, &acc, len, sizeof(float));
+  }
+}
+
+/* y[row] = A[row, :] . x for CSR A and contiguous x (B's single column,
+ * rows 1 apart). */
+static float csrDotGeneric(const SparseArgs *s, size_t row) {
+  const size_t begin = s->rowOffsets[row], end = s->rowOffsets[row + 1];
+  float sum[4] = {0};
+  size_t k = begin;
+  for (; k + 4 <= end; k += 4) {
+    for (int j = 0; j < 4; ++j)
+      sum[j] += s->values[k + j] * s->B[s->colIndices[k + j]];
+  }
+  for (; k < end; ++k)
+    sum[0] += s->values[k] * s->B[s->colIndices[k]];
+  return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+static void rowGeneric(const SparseArgs *s, size_t br, size_t r, size_t x0,
+                       size_t w) {
+  rowLanes(s, br, r, x0, w);
+}
+
+#ifdef SPARSE_X86
+__attribute__((target("avx2,fma"))) static void
+rowAvx2(const SparseArgs *s, size_t br, size_t r, size_t x0, size_t w) {
+  rowLanes(s, br, r, x0, w);
+}
+
+__attribute__((target("avx512f"))) static void
+rowAvx512(const SparseArgs *s, size_t br, size_t r, size_t x0, size_t w) {
+  rowLanes(s, br, r, x0, w);
+}
+
+__attribute__((target("avx2,fma"))) static float
+csrDotAvx2(const SparseArgs *s, size_t row) {
+  const size_t begin = s->rowOffsets[row], end = s->rowOffsets[row + 1];
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  size_t k = begin;
+  for (; k + 16 <= end; k += 16) {
+    const __m256i i0 = _mm256_loadu_si256((const void *)(s->colIndices + k));
+    const __m256i i1 =
+        _mm256_loadu_si256((const void *)(s->colIndices + k + 8));
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(s->values + k),
+                           _mm256_i32gather_ps(s->B, i0, 4), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(s->values + k + 8),
+                           _mm256_i32gather_ps(s->B, i1, 4), acc1);
+  }
+  float lanes[8];
+  _mm256_storeu_ps(lanes, _mm256_add_ps(acc0, acc1));
+  float sum = 0.0f;
+  for (int j = 0; j < 8; ++j)
+    sum += lanes[j];
+  for (; k < end; ++k)
+    sum += s->values[k] * s->B[s->colIndices[k]];
+  return sum;
+}
+
+__attribute__((target("avx512f"))) static float
+csrDotAvx512(const SparseArgs *s, size_t row) {
+  const size_t begin = s->rowOffsets[row], end = s->rowOffsets[row + 1];
+  __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+  size_t k = begin;
+  for (; k + 32 <= end; k += 32) {
+    const __m512i i0 = _mm512_loadu_si512(s->colIndices + k);
+    const __m512i i1 = _mm512_loadu_si512(s->colIndices + k + 16);
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(s->values + k),
+                           _mm512_i32gather_ps(i0, s->B, 4), acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(s->values + k + 16),
+                           _mm512_i32gather_ps(i1, s->B, 4), acc1);
+  }
+  // the rest of the row under a mask, so short rows stay vectorized
+  for (; k < end; k += 16) {
+    const size_t len = end - k < 16 ? end - k : 16;
+    const __mmask16 mask = (__mmask16)((1u << len) - 1);
+    const __m512i idx = _mm512_maskz_loadu_epi32(mask, s->colIndices + k);
+    const __m512 x = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, idx,
+                                              s->B, 4);
+    acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, s->values + k), x,
+                           acc0);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+#endif
+
+typedef struct SparseImpl {
+  void (*row)(const SparseArgs *s, size_t br, size_t r, size_t x0, size_t w);
+  float (*csrDot)(const SparseArgs *s, size_t row);
+} SparseImpl;
+
+static const SparseImpl *sparseImpl(void) {
+  static const SparseImpl generic = {rowGeneric, csrDotGeneric};
+#ifdef SPARSE_X86
+  static const SparseImpl avx2 = {rowAvx2, csrDotAvx2};
+  static const SparseImpl avx512 = {rowAvx512, csrDotAvx512};
+  if (__builtin_cpu_supports("avx512f"))
+    return &avx512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return &avx2;
+#endif
+  return &generic;
+}
+
+void sparseMultiplicationKernel(const MtHostKernelArgs *args,
+                                const MtHostThreadgroup *tg) {
+  const SparseArgs s = sparseArgs(args);
+  const SparseImpl *impl = sparseImpl();
+  const size_t x0 = tg->threadOrigin.x;
+  const size_t w = tg->threadsPerThreadgroup.width;
+
+  for (size_t p = 0; p < tg->threadsPerThreadgroup.height; ++p) {
+    const size_t part = tg->threadOrigin.y + p;
+    const size_t first = s.partitions[part], last = s.partitions[part + 1];
+    for (size_t br = first; br < last; ++br) {
+      if (s.blockSize == 1 && s.n == 1 && s.ldb == 1) {
+        s.C[br * s.ldc] = impl->csrDot(&s, br);
+        continue;
+      }
+      // each row of a block row rereads the same rows of B, from cache
+      const size_t row0 = br * s.blockSize;
+      for (size_t r = 0; r < s.blockSize && row0 + r < s.rows; ++r)
+        impl->row(&s, br, r, x0, w);
+    }
+  }
+}
+
+void sparseAdditionKernel(const MtHostKernelArgs *args,
+                          const MtHostThreadgroup *tg) {
+  const SparseArgs s = sparseArgs(args);
+  const size_t bs = s.blockSize;
+  const size_t x0 = tg->threadOrigin.x;
+  const size_t x1 = x0 + tg->threadsPerThreadgroup.width;
+
+  for (size_t p = 0; p < tg->threadsPerThreadgroup.height; ++p) {
+    const size_t part = tg->threadOrigin.y + p;
+    const size_t first = s.partitions[part], last = s.partitions[part + 1];
+    for (size_t br = first; br < last; ++br) {
+      const size_t row0 = br * bs;
+      const size_t height = s.rows - row0 < bs ? s.rows - row0 : bs;
+      for (size_t r = 0; r < height; ++r) {
+        float *c = s.C + (row0 + r) * s.ldc;
+        const float *b = s.B + (row0 + r) * s.ldb;
+        if (c != b)
+          memcpy(c + x0, b + x0, (x1 - x0) * sizeof(float));
+      }
+      // then the stored entries that fall in this threadgroup's columns
+      const size_t begin = s.rowOffsets[br], end = s.rowOffsets[br + 1];
+      for (size_t k = begin; k < end; ++k) {
+        const size_t col0 = (size_t)s.colIndices[k] * bs;
+        const size_t from = col0 > x0 ? col0 : x0;
+        const size_t to = col0 + bs < x1 ? col0 + bs : x1;
+        const float *block = s.values + k * bs * bs;
+        for (size_t r = 0; r < height; ++r) {
+          float *c = s.C + (row0 + r) * s.ldc;
+          for (size_t j = from; j < to; ++j)
+            c[j] += block[r * bs + j - col0];
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,217 @@
+#include "kernels.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRANSPOSE_X86 1
+#endif
+
+/*
+ * Cache-oblivious transpose: a block is halved along its longer side until
+ * it fits TRANSPOSE_LEAF x TRANSPOSE_LEAF, so at every level of the memory
+ * hierarchy both the rows read and the rows written stay resident. Leaves
+ * are transposed 8 x 8 in registers where the element size allows it.
+ */
+
+#define TRANSPOSE_LEAF 32
+
+typedef void (*TransposeBlock8)(const char *src, size_t lds, char *dst,
+                                size_t ldd);
+
+static void transposeScalar(const char *src, size_t lds, char *dst,
+                            size_t ldd, size_t rows, size_t cols,
+                            size_t size) {
+  for (size_t i = 0; i < rows; ++i) {
+    for (size_t j = 0; j < cols; ++j)
+      memcpy(dst + (j * ldd + i) * size, src + (i * lds + j) * size, size);
+  }
+}
+
+#ifdef TRANSPOSE_X86
+/* 8 x 8 32-bit elements: interleave pairs of rows, then pairs of pairs,
+ * then swap 128-bit halves. */
+__attribute__((target("avx2"))) static void
+transpose8x8x32(const char *src, size_t lds, char *dst, size_t ldd) {
+  const float *s = (const float *)src;
+  float *d = (float *)dst;
+  __m256 r[8], t[8];
+#pragma GCC unroll 8
+  for (int i = 0; i < 8; ++i)
+    r[i] = _mm256_loadu_ps(s + i * lds);
+#pragma GCC unroll 8
+  for (int i = 0; i < 8; i += 2) {
+    t[i] = _mm256_unpacklo_ps(r[i], r[i + 1]);
+    t[i + 1] = _mm256_unpackhi_ps(r[i], r[i + 1]);
+  }
+#pragma GCC unroll 8
+  for (int i = 0; i < 8; i += 4) {
+    r[i] = _mm256_shuffle_ps(t[i], t[i + 2], _MM_SHUFFLE(1, 0, 1, 0));
+    r[i + 1] = _mm256_shuffle_ps(t[i], t[i + 2], _MM_SHUFFLE(3, 2, 3, 2));
+    r[i + 2] = _mm256_shuffle_ps(t[i + 1], t[i + 3], _MM_SHUFFLE(1, 0, 1, 0));
+    r[i + 3] = _mm256_shuffle_ps(t[i + 1], t[i + 3], _MM_SHUFFLE(3, 2, 3, 2));
+  }
+#pragma GCC unroll 8
+  for (int i = 0; i < 4; ++i) {
+    _mm256_storeu_ps(d + i * ldd, _mm256_permute2f128_ps(r[i], r[i + 4], 0x20));
+    _mm256_storeu_ps(d + (i + 4) * ldd,
+                     _mm256_permute2f128_ps(r[i], r[i + 4], 0x31));
+  }
+}
+
+/* 8 x 8 16-bit elements: three rounds of interleaving 16, 32 and 64-bit
+ * pieces. */
+static void transpose8x8x16(const char *src, size_t lds, char *dst,
+                            size_t ldd) {
+  const uint16_t *s = (const uint16_t *)src;
+  uint16_t *d = (uint16_t *)dst;
+  __m128i r[8], t[8];
+#pragma GCC unroll 8
+  for (int i = 0; i < 8; ++i)
+    r[i] = _mm_loadu_si128((const __m128i *)(s + i * lds));
+#pragma GCC unroll 8
+  for (int i = 0; i < 8; i += 2) {
+    t[i / 2] = _mm_unpacklo_epi16(r[i], r[i + 1]);
+    t[i / 2 + 4] = _mm_unpackhi_epi16(r[i], r[i + 1]);
+  }
+#pragma GCC unroll 8
+  for (int i = 0; i < 8; i += 4) {
+    r[i] = _mm_unpacklo_epi32(t[i], t[i + 1]);
+    r[i + 1] = _mm_unpackhi_epi32(t[i], t[i + 1]);
+    r[i + 2] = _mm_unpacklo_epi32(t[i + 2], t[i + 3]);
+    r[i + 3] = _mm_unpackhi_epi32(t[i + 2], t[i + 3]);
+  }
+  // r[0..3] hold columns 0-1, 2-3 of rows 0-3 and 4-7, r[4..7] columns 4-7
+#pragma GCC unroll 8
+  for (int i = 0; i < 2; ++i) {
+#pragma GCC unroll 8
+    for (int h = 0; h < 2; ++h) {
+      const __m128i lo = r[4 * h + i], hi = r[4 * h + i + 2];
+      _mm_storeu_si128((__m128i *)(d + (4 * h + 2 * i) * ldd),
+                       _mm_unpacklo_epi64(lo, hi));
+      _mm_storeu_si128((__m128i *)(d + (4 * h + 2 * i + 1) * ldd),
+                       _mm_unpackhi_epi64(lo, hi));
+    }
+  }
+}
+#endif
+
+static TransposeBlock8 transposeBlock8(size_t size) {
+#ifdef TRANSPOSE_X86
+  if (size == 4 && __builtin_cpu_supports("avx2"))
+    return transpose8x8x32;
+  if (size == 2)
+    return transpose8x8x16;
+#endif
+  (void)size;
+  return NULL;
+}
+
+/* A leaf: whole 8 x 8 blocks in registers, the ragged right and bottom
+ * edges element by element. */
+static void transposeLeaf(TransposeBlock8 block8, const char *src, size_t lds,
+                          char *dst, size_t ldd, size_t rows, size_t cols,
+                          size_t size) {
+  if (!block8) {
+    transposeScalar(src, lds, dst, ldd, rows, cols, size);
+    return;
+  }
+
+  const size_t rows8 = rows & ~(size_t)7, cols8 = cols & ~(size_t)7;
+  // down the columns of src, so each row of dst is written front to back
+  for (size_t j = 0; j < cols8; j += 8) {
+    for (size_t i = 0; i < rows8; i += 8)
+      block8(src + (i * lds + j) * size, lds, dst + (j * ldd + i) * size, ldd);
+  }
+  transposeScalar(src + cols8 * size, lds, dst + cols8 * ldd * size, ldd,
+                  rows, cols - cols8, size);
+  transposeScalar(src + rows8 * lds * size, lds, dst + rows8 * size, ldd,
+                  rows - rows8, cols8, size);
+}
+
+static void transposeRecursive(TransposeBlock8 block8, const char *src,
+                               size_t lds, char *dst, size_t ldd, size_t rows,
+                               size_t cols, size_t size) {
+  if (rows <= TRANSPOSE_LEAF && cols <= TRANSPOSE_LEAF) {
+    transposeLeaf(block8, src, lds, dst, ldd, rows, cols, size);
+    return;
+  }
+
+  // split on a multiple of 8 so the leaves stay whole register blocks
+  if (rows >= cols) {
+    const size_t half = (rows / 2 + 7) & ~(size_t)7;
+    transposeRecursive(block8, src, lds, dst, ldd, half, cols, size);
+    transposeRecursive(block8, src + half * lds * size, lds, dst + half * size,
+                       ldd, rows - half, cols, size);
+  } else {
+    const size_t half = (cols / 2 + 7) & ~(size_t)7;
+    transposeRecursive(block8, src, lds, dst, ldd, rows, half, size);
+    transposeRecursive(block8, src + half * size, lds, dst + half * ldd * size,
+                       ldd, rows, cols - half, size);
+  }
+}
+
+void transposeElements(const void *src, size_t lds, void *dst, size_t ldd,
+                       size_t rows, size_t cols, size_t size) {
+  transposeRecursive(transposeBlock8(size), src, lds, dst, ldd, rows, cols,
+                     size);
+}
+
+/* Arguments are src, dst and the element size; the grid is dst's shape, so
+ * a threadgroup writes a tile of dst from the mirrored tile of src. */
+void transposeMatrixKernel(const MtHostKernelArgs *args,
+                           const MtHostThreadgroup *tg) {
+  const char *src = args->buffers[0];
+  char *dst = args->buffers[1];
+  const size_t size = *(const uint32_t *)args->buffers[2];
+  const uint32_t *ld = args->buffers[3];
+  const size_t x0 = tg->threadOrigin.x; /* a row of src */
+  const size_t y0 = tg->threadOrigin.y; /* a column of src */
+
+  transposeElements(src + (x0 * ld[0] + y0) * size, ld[0],
+                    dst + (y0 * ld[1] + x0) * size, ld[1],
+                    tg->threadsPerThreadgroup.width,
+                    tg->threadsPerThreadgroup.height, size);
+}
+
+/* Arguments are the square matrix and the element size. It is cut into
+ * TRANSPOSE_LEAF blocks; the threadgroup holding a block's first element
+ * swaps it with its mirror if it lies above the diagonal and transposes it
+ * in place if it lies on it, so every element moves exactly once. */
+void transposeMatrixInPlaceKernel(const MtHostKernelArgs *args,
+                                  const MtHostThreadgroup *tg) {
+  char *data = args->buffers[0];
+  const size_t size = *(const uint32_t *)args->buffers[1];
+  const size_t ld = *(const uint32_t *)args->buffers[2];
+  const size_t n = args->threadsPerGrid.width;
+  const size_t x0 = tg->threadOrigin.x, y0 = tg->threadOrigin.y;
+  const size_t x1 = x0 + tg->threadsPerThreadgroup.width;
+  const size_t y1 = y0 + tg->threadsPerThreadgroup.height;
+  const TransposeBlock8 block8 = transposeBlock8(size);
+  char upper[TRANSPOSE_LEAF * TRANSPOSE_LEAF * 4];
+  char lower[TRANSPOSE_LEAF * TRANSPOSE_LEAF * 4];
+
+  const size_t first = (y0 + TRANSPOSE_LEAF - 1) / TRANSPOSE_LEAF;
+  for (size_t bi = first; bi * TRANSPOSE_LEAF < y1; ++bi) {
+    const size_t i = bi * TRANSPOSE_LEAF;
+    const size_t rows = n - i < TRANSPOSE_LEAF ? n - i : TRANSPOSE_LEAF;
+    size_t bj = (x0 + TRANSPOSE_LEAF - 1) / TRANSPOSE_LEAF;
+    if (bj < bi)
+      bj = bi;
+    for (; bj * TRANSPOSE_LEAF < x1; ++bj) {
+      const size_t j = bj * TRANSPOSE_LEAF;
+      const size_t cols = n - j < TRANSPOSE_LEAF ? n - j : TRANSPOSE_LEAF;
+      char *a = data + (i * ld + j) * size; /* rows x cols, above */
+      char *b = data + (j * ld + i) * size; /* cols x rows, mirrored */
+
+      transposeLeaf(block8, a, ld, upper, rows, rows, cols, size);
+      if (bi != bj)
+        transposeLeaf(block8, b, ld, lower, cols, cols, rows, size);
+      for (size_t r = 0; r < cols; ++r)
+        memcpy(b + r * ld * size, upper + r * rows * size, rows * size);
+      if (bi != bj) {
+        for (size_t r = 0; r < rows; ++r)
+          memcpy(a + r * ld * size, lower + r * cols * size, cols * size);
+      }
+    }
+  }
+}
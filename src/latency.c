@@ -0,0 +1,320 @@
+#define _POSIX_C_SOURCE 200809L
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE /* CLOCK_UPTIME_RAW */
+#endif
+#include "internal.h"
+#include <string.h>
+#include <time.h>
+
+/*
+ * Latencies are kept in nanoseconds in log-linear (HDR) histograms: values
+ * below 128 ns have a bucket each, and every power of two above is split
+ * into 64 buckets, so any recorded value is known to within 1/64 (1.6%)
+ * however large it is. Values from 2^42 ns (73 minutes) on share the top
+ * bucket. A histogram is 2368 counters; one set of them per phase is
+ * allocated for each kernel the first time it is submitted.
+ */
+
+#define LATENCY_SUB_BITS 7
+#define LATENCY_HALF (1 << (LATENCY_SUB_BITS - 1))
+#define LATENCY_MAX_BITS 42
+#define LATENCY_BUCKETS                                                        \
+  (LATENCY_HALF * (LATENCY_MAX_BITS - LATENCY_SUB_BITS + 2))
+
+typedef struct LatencyHistogram {
+  uint64_t count;
+  uint64_t sum; /* ns */
+  uint64_t min, max;
+  uint64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+struct AlloyLatencyKernel {
+  char *name; /* stored after the entry */
+  pthread_mutex_t lock;
+  LatencyHistogram phases[ALLOY_LATENCY_PHASES];
+  AlloyLatencyKernel *next;
+};
+
+struct AlloyLatencyRecorder {
+  pthread_mutex_t lock; /* guards the list, not the histograms */
+  AlloyLatencyKernel *kernels;
+  size_t kernelCount;
+};
+
+static const char *phaseNames[ALLOY_LATENCY_PHASES] = {
+    "encode", "queue", "execute", "wake", "total"};
+
+static size_t bucketIndex(uint64_t ns) {
+  if (ns >> LATENCY_MAX_BITS)
+    return LATENCY_BUCKETS - 1;
+  unsigned msb = 63 - __builtin_clzll(ns | 1);
+  unsigned shift =
+      msb < LATENCY_SUB_BITS - 1 ? 0 : msb - (LATENCY_SUB_BITS - 1);
+  return LATENCY_HALF * shift + (size_t)(ns >> shift);
+}
+
+// The largest value that lands in bucket i.
+static uint64_t bucketTop(size_t i) {
+  unsigned shift = i < 2 * LATENCY_HALF ? 0 : (unsigned)(i / LATENCY_HALF - 1);
+  uint64_t sub = i - (size_t)LATENCY_HALF * shift;
+  return ((sub + 1) << shift) - 1;
+}
+
+static void histogramReset(LatencyHistogram *h) {
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+static void histogramAdd(LatencyHistogram *dst, const LatencyHistogram *src) {
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+  for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+    dst->buckets[i] += src->buckets[i];
+}
+
+// The value at or below which a fraction q of the recorded values lie,
+// reported as the top of its bucket but never beyond the largest value.
+static uint64_t histogramQuantile(const LatencyHistogram *h, double q) {
+  if (!h->count)
+    return 0;
+  if (q < 0.0)
+    q = 0.0;
+  if (q > 1.0)
+    q = 1.0;
+  uint64_t rank = (uint64_t)(q * (double)h->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t top = bucketTop(i);
+      return top < h->max ? (top > h->min ? top : h->min) : h->max;
+    }
+  }
+  return h->max;
+}
+
+static AlloyLatencyStats histogramStats(const LatencyHistogram *h) {
+  AlloyLatencyStats stats = {0};
+  if (!h->count)
+    return stats;
+  stats.count = h->count;
+  stats.min = h->min * 1e-9;
+  stats.max = h->max * 1e-9;
+  stats.mean = (double)h->sum / (double)h->count * 1e-9;
+  stats.p50 = histogramQuantile(h, 0.5) * 1e-9;
+  stats.p90 = histogramQuantile(h, 0.9) * 1e-9;
+  stats.p99 = histogramQuantile(h, 0.99) * 1e-9;
+  stats.p999 = histogramQuantile(h, 0.999) * 1e-9;
+  return stats;
+}
+
+double latencyClock(void) {
+  struct timespec ts;
+  // the clock command buffers report their start and end times on
+#ifdef __APPLE__
+  clock_gettime(CLOCK_UPTIME_RAW, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+AlloyLatencyRecorder *createLatencyRecorder(void) {
+  AlloyLatencyRecorder *recorder = calloc(1, sizeof(*recorder));
+  if (!recorder)
+    return NULL;
+  pthread_mutex_init(&recorder->lock, NULL);
+  return recorder;
+}
+
+void freeLatencyRecorder(AlloyLatencyRecorder *recorder) {
+  if (!recorder)
+    return;
+
+  AlloyLatencyKernel *kernel = recorder->kernels;
+  while (kernel) {
+    AlloyLatencyKernel *next = kernel->next;
+    pthread_mutex_destroy(&kernel->lock);
+    free(kernel);
+    kernel = next;
+  }
+  pthread_mutex_destroy(&recorder->lock);
+  free(recorder);
+}
+
+AlloyLatencyKernel *latencyKernel(AlloyLatencyRecorder *recorder,
+                                  const char *name) {
+  if (!recorder || !name)
+    return NULL;
+
+  pthread_mutex_lock(&recorder->lock);
+  AlloyLatencyKernel *kernel = recorder->kernels;
+  for (; kernel; kernel = kernel->next) {
+    if (kernel->name == name || strcmp(kernel->name, name) == 0)
+      goto cleanup;
+  }
+
+  size_t nameSize = strlen(name) + 1;
+  kernel = malloc(sizeof(*kernel) + nameSize);
+  if (!kernel)
+    goto cleanup;
+  kernel->name = memcpy(kernel + 1, name, nameSize);
+  pthread_mutex_init(&kernel->lock, NULL);
+  for (size_t i = 0; i < ALLOY_LATENCY_PHASES; ++i)
+    histogramReset(&kernel->phases[i]);
+  // appended, so kernels are listed in the order first submitted
+  AlloyLatencyKernel **tail = &recorder->kernels;
+  while (*tail)
+    tail = &(*tail)->next;
+  kernel->next = NULL;
+  *tail = kernel;
+  recorder->kernelCount++;
+
+cleanup:
+  pthread_mutex_unlock(&recorder->lock);
+  return kernel;
+}
+
+void recordLatencies(AlloyLatencyKernel *kernel, const double *seconds,
+                     const bool *recorded) {
+  if (!kernel)
+    return;
+
+  pthread_mutex_lock(&kernel->lock);
+  for (size_t i = 0; i < ALLOY_LATENCY_PHASES; ++i) {
+    if (!recorded[i])
+      continue;
+    // clocks that step backwards read as 0
+    uint64_t ns = seconds[i] > 0.0 ? (uint64_t)(seconds[i] * 1e9 + 0.5) : 0;
+    LatencyHistogram *h = &kernel->phases[i];
+    h->count++;
+    h->sum += ns;
+    if (ns < h->min)
+      h->min = ns;
+    if (ns > h->max)
+      h->max = ns;
+    h->buckets[bucketIndex(ns)]++;
+  }
+  pthread_mutex_unlock(&kernel->lock);
+}
+
+// Adds kernel's histogram for phase, or every kernel's when kernel is NULL,
+// into h; returns false if no kernel goes by that name.
+static bool collectHistogram(AlloyLatencyRecorder *recorder,
+                             const char *kernel, AlloyLatencyPhase phase,
+                             LatencyHistogram *h) {
+  bool found = !kernel;
+  histogramReset(h);
+
+  pthread_mutex_lock(&recorder->lock);
+  for (AlloyLatencyKernel *k = recorder->kernels; k; k = k->next) {
+    if (kernel && strcmp(k->name, kernel) != 0)
+      continue;
+    found = true;
+    pthread_mutex_lock(&k->lock);
+    histogramAdd(h, &k->phases[phase]);
+    pthread_mutex_unlock(&k->lock);
+  }
+  pthread_mutex_unlock(&recorder->lock);
+  return found;
+}
+
+size_t getLatencyKernels(AlloyContext *ctx, const char **names,
+                         size_t capacity) {
+  AlloyLatencyRecorder *recorder = ctx->latency;
+
+  pthread_mutex_lock(&recorder->lock);
+  size_t i = 0;
+  for (AlloyLatencyKernel *k = recorder->kernels; k && i < capacity;
+       k = k->next)
+    names[i++] = k->name;
+  size_t count = recorder->kernelCount;
+  pthread_mutex_unlock(&recorder->lock);
+  return count;
+}
+
+int getLatencyStats(AlloyContext *ctx, const char *kernel,
+                    AlloyLatencyPhase phase, AlloyLatencyStats *stats) {
+  LatencyHistogram *h = NULL;
+  int status = -1;
+
+  CHECK_ERROR(phase >= 0 && phase < ALLOY_LATENCY_PHASES,
+              "Unknown latency phase");
+  h = malloc(sizeof(*h));
+  CHECK_ERROR(h, "Failed to allocate latency histogram");
+  if (!collectHistogram(ctx->latency, kernel, phase, h))
+    goto cleanup;
+  *stats = histogramStats(h);
+  status = 0;
+
+cleanup:
+  free(h);
+  return status;
+}
+
+double getLatencyPercentile(AlloyContext *ctx, const char *kernel,
+                            AlloyLatencyPhase phase, double percentile) {
+  LatencyHistogram *h = NULL;
+  double value = -1.0;
+
+  CHECK_ERROR(phase >= 0 && phase < ALLOY_LATENCY_PHASES,
+              "Unknown latency phase");
+  h = malloc(sizeof(*h));
+  CHECK_ERROR(h, "Failed to allocate latency histogram");
+  if (collectHistogram(ctx->latency, kernel, phase, h))
+    value = histogramQuantile(h, percentile / 100.0) * 1e-9;
+
+cleanup:
+  free(h);
+  return value;
+}
+
+void resetLatencyHistograms(AlloyContext *ctx) {
+  AlloyLatencyRecorder *recorder = ctx->latency;
+
+  pthread_mutex_lock(&recorder->lock);
+  for (AlloyLatencyKernel *k = recorder->kernels; k; k = k->next) {
+    pthread_mutex_lock(&k->lock);
+    for (size_t i = 0; i < ALLOY_LATENCY_PHASES; ++i)
+      histogramReset(&k->phases[i]);
+    pthread_mutex_unlock(&k->lock);
+  }
+  pthread_mutex_unlock(&recorder->lock);
+}
+
+void dumpLatencyHistograms(AlloyContext *ctx, FILE *out) {
+  AlloyLatencyRecorder *recorder = ctx->latency;
+  LatencyHistogram *h = malloc(sizeof(*h));
+  if (!h)
+    return;
+
+  fprintf(out, "%-32s %-8s %9s %10s %10s %10s %10s %10s %10s %10s\n",
+          "kernel (us)", "phase", "count", "min", "mean", "p50", "p90", "p99",
+          "p99.9", "max");
+  pthread_mutex_lock(&recorder->lock);
+  for (AlloyLatencyKernel *k = recorder->kernels; k; k = k->next) {
+    for (size_t i = 0; i < ALLOY_LATENCY_PHASES; ++i) {
+      pthread_mutex_lock(&k->lock);
+      *h = k->phases[i];
+      pthread_mutex_unlock(&k->lock);
+      if (!h->count)
+        continue;
+      AlloyLatencyStats s = histogramStats(h);
+      fprintf(out,
+              "%-32s %-8s %9zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f "
+              "%10.1f\n",
+              k->name, phaseNames[i], s.count, s.min * 1e6, s.mean * 1e6,
+              s.p50 * 1e6, s.p90 * 1e6, s.p99 * 1e6, s.p999 * 1e6,
+              s.max * 1e6);
+    }
+  }
+  pthread_mutex_unlock(&recorder->lock);
+  free(h);
+}
@@ -0,0 +1,308 @@
+#define _POSIX_C_SOURCE 200809L
+#include "internal.h"
+#include "kernels/float16.h"
+#ifndef __APPLE__
+#include "../include/cmt/host.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+size_t matrixElementSize(const Matrix *mat) {
+  switch (matrixType(mat)) {
+  case MtDataTypeFloat:
+    return sizeof(float);
+  case MtDataTypeHalf:
+  case MtDataTypeBFloat:
+    return sizeof(uint16_t);
+  case MtDataTypeChar:
+    return sizeof(int8_t);
+  case MtDataTypeInt:
+    return sizeof(int32_t);
+  default:
+    return 0;
+  }
+}
+
+MtDataType matrixType(const Matrix *mat) {
+  return mat->type ? mat->type : MtDataTypeFloat;
+}
+
+size_t matrixBytes(const Matrix *mat) {
+  return mat->rows * mat->cols * matrixElementSize(mat);
+}
+
+size_t matrixLd(const Matrix *mat) { return mat->ld ? mat->ld : mat->cols; }
+
+bool matrixIsPacked(const Matrix *mat) {
+  return mat->rows <= 1 || matrixLd(mat) == mat->cols;
+}
+
+size_t matrixExtent(const Matrix *mat) {
+  if (!mat->rows || !mat->cols)
+    return 0;
+  return ((mat->rows - 1) * matrixLd(mat) + mat->cols) *
+         matrixElementSize(mat);
+}
+
+typedef struct PackRows {
+  const Matrix *mat;
+  char *dst;
+  size_t rowBytes, ldBytes;
+} PackRows;
+
+static void packRows(void *userData, size_t begin, size_t end) {
+  const PackRows *p = userData;
+  for (size_t i = begin; i < end; ++i)
+    memcpy(p->dst + i * p->rowBytes,
+           (const char *)p->mat->data + i * p->ldBytes, p->rowBytes);
+}
+
+void packMatrix(const Matrix *mat, void *dst) {
+  const size_t rowBytes = mat->cols * matrixElementSize(mat);
+  PackRows p = {mat, dst, rowBytes, matrixLd(mat) * matrixElementSize(mat)};
+  parallelFor(mat->rows, parallelGrain(rowBytes), packRows, &p);
+}
+
+// Rows start on cache lines, so aligned vector loads never straddle two.
+#define MATRIX_ALIGNMENT 64
+// Caches pick a set from the low address bits: rows a multiple of this many
+// bytes apart put a whole column into a handful of sets, which then thrash.
+#define MATRIX_ALIASING_STRIDE 512
+
+size_t paddedLd(size_t cols, size_t elementSize) {
+  size_t bytes = (cols * elementSize + MATRIX_ALIGNMENT - 1) /
+                 MATRIX_ALIGNMENT * MATRIX_ALIGNMENT;
+  if (bytes % MATRIX_ALIASING_STRIDE == 0)
+    bytes += MATRIX_ALIGNMENT;
+  return bytes / elementSize;
+}
+
+// Allocates mat's storage aligned to alignment and rounded up to a multiple
+// of it, after padding ld when asked. Returns the bytes allocated, or 0.
+static size_t allocateMatrix(Matrix *mat, bool padded, size_t alignment) {
+  const size_t elementSize = matrixElementSize(mat);
+  if (!elementSize) {
+    fprintf(stderr, "Unsupported matrix element type.\n");
+    return 0;
+  }
+  if (padded && mat->rows > 1 && mat->cols)
+    mat->ld = paddedLd(mat->cols, elementSize);
+
+  size_t size = mat->rows * matrixLd(mat) * elementSize;
+  size = size ? (size + alignment - 1) / alignment * alignment : alignment;
+  void *data = NULL;
+#ifdef __APPLE__
+  if (posix_memalign(&data, alignment, size) != 0)
+    data = NULL;
+#else
+  // large ones on huge pages, which are aligned to a page and more
+  NsUInteger mapped = 0;
+  data = mtHostAllocateMemory(size, 0, alignment, &mapped);
+  mat->mapped = mapped;
+#endif
+  if (!data) {
+    fprintf(stderr, "Failed to allocate memory for matrix.\n");
+    return 0;
+  }
+#ifndef __APPLE__
+  // spread over the NUMA nodes before anything touches it
+  mtHostInterleaveMemory(data, size);
+#endif
+  mat->data = data;
+  return size;
+}
+
+static Matrix createHostMatrix(size_t rows, size_t cols, MtDataType type,
+                               bool padded) {
+  Matrix mat = {.rows = rows, .cols = cols, .type = type};
+  allocateMatrix(&mat, padded, MATRIX_ALIGNMENT);
+  return mat;
+}
+
+static Matrix createDeviceMatrix(AlloyContext *ctx, size_t rows, size_t cols,
+                                 MtDataType type, bool padded) {
+  Matrix mat = {.rows = rows, .cols = cols, .type = type};
+
+  // no-copy buffers must start on a page and cover whole pages
+  const size_t size =
+      allocateMatrix(&mat, padded, (size_t)sysconf(_SC_PAGESIZE));
+  if (!size)
+    return mat;
+
+  mat.buffer = mtDeviceNewBufferWithBytesNoCopy(ctx->device, mat.data, size,
+                                                MtResourceStorageModeShared);
+  if (!mat.buffer) {
+    fprintf(stderr, "Failed to wrap matrix storage in a buffer.\n");
+    freeMatrix(&mat);
+  }
+  return mat;
+}
+
+Matrix createMatrix(size_t rows, size_t cols) {
+  return createMatrixOfType(rows, cols, MtDataTypeFloat);
+}
+
+Matrix createMatrixOfType(size_t rows, size_t cols, MtDataType type) {
+  return createHostMatrix(rows, cols, type, false);
+}
+
+Matrix createSharedMatrix(AlloyContext *ctx, size_t rows, size_t cols) {
+  return createSharedMatrixOfType(ctx, rows, cols, MtDataTypeFloat);
+}
+
+Matrix createSharedMatrixOfType(AlloyContext *ctx, size_t rows, size_t cols,
+                                MtDataType type) {
+  return createDeviceMatrix(ctx, rows, cols, type, false);
+}
+
+Matrix createPaddedMatrix(size_t rows, size_t cols) {
+  return createPaddedMatrixOfType(rows, cols, MtDataTypeFloat);
+}
+
+Matrix createPaddedMatrixOfType(size_t rows, size_t cols, MtDataType type) {
+  return createHostMatrix(rows, cols, type, true);
+}
+
+Matrix createPaddedSharedMatrix(AlloyContext *ctx, size_t rows, size_t cols) {
+  return createPaddedSharedMatrixOfType(ctx, rows, cols, MtDataTypeFloat);
+}
+
+Matrix createPaddedSharedMatrixOfType(AlloyContext *ctx, size_t rows,
+                                      size_t cols, MtDataType type) {
+  return createDeviceMatrix(ctx, rows, cols, type, true);
+}
+
+Matrix sliceMatrix(const Matrix *mat, size_t row, size_t col, size_t rows,
+                   size_t cols) {
+  Matrix view = {0};
+  if (!mat->data || row > mat->rows || rows > mat->rows - row ||
+      col > mat->cols || cols > mat->cols - col) {
+    fprintf(stderr, "Slice lies outside the matrix.\n");
+    return view;
+  }
+
+  const size_t ld = matrixLd(mat);
+  view = *mat;
+  view.rows = rows;
+  view.cols = cols;
+  view.ld = ld;
+  view.data = (float *)((char *)mat->data +
+                        (row * ld + col) * matrixElementSize(mat));
+  view.offset = mat->offset + row * ld + col;
+  view.view = true;
+  return view;
+}
+
+Matrix sliceMatrixRows(const Matrix *mat, size_t row, size_t rows) {
+  return sliceMatrix(mat, row, 0, rows, mat->cols);
+}
+
+void freeMatrix(Matrix *mat) {
+  if (mat && mat->view) {
+    *mat = (Matrix){0};
+    return;
+  }
+  if (mat && mat->buffer) {
+    mtRelease(mat->buffer);
+    mat->buffer = NULL;
+  }
+  if (mat && mat->mapped) {
+    // the mapping starts where the buffer does, offset elements before data
+    void *base = (char *)mat->data - mat->offset * matrixElementSize(mat);
+#ifdef __APPLE__
+    munmap(base, mat->mapped);
+#else
+    mtHostFreeMemory(base, mat->mapped);
+#endif
+    mat->data = NULL;
+    mat->mapped = 0;
+  }
+  if (mat && mat->data) {
+    free(mat->data);
+    mat->data = NULL;
+  }
+}
+
+static float getElement(const Matrix *mat, size_t i) {
+  switch (matrixType(mat)) {
+  case MtDataTypeHalf:
+    return halfToFloat(mat->data16[i]);
+  case MtDataTypeBFloat:
+    return bfloatToFloat(mat->data16[i]);
+  case MtDataTypeChar:
+    return mat->data8[i];
+  case MtDataTypeInt:
+    return (float)mat->data32[i];
+  default:
+    return mat->data[i];
+  }
+}
+
+static void setElement(Matrix *mat, size_t i, float value) {
+  switch (matrixType(mat)) {
+  case MtDataTypeHalf:
+    mat->data16[i] = floatToHalf(value);
+    break;
+  case MtDataTypeBFloat:
+    mat->data16[i] = floatToBFloat(value);
+    break;
+  case MtDataTypeChar:
+    mat->data8[i] = (int8_t)value;
+    break;
+  case MtDataTypeInt:
+    mat->data32[i] = (int32_t)value;
+    break;
+  default:
+    mat->data[i] = value;
+    break;
+  }
+}
+
+typedef struct RandomFill {
+  Matrix *mat;
+  uint64_t seed;
+  bool integer;
+} RandomFill;
+
+// splitmix64 of the element's index: every element has its own stream, so
+// the values do not depend on how the rows are shared out.
+static uint64_t randomBits(uint64_t seed, uint64_t index) {
+  uint64_t z = seed + (index + 1) * 0x9e3779b97f4a7c15u;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+static void fillRows(void *userData, size_t begin, size_t end) {
+  const RandomFill *f = userData;
+  const size_t ld = matrixLd(f->mat), cols = f->mat->cols;
+  for (size_t i = begin; i < end; ++i) {
+    for (size_t j = 0; j < cols; ++j) {
+      const uint64_t bits = randomBits(f->seed, i * cols + j);
+      // integer matrices get the whole int8 range rather than [0, 1)
+      setElement(f->mat, i * ld + j,
+                 f->integer ? (float)((int)(bits >> 56) - 128)
+                            : (float)(bits >> 40) * 0x1p-24f);
+    }
+  }
+}
+
+void fillMatrixRandom(Matrix *mat) {
+  // seeded from rand(), so srand still makes a run repeatable
+  RandomFill f = {mat, (uint64_t)rand() << 31 ^ (uint64_t)rand(),
+                  matrixType(mat) == MtDataTypeChar ||
+                      matrixType(mat) == MtDataTypeInt};
+  parallelFor(mat->rows, parallelGrain(mat->cols * sizeof(float)), fillRows,
+              &f);
+}
+
+void printMatrix(const Matrix *mat) {
+  for (size_t i = 0; i < mat->rows; ++i) {
+    for (size_t j = 0; j < mat->cols; ++j) {
+      printf("%f ", getElement(mat, i * matrixLd(mat) + j));
+    }
+    printf("\n");
+  }
+}
@@ -0,0 +1,144 @@
+#define _POSIX_C_SOURCE 200809L
+#include "internal.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Matrix files are laid out to be mapped rather than read: the rows start on
+ * a page boundary, so the whole file is wrapped in one no-copy buffer and
+ * the matrix is a window into it, offset by the header. Nothing is read at
+ * map time; the kernel pages data in on first touch.
+ */
+
+#define MATRIX_FILE_ALIGNMENT ((size_t)16384)
+
+static bool writeAll(FILE *file, const void *data, size_t size) {
+  return fwrite(data, 1, size, file) == size;
+}
+
+int saveMatrix(const Matrix *mat, const char *path) {
+  const size_t elementSize = matrixElementSize(mat);
+  const size_t ld = mat->view ? mat->cols : matrixLd(mat);
+  FILE *file = NULL;
+  char *gap = NULL;
+  int status = -1;
+
+  CHECK_ERROR(elementSize && (mat->data || !mat->rows || !mat->cols),
+              "Matrix to save has no supported elements");
+
+  AlloyMatrixHeader header = {
+      .version = ALLOY_MATRIX_VERSION,
+      .type = matrixType(mat),
+      .rows = mat->rows,
+      .cols = mat->cols,
+      .ld = ld,
+      .alignment = MATRIX_FILE_ALIGNMENT,
+      .dataOffset = MATRIX_FILE_ALIGNMENT,
+  };
+  memcpy(header.magic, ALLOY_MATRIX_MAGIC, sizeof(header.magic));
+
+  // zeros for the header's padding and for the gaps between rows
+  const size_t padding = MATRIX_FILE_ALIGNMENT - sizeof(header);
+  const size_t gapBytes = (ld - mat->cols) * elementSize;
+  gap = calloc(1, padding > gapBytes ? padding : gapBytes);
+  CHECK_ERROR(gap, "Failed to allocate memory for matrix file padding");
+
+  file = fopen(path, "wb");
+  CHECK_ERROR(file, "Failed to create matrix file");
+  CHECK_ERROR(writeAll(file, &header, sizeof(header)) &&
+                  writeAll(file, gap, padding),
+              "Failed to write matrix file header");
+  for (size_t i = 0; i < mat->rows; ++i) {
+    CHECK_ERROR(writeAll(file,
+                         (const char *)mat->data +
+                             i * matrixLd(mat) * elementSize,
+                         mat->cols * elementSize) &&
+                    writeAll(file, gap, gapBytes),
+                "Failed to write matrix file rows");
+  }
+  status = 0;
+
+cleanup:
+  if (file && fclose(file) != 0 && status == 0) {
+    fprintf(stderr, "Error: Failed to write matrix file\n");
+    status = -1;
+  }
+  free(gap);
+  return status;
+}
+
+// Checks that header describes a matrix whose rows lie within fileSize
+// bytes; on success fills in mat's shape and type.
+static bool readHeader(const AlloyMatrixHeader *header, size_t fileSize,
+                       Matrix *mat) {
+  const uint64_t alignment = header->alignment;
+  if (memcmp(header->magic, ALLOY_MATRIX_MAGIC, sizeof(header->magic)) ||
+      header->version != ALLOY_MATRIX_VERSION)
+    return false;
+  if (alignment < 64 || (alignment & (alignment - 1)) ||
+      header->dataOffset % alignment ||
+      header->dataOffset < sizeof(*header))
+    return false;
+
+  Matrix m = {.type = (MtDataType)header->type};
+  const size_t elementSize = matrixElementSize(&m);
+  if (!elementSize || header->ld < header->cols ||
+      header->dataOffset > fileSize)
+    return false;
+
+  // the rows must fit what follows the header, without overflowing
+  const size_t available = (fileSize - header->dataOffset) / elementSize;
+  if (header->rows && header->cols &&
+      (header->cols > available ||
+       header->rows - 1 > (available - header->cols) / header->ld))
+    return false;
+
+  m.rows = header->rows;
+  m.cols = header->cols;
+  m.ld = header->ld;
+  m.offset = header->dataOffset / elementSize;
+  *mat = m;
+  return true;
+}
+
+Matrix mapMatrix(AlloyContext *ctx, const char *path, bool writable) {
+  Matrix mat = {0};
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  void *base = MAP_FAILED;
+  size_t length = 0;
+  struct stat st;
+  AlloyMatrixHeader header;
+
+  int fd = open(path, writable ? O_RDWR : O_RDONLY);
+  CHECK_ERROR(fd >= 0, "Failed to open matrix file");
+  CHECK_ERROR(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(header),
+              "Matrix file is too short");
+  CHECK_ERROR(pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                  readHeader(&header, (size_t)st.st_size, &mat),
+              "Not a valid matrix file");
+
+  // no-copy buffers must start on a page and cover whole pages
+  length = ((size_t)st.st_size + page - 1) / page * page;
+  base = mmap(NULL, length, PROT_READ | (writable ? PROT_WRITE : 0),
+              MAP_SHARED, fd, 0);
+  CHECK_ERROR(base != MAP_FAILED, "Failed to map matrix file");
+
+  mat.buffer = mtDeviceNewBufferWithBytesNoCopy(ctx->device, base, length,
+                                                MtResourceStorageModeShared);
+  CHECK_ERROR(mat.buffer, "Failed to wrap matrix file in a buffer");
+  mat.data = (float *)((char *)base + mat.offset * matrixElementSize(&mat));
+  mat.mapped = length;
+  close(fd);
+  return mat;
+
+cleanup:
+  if (base != MAP_FAILED)
+    munmap(base, length);
+  if (fd >= 0)
+    close(fd);
+  return (Matrix){0};
+}
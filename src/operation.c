@@ -0,0 +1,212 @@
+#include "internal.h"
+#include "../include/cmt/error_handling.h"
+#include <stdatomic.h>
+#include <string.h>
+
+struct AlloyOperation {
+  AlloyContext *ctx;
+  MtCommandBuffer *cmdBuffer;
+  atomic_int refs; /* caller and completion handler */
+
+  MtBuffer *staged[OPERATION_MAX_OPERANDS];
+  size_t stagedCount;
+
+  MtBuffer *readback;
+  char *readbackDst;
+  size_t readbackItems;
+  size_t readbackSrcStride;
+  size_t readbackDstStride;
+  size_t readbackItemBytes;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool completed;
+  int status;
+  AlloyOperationCallback callback;
+  void *userData;
+
+  AlloyLatencyKernel *latency;
+  double submitted, committed; /* latencyClock */
+  double kernelEnd;            /* 0 until known */
+  bool woken;                  /* the wake phase has been recorded */
+};
+
+AlloyOperation *createOperation(AlloyContext *ctx, MtCommandBuffer *cmdBuffer,
+                                const char *kernel, double submitted) {
+  AlloyOperation *op = calloc(1, sizeof(*op));
+  if (!op)
+    return NULL;
+
+  op->ctx = ctx;
+  op->cmdBuffer = mtRetain(cmdBuffer);
+  atomic_init(&op->refs, 1);
+  op->status = -1;
+  op->latency = latencyKernel(ctx->latency, kernel);
+  op->submitted = submitted;
+  pthread_mutex_init(&op->lock, NULL);
+  pthread_cond_init(&op->cond, NULL);
+  return op;
+}
+
+bool operationAddStaged(AlloyOperation *op, MtBuffer *buffer) {
+  if (op->stagedCount == OPERATION_MAX_OPERANDS) {
+    releaseBuffer(op->ctx->bufferPool, buffer);
+    return false;
+  }
+  op->staged[op->stagedCount++] = buffer;
+  return true;
+}
+
+void operationSetReadback(AlloyOperation *op, MtBuffer *src, void *dst,
+                          size_t items, size_t srcStride, size_t dstStride,
+                          size_t itemBytes) {
+  op->readback = src;
+  op->readbackDst = dst;
+  op->readbackItems = items;
+  op->readbackSrcStride = srcStride;
+  op->readbackDstStride = dstStride;
+  op->readbackItemBytes = itemBytes;
+}
+
+static void dropOperation(AlloyOperation *op) {
+  if (atomic_fetch_sub(&op->refs, 1) != 1)
+    return;
+
+  /* never committed: the staging buffers are still ours */
+  for (size_t i = 0; i < op->stagedCount; ++i)
+    releaseBuffer(op->ctx->bufferPool, op->staged[i]);
+  mtRelease(op->cmdBuffer);
+  pthread_cond_destroy(&op->cond);
+  pthread_mutex_destroy(&op->lock);
+  free(op);
+}
+
+// Records the phases known once op's work has completed, at time now.
+static void recordCompletion(AlloyOperation *op, MtCommandBuffer *cmdb,
+                             double now) {
+  double seconds[ALLOY_LATENCY_PHASES] = {0};
+  bool recorded[ALLOY_LATENCY_PHASES] = {false};
+  const double start = mtCommandBufferKernelStartTime(cmdb);
+  const double end = mtCommandBufferKernelEndTime(cmdb);
+
+  seconds[ALLOY_LATENCY_ENCODE] = op->committed - op->submitted;
+  seconds[ALLOY_LATENCY_TOTAL] = now - op->submitted;
+  recorded[ALLOY_LATENCY_ENCODE] = recorded[ALLOY_LATENCY_TOTAL] = true;
+  // a device that does not time its kernels reports 0
+  if (start > 0.0 && end >= start) {
+    seconds[ALLOY_LATENCY_QUEUE] = start - op->committed;
+    seconds[ALLOY_LATENCY_EXECUTE] = end - start;
+    recorded[ALLOY_LATENCY_QUEUE] = recorded[ALLOY_LATENCY_EXECUTE] = true;
+  }
+  recordLatencies(op->latency, seconds, recorded);
+}
+
+static void copyReadback(void *userData, size_t begin, size_t end) {
+  const AlloyOperation *op = userData;
+  const char *src = mtBufferContents(op->readback);
+  for (size_t i = begin; i < end; ++i)
+    memcpy(op->readbackDst + i * op->readbackDstStride,
+           src + i * op->readbackSrcStride, op->readbackItemBytes);
+}
+
+static void operationCompleted(void *__restrict sender,
+                               MtCommandBuffer *__restrict cmdb) {
+  AlloyOperation *op = sender;
+  int status = mtCommandBufferStatus(cmdb) == MtCommandBufferStatusCompleted
+                   ? 0
+                   : -1;
+  NsError *error = status == 0 ? NULL : mtCommandBufferError(cmdb);
+  if (error)
+    printNSError(error);
+
+  if (status == 0 && op->readback) {
+    if (op->readbackItems == 1)
+      parallelCopy(op->readbackDst, mtBufferContents(op->readback),
+                   op->readbackItemBytes);
+    else
+      parallelFor(op->readbackItems, parallelGrain(op->readbackItemBytes),
+                  copyReadback, op);
+  }
+  for (size_t i = 0; i < op->stagedCount; ++i)
+    releaseBuffer(op->ctx->bufferPool, op->staged[i]);
+  op->stagedCount = 0;
+
+  const double now = latencyClock();
+  if (status == 0)
+    recordCompletion(op, cmdb, now);
+
+  pthread_mutex_lock(&op->lock);
+  if (status == 0) {
+    const double end = mtCommandBufferKernelEndTime(cmdb);
+    op->kernelEnd = end > 0.0 ? end : now;
+  }
+  op->status = status;
+  op->completed = true;
+  AlloyOperationCallback callback = op->callback;
+  pthread_cond_broadcast(&op->cond);
+  pthread_mutex_unlock(&op->lock);
+
+  if (callback)
+    callback(op, op->userData);
+  dropOperation(op);
+}
+
+void commitOperation(AlloyOperation *op) {
+  atomic_fetch_add(&op->refs, 1);
+  op->committed = latencyClock();
+  mtCommandBufferOnComplete(op->cmdBuffer, op, operationCompleted);
+  mtCommandBufferCommit(op->cmdBuffer);
+}
+
+int waitOperation(AlloyOperation *op) {
+  pthread_mutex_lock(&op->lock);
+  while (!op->completed)
+    pthread_cond_wait(&op->cond, &op->lock);
+  int status = op->status;
+  // only the first waiter to return measures the wake
+  const bool wake = op->kernelEnd > 0.0 && !op->woken;
+  op->woken = true;
+  pthread_mutex_unlock(&op->lock);
+
+  if (wake) {
+    double seconds[ALLOY_LATENCY_PHASES] = {0};
+    bool recorded[ALLOY_LATENCY_PHASES] = {false};
+    seconds[ALLOY_LATENCY_WAKE] = latencyClock() - op->kernelEnd;
+    recorded[ALLOY_LATENCY_WAKE] = true;
+    recordLatencies(op->latency, seconds, recorded);
+  }
+  return status;
+}
+
+bool pollOperation(AlloyOperation *op) {
+  pthread_mutex_lock(&op->lock);
+  bool completed = op->completed;
+  pthread_mutex_unlock(&op->lock);
+  return completed;
+}
+
+int operationStatus(AlloyOperation *op) {
+  pthread_mutex_lock(&op->lock);
+  int status = op->status;
+  pthread_mutex_unlock(&op->lock);
+  return status;
+}
+
+void setOperationCallback(AlloyOperation *op, AlloyOperationCallback callback,
+                          void *userData) {
+  pthread_mutex_lock(&op->lock);
+  bool completed = op->completed;
+  if (!completed) {
+    op->callback = callback;
+    op->userData = userData;
+  }
+  pthread_mutex_unlock(&op->lock);
+
+  if (completed && callback)
+    callback(op, userData);
+}
+
+void releaseOperation(AlloyOperation *op) {
+  if (op)
+    dropOperation(op);
+}
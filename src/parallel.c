@@ -0,0 +1,126 @@
+#include "internal.h"
+#include <string.h>
+#ifdef __APPLE__
+#include <dispatch/dispatch.h>
+#else
+#include "../include/cmt/host.h"
+#include <pthread.h>
+#endif
+
+/*
+ * Host-side loops run on the host backend's worker pool, the threads its
+ * kernels run on, so a copy or fill and the kernels of concurrent
+ * operations never add up to more threads than cores. Under Metal they go
+ * to Grand Central Dispatch, which shares its threads the same way.
+ */
+
+// Bytes of work worth handing to another thread.
+#define PARALLEL_CHUNK_BYTES ((size_t)64 * 1024)
+
+#ifdef __APPLE__
+typedef struct ParallelChunks {
+  size_t count, grain;
+  AlloyRangeFn fn;
+  void *userData;
+} ParallelChunks;
+
+static void runChunk(void *ctx, size_t chunk) {
+  const ParallelChunks *chunks = ctx;
+  const size_t begin = chunk * chunks->grain;
+  const size_t end = chunks->count - begin < chunks->grain
+                         ? chunks->count
+                         : begin + chunks->grain;
+  chunks->fn(chunks->userData, begin, end);
+}
+
+void parallelFor(size_t count, size_t grain, AlloyRangeFn fn,
+                 void *userData) {
+  if (!count)
+    return;
+  if (!grain)
+    grain = 1;
+  ParallelChunks chunks = {count, grain, fn, userData};
+  dispatch_apply_f((count - 1) / grain + 1, DISPATCH_APPLY_AUTO, &chunks,
+                   runChunk);
+}
+#else
+static MtDevice *hostDevice;
+static pthread_once_t hostDeviceOnce = PTHREAD_ONCE_INIT;
+
+typedef struct ParallelLoop {
+  AlloyRangeFn fn;
+  void *userData;
+} ParallelLoop;
+
+static void runRange(void *ctx, NsUInteger begin, NsUInteger end) {
+  const ParallelLoop *loop = ctx;
+  loop->fn(loop->userData, begin, end);
+}
+
+static void openHostDevice(void) {
+  // the system device, and so its pool, lives as long as the process
+  hostDevice = mtCreateSystemDefaultDevice();
+}
+
+void parallelFor(size_t count, size_t grain, AlloyRangeFn fn,
+                 void *userData) {
+  pthread_once(&hostDeviceOnce, openHostDevice);
+  if (!hostDevice) {
+    if (count)
+      fn(userData, 0, count);
+    return;
+  }
+  ParallelLoop loop = {fn, userData};
+  mtHostParallelFor(hostDevice, count, grain, runRange, &loop);
+}
+#endif
+
+typedef struct ParallelTiles {
+  size_t rows, cols, rowGrain, colGrain, tileCols;
+  AlloyTileFn fn;
+  void *userData;
+} ParallelTiles;
+
+static void runTiles(void *userData, size_t begin, size_t end) {
+  const ParallelTiles *t = userData;
+  for (size_t tile = begin; tile < end; ++tile) {
+    const size_t row = tile / t->tileCols * t->rowGrain;
+    const size_t col = tile % t->tileCols * t->colGrain;
+    t->fn(t->userData, row,
+          t->rows - row < t->rowGrain ? t->rows : row + t->rowGrain, col,
+          t->cols - col < t->colGrain ? t->cols : col + t->colGrain);
+  }
+}
+
+void parallelFor2D(size_t rows, size_t cols, size_t rowGrain,
+                   size_t colGrain, AlloyTileFn fn, void *userData) {
+  if (!rows || !cols)
+    return;
+  ParallelTiles tiles = {rows, cols, rowGrain ? rowGrain : 1,
+                         colGrain ? colGrain : 1, 0, fn, userData};
+  tiles.tileCols = (cols - 1) / tiles.colGrain + 1;
+  // tiles are numbered by rows, so a stolen half is a band of rows
+  parallelFor(((rows - 1) / tiles.rowGrain + 1) * tiles.tileCols, 1,
+              runTiles, &tiles);
+}
+
+size_t parallelGrain(size_t itemBytes) {
+  return itemBytes && itemBytes < PARALLEL_CHUNK_BYTES
+             ? PARALLEL_CHUNK_BYTES / itemBytes
+             : 1;
+}
+
+typedef struct ParallelCopy {
+  char *dst;
+  const char *src;
+} ParallelCopy;
+
+static void copyBytes(void *userData, size_t begin, size_t end) {
+  const ParallelCopy *copy = userData;
+  memcpy(copy->dst + begin, copy->src + begin, end - begin);
+}
+
+void parallelCopy(void *dst, const void *src, size_t size) {
+  ParallelCopy copy = {dst, src};
+  parallelFor(size, PARALLEL_CHUNK_BYTES * 4, copyBytes, &copy);
+}
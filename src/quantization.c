@@ -0,0 +1,381 @@
+#include "internal.h"
+#include "kernels/kernels.h"
+#include <math.h>
+#include <stdlib.h>
+
+/*
+ * int8 quantization. Parameters are picked on the host from the float
+ * matrix; quantizing, dequantizing and the dequantizing int8 product each
+ * run as one kernel. Scales and zero points travel as two small operands,
+ * and a symmetric matrix binds a single zero point of 0 instead.
+ */
+
+_Static_assert(QUANT_PER_TENSOR == QUANT_AXIS_TENSOR &&
+                   QUANT_PER_ROW == QUANT_AXIS_ROW &&
+                   QUANT_PER_COLUMN == QUANT_AXIS_COLUMN,
+               "QuantAxis must match the kernels' axis values");
+
+const char *matrixQuantizationShader =
+    "#include <metal_stdlib>\n"
+    "using namespace metal;\n"
+    "inline uint paramIndex(uint axis, uint row, uint col) {\n"
+    "   return axis == 1 ? row : axis == 2 ? col : 0;\n"
+    "}\n"
+    "kernel void quantize_matrix(const device float* src [[buffer(0)]],\n"
+    "                            const device float* scales [[buffer(1)]],\n"
+    "                            const device int* zeros [[buffer(2)]],\n"
+    "                            device char* dst [[buffer(3)]],\n"
+    "                            constant uint2& axes [[buffer(4)]],\n"
+    "                            constant uint* ld [[buffer(5)]],\n"
+    "                            uint2 id [[thread_position_in_grid]],\n"
+    "                            uint2 gridSize [[threads_per_grid]]) {\n"
+    "   if (id.x < gridSize.x && id.y < gridSize.y) {\n"
+    "       float y = src[id.y * ld[0] + id.x] /\n"
+    "                 scales[paramIndex(axes.x, id.y, id.x)];\n"
+    "       y = clamp(y, -256.0f, 256.0f);\n"
+    "       int q = int(rint(y)) + zeros[paramIndex(axes.y, id.y, id.x)];\n"
+    "       dst[id.y * ld[3] + id.x] = char(clamp(q, -128, 127));\n"
+    "   }\n"
+    "}\n"
+    "kernel void dequantize_matrix(const device uchar* src [[buffer(0)]],\n"
+    "                              const device float* scales [[buffer(1)]],\n"
+    "                              const device int* zeros [[buffer(2)]],\n"
+    "                              device float* dst [[buffer(3)]],\n"
+    "                              constant uint& srcType [[buffer(4)]],\n"
+    "                              constant uint2& axes [[buffer(5)]],\n"
+    "                              constant uint* ld [[buffer(6)]],\n"
+    "                              uint2 id [[thread_position_in_grid]],\n"
+    "                              uint2 gridSize [[threads_per_grid]]) {\n"
+    "   if (id.x < gridSize.x && id.y < gridSize.y) {\n"
+    "       unsigned int index = id.y * ld[0] + id.x;\n"
+    "       int q = srcType == 29 ? ((const device int*)src)[index]\n"
+    "                             : int(((const device char*)src)[index]);\n"
+    "       q -= zeros[paramIndex(axes.y, id.y, id.x)];\n"
+    "       dst[id.y * ld[3] + id.x] =\n"
+    "           float(q) * scales[paramIndex(axes.x, id.y, id.x)];\n"
+    "   }\n"
+    "}\n"
+    "kernel void matrix_multiplication_int8_dequantize(\n"
+    "    const device char* A [[buffer(0)]],\n"
+    "    const device char* B [[buffer(1)]],\n"
+    "    const device float* scalesA [[buffer(2)]],\n"
+    "    const device int* zerosA [[buffer(3)]],\n"
+    "    const device float* scalesB [[buffer(4)]],\n"
+    "    const device int* zerosB [[buffer(5)]],\n"
+    "    device float* C [[buffer(6)]],\n"
+    "    constant uint& M [[buffer(7)]],\n"
+    "    constant uint& N [[buffer(8)]],\n"
+    "    constant uint& K [[buffer(9)]],\n"
+    "    constant uint4& axes [[buffer(10)]],\n"
+    "    constant uint* ld [[buffer(11)]],\n"
+    "    uint2 id [[thread_position_in_grid]]) {\n"
+    "   if (id.x >= N || id.y >= M) return;\n"
+    "   int za = zerosA[paramIndex(axes.y, id.y, 0)];\n"
+    "   int zb = zerosB[paramIndex(axes.w, 0, id.x)];\n"
+    "   int sum = 0;\n"
+    "   for (uint i = 0; i < K; ++i) {\n"
+    "       sum += (int(A[id.y * ld[0] + i]) - za) *\n"
+    "              (int(B[i * ld[1] + id.x]) - zb);\n"
+    "   }\n"
+    "   float scale = scalesA[paramIndex(axes.x, id.y, 0)] *\n"
+    "                 scalesB[paramIndex(axes.z, 0, id.x)];\n"
+    "   C[id.y * ld[6] + id.x] = float(sum) * scale;\n"
+    "}";
+
+/* the zero point bound for symmetric matrices; only ever read */
+static int32_t noZeroPoint = 0;
+
+/* int32 sums of up to 2^15 products of 255 * 255 cannot overflow */
+#define QUANTIZED_MAX_DEPTH 32768
+
+static size_t paramCount(QuantAxis axis, const Matrix *mat) {
+  return axis == QUANT_PER_ROW      ? mat->rows
+         : axis == QUANT_PER_COLUMN ? mat->cols
+                                    : 1;
+}
+
+typedef struct RangeScan {
+  const Matrix *src;
+  QuantAxis axis;
+  float *lo, *hi;
+  pthread_mutex_t lock; /* merges per-tensor ranges */
+} RangeScan;
+
+// Widens the ranges over rows [begin, end) of src, or over columns
+// [begin, end) of every row for per-column parameters. The ranges start at
+// [0, 0], so zero is always exactly representable.
+static void scanRanges(void *userData, size_t begin, size_t end) {
+  RangeScan *scan = userData;
+  const Matrix *src = scan->src;
+  const size_t ld = matrixLd(src);
+
+  if (scan->axis == QUANT_PER_COLUMN) {
+    for (size_t i = 0; i < src->rows; ++i) {
+      for (size_t j = begin; j < end; ++j) {
+        const float v = src->data[i * ld + j];
+        scan->lo[j] = fminf(scan->lo[j], v);
+        scan->hi[j] = fmaxf(scan->hi[j], v);
+      }
+    }
+    return;
+  }
+
+  float tensorLo = 0.0f, tensorHi = 0.0f;
+  for (size_t i = begin; i < end; ++i) {
+    float rowLo = 0.0f, rowHi = 0.0f;
+    for (size_t j = 0; j < src->cols; ++j) {
+      rowLo = fminf(rowLo, src->data[i * ld + j]);
+      rowHi = fmaxf(rowHi, src->data[i * ld + j]);
+    }
+    if (scan->axis == QUANT_PER_ROW) {
+      scan->lo[i] = rowLo;
+      scan->hi[i] = rowHi;
+    }
+    tensorLo = fminf(tensorLo, rowLo);
+    tensorHi = fmaxf(tensorHi, rowHi);
+  }
+  if (scan->axis == QUANT_PER_TENSOR) {
+    pthread_mutex_lock(&scan->lock);
+    scan->lo[0] = fminf(scan->lo[0], tensorLo);
+    scan->hi[0] = fmaxf(scan->hi[0], tensorHi);
+    pthread_mutex_unlock(&scan->lock);
+  }
+}
+
+int computeQuantParams(const Matrix *src, QuantAxis axis, bool symmetric,
+                       QuantParams *params) {
+  QuantParams result = {.axis = axis};
+  float *lo = NULL, *hi = NULL;
+  int status = -1;
+
+  CHECK_ERROR(axis <= QUANT_PER_COLUMN, "Invalid quantization axis");
+  CHECK_ERROR(matrixType(src) == MtDataTypeFloat && src->data,
+              "Quantization parameters need a float matrix");
+
+  const size_t count = paramCount(axis, src);
+  lo = calloc(count, sizeof(float));
+  hi = calloc(count, sizeof(float));
+  result.scales = malloc(count * sizeof(float));
+  if (!symmetric)
+    result.zeroPoints = malloc(count * sizeof(int32_t));
+  CHECK_ERROR(lo && hi && result.scales && (symmetric || result.zeroPoints),
+              "Failed to allocate quantization parameters");
+
+  RangeScan scan = {src, axis, lo, hi, PTHREAD_MUTEX_INITIALIZER};
+  if (axis == QUANT_PER_COLUMN)
+    parallelFor(src->cols, parallelGrain(src->rows * sizeof(float)),
+                scanRanges, &scan);
+  else
+    parallelFor(src->rows, parallelGrain(src->cols * sizeof(float)),
+                scanRanges, &scan);
+  pthread_mutex_destroy(&scan.lock);
+
+  for (size_t c = 0; c < count; ++c) {
+    if (symmetric) {
+      const float magnitude = fmaxf(-lo[c], hi[c]);
+      result.scales[c] = magnitude > 0.0f ? magnitude / 127.0f : 1.0f;
+    } else {
+      const float range = hi[c] - lo[c];
+      const float scale = range > 0.0f ? range / 255.0f : 1.0f;
+      const long zero = -128 - lrintf(lo[c] / scale);
+      result.scales[c] = scale;
+      result.zeroPoints[c] = zero < -128 ? -128 : zero > 127 ? 127 : zero;
+    }
+  }
+
+  *params = result;
+  result.scales = NULL;
+  result.zeroPoints = NULL;
+  status = 0;
+
+cleanup:
+  free(lo);
+  free(hi);
+  freeQuantParams(&result);
+  return status;
+}
+
+void freeQuantParams(QuantParams *params) {
+  if (!params)
+    return;
+  free(params->scales);
+  free(params->zeroPoints);
+  params->scales = NULL;
+  params->zeroPoints = NULL;
+}
+
+/* A matrix's QuantParams as the two operands and axes the kernels take. */
+typedef struct BoundParams {
+  Matrix scales;
+  Matrix zeroPoints;
+  uint32_t axes[2];
+} BoundParams;
+
+static bool bindParams(const QuantParams *params, const Matrix *mat,
+                       BoundParams *bound) {
+  if (!params || !params->scales || params->axis > QUANT_PER_COLUMN)
+    return false;
+
+  const size_t count = paramCount(params->axis, mat);
+  bound->scales = (Matrix){.rows = 1, .cols = count, .data = params->scales};
+  bound->zeroPoints = (Matrix){
+      .rows = 1,
+      .cols = params->zeroPoints ? count : 1,
+      .data32 = params->zeroPoints ? params->zeroPoints : &noZeroPoint,
+      .type = MtDataTypeInt,
+  };
+  bound->axes[0] = params->axis;
+  bound->axes[1] = params->zeroPoints ? params->axis : QUANT_PER_TENSOR;
+  return true;
+}
+
+static bool sameShape(const Matrix *a, const Matrix *b) {
+  return a->rows == b->rows && a->cols == b->cols;
+}
+
+AlloyOperation *submitMatrixQuantization(AlloyContext *ctx, Matrix *src,
+                                         Matrix *dst,
+                                         const QuantParams *params) {
+  BoundParams bound;
+
+  CHECK_ERROR(matrixType(src) == MtDataTypeFloat &&
+                  matrixType(dst) == MtDataTypeChar,
+              "Quantization maps a float matrix to an int8 one");
+  CHECK_ERROR(sameShape(src, dst), "Quantization shapes do not match");
+  CHECK_ERROR(bindParams(params, src, &bound),
+              "Invalid quantization parameters");
+
+  OperationDesc desc = {
+      .shaderFile = "quantization.metal",
+      .funcName = "quantize_matrix",
+      .operands = {src, &bound.scales, &bound.zeroPoints, dst},
+      .sizes = {matrixBytes(src), matrixBytes(&bound.scales),
+                matrixBytes(&bound.zeroPoints), matrixBytes(dst)},
+      .operandCount = 4,
+      .bytes = {bound.axes},
+      .byteLengths = {sizeof(bound.axes)},
+      .bytesCount = 1,
+      .gridSize = {dst->cols, dst->rows, 1},
+      .threadgroupSize = rowThreadgroupSizeFor,
+      .resultItems = 1,
+  };
+  return submitOperation(ctx, &desc);
+
+cleanup:
+  return NULL;
+}
+
+int performMatrixQuantization(AlloyContext *ctx, Matrix *src, Matrix *dst,
+                              const QuantParams *params) {
+  AlloyOperation *operation = submitMatrixQuantization(ctx, src, dst, params);
+  if (!operation)
+    return -1;
+
+  int status = waitOperation(operation);
+  releaseOperation(operation);
+  return status;
+}
+
+AlloyOperation *submitMatrixDequantization(AlloyContext *ctx, Matrix *src,
+                                           Matrix *dst,
+                                           const QuantParams *params) {
+  const uint32_t srcType = matrixType(src);
+  BoundParams bound;
+
+  CHECK_ERROR((srcType == MtDataTypeChar || srcType == MtDataTypeInt) &&
+                  matrixType(dst) == MtDataTypeFloat,
+              "Dequantization maps an int8 or int32 matrix to a float one");
+  CHECK_ERROR(sameShape(src, dst), "Dequantization shapes do not match");
+  CHECK_ERROR(bindParams(params, src, &bound),
+              "Invalid quantization parameters");
+
+  OperationDesc desc = {
+      .shaderFile = "quantization.metal",
+      .funcName = "dequantize_matrix",
+      .operands = {src, &bound.scales, &bound.zeroPoints, dst},
+      .sizes = {matrixBytes(src), matrixBytes(&bound.scales),
+                matrixBytes(&bound.zeroPoints), matrixBytes(dst)},
+      .operandCount = 4,
+      .bytes = {&srcType, bound.axes},
+      .byteLengths = {sizeof(srcType), sizeof(bound.axes)},
+      .bytesCount = 2,
+      .gridSize = {dst->cols, dst->rows, 1},
+      .threadgroupSize = rowThreadgroupSizeFor,
+      .resultItems = 1,
+  };
+  return submitOperation(ctx, &desc);
+
+cleanup:
+  return NULL;
+}
+
+int performMatrixDequantization(AlloyContext *ctx, Matrix *src, Matrix *dst,
+                                const QuantParams *params) {
+  AlloyOperation *operation =
+      submitMatrixDequantization(ctx, src, dst, params);
+  if (!operation)
+    return -1;
+
+  int status = waitOperation(operation);
+  releaseOperation(operation);
+  return status;
+}
+
+AlloyOperation *submitQuantizedMatrixMultiply(AlloyContext *ctx, Matrix *a,
+                                              const QuantParams *qa, Matrix *b,
+                                              const QuantParams *qb,
+                                              Matrix *result) {
+  BoundParams boundA, boundB;
+
+  CHECK_ERROR(matrixType(a) == MtDataTypeChar &&
+                  matrixType(b) == MtDataTypeChar &&
+                  matrixType(result) == MtDataTypeFloat,
+              "Quantized products take int8 operands and a float result");
+  CHECK_ERROR(a->cols == b->rows && result->rows == a->rows &&
+                  result->cols == b->cols,
+              "Quantized multiply shapes do not match");
+  CHECK_ERROR(a->cols <= QUANTIZED_MAX_DEPTH,
+              "Quantized multiply is too deep for int32 sums");
+  CHECK_ERROR(bindParams(qa, a, &boundA) && bindParams(qb, b, &boundB),
+              "Invalid quantization parameters");
+  // each output element needs a single scale from either side
+  CHECK_ERROR(qa->axis != QUANT_PER_COLUMN && qb->axis != QUANT_PER_ROW,
+              "Quantized multiply takes per-row a and per-column b scales");
+
+  uint32_t constants[] = {a->rows, b->cols, a->cols};
+  uint32_t axes[] = {boundA.axes[0], boundA.axes[1], boundB.axes[0],
+                     boundB.axes[1]};
+  OperationDesc desc = {
+      .shaderFile = "quantization.metal",
+      .funcName = "matrix_multiplication_int8_dequantize",
+      .operands = {a, b, &boundA.scales, &boundA.zeroPoints, &boundB.scales,
+                   &boundB.zeroPoints, result},
+      .sizes = {matrixBytes(a), matrixBytes(b), matrixBytes(&boundA.scales),
+                matrixBytes(&boundA.zeroPoints), matrixBytes(&boundB.scales),
+                matrixBytes(&boundB.zeroPoints), matrixBytes(result)},
+      .operandCount = 7,
+      .bytes = {&constants[0], &constants[1], &constants[2], axes},
+      .byteLengths = {sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t),
+                      sizeof(axes)},
+      .bytesCount = 4,
+      .gridSize = {result->cols, result->rows, 1},
+      .resultItems = 1,
+  };
+  return submitOperation(ctx, &desc);
+
+cleanup:
+  return NULL;
+}
+
+int performQuantizedMatrixMultiply(AlloyContext *ctx, Matrix *a,
+                                   const QuantParams *qa, Matrix *b,
+                                   const QuantParams *qb, Matrix *result) {
+  AlloyOperation *operation =
+      submitQuantizedMatrixMultiply(ctx, a, qa, b, qb, result);
+  if (!operation)
+    return -1;
+
+  int status = waitOperation(operation);
+  releaseOperation(operation);
+  return status;
+}
@@ -0,0 +1,84 @@
+#include "internal.h"
+
+/*
+ * Reductions. A threadgroup row sums one row of the matrix: its threads take
+ * every w-th column, w the threadgroup width, and then halve their partial
+ * sums in threadgroup memory in a tree, so each row is read once and summed
+ * without atomics. The grid is at most ROW_SUMS_WIDTH threads wide; should
+ * a tuned shape be narrower than the grid, every threadgroup across a row
+ * still sums all of it and they store the same sum.
+ */
+
+#define ROW_SUMS_WIDTH 64
+
+const char *matrixReductionShader =
+    "#include <metal_stdlib>\n"
+    "using namespace metal;\n"
+    "kernel void matrix_row_sums(\n"
+    "    const device float* A [[buffer(0)]],\n"
+    "    device float* sums [[buffer(1)]],\n"
+    "    constant uint2& dims [[buffer(2)]],\n"
+    "    constant uint* ld [[buffer(3)]],\n"
+    "    threadgroup float* partial [[threadgroup(0)]],\n"
+    "    uint2 id [[thread_position_in_grid]],\n"
+    "    uint2 tid [[thread_position_in_threadgroup]],\n"
+    "    uint2 tgSize [[threads_per_threadgroup]]) {\n"
+    "   // dims: rows, cols; partial: one float per thread\n"
+    "   threadgroup float totals[1024];\n"
+    "   uint w = tgSize.x;\n"
+    "   uint i = tid.y * w + tid.x;\n"
+    "   float sum = 0.0f;\n"
+    "   for (uint j = tid.x; j < dims.y; j += w)\n"
+    "       sum += A[id.y * ld[0] + j];\n"
+    "   partial[i] = sum;\n"
+    "   threadgroup_barrier(mem_flags::mem_threadgroup);\n"
+    "   for (uint s = w > 1 ? 1u << (31 - clz(w - 1)) : 0; s; s >>= 1) {\n"
+    "       if (tid.x < s && tid.x + s < w) partial[i] += partial[i + s];\n"
+    "       threadgroup_barrier(mem_flags::mem_threadgroup);\n"
+    "   }\n"
+    "   if (tid.x == 0) totals[tid.y] = partial[i];\n"
+    "   threadgroup_barrier(mem_flags::mem_threadgroup);\n"
+    "   if (i < tgSize.y) sums[(id.y - tid.y + i) * ld[1]] = totals[i];\n"
+    "}\n";
+
+AlloyOperation *submitMatrixRowSums(AlloyContext *ctx, Matrix *src,
+                                    Matrix *sums) {
+  CHECK_ERROR(matrixType(src) == MtDataTypeFloat &&
+                  matrixType(sums) == MtDataTypeFloat,
+              "Row sums take float matrices");
+  CHECK_ERROR(sums->rows == src->rows && sums->cols == 1,
+              "Row sums need one column with a row per source row");
+  CHECK_ERROR(src != sums, "Row sums need a separate result");
+
+  uint32_t dims[] = {src->rows, src->cols};
+  OperationDesc desc = {
+      .shaderFile = "reduction.metal",
+      .funcName = "matrix_row_sums",
+      .operands = {src, sums},
+      .sizes = {matrixBytes(src), matrixBytes(sums)},
+      .operandCount = 2,
+      .bytes = {dims},
+      .byteLengths = {sizeof(dims)},
+      .bytesCount = 1,
+      .gridSize = {src->cols < ROW_SUMS_WIDTH ? (src->cols ? src->cols : 1)
+                                              : ROW_SUMS_WIDTH,
+                   src->rows, 1},
+      .threadgroupSize = rowThreadgroupSizeFor,
+      .threadgroupMemoryPerThread = sizeof(float),
+      .resultItems = 1,
+  };
+  return submitOperation(ctx, &desc);
+
+cleanup:
+  return NULL;
+}
+
+int performMatrixRowSums(AlloyContext *ctx, Matrix *src, Matrix *sums) {
+  AlloyOperation *operation = submitMatrixRowSums(ctx, src, sums);
+  if (!operation)
+    return -1;
+
+  int status = waitOperation(operation);
+  releaseOperation(operation);
+  return status;
+}
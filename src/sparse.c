@@ -0,0 +1,324 @@
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Sparse matrices. The arrays of a SparseMatrix are shared int32 and float
+ * matrices, so products and sums bind them as ordinary operands without
+ * staging. Both kernels run one thread per result column and partition:
+ * each thread walks the (block) rows of its partition.
+ */
+
+const char *matrixSparseShader =
+    "#include <metal_stdlib>\n"
+    "using namespace metal;\n"
+    "kernel void sparse_multiplication(\n"
+    "    const device int* rowOffsets [[buffer(0)]],\n"
+    "    const device int* colIndices [[buffer(1)]],\n"
+    "    const device float* values [[buffer(2)]],\n"
+    "    const device int* partitions [[buffer(3)]],\n"
+    "    const device float* B [[buffer(4)]],\n"
+    "    device float* C [[buffer(5)]],\n"
+    "    constant uint4& dims [[buffer(6)]],\n"
+    "    constant uint* ld [[buffer(7)]],\n"
+    "    uint2 id [[thread_position_in_grid]],\n"
+    "    uint2 gridSize [[threads_per_grid]]) {\n"
+    "   // dims: rows, cols, columns of B and C, block size; ld: operand\n"
+    "   // leading dimensions\n"
+    "   if (id.x >= dims.z || id.y >= gridSize.y) return;\n"
+    "   uint bs = dims.w;\n"
+    "   for (int br = partitions[id.y]; br < partitions[id.y + 1]; ++br) {\n"
+    "       for (uint r = 0; r < bs && br * bs + r < dims.x; ++r) {\n"
+    "           float sum = 0.0f;\n"
+    "           for (int k = rowOffsets[br]; k < rowOffsets[br + 1]; ++k) {\n"
+    "               uint c0 = uint(colIndices[k]) * bs;\n"
+    "               for (uint c = 0; c < bs && c0 + c < dims.y; ++c)\n"
+    "                   sum += values[(k * bs + r) * bs + c] *\n"
+    "                          B[(c0 + c) * ld[4] + id.x];\n"
+    "           }\n"
+    "           C[(br * bs + r) * ld[5] + id.x] = sum;\n"
+    "       }\n"
+    "   }\n"
+    "}\n"
+    "kernel void sparse_addition(\n"
+    "    const device int* rowOffsets [[buffer(0)]],\n"
+    "    const device int* colIndices [[buffer(1)]],\n"
+    "    const device float* values [[buffer(2)]],\n"
+    "    const device int* partitions [[buffer(3)]],\n"
+    "    const device float* B [[buffer(4)]],\n"
+    "    device float* C [[buffer(5)]],\n"
+    "    constant uint4& dims [[buffer(6)]],\n"
+    "    constant uint* ld [[buffer(7)]],\n"
+    "    uint2 id [[thread_position_in_grid]],\n"
+    "    uint2 gridSize [[threads_per_grid]]) {\n"
+    "   if (id.x >= dims.z || id.y >= gridSize.y) return;\n"
+    "   uint bs = dims.w;\n"
+    "   uint bc = id.x / bs;\n"
+    "   for (int br = partitions[id.y]; br < partitions[id.y + 1]; ++br) {\n"
+    "       for (uint r = 0; r < bs && br * bs + r < dims.x; ++r) {\n"
+    "           uint row = br * bs + r;\n"
+    "           float sum = B[row * ld[4] + id.x];\n"
+    "           for (int k = rowOffsets[br]; k < rowOffsets[br + 1]; ++k) {\n"
+    "               if (uint(colIndices[k]) == bc)\n"
+    "                   sum += values[(k * bs + r) * bs + id.x % bs];\n"
+    "           }\n"
+    "           C[row * ld[5] + id.x] = sum;\n"
+    "       }\n"
+    "   }\n"
+    "}";
+
+/* Stored elements per partition, each row counting as one more: enough work
+ * to amortize a threadgroup, small enough to balance irregular rows. */
+#define SPARSE_PARTITION_WORK 4096
+
+/* Allocates the shared arrays of a matrix of blockRows (block) rows and nnz
+ * entries. */
+static bool allocateSparse(AlloyContext *ctx, SparseMatrix *sparse,
+                           size_t blockRows, size_t nnz) {
+  const size_t blockElements = sparse->blockSize * sparse->blockSize;
+  sparse->nnz = nnz;
+  sparse->rowOffsets =
+      createSharedMatrixOfType(ctx, 1, blockRows + 1, MtDataTypeInt);
+  sparse->colIndices = createSharedMatrixOfType(ctx, 1, nnz, MtDataTypeInt);
+  sparse->values =
+      createSharedMatrixOfType(ctx, nnz, blockElements, MtDataTypeFloat);
+  return sparse->rowOffsets.data && sparse->colIndices.data &&
+         sparse->values.data;
+}
+
+/* Splits the rows into runs of about SPARSE_PARTITION_WORK each. A single
+ * row is never split, so one longer than that may leave a run empty. */
+static bool partitionRows(AlloyContext *ctx, SparseMatrix *sparse) {
+  const int32_t *offsets = sparse->rowOffsets.data32;
+  const size_t blockRows = sparse->rowOffsets.cols - 1;
+  const size_t entryWork = sparse->blockSize * sparse->blockSize;
+  const size_t total = sparse->nnz * entryWork + blockRows;
+
+  size_t count = (total + SPARSE_PARTITION_WORK - 1) / SPARSE_PARTITION_WORK;
+  if (count > blockRows)
+    count = blockRows;
+  if (!count)
+    count = 1;
+
+  sparse->partitions =
+      createSharedMatrixOfType(ctx, 1, count + 1, MtDataTypeInt);
+  if (!sparse->partitions.data)
+    return false;
+
+  // cut after the row at which the running work first reaches each share
+  int32_t *bounds = sparse->partitions.data32;
+  const size_t share = total / count;
+  size_t part = 1, work = 0;
+  bounds[0] = 0;
+  for (size_t br = 0; br < blockRows && part < count; ++br) {
+    work += (size_t)(offsets[br + 1] - offsets[br]) * entryWork + 1;
+    while (part < count && work >= part * share)
+      bounds[part++] = (int32_t)(br + 1);
+  }
+  while (part <= count)
+    bounds[part++] = (int32_t)blockRows;
+  return true;
+}
+
+/* Marks the block columns of block row br of dense that hold a nonzero,
+ * returning how many do. */
+static size_t markBlockRow(const Matrix *dense, size_t br, size_t blockSize,
+                           size_t blockCols, uint8_t *marks) {
+  size_t count = 0;
+  memset(marks, 0, blockCols);
+  for (size_t i = br * blockSize;
+       i < dense->rows && i < (br + 1) * blockSize; ++i) {
+    const float *row = dense->data + i * matrixLd(dense);
+    for (size_t j = 0; j < dense->cols; ++j) {
+      if (row[j] != 0.0f && !marks[j / blockSize]) {
+        marks[j / blockSize] = 1;
+        ++count;
+      }
+    }
+  }
+  return count;
+}
+
+int createSparseMatrix(AlloyContext *ctx, const Matrix *dense,
+                       SparseFormat format, size_t blockSize,
+                       SparseMatrix *sparse) {
+  SparseMatrix result = {.format = format};
+  uint8_t *marks = NULL;
+  int status = -1;
+
+  CHECK_ERROR(format == SPARSE_CSR || format == SPARSE_BSR,
+              "Invalid sparse format");
+  if (format == SPARSE_CSR)
+    blockSize = 1;
+  CHECK_ERROR(blockSize >= 1 && blockSize <= SPARSE_MAX_BLOCK_SIZE,
+              "Invalid sparse block size");
+  CHECK_ERROR(matrixType(dense) == MtDataTypeFloat && dense->data,
+              "Sparse matrices are built from float matrices");
+  CHECK_ERROR(dense->rows <= INT32_MAX && dense->cols <= INT32_MAX,
+              "Matrix too large for sparse indices");
+
+  const size_t blockRows = (dense->rows + blockSize - 1) / blockSize;
+  const size_t blockCols = (dense->cols + blockSize - 1) / blockSize;
+  const size_t ld = matrixLd(dense);
+  result.rows = dense->rows;
+  result.cols = dense->cols;
+  result.blockSize = blockSize;
+  marks = malloc(blockCols ? blockCols : 1);
+  CHECK_ERROR(marks, "Failed to allocate sparse matrix");
+
+  size_t nnz = 0;
+  for (size_t br = 0; br < blockRows; ++br)
+    nnz += markBlockRow(dense, br, blockSize, blockCols, marks);
+  CHECK_ERROR(nnz <= INT32_MAX, "Matrix too large for sparse indices");
+  CHECK_ERROR(allocateSparse(ctx, &result, blockRows, nnz),
+              "Failed to allocate sparse matrix");
+
+  size_t k = 0;
+  for (size_t br = 0; br < blockRows; ++br) {
+    markBlockRow(dense, br, blockSize, blockCols, marks);
+    result.rowOffsets.data32[br] = (int32_t)k;
+    for (size_t bc = 0; bc < blockCols; ++bc) {
+      if (!marks[bc])
+        continue;
+      result.colIndices.data32[k] = (int32_t)bc;
+      float *block = result.values.data + k * blockSize * blockSize;
+      for (size_t r = 0; r < blockSize; ++r) {
+        for (size_t c = 0; c < blockSize; ++c) {
+          const size_t i = br * blockSize + r, j = bc * blockSize + c;
+          block[r * blockSize + c] = i < dense->rows && j < dense->cols
+                                         ? dense->data[i * ld + j]
+                                         : 0.0f;
+        }
+      }
+      ++k;
+    }
+  }
+  result.rowOffsets.data32[blockRows] = (int32_t)k;
+
+  CHECK_ERROR(partitionRows(ctx, &result), "Failed to partition sparse rows");
+
+  *sparse = result;
+  result = (SparseMatrix){0};
+  status = 0;
+
+cleanup:
+  free(marks);
+  freeSparseMatrix(&result);
+  return status;
+}
+
+int createSparseMatrixFromCSR(AlloyContext *ctx, size_t rows, size_t cols,
+                              size_t nnz, const int32_t *rowOffsets,
+                              const int32_t *colIndices, const float *values,
+                              SparseMatrix *sparse) {
+  SparseMatrix result = {
+      .format = SPARSE_CSR, .rows = rows, .cols = cols, .blockSize = 1};
+  int status = -1;
+
+  CHECK_ERROR(rows <= INT32_MAX && cols <= INT32_MAX && nnz <= INT32_MAX,
+              "Matrix too large for sparse indices");
+  CHECK_ERROR(rowOffsets && (!nnz || (colIndices && values)),
+              "Missing CSR arrays");
+  CHECK_ERROR(rowOffsets[0] == 0 && (size_t)rowOffsets[rows] == nnz,
+              "CSR row offsets must run from 0 to nnz");
+  for (size_t i = 0; i < rows; ++i)
+    CHECK_ERROR(rowOffsets[i] <= rowOffsets[i + 1],
+                "CSR row offsets must not decrease");
+  for (size_t k = 0; k < nnz; ++k)
+    CHECK_ERROR(colIndices[k] >= 0 && (size_t)colIndices[k] < cols,
+                "CSR column index out of range");
+
+  CHECK_ERROR(allocateSparse(ctx, &result, rows, nnz),
+              "Failed to allocate sparse matrix");
+  memcpy(result.rowOffsets.data32, rowOffsets, (rows + 1) * sizeof(int32_t));
+  if (nnz) {
+    memcpy(result.colIndices.data32, colIndices, nnz * sizeof(int32_t));
+    memcpy(result.values.data, values, nnz * sizeof(float));
+  }
+  CHECK_ERROR(partitionRows(ctx, &result), "Failed to partition sparse rows");
+
+  *sparse = result;
+  result = (SparseMatrix){0};
+  status = 0;
+
+cleanup:
+  freeSparseMatrix(&result);
+  return status;
+}
+
+void freeSparseMatrix(SparseMatrix *sparse) {
+  if (!sparse)
+    return;
+  freeMatrix(&sparse->rowOffsets);
+  freeMatrix(&sparse->colIndices);
+  freeMatrix(&sparse->values);
+  freeMatrix(&sparse->partitions);
+}
+
+// one partition per threadgroup row, and as many result columns as fit
+static MtSize partitionThreadgroupSizeFor(MtComputePipelineState *pipelineState,
+                                          MtSize gridSize) {
+  NsUInteger maxThreads =
+      mtComputePipelineMaxTotalThreadsPerThreadgroup(pipelineState);
+  NsUInteger width = gridSize.width < maxThreads ? gridSize.width : maxThreads;
+  MtSize size = {width ? width : 1, 1, 1};
+  return size;
+}
+
+AlloyOperation *submitSparseMatrixOperation(AlloyContext *ctx,
+                                            SparseMatrix *a, Matrix *b,
+                                            Matrix *result,
+                                            MatrixOperation op) {
+  CHECK_ERROR(a->partitions.data, "Sparse matrix is not initialized");
+  CHECK_ERROR(op == MATRIX_OP_ADD || op == MATRIX_OP_MULTIPLY,
+              "Sparse operations do not take transpose flags");
+  CHECK_ERROR(matrixType(b) == MtDataTypeFloat &&
+                  matrixType(result) == MtDataTypeFloat,
+              "Sparse operations take float dense matrices");
+  if (op == MATRIX_OP_ADD)
+    CHECK_ERROR(a->rows == b->rows && a->cols == b->cols &&
+                    result->rows == b->rows && result->cols == b->cols,
+                "Sparse addition shapes do not match");
+  else
+    CHECK_ERROR(a->cols == b->rows && result->rows == a->rows &&
+                    result->cols == b->cols,
+                "Sparse multiply shapes do not match");
+  CHECK_ERROR(op == MATRIX_OP_ADD || b != result,
+              "Sparse multiply needs a separate result");
+
+  uint32_t dims[] = {a->rows, a->cols, result->cols, a->blockSize};
+  OperationDesc desc = {
+      .shaderFile = "sparse.metal",
+      .funcName =
+          op == MATRIX_OP_ADD ? "sparse_addition" : "sparse_multiplication",
+      .operands = {&a->rowOffsets, &a->colIndices, &a->values, &a->partitions,
+                   b, result},
+      .sizes = {matrixBytes(&a->rowOffsets), matrixBytes(&a->colIndices),
+                matrixBytes(&a->values), matrixBytes(&a->partitions),
+                matrixBytes(b), matrixBytes(result)},
+      .operandCount = 6,
+      .bytes = {dims},
+      .byteLengths = {sizeof(dims)},
+      .bytesCount = 1,
+      .gridSize = {result->cols, a->partitions.cols - 1, 1},
+      .threadgroupSize = partitionThreadgroupSizeFor,
+      .resultItems = 1,
+  };
+  return submitOperation(ctx, &desc);
+
+cleanup:
+  return NULL;
+}
+
+int performSparseMatrixOperation(AlloyContext *ctx, SparseMatrix *a,
+                                 Matrix *b, Matrix *result,
+                                 MatrixOperation op) {
+  AlloyOperation *operation =
+      submitSparseMatrixOperation(ctx, a, b, result, op);
+  if (!operation)
+    return -1;
+
+  int status = waitOperation(operation);
+  releaseOperation(operation);
+  return status;
+}
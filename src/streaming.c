@@ -0,0 +1,314 @@
+#include "internal.h"
+#include <math.h>
+#include <string.h>
+
+/*
+ * c = a * b a tile at a time. c is cut into mt x nt tiles, computed in row
+ * order, and each tile's product runs over the inner dimension in panels of
+ * kt; with more than one panel, every panel's product goes to a partial
+ * tile that is then added in. A step (one tile times one pair of panels)
+ * reads its panels into one of two panel sets and accumulates into one of
+ * two tiles of c, so the next step's panels are read, and the previous
+ * tile is written, while this step computes. Operations on a context run in
+ * submission order: once the next step is submitted and this one waited
+ * for, this step's buffers are free again.
+ */
+
+/* Below this, tiles of c are too thin to be worth keeping the inner
+ * dimension whole; it is split instead. */
+#define STREAM_MIN_TILE 64
+
+typedef struct StreamPlan {
+  size_t M, N, K;
+  size_t mt, nt, kt;
+  size_t tilesN, tilesK;
+} StreamPlan;
+
+/* Where a step's tile and panels start in c, a and b. */
+typedef struct StreamStep {
+  size_t i, j, k;
+} StreamStep;
+
+/* Shared buffers for a step's panels, the views its operation reads and the
+ * panels they last held, which need not be read again when they recur. */
+typedef struct PanelSet {
+  Matrix a, b;
+  Matrix aView, bView;
+  bool aHeld, bHeld;
+  size_t aI, aK, bK, bJ;
+} PanelSet;
+
+static size_t min(size_t x, size_t y) { return x < y ? x : y; }
+
+static size_t streamRows(const AlloyMatrixStream *s) {
+  return s->matrix ? s->matrix->rows : s->rows;
+}
+
+static size_t streamCols(const AlloyMatrixStream *s) {
+  return s->matrix ? s->matrix->cols : s->cols;
+}
+
+// How many more of an item taking per floats fit in floats when used are
+// already taken.
+static size_t fit(double floats, double used, double per) {
+  return floats > used ? (size_t)((floats - used) / per) : 0;
+}
+
+static bool streamUsable(const AlloyMatrixStream *s, bool write) {
+  if (write ? s->write != NULL : s->read != NULL)
+    return true;
+  return s->matrix && s->matrix->data &&
+         matrixType(s->matrix) == MtDataTypeFloat;
+}
+
+// Picks tile sizes whose working set fits budget bytes: two tiles of c and
+// two sets of panels, plus the partial tile when the inner dimension is
+// split. Tiles are kept as square as the shape allows, since a is read once
+// per column of tiles and b once per row of them.
+static bool planStream(size_t M, size_t N, size_t K, size_t budget,
+                       StreamPlan *plan) {
+  const double floats = (double)(budget / sizeof(float));
+  size_t mt, nt, kt = K ? K : 1;
+
+  // whole inner dimension: 2 mt nt + 2 kt (mt + nt) floats; square first,
+  // then whatever one side leaves to the other
+  double t = (sqrt(4.0 * kt * kt + 2.0 * floats) - 2.0 * kt) / 2.0;
+  mt = min(M, (size_t)t);
+  nt = min(N, fit(floats, 2.0 * kt * mt, 2.0 * (kt + mt)));
+  mt = min(M, fit(floats, 2.0 * kt * nt, 2.0 * (kt + nt)));
+
+  if (!mt || !nt || (mt < STREAM_MIN_TILE && mt < M) ||
+      (nt < STREAM_MIN_TILE && nt < N)) {
+    // split: 3 mt nt + 2 kt (mt + nt) floats, panels as deep as tiles
+    t = sqrt(floats / 7.0);
+    mt = min(M, (size_t)t);
+    nt = min(N, (size_t)t);
+    if (!mt || !nt)
+      return false;
+    kt = min(K, fit(floats, 3.0 * mt * nt, 2.0 * (mt + nt)));
+    if (!kt)
+      return false;
+  }
+
+  plan->M = M;
+  plan->N = N;
+  plan->K = K;
+  plan->mt = mt;
+  plan->nt = nt;
+  plan->kt = kt;
+  plan->tilesN = (N + nt - 1) / nt;
+  plan->tilesK = K ? (K + kt - 1) / kt : 1;
+  return true;
+}
+
+// Moves step on to the next panel of its tile, or the next tile; returns
+// false past the last tile.
+static bool nextStep(const StreamPlan *plan, StreamStep *step) {
+  if ((step->k += plan->kt) < plan->K)
+    return true;
+  step->k = 0;
+  if ((step->j += plan->nt) < plan->N)
+    return true;
+  step->j = 0;
+  return (step->i += plan->mt) < plan->M;
+}
+
+static bool lastPanel(const StreamPlan *plan, const StreamStep *step) {
+  return step->k + plan->kt >= plan->K;
+}
+
+// The parity of step's tile in row order, which picks its buffer of c.
+static size_t tileParity(const StreamPlan *plan, const StreamStep *step) {
+  return (step->i / plan->mt * plan->tilesN + step->j / plan->nt) % 2;
+}
+
+typedef struct TileCopy {
+  float *dst;
+  const float *src;
+  size_t ldd, lds, cols;
+} TileCopy;
+
+static void copyTileRows(void *userData, size_t begin, size_t end) {
+  const TileCopy *c = userData;
+  for (size_t r = begin; r < end; ++r)
+    memcpy(c->dst + r * c->ldd, c->src + r * c->lds, c->cols * sizeof(float));
+}
+
+static void copyTile(float *dst, size_t ldd, const float *src, size_t lds,
+                     size_t rows, size_t cols) {
+  TileCopy c = {dst, src, ldd, lds, cols};
+  parallelFor(rows, parallelGrain(cols * sizeof(float)), copyTileRows, &c);
+}
+
+// Copies the tile->rows x tile->cols block of s at (row, col) into tile.
+static int readTile(const AlloyMatrixStream *s, size_t row, size_t col,
+                    Matrix *tile) {
+  if (s->read)
+    return s->read(s->userData, row, col, tile->rows, tile->cols, tile->data,
+                   matrixLd(tile));
+
+  const Matrix *mat = s->matrix;
+  copyTile(tile->data, matrixLd(tile),
+           mat->data + row * matrixLd(mat) + col, matrixLd(mat), tile->rows,
+           tile->cols);
+  return 0;
+}
+
+static int writeTile(const AlloyMatrixStream *s, size_t row, size_t col,
+                     const Matrix *tile) {
+  if (s->write)
+    return s->write(s->userData, row, col, tile->rows, tile->cols,
+                    tile->data, matrixLd(tile));
+
+  Matrix *mat = s->matrix;
+  copyTile(mat->data + row * matrixLd(mat) + col, matrixLd(mat), tile->data,
+           matrixLd(tile), tile->rows, tile->cols);
+  return 0;
+}
+
+// Points set's views at step's panels, reading those it does not hold.
+static int loadPanels(const StreamPlan *plan, const AlloyMatrixStream *a,
+                      const AlloyMatrixStream *b, const StreamStep *step,
+                      PanelSet *set) {
+  const size_t rows = min(plan->mt, plan->M - step->i);
+  const size_t cols = min(plan->nt, plan->N - step->j);
+  const size_t depth = min(plan->kt, plan->K - step->k);
+
+  set->aView = sliceMatrix(&set->a, 0, 0, rows, depth);
+  set->bView = sliceMatrix(&set->b, 0, 0, depth, cols);
+  if (!set->aHeld || set->aI != step->i || set->aK != step->k) {
+    set->aHeld = false;
+    if (readTile(a, step->i, step->k, &set->aView) != 0)
+      return -1;
+    set->aHeld = true;
+    set->aI = step->i;
+    set->aK = step->k;
+  }
+  if (!set->bHeld || set->bK != step->k || set->bJ != step->j) {
+    set->bHeld = false;
+    if (readTile(b, step->k, step->j, &set->bView) != 0)
+      return -1;
+    set->bHeld = true;
+    set->bK = step->k;
+    set->bJ = step->j;
+  }
+  return 0;
+}
+
+// Waits for and releases a step's operations; returns their joint status.
+static int finishStep(AlloyOperation **ops) {
+  int status = 0;
+  for (int i = 0; i < 2; ++i) {
+    if (ops[i] && waitOperation(ops[i]) != 0)
+      status = -1;
+    releaseOperation(ops[i]);
+    ops[i] = NULL;
+  }
+  return status;
+}
+
+int performStreamingMatrixMultiply(AlloyContext *ctx,
+                                   const AlloyMatrixStream *a,
+                                   const AlloyMatrixStream *b,
+                                   const AlloyMatrixStream *c,
+                                   size_t memoryBudget) {
+  PanelSet sets[2];
+  Matrix tiles[2] = {{0}}, tileViews[2] = {{0}}, partial = {0};
+  Matrix partialView = {0};
+  AlloyOperation *ops[2] = {NULL}, *pendingOps[2] = {NULL};
+  StreamStep step = {0}, pending = {0};
+  bool hasPending = false;
+  StreamPlan plan;
+  int status = -1;
+
+  memset(sets, 0, sizeof(sets));
+  const size_t M = streamRows(a), K = streamCols(a), N = streamCols(b);
+  CHECK_ERROR(streamRows(b) == K && streamRows(c) == M &&
+                  streamCols(c) == N,
+              "Streaming multiply shapes do not match");
+  CHECK_ERROR(streamUsable(a, false) && streamUsable(b, false) &&
+                  streamUsable(c, true),
+              "Streams need a read or write callback or a float matrix");
+  if (!M || !N)
+    return 0;
+  CHECK_ERROR(planStream(M, N, K,
+                         memoryBudget ? memoryBudget
+                                      : ALLOY_STREAM_DEFAULT_BUDGET,
+                         &plan),
+              "Memory budget too small for a streaming multiply");
+
+  for (int i = 0; i < 2; ++i) {
+    sets[i].a = createSharedMatrix(ctx, plan.mt, plan.kt);
+    sets[i].b = createSharedMatrix(ctx, plan.kt, plan.nt);
+    tiles[i] = createSharedMatrix(ctx, plan.mt, plan.nt);
+    CHECK_ERROR(sets[i].a.data && sets[i].b.data && tiles[i].data,
+                "Failed to create streaming tiles");
+  }
+  if (plan.tilesK > 1) {
+    partial = createSharedMatrix(ctx, plan.mt, plan.nt);
+    CHECK_ERROR(partial.data, "Failed to create streaming tiles");
+  }
+
+  CHECK_ERROR(loadPanels(&plan, a, b, &step, &sets[0]) == 0,
+              "Failed to read a streamed tile");
+  for (size_t s = 0;; ++s) {
+    PanelSet *set = &sets[s % 2];
+    const size_t parity = tileParity(&plan, &step);
+    Matrix *tile = &tileViews[parity];
+
+    // the first panel's product starts the tile, later ones add to it
+    *tile = sliceMatrix(&tiles[parity], 0, 0, set->aView.rows,
+                        set->bView.cols);
+    if (step.k == 0) {
+      ops[0] = submitMatrixOperation(ctx, &set->aView, &set->bView, tile,
+                                     MATRIX_OP_MULTIPLY);
+      CHECK_ERROR(ops[0], "Failed to submit a streamed tile");
+    } else {
+      partialView = sliceMatrix(&partial, 0, 0, tile->rows, tile->cols);
+      ops[0] = submitMatrixOperation(ctx, &set->aView, &set->bView,
+                                     &partialView, MATRIX_OP_MULTIPLY);
+      CHECK_ERROR(ops[0], "Failed to submit a streamed tile");
+      ops[1] = submitMatrixOperation(ctx, tile, &partialView, tile,
+                                     MATRIX_OP_ADD);
+      CHECK_ERROR(ops[1], "Failed to submit a streamed tile");
+    }
+
+    // the previous step is done once waited for: its tile, if complete, and
+    // its panel set are free
+    if (hasPending) {
+      CHECK_ERROR(finishStep(pendingOps) == 0, "Streamed tile failed");
+      if (lastPanel(&plan, &pending))
+        CHECK_ERROR(writeTile(c, pending.i, pending.j,
+                              &tileViews[tileParity(&plan, &pending)]) == 0,
+                    "Failed to write a streamed tile");
+    }
+    pending = step;
+    pendingOps[0] = ops[0];
+    pendingOps[1] = ops[1];
+    ops[0] = ops[1] = NULL;
+    hasPending = true;
+
+    if (!nextStep(&plan, &step))
+      break;
+    CHECK_ERROR(loadPanels(&plan, a, b, &step, &sets[(s + 1) % 2]) == 0,
+                "Failed to read a streamed tile");
+  }
+
+  CHECK_ERROR(finishStep(pendingOps) == 0, "Streamed tile failed");
+  CHECK_ERROR(writeTile(c, pending.i, pending.j,
+                        &tileViews[tileParity(&plan, &pending)]) == 0,
+              "Failed to write a streamed tile");
+  status = 0;
+
+cleanup:
+  // nothing may be freed while still in use
+  finishStep(ops);
+  finishStep(pendingOps);
+  for (int i = 0; i < 2; ++i) {
+    freeMatrix(&sets[i].a);
+    freeMatrix(&sets[i].b);
+    freeMatrix(&tiles[i]);
+  }
+  freeMatrix(&partial);
+  return status;
+}